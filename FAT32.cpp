@@ -4,13 +4,30 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #include <stdexcept>
 #include <cstring>
+#include <cmath>
 #include <cerrno>
 #include <algorithm>
 #include <array>
 #include <map>
+#include <thread>
+#include <future>
+#include <filesystem>
+#include <queue>
+#include <sstream>
+#include <ctime>
+#include <condition_variable>
 
 // ======================================================================
 //                           DIR ENTRY METHODS
@@ -96,6 +113,20 @@ string DirEntry::getNameString() const
     }
 }
 
+string DirEntry::getRecoveryName() const
+{
+    // Byte đầu đã bị ghi đè bằng 0xE5, phần còn lại của tên 8.3 vẫn dùng được
+    string base;
+    for (int i = 0; i < 8; ++i)
+        base.push_back(i == 0 && name[0] == 0xE5 ? '?' : static_cast<char>(name[i]));
+    trimRight(base);
+
+    string ext(reinterpret_cast<const char *>(name + 8), 3);
+    trimRight(ext);
+
+    return ext.empty() ? base : base + "." + ext;
+}
+
 uint32_t DirEntry::getWriteTimestamp() const
 {
     return (uint32_t(date) << 16) | uint32_t(time);
@@ -105,1475 +136,7612 @@ uint32_t DirEntry::getCreationTimestamp() const
 {
     return (uint32_t(crtDate) << 16) | uint32_t(crtTime);
 }
+
 // ======================================================================
-//                        CONSTRUCTOR / DESTRUCTOR
+//                           LOGGING
 // ======================================================================
-FAT32Recovery::FAT32Recovery(const string &path) : imagePath(path)
+atomic<int> Logger::runtimeLevel(LOG_INFO);
+atomic<unsigned> Logger::rateLimit(10);
+
+namespace
 {
-    memset(&mbr, 0, sizeof(MBR));
+    const char *LEVEL_TAGS[] = {"[DEBUG]", "[INFO]", "[WARN]", "[ERROR]"};
 
-    // fd = -1;
-    bootSector.bytesPerSector = 0;
-    bootSector.sectorsPerCluster = 0;
-    bootSector.reservedSectors = 0;
-    bootSector.numFATs = 0;
-    bootSector.sectorsPerFat = 0;
-    bootSector.rootCluster = 0;
+    // Ring buffer MPMC có giới hạn (kiểu Vyukov): mỗi slot có số thứ tự riêng,
+    // producer/consumer chỉ cần CAS trên chỉ số, không dùng khóa.
+    struct LogRecord
+    {
+        atomic<size_t> seq;
+        int level;
+        string message;
+    };
 
-    fatBegin = 0;
-    dataBegin = 0;
-    totalClusters = 0;
+    const size_t LOG_RING_SIZE = 4096; // lũy thừa của 2
+    LogRecord logRing[LOG_RING_SIZE];
+    atomic<size_t> logEnqueuePos(0);
+    atomic<size_t> logDequeuePos(0);
+    atomic<uint64_t> logDropped(0);
+    once_flag logRingInit;
 
-    vhd.open(path, ios::in | ios::out | ios::binary);
+    // Bảng đếm theo key (open addressing, lock-free)
+    struct LogKeySlot
+    {
+        atomic<const char *> key;
+        atomic<int> level;
+        atomic<uint64_t> count;
+    };
+    const size_t LOG_KEY_SLOTS = 128;
+    LogKeySlot logKeys[LOG_KEY_SLOTS];
 
-    if (!vhd.is_open())
-        throw runtime_error(string("Open failed: ") + strerror(errno));
+    mutex logDrainLock; // chỉ giữa các consumer (luồng nền / drain)
+    atomic<bool> logThreadStarted(false);
+    atomic<bool> logThreadStop(false);
+    thread logThread;
 
-    // Lấy kích thước đĩa
-    vhd.seekg(0, ios::end);
-    diskSize = vhd.tellg();
-    vhd.seekg(0, ios::beg);
-    cout << "[INFO] Disk size: " << diskSize << " bytes\n";
+    void initRing()
+    {
+        for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+            logRing[i].seq.store(i, memory_order_relaxed);
+    }
 
-    // readBootSector();
-    // loadFAT();
-    // readMBR();
-}
+    bool ringPush(int level, string &&message)
+    {
+        size_t pos = logEnqueuePos.load(memory_order_relaxed);
+        for (;;)
+        {
+            LogRecord &rec = logRing[pos & (LOG_RING_SIZE - 1)];
+            size_t seq = rec.seq.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (logEnqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    rec.level = level;
+                    rec.message = move(message);
+                    rec.seq.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // Đầy: bỏ bản ghi, không bao giờ chặn luồng gọi
+            else
+                pos = logEnqueuePos.load(memory_order_relaxed);
+        }
+    }
 
-FAT32Recovery::~FAT32Recovery()
-{
-    if (vhd.is_open())
-        vhd.close();
-}
+    bool ringPop(int &level, string &message)
+    {
+        size_t pos = logDequeuePos.load(memory_order_relaxed);
+        for (;;)
+        {
+            LogRecord &rec = logRing[pos & (LOG_RING_SIZE - 1)];
+            size_t seq = rec.seq.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (logDequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    level = rec.level;
+                    message = move(rec.message);
+                    rec.seq.store(pos + LOG_RING_SIZE, memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // Rỗng
+            else
+                pos = logDequeuePos.load(memory_order_relaxed);
+        }
+    }
 
-// ======================================================================
-//                             LOW-LEVEL IO
-// ======================================================================
-string FAT32Recovery::formatShortName(const uint8_t name[11])
-{
-    string res;
+    // Trả về số lần key đã xuất hiện (tính cả lần này)
+    uint64_t countKey(const char *key, int level)
+    {
+        size_t h = (reinterpret_cast<uintptr_t>(key) >> 3) % LOG_KEY_SLOTS;
+        for (size_t probe = 0; probe < LOG_KEY_SLOTS; ++probe)
+        {
+            LogKeySlot &slot = logKeys[(h + probe) % LOG_KEY_SLOTS];
+            const char *cur = slot.key.load(memory_order_acquire);
+            if (cur == nullptr)
+            {
+                const char *expected = nullptr;
+                if (slot.key.compare_exchange_strong(expected, key, memory_order_acq_rel))
+                {
+                    slot.level.store(level, memory_order_relaxed);
+                    return slot.count.fetch_add(1, memory_order_relaxed) + 1;
+                }
+                cur = expected;
+            }
+            if (cur == key)
+                return slot.count.fetch_add(1, memory_order_relaxed) + 1;
+        }
+        return 1; // Bảng đầy: không gộp được, cứ in
+    }
 
-    // name part
-    for (int i = 0; i < 8; ++i)
+    string withThousands(uint64_t v)
     {
-        if (name[i] == ' ')
-            break;
-        res.push_back(char(name[i]));
+        string digits = to_string(v);
+        string out;
+        for (size_t i = 0; i < digits.size(); ++i)
+        {
+            if (i > 0 && (digits.size() - i) % 3 == 0)
+                out.push_back(',');
+            out.push_back(digits[i]);
+        }
+        return out;
     }
 
-    // extension part
-    string ext;
-    for (int i = 8; i < 11; ++i)
+    void drainRing()
     {
-        if (name[i] == ' ')
-            break;
-        ext.push_back(name[i]);
+        lock_guard<mutex> g(logDrainLock);
+        int level;
+        string message;
+        while (ringPop(level, message))
+            cerr << LEVEL_TAGS[level] << " " << message << "\n";
     }
 
-    if (!ext.empty())
-        res += "." + ext;
+    void startLogThread()
+    {
+        bool expected = false;
+        if (!logThreadStarted.compare_exchange_strong(expected, true))
+            return;
+        logThread = thread([]()
+                           {
+            while (!logThreadStop.load(memory_order_relaxed))
+            {
+                drainRing();
+                this_thread::sleep_for(chrono::milliseconds(20));
+            }
+            drainRing(); });
+    }
 
-    return res;
+    // Dừng luồng nền khi chương trình kết thúc (kể cả khi không ai gọi shutdown)
+    struct LogShutdownGuard
+    {
+        ~LogShutdownGuard() { Logger::shutdown(); }
+    } logShutdownGuard;
 }
 
-ssize_t FAT32Recovery::readBytes(uint64_t offset, void *buf, size_t size) const
+void Logger::log(LogLevel level, const char *key, string message)
 {
-    // fstream::seekg yêu cầu quyền thay đổi trạng thái stream,
-    // nên ta cần 'mutable' hoặc cast 'const' đi nếu vhd là const member.
-    // Cách tốt nhất là dùng một biến fstream không const.
-
-    auto &mutable_vhd = const_cast<fstream &>(vhd);
+    if (!enabled(level) || level >= LOG_OFF)
+        return;
+    call_once(logRingInit, initRing);
 
-    mutable_vhd.clear(); // Xóa cờ lỗi (EOF, Fail) trước khi seek
-    mutable_vhd.seekg(offset, ios::beg);
+    if (key != nullptr)
+    {
+        uint64_t n = countKey(key, level);
+        unsigned limit = rateLimit.load(memory_order_relaxed);
+        if (limit != 0 && n > limit)
+            return; // Chỉ đếm, tổng kết in lúc shutdown
+        if (limit != 0 && n == limit)
+            message += " (further messages of this kind are aggregated)";
+    }
 
-    if (mutable_vhd.fail())
-        return -1;
+    if (!ringPush(level, move(message)))
+        logDropped.fetch_add(1, memory_order_relaxed);
+    startLogThread();
+}
 
-    mutable_vhd.read((char *)buf, size);
-    return mutable_vhd.gcount(); // Trả về số byte thực tế đã đọc
+void Logger::drain()
+{
+    call_once(logRingInit, initRing);
+    drainRing();
 }
 
-void FAT32Recovery::writeAll(ostream &out, const void *buf, size_t size) const
+void Logger::shutdown()
 {
-    // Ép kiểu về const char* vì fstream yêu cầu char*
-    out.write(static_cast<const char *>(buf), size);
+    if (logThreadStarted.load())
+    {
+        logThreadStop = true;
+        if (logThread.joinable())
+            logThread.join();
+        logThreadStarted = false;
+        logThreadStop = false;
+    }
+    drain();
 
-    // Kiểm tra trạng thái stream sau khi ghi
-    if (out.fail() || out.bad())
+    unsigned limit = rateLimit.load(memory_order_relaxed);
+    for (auto &slot : logKeys)
     {
-        // Có thể throw exception hoặc xử lý tùy logic của bạn
-        throw runtime_error("Failed to write data to output file.");
+        const char *key = slot.key.load();
+        uint64_t n = slot.count.exchange(0);
+        if (key != nullptr && limit != 0 && n > limit)
+            cerr << LEVEL_TAGS[slot.level.load()] << " " << withThousands(n) << " x " << key << "\n";
     }
+    uint64_t dropped = logDropped.exchange(0);
+    if (dropped > 0)
+        cerr << "[WARN] " << withThousands(dropped) << " log records dropped (ring buffer full)\n";
 }
 
-void FAT32Recovery::saveMBRToDisk()
+// ======================================================================
+//                           METRICS
+// ======================================================================
+atomic<bool> Metrics::enabledFlag(false);
+atomic<uint64_t> Metrics::counters[Metrics::COUNTER_COUNT];
+atomic<uint64_t> Metrics::phaseNanos[Metrics::PHASE_COUNT];
+atomic<uint64_t> Metrics::phaseCalls[Metrics::PHASE_COUNT];
+atomic<int> Metrics::activeThreads[Metrics::PHASE_COUNT];
+thread_local Metrics::Phase Metrics::currentPhase = Metrics::PHASE_NONE;
+
+namespace
 {
-    vhd.clear();
-    vhd.seekp(0, ios::beg);
-    vhd.write(reinterpret_cast<const char *>(&mbr), sizeof(MBR));
-    vhd.flush();
-    cout << "[INFO] New MBR written to disk.\n";
+    const char *COUNTER_NAMES[Metrics::COUNTER_COUNT] = {
+        "bytes_read", "bytes_written", "read_calls", "write_calls",
+        "cache_hits", "cache_misses", "clusters_walked", "bytes_skipped",
+        "fat_entries_merged", "bytes_hashed", "clusters_sampled", "clusters_classified"};
+    const char *PHASE_NAMES[Metrics::PHASE_COUNT] = {
+        "mbr", "bpb", "fat_load", "scan", "analyze", "restore", "export", "carve", "hash", "score"};
+
+    mutex progressLock;
+    condition_variable progressWake;
+    thread progressThread;
+    bool progressStop = false;
 }
 
-void FAT32Recovery::listPartitions() const
+void Metrics::addPhase(Phase p, uint64_t nanos)
 {
-    cout << "[INFO] CURRENT PARTITION TABLE STATUS\n";
-    for (int i = 0; i < 4; i++)
-    {
-        const ParEntry &p = mbr.partitions[i];
-        if (p.numSectors == 0)
-            continue;
+    phaseNanos[p].fetch_add(nanos, memory_order_relaxed);
+    phaseCalls[p].fetch_add(1, memory_order_relaxed);
+}
 
-        cout << "[INFO] Partition #" << i << ": Start LBA=" << p.lbaFirst
-             << "       | Size=" << p.numSectors
-             << "       | Type=0x" << hex << (int)p.partitionType << dec
-             << (p.status == 0x80 ? " (Active)" : "") << endl;
+void Metrics::switchPhase(Phase from, Phase to)
+{
+    if (from != PHASE_NONE)
+    {
+        // reset() giữa chừng đã đưa về 0 -> không để bộ đếm âm khi luồng rời pha
+        int n = activeThreads[from].load(memory_order_relaxed);
+        while (n > 0 && !activeThreads[from].compare_exchange_weak(n, n - 1, memory_order_relaxed))
+        {
+        }
     }
-    cout << "================================================================\n\n";
+    if (to != PHASE_NONE)
+        activeThreads[to].fetch_add(1, memory_order_relaxed);
+    currentPhase = to;
 }
 
-void FAT32Recovery::parseBPB(const uint8_t *buffer)
+Metrics::Phase Metrics::enterPhase(Phase p)
 {
-    // Copy 512 byte raw vào struct BootSector
-    // (Giả sử struct BootSector đã được pack 1 byte chuẩn)
-    memcpy(&bootSector, buffer, sizeof(BootSector));
+    Phase previous = currentPhase;
+    switchPhase(previous, p);
+    return previous;
 }
 
-void FAT32Recovery::saveBootSector(uint64_t offset)
+void Metrics::leavePhase(Phase previous)
 {
-    vhd.clear();
-    vhd.seekp(offset, ios::beg);
-    vhd.write(reinterpret_cast<const char *>(&bootSector), sizeof(BootSector));
-    vhd.flush();
-    cout << "[SUCCESS] Boot Sector written to disk at offset " << offset << ".\n";
+    switchPhase(currentPhase, previous);
 }
 
-void FAT32Recovery::printVolumeInfo() const
+void Metrics::reset()
 {
-    cout << "[INFO] VOLUME PARAMETERS (ACTIVE)\n";
-    cout << "       | Bytes per Sector: " << bootSector.bytesPerSector << "\n";
-    cout << "       | Sectors per Cluster: " << (int)bootSector.sectorsPerCluster << "\n";
-    cout << "       | Reserved Sectors: " << bootSector.reservedSectors << "\n";
-    cout << "       | Number of FATs: " << (int)bootSector.numFATs << "\n";
-    cout << "       | Sectors per FAT: " << bootSector.sectorsPerFat << "\n";
-    cout << "       | Root Cluster: " << bootSector.rootCluster << "\n";
-    cout << "       | Total Sectors: " << bootSector.totalSectors32 << "\n";
+    for (auto &c : counters)
+        c = 0;
+    for (int i = 0; i < PHASE_COUNT; ++i)
+    {
+        phaseNanos[i] = 0;
+        phaseCalls[i] = 0;
+        activeThreads[i] = 0;
+    }
 }
 
-// =====================================================================
-//                       HELPER: VALIDATOR FUNCTIONS
-// =====================================================================
-bool FAT32Recovery::isValidMBR(const MBR *mbrPtr) const
+string Metrics::toJSON()
 {
-    // Kiểm tra chữ ký MBR
-    if (mbrPtr->signature != FAT32Const::SIGNATURE_LE)
-        return false;
+    ostringstream o;
+    o << "{\"counters\":{";
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        o << (i ? "," : "") << "\"" << COUNTER_NAMES[i] << "\":" << counters[i].load();
+    o << "},\"phases\":{";
+    for (int i = 0; i < PHASE_COUNT; ++i)
+        o << (i ? "," : "") << "\"" << PHASE_NAMES[i] << "\":{\"seconds\":" << phaseNanos[i].load() / 1e9
+          << ",\"calls\":" << phaseCalls[i].load() << "}";
+    o << "}}";
+    return o.str();
+}
 
-    // Kiểm tra ít nhất một partition là FAT32
-    bool hasFAT32 = false;
-    for (int i = 0; i < 4; ++i)
+string Metrics::toPrometheus()
+{
+    ostringstream o;
+    for (int i = 0; i < COUNTER_COUNT; ++i)
     {
-        //Nếu là boot sector thì sẽ có chữ ký
-        uint8_t sector[512];
-        ssize_t n = readBytes((uint64_t)mbrPtr->partitions[i].lbaFirst * 512ULL, sector, 512);
-        if (n != 512)
-        {
-            cout << "[ERROR] Cannot read boot sector at LBA given\n";
-            return false;
-        }
+        o << "# TYPE fat32_" << COUNTER_NAMES[i] << "_total counter\n";
+        o << "fat32_" << COUNTER_NAMES[i] << "_total " << counters[i].load() << "\n";
+    }
+    o << "# TYPE fat32_phase_seconds_total counter\n";
+    for (int i = 0; i < PHASE_COUNT; ++i)
+        o << "fat32_phase_seconds_total{phase=\"" << PHASE_NAMES[i] << "\"} " << phaseNanos[i].load() / 1e9 << "\n";
+    o << "# TYPE fat32_phase_calls_total counter\n";
+    for (int i = 0; i < PHASE_COUNT; ++i)
+        o << "fat32_phase_calls_total{phase=\"" << PHASE_NAMES[i] << "\"} " << phaseCalls[i].load() << "\n";
+    return o.str();
+}
 
-        uint16_t sig = read_u16_le(sector + 510);
-        if (sig != FAT32Const::SIGNATURE_LE) {
-            cout << "[ERROR] This is not a boot sector\n";
-            return false;
-        }
-        
-        const ParEntry &p = mbrPtr->partitions[i];
-        if (p.partitionType == FAT32Const::PART_TYPE_FAT32_LBA ||
-            p.partitionType == FAT32Const::PART_TYPE_FAT32_CHS)
+void Metrics::startProgress(unsigned intervalMs)
+{
+    if (intervalMs == 0 || progressThread.joinable())
+        return;
+    progressStop = false;
+    progressThread = thread([intervalMs]()
+                            {
+        uint64_t lastBytes = 0;
+        unique_lock<mutex> lk(progressLock);
+        while (!progressWake.wait_for(lk, chrono::milliseconds(intervalMs), [] { return progressStop; }))
         {
-            if (p.lbaFirst > 0 && p.numSectors > 0)
+            uint64_t bytes = counters[BYTES_READ].load();
+            double rate = (bytes - lastBytes) / (intervalMs / 1000.0) / (1024.0 * 1024.0);
+            lastBytes = bytes;
+
+            // Gom pha của mọi luồng: "scan,export" hoặc "scan(2)" khi 2 volume cùng scan
+            string phases;
+            for (int i = 0; i < PHASE_COUNT; ++i)
             {
-                hasFAT32 = true;
-                break;
+                int n = activeThreads[i].load(memory_order_relaxed);
+                if (n <= 0)
+                    continue;
+                phases += (phases.empty() ? "" : ",") + string(PHASE_NAMES[i]);
+                if (n > 1)
+                    phases += "(" + to_string(n) + ")";
             }
-        }
-    }
-    return hasFAT32;
+            cerr << "[PROGRESS] phase=" << (phases.empty() ? "idle" : phases)
+                 << " read=" << bytes / (1024 * 1024) << "MB (" << (uint64_t)rate << " MB/s)"
+                 << " clusters=" << counters[CLUSTERS_WALKED].load()
+                 << " cache=" << counters[CACHE_HITS].load() << "/" << counters[CACHE_MISSES].load() << "\n";
+        } });
 }
 
-bool FAT32Recovery::isValidFAT32BS(const uint8_t *buffer) const
+void Metrics::stopProgress()
 {
-    // Check Signature 0xAA55 ở cuối sector
-    uint16_t sig = read_u16_le(buffer + 510);
-    if (sig != FAT32Const::SIGNATURE_LE)
-        return false;
-
-    // Check chuỗi "FAT32   " ở offset 82 (0x52)
-    // Đây là dấu hiệu nhận biết Boot Sector của FAT32, phân biệt với NTFS/MBR
-    if (memcmp(buffer + 0x52, "FAT32", 5) != 0)
-        return false;
-
-    // Sanity Check (Kiểm tra tính hợp lý của thông số)
-    const BootSector *bs = reinterpret_cast<const BootSector *>(buffer);
-
-    // Bytes Per Sector phải chuẩn (thường là 512)
-    if (bs->bytesPerSector != 512 && bs->bytesPerSector != 1024 &&
-        bs->bytesPerSector != 2048 && bs->bytesPerSector != 4096)
-        return false;
-
-    // Cluster Size phải > 0
-    if (bs->sectorsPerCluster == 0 || bs->sectorsPerCluster > 128 ||
-        (bs->sectorsPerCluster & (bs->sectorsPerCluster - 1)) != 0)
-        return false;
-
-    // Reserved Sectors phải > 0
-    if (bs->reservedSectors == 0)
-        return false;
-
-    // Total Sectors phải > 0 (Nếu = 0 thì volume rỗng -> rác)
-    if (bs->totalSectors32 == 0)
-        return false;
-
-    // Sectors Per FAT phải > 0
-    if (bs->numFATs < 1 || bs->numFATs > 2)
-        return false;
-
-    // Root Cluster phải >= 2
-    if (bs->rootCluster < 2)
-        return false;
-
-    return true;
+    if (!progressThread.joinable())
+        return;
+    {
+        lock_guard<mutex> g(progressLock);
+        progressStop = true;
+    }
+    progressWake.notify_all();
+    progressThread.join();
 }
 
 // ======================================================================
-//                       MBR PARSING / VALIDATION
+//                           CLUSTER CACHE
 // ======================================================================
-void FAT32Recovery::initializeMBR()
+ClusterCache::ClusterCache(size_t budgetBytes, size_t shardCount)
+    : budget(budgetBytes), hits(0), misses(0), evictions(0), dirtyCount(0)
 {
-    cout << "\n=== MASTER BOOT RECORD (MBR) RECOVERY ===\n";
-    bool good = false;
+    if (shardCount == 0)
+        shardCount = 1;
+    for (size_t i = 0; i < shardCount; ++i)
+        shards.emplace_back(new Shard());
+}
 
-    // BƯỚC 1: Kiểm tra Sector 0 xem có dùng được không
-    if (checkMBR())
+ClusterCache::Shard &ClusterCache::shardFor(uint32_t cluster) const
+{
+    // Các cluster liền kề rơi vào các shard khác nhau -> giảm tranh chấp khóa
+    return *shards[cluster % shards.size()];
+}
+
+void ClusterCache::setBudget(size_t budgetBytes)
+{
+    budget = budgetBytes;
+    for (auto &s : shards)
     {
-        cout << "[SUCCESS] Primary MBR is valid.\n";
-        listPartitions();
-        good = true; // Xong, không cần làm gì thêm
-    }
-    else {
-        // BƯỚC 2: Nếu Sector 0 hỏng, quét đĩa để dựng lại (Bỏ qua tìm Backup)
-        cout << "[WARN] Primary MBR corrupted or empty. Starting Deep Scan...\n";
-        if (rebuildMBR())
-        {
-            cout << "[SUCCESS] MBR rebuilt from found volumes.\n";
-            listPartitions();
-            good = true;
-        }
+        lock_guard<mutex> g(s->lock);
+        evictLocked(*s);
     }
+}
 
-    cout << "================================================================\n\n";
+size_t ClusterCache::getBudget() const
+{
+    return budget;
+}
 
-    // Nếu quét cũng không ra -> Lỗi nghiêm trọng
-    if (!good)
-        throw runtime_error("[CRITICAL] Failed to initialize MBR. Disk unrecognizable.");
+void ClusterCache::evictLocked(Shard &s)
+{
+    const size_t shardBudget = budget / shards.size();
+
+    // Duyệt từ cuối LRU (cũ nhất), bỏ qua các buffer đang bị pin
+    auto it = s.lru.end();
+    while (s.bytes > shardBudget && it != s.lru.begin())
+    {
+        --it;
+        if (it->second.use_count() > 1)
+            continue; // Có người đang giữ buffer này
+
+        s.bytes -= it->second->size();
+        s.index.erase(it->first);
+        it = s.lru.erase(it);
+        ++evictions;
+    }
 }
 
-bool FAT32Recovery::checkMBR()
+ClusterCache::Buffer ClusterCache::get(uint32_t cluster)
 {
-    // Đọc Sector 0 vào biến thành viên `mbr`
-    if (readBytes(0, &mbr, sizeof(MBR)) != sizeof(MBR))
+    Shard &s = shardFor(cluster);
+    lock_guard<mutex> g(s.lock);
+
+    auto dirty = s.dirty.find(cluster);
+    if (dirty != s.dirty.end())
     {
-        cerr << "[ERROR] Read Sector 0 failed.\n";
-        return false;
+        ++hits;
+        Metrics::add(Metrics::CACHE_HITS, 1);
+        return dirty->second;
     }
 
-    // Dùng Validator đã tách riêng để kiểm tra
-    if (!isValidMBR(&mbr))
+    auto found = s.index.find(cluster);
+    if (found == s.index.end())
     {
-        cout << "[INFO] Sector 0 is invalid (Signature mismatch or no FAT32 partitions).\n";
-        return false;
+        ++misses;
+        Metrics::add(Metrics::CACHE_MISSES, 1);
+        return Buffer();
     }
 
-    return true;
+    // Đưa lên đầu LRU
+    s.lru.splice(s.lru.begin(), s.lru, found->second);
+    ++hits;
+    Metrics::add(Metrics::CACHE_HITS, 1);
+    return found->second->second;
 }
 
-bool FAT32Recovery::rebuildMBR()
+uint64_t ClusterCache::generation(uint32_t cluster) const
 {
-    // 1. Reset struct MBR trong bộ nhớ
-    memset(&mbr, 0, sizeof(MBR));
-    mbr.signature = FAT32Const::SIGNATURE_LE; // Đặt sẵn chữ ký đúng để chuẩn bị ghi
+    Shard &s = shardFor(cluster);
+    lock_guard<mutex> g(s.lock);
+    return s.generation;
+}
 
-    int partitionsFound = 0;
-    uint8_t buf[512];
-    uint64_t currentSector = 0;
+ClusterCache::Buffer ClusterCache::put(uint32_t cluster, vector<uint8_t> &&data, uint64_t expectedGeneration)
+{
+    Buffer buf = make_shared<const vector<uint8_t>>(move(data));
 
-    // Giới hạn quét: Toàn bộ đĩa
-    uint64_t maxSectors = diskSize / FAT32Const::SECTOR_SIZE;
+    Shard &s = shardFor(cluster);
+    lock_guard<mutex> g(s.lock);
 
-    cout << "   -> Scanning " << maxSectors << " sectors for FAT32 Signatures...\n";
+    // Có bản sửa chưa ghi -> dữ liệu vừa đọc từ đĩa đã cũ
+    auto dirty = s.dirty.find(cluster);
+    if (dirty != s.dirty.end())
+        return dirty->second;
+
+    // Budget = 0 -> tắt cache, chỉ trả buffer cho người gọi
+    if (budget == 0)
+        return buf;
 
-    while (currentSector < maxSectors && partitionsFound < 4)
+    auto found = s.index.find(cluster);
+    if (found != s.index.end())
     {
-        // Bỏ qua Sector 0 (vì ta biết nó lỗi rồi mới vào đây)
-        if (currentSector == 0)
-        {
-            currentSector++;
-            continue;
-        }
-
-        // Đọc sector
-        if (readBytes(currentSector * 512, buf, 512) != 512)
-            break;
+        // Luồng khác đã nạp trước -> dùng bản đang có
+        s.lru.splice(s.lru.begin(), s.lru, found->second);
+        return found->second->second;
+    }
 
-        // --- SỬ DỤNG HÀM VALIDATOR ĐÃ TÁCH ---
-        // Nếu đây là một Boot Sector chuẩn FAT32
-        if (isValidFAT32BS(buf))
-        {
-            // Lấy kích thước volume từ Boot Sector tìm được
-            const BootSector *bs = reinterpret_cast<const BootSector *>(buf);
-            uint32_t volSize = bs->totalSectors32;
+    // Dữ liệu đọc trước một lần ghi -> chỉ trả cho người gọi, không nạp vào cache
+    if (expectedGeneration != ANY_GENERATION && expectedGeneration != s.generation)
+        return buf;
 
-            cout << "   [+] Found Valid FAT32 Volume at Sector " << currentSector
-                 << " | Size: " << volSize << "\n";
+    s.lru.emplace_front(cluster, buf);
+    s.index[cluster] = s.lru.begin();
+    s.bytes += buf->size();
+    evictLocked(s);
+    return buf;
+}
 
-            // Điền thông tin vào MBR Partition Table
-            ParEntry &p = mbr.partitions[partitionsFound];
+void ClusterCache::writeThrough(uint32_t cluster, const uint8_t *data, size_t size)
+{
+    Shard &s = shardFor(cluster);
+    lock_guard<mutex> g(s.lock);
+    ++s.generation;
+
+    auto found = s.index.find(cluster);
+    if (found == s.index.end())
+        return; // Chưa cache thì không cần làm gì
+
+    // Thay buffer mới, người đang giữ buffer cũ vẫn thấy snapshot nhất quán
+    Buffer fresh = make_shared<const vector<uint8_t>>(data, data + size);
+    s.bytes -= found->second->second->size();
+    s.bytes += fresh->size();
+    found->second->second = fresh;
+    s.lru.splice(s.lru.begin(), s.lru, found->second);
+}
 
-            p.status = (partitionsFound == 0) ? 0x80 : 0x00;   // Active partition đầu tiên
-            p.partitionType = FAT32Const::PART_TYPE_FAT32_LBA; // Type 0x0C
-            p.lbaFirst = (uint32_t)currentSector;
-            p.numSectors = volSize;
+void ClusterCache::invalidate(uint32_t cluster)
+{
+    Shard &s = shardFor(cluster);
+    lock_guard<mutex> g(s.lock);
+    ++s.generation; // Kể cả khi chưa cache: luồng đang đọc dở sẽ không nạp bản cũ
 
-            partitionsFound++;
+    auto found = s.index.find(cluster);
+    if (found == s.index.end())
+        return;
 
-            // QUAN TRỌNG: Nhảy qua volume này để tìm cái tiếp theo
-            // Tránh việc quét trùng lặp bên trong volume vừa tìm thấy
-            currentSector += volSize;
-        }
-        else
-        {
-            // Không phải Boot Sector -> Nhảy tiếp
-            // Tối ưu: Nếu đang ở đầu volume, nhảy 1 sector.
-            // Nếu muốn nhanh hơn có thể nhảy 63 hoặc 2048 sector tùy chiến lược.
-            currentSector++;
-        }
-    }
+    s.bytes -= found->second->second->size();
+    s.lru.erase(found->second);
+    s.index.erase(found);
+}
 
-    // Nếu tìm thấy ít nhất 1 partition -> Ghi MBR mới xuống đĩa
-    if (partitionsFound > 0)
+void ClusterCache::putDirty(uint32_t cluster, vector<uint8_t> &&data)
+{
+    Buffer buf = make_shared<const vector<uint8_t>>(move(data));
+    Shard &s = shardFor(cluster);
+    lock_guard<mutex> g(s.lock);
+    ++s.generation;
+
+    // Bản trong LRU (nếu có) là bản đĩa, bỏ đi để overlay là nguồn duy nhất
+    auto found = s.index.find(cluster);
+    if (found != s.index.end())
     {
-        saveMBRToDisk();
-        return true;
+        s.bytes -= found->second->second->size();
+        s.lru.erase(found->second);
+        s.index.erase(found);
     }
-    return false;
+
+    if (s.dirty.insert_or_assign(cluster, buf).second)
+        ++dirtyCount;
 }
 
-// ======================================================================
-//                       BOOT SECTOR PARSING / VALIDATION
-// ======================================================================
-bool FAT32Recovery::initializeVolume(int partitionIndex)
+void ClusterCache::overlayDirty(uint32_t firstCluster, uint32_t count, size_t clusterSize, uint8_t *dst) const
 {
-    cout << "[INFO] VOLUME PARAMETER RECOVERY (PARTITION " << partitionIndex << ")\n";
-
-    // 1. Lấy thông tin LBA từ MBR (Mỏ neo vật lý)
-    if (partitionIndex < 0 || partitionIndex > 3)
-        return false;
-    ParEntry &p = mbr.partitions[partitionIndex];
-
-    if (p.numSectors == 0)
+    if (!hasDirty())
+        return;
+    for (uint32_t i = 0; i < count; ++i)
     {
-        cout << "[ERROR] Partition entry is empty.\n";
-        return false;
+        Shard &s = shardFor(firstCluster + i);
+        lock_guard<mutex> g(s.lock);
+        auto dirty = s.dirty.find(firstCluster + i);
+        if (dirty != s.dirty.end())
+            memcpy(dst + (size_t)i * clusterSize, dirty->second->data(), min(clusterSize, dirty->second->size()));
     }
+}
 
-    // Tính Offset bắt đầu phân vùng
-    uint64_t partitionStartOffset = (uint64_t)p.lbaFirst * FAT32Const::SECTOR_SIZE;
-
-    cout << "[INFO] Partition Start LBA: " << p.lbaFirst
-         << " (Offset: " << partitionStartOffset << ")\n";
-
-    // 2. Cố gắng Load Boot Sector (Main -> Backup -> Reconstruct)
-    bool bsLoaded = false;
-
-    // Check Main & Backup
-    if (checkAndFixBootSector(p.lbaFirst))
+void ClusterCache::clear()
+{
+    // Geometry đổi -> overlay cũ cũng không còn nghĩa
+    for (auto &s : shards)
     {
-        cout << "[SUCCESS] Boot Sector loaded from disk.\n";
-        bsLoaded = true;
+        lock_guard<mutex> g(s->lock);
+        s->lru.clear();
+        s->index.clear();
+        s->bytes = 0;
+        ++s->generation;
+        dirtyCount -= s->dirty.size();
+        s->dirty.clear();
     }
-    // Nếu thất bại -> Reconstruct
-    else
+}
+
+ClusterCache::Stats ClusterCache::getStats() const
+{
+    Stats st;
+    st.hits = hits;
+    st.misses = misses;
+    st.evictions = evictions;
+    st.budgetBytes = budget;
+    st.bytesCached = 0;
+    for (auto &s : shards)
     {
-        cout << "[WARN] Boot Sectors corrupted. Reconstructing...\n";
-        reconstructBPB(p.lbaFirst, p.numSectors); // Hàm này đã sửa ở câu trả lời trước
-        cout << "[SUCCESS] Boot Sector reconstructed.\n";
-        bsLoaded = true;
+        lock_guard<mutex> g(s->lock);
+        st.bytesCached += s->bytes;
     }
+    return st;
+}
 
-    if (!bsLoaded)
-        return false;
-
-    // Đảm bảo bytesPerSector hợp lệ để tránh chia cho 0 (Reconstruct đã set mặc định 512)
-    if (bootSector.bytesPerSector == 0)
-        bootSector.bytesPerSector = 512;
-
-    // A. Tính fatBegin
-    // fatBegin = Start_Partition + Reserved_Size
-    this->fatBegin = partitionStartOffset +
-                     ((uint64_t)bootSector.reservedSectors * bootSector.bytesPerSector);
+// ======================================================================
+//                           BLOCK DEVICE
+// ======================================================================
+BlockDevice::BlockDevice(const string &path, bool readOnly)
+    : imagePath(path), readOnly(readOnly), diskFormat(DISK_RAW), blockSize(0), containerWritable(true), holeFd(-1)
+{
+    if (readOnly)
+        writer.open(path, ios::in | ios::binary);
+    else
+        writer.open(path, ios::in | ios::out | ios::binary);
 
-    // B. Tính dataBegin
-    // dataBegin = fatBegin + (NumFATs * FAT_Size)
-    uint64_t fatSizeInBytes = (uint64_t)bootSector.sectorsPerFat * bootSector.bytesPerSector;
-    this->dataBegin = this->fatBegin + ((uint64_t)bootSector.numFATs * fatSizeInBytes);
+    if (!writer.is_open())
+        throw runtime_error(string("Open failed: ") + strerror(errno));
+    if (readOnly)
+        cout << "[INFO] Read-only mode: repairs are kept in memory only.\n";
+
+    // Lấy kích thước file, rồi nhận dạng container (VHD/VHDX/qcow2) để ra kích thước đĩa guest
+    writer.seekg(0, ios::end);
+    hostSize = writer.tellg();
+    writer.seekg(0, ios::beg);
+    diskSize = hostSize;
+    openContainer();
+    cout << "[INFO] Disk size: " << diskSize << " bytes\n";
 
-    // C. Tính Total Clusters
-    // Data_Sectors = Total_Sectors - Reserved - FATs_Area
-    // Lưu ý: totalSectors32 có thể chưa chính xác nếu BS hỏng, nên ưu tiên dùng p.numSectors từ MBR nếu có thể
-    uint32_t totalSecs = (bootSector.totalSectors32 > 0) ? bootSector.totalSectors32 : p.numSectors;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    // Chỉ cần cho raw/fixed VHD: container dynamic đã có bảng cấp phát
+    if (diskFormat == DISK_RAW || diskFormat == DISK_VHD_FIXED)
+        holeFd = ::open(path.c_str(), O_RDONLY);
+#endif
+}
 
-    uint64_t reservedArea = bootSector.reservedSectors;
-    uint64_t fatArea = (uint64_t)bootSector.numFATs * bootSector.sectorsPerFat;
+BlockDevice::~BlockDevice()
+{
+#ifndef _MSC_VER
+    if (holeFd >= 0)
+        ::close(holeFd);
+#endif
+}
 
-    if (totalSecs > (reservedArea + fatArea))
+const char *BlockDevice::formatName() const
+{
+    switch (diskFormat)
     {
-        uint64_t dataSectors = totalSecs - reservedArea - fatArea;
+    case DISK_VHD_FIXED:
+        return "fixed VHD";
+    case DISK_VHD_DYNAMIC:
+        return "dynamic VHD";
+    case DISK_VHDX:
+        return "VHDX";
+    case DISK_QCOW2:
+        return "qcow2";
+    default:
+        return "raw";
+    }
+}
 
-        if (bootSector.sectorsPerCluster > 0)
-        {
-            this->totalClusters = dataSectors / bootSector.sectorsPerCluster;
-        }
-        else
+ssize_t BlockDevice::readHost(uint64_t offset, void *buf, size_t size) const
+{
+    // Mượn một handle rảnh (hoặc mở mới) -> các luồng đọc không chặn nhau
+    unique_ptr<ifstream> in;
+    {
+        lock_guard<mutex> g(poolLock);
+        if (!idleReaders.empty())
         {
-            this->totalClusters = 0;
+            in = move(idleReaders.back());
+            idleReaders.pop_back();
         }
     }
-    else
+    if (!in)
     {
-        this->totalClusters = 0;
-        cout << "[ERROR] Calculated Data Area is negative or zero. Geometry invalid.\n";
-        return false;
+        in.reset(new ifstream(imagePath, ios::in | ios::binary));
+        if (!in->is_open())
+            return -1;
     }
 
-    // In kiểm tra
-    cout << "   -> FAT Begin Offset:  " << this->fatBegin << "\n";
-    cout << "   -> Data Begin Offset: " << this->dataBegin << "\n";
-    cout << "   -> Total Clusters:    " << this->totalClusters << "\n";
+    in->clear(); // Xóa cờ lỗi (EOF, Fail) trước khi seek
+    in->seekg(offset, ios::beg);
+    ssize_t n = -1;
+    if (!in->fail())
+    {
+        in->read((char *)buf, size);
+        n = in->gcount(); // Số byte thực tế đã đọc
+        Metrics::add(Metrics::READ_CALLS, 1);
+        Metrics::add(Metrics::BYTES_READ, n);
+    }
 
-    printVolumeInfo();
-    return true;
+    lock_guard<mutex> g(poolLock);
+    idleReaders.push_back(move(in));
+    return n;
 }
 
-bool FAT32Recovery::checkAndFixBootSector(uint64_t partStartSector)
+ssize_t BlockDevice::read(uint64_t offset, void *buf, size_t size) const
 {
-    uint8_t buf[512];
-    uint64_t mainOffset = partStartSector * FAT32Const::SECTOR_SIZE;
+    if (diskFormat == DISK_RAW)
+        return readHost(offset, buf, size);
 
-    // --- BƯỚC 1: KIỂM TRA MAIN BOOT SECTOR ---
-    // "BR appears to be greatly important"
-    if (readBytes(mainOffset, buf, 512) == 512)
+    if (offset >= diskSize)
+        return 0;
+    size = (size_t)min<uint64_t>(size, diskSize - offset);
+
+    // Đi qua từng block: block có dữ liệu đọc từ file, block trống điền 0 (không I/O)
+    uint8_t *out = static_cast<uint8_t *>(buf);
+    size_t done = 0;
+    while (done < size)
     {
-        // Dùng Validator đã viết ở Phase 1 để kiểm tra
-        if (isValidFAT32BS(buf))
+        uint64_t hostOffset = 0, runBytes = 0;
+        MapResult m = mapOffset(offset + done, hostOffset, runBytes);
+        size_t chunk = (size_t)min<uint64_t>(size - done, runBytes);
+
+        if (m == MAP_ERROR)
+            return done > 0 ? (ssize_t)done : -1;
+        if (m == MAP_ZERO)
         {
-            cout << "[SUCCESS] Main Boot Sector is healthy.\n";
-            parseBPB(buf); // Load vào bộ nhớ
-            return true;
+            memset(out + done, 0, chunk);
         }
         else
         {
-            cout << "[FAIL] Main Boot Sector is invalid/corrupted.\n";
+            ssize_t n = readHost(hostOffset, out + done, chunk);
+            if (n < (ssize_t)chunk)
+                return n > 0 ? (ssize_t)(done + n) : (done > 0 ? (ssize_t)done : -1);
         }
+        done += chunk;
     }
+    return done;
+}
 
-    // --- BƯỚC 2: KIỂM TRA BACKUP BOOT SECTOR ---
-    // "Copies of BR are usually at the top... finding it doesn't take much time"
-    // Với FAT32, vị trí mặc định là Sector 6 so với đầu phân vùng.
-    uint64_t backupOffset = (partStartSector + 6) * FAT32Const::SECTOR_SIZE;
+bool BlockDevice::write(uint64_t offset, const void *buf, size_t size)
+{
+    if (readOnly)
+        return true; // dry-run
 
-    if (readBytes(backupOffset, buf, 512) == 512)
+    if (diskFormat != DISK_RAW && offset + size > diskSize)
     {
-        // Kiểm tra bản sao này
-        if (isValidFAT32BS(buf))
-        {
-            cout << "[SUCCESS] Found valid Backup Boot Sector at +6.\n";
-
-            // "Copy it back to the MBR" (ở đây là BR)
-            cout << "[FIX] Restoring Backup to Main Boot Sector...\n";
-
-            // 1. Load vào bộ nhớ
-            parseBPB(buf);
-
-            // 2. Ghi đè lên vị trí Main BS hỏng
-            saveBootSector(mainOffset);
+        cerr << "[ERROR] Write past the end of the virtual disk.\n";
+        return false;
+    }
+    if (!containerWritable)
+    {
+        cerr << "[ERROR] Writing to this " << formatName() << " image is not supported.\n";
+        return false;
+    }
 
-            return true;
-        }
-        else
+    const uint8_t *in = static_cast<const uint8_t *>(buf);
+    size_t done = 0;
+    lock_guard<mutex> g(writeLock);
+    while (done < size)
+    {
+        // Raw: ghi thẳng; container: chỉ ghi được vào block đã cấp phát
+        uint64_t hostOffset = offset + done, runBytes = size - done;
+        if (diskFormat != DISK_RAW && mapOffset(offset + done, hostOffset, runBytes) != MAP_HOST)
         {
-            cout << "[FAIL] Backup Boot Sector is also corrupted.\n";
+            cerr << "[ERROR] Cannot write to an unallocated block of " << formatName() << " image.\n";
+            return false;
         }
-    }
+        size_t chunk = (size_t)min<uint64_t>(size - done, runBytes);
 
-    return false; // Cả hai đều hỏng
+        writer.clear();
+        writer.seekp(hostOffset, ios::beg);
+        writer.write(reinterpret_cast<const char *>(in + done), chunk);
+        if (!writer.good())
+            return false;
+        done += chunk;
+    }
+    writer.flush(); // Đẩy xuống OS để các handle đọc thấy ngay
+    if (!writer.good())
+        return false;
+    Metrics::add(Metrics::WRITE_CALLS, 1);
+    Metrics::add(Metrics::BYTES_WRITTEN, size);
+    return true;
 }
 
-void FAT32Recovery::reconstructBPB(uint64_t partStartSector, uint32_t partSize)
+// ======================================================================
+//               VIRTUAL DISK CONTAINERS (VHD / VHDX / QCOW2)
+// ======================================================================
+namespace
 {
-    cout << "   -> Attempting Advanced Reconstruction (Scanning for FAT signatures)...\n";
-
-    // Xóa sạch struct
-    memset(&bootSector, 0, sizeof(BootSector));
-
-    // 1. Điền các tham số cơ bản (Mặc định)
-    bootSector.bytesPerSector = 512;
-    bootSector.numFATs = 2;
-    bootSector.totalSectors32 = partSize;
-    bootSector.hiddenSectors = (uint32_t)partStartSector;
-    bootSector.rootCluster = 2;
-
-    // 2. TẬN DỤNG LOGIC CŨ: Quét tìm bảng FAT để xác định Reserved Sectors
-    // (Logic cũ của bạn nằm trong reconstructBootSector cũ)
-
-    uint8_t buffer[512];
-    uint64_t fat1Offset = 0;
-    uint64_t fat2Offset = 0;
-    bool foundFAT1 = false;
-
-    uint64_t maxSectors = diskSize / FAT32Const::SECTOR_SIZE;
-    for (int i = 1; i < maxSectors; i++)
+    uint32_t read_u32_be(const uint8_t *p)
     {
-        uint64_t absOffset = (partStartSector + i) * 512;
-        if (readBytes(absOffset, buffer, 512) != 512)
-            break;
-
-        // Signature đầu bảng FAT32: F8 FF FF 0F
-        if (read_u32_le(buffer) == 0x0FFFFFF8 && read_u32_le(buffer + 4) == 0xFFFFFFFF)
-        { // Little Endian của F8 FF FF 0F
-            if (!foundFAT1)
-            {
-                cout << "      [SCAN] Found Potential FAT1 at Sector +" << i << "\n";
-                fat1Offset = absOffset;
-                bootSector.reservedSectors = (uint16_t)i; // Tìm ra Reserved Sectors!
-                foundFAT1 = true;
-            }
-            else
-            {
-                cout << "      [SCAN] Found Potential FAT2 at Sector +" << i << "\n";
-                fat2Offset = absOffset;
-                break; // Tìm thấy 2 bảng là đủ
-            }
-        }
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
     }
 
-    // 3. Tính toán Sectors Per FAT
-    if (fat1Offset > 0 && fat2Offset > 0)
-    {
-        uint64_t dist = fat2Offset - fat1Offset;
-        bootSector.sectorsPerFat = (uint32_t)(dist / 512);
-        cout << "      [INFO] Calculated FAT Size: " << bootSector.sectorsPerFat << " sectors.\n";
-    }
-    else
+    uint64_t read_u64_be(const uint8_t *p)
     {
-        // Fallback: Nếu không tìm thấy FAT, dùng công thức ước lượng (như câu trả lời trước)
-        cout << "      [WARN] Cannot find FAT tables. Using estimation.\n";
-        bootSector.sectorsPerFat = (partSize / 8 / 128); // Ước lượng thô
+        return (uint64_t(read_u32_be(p)) << 32) | read_u32_be(p + 4);
     }
 
-    // 4. TẬN DỤNG LOGIC CŨ: Đoán Sectors Per Cluster (SPC)
-    // Brute-force thử đọc Root Directory
-    int possibleSPCs[] = {8, 16, 32, 64, 1, 2, 4, 128};
-    bool spcFound = false;
-
-    // Tính offset bắt đầu vùng FAT
-    uint64_t fatStart = partStartSector * 512 + (uint64_t)bootSector.reservedSectors * 512;
-    uint64_t fatSizeBytes = (uint64_t)bootSector.sectorsPerFat * 512;
-
-    for (int spc : possibleSPCs)
+    // CRC32C (Castagnoli, reflected) dùng cho header/region table của VHDX
+    uint32_t crc32c(const uint8_t *data, size_t size)
     {
-        // Giả lập vùng Data bắt đầu ở đâu với SPC này
-        uint64_t dataStart = fatStart + ((uint64_t)bootSector.numFATs * fatSizeBytes);
-
-        // Root Cluster (2) nằm ngay đầu vùng Data
-        // Đọc thử xem có ra dáng thư mục không
-        if (readBytes(dataStart, buffer, 512) == 512)
+        static const array<uint32_t, 256> table = []()
         {
-            // Logic check Directory của bạn:
-            // Check xem entry đầu có phải là volume label hoặc . hoặc file hợp lệ không
-            // (Đơn giản hóa: Check attribute 0x08, 0x10, 0x20...)
-            bool looksLikeDir = false;
-            for (int k = 0; k < 16; k++)
+            array<uint32_t, 256> t;
+            for (uint32_t i = 0; i < 256; ++i)
             {
-                uint8_t attr = buffer[k * 32 + 11];
-                if ((attr & 0x18) || attr == 0x20)
-                { // Dir or Vol or Archive
-                    looksLikeDir = true;
-                    break;
-                }
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+                t[i] = c;
             }
+            return t;
+        }();
 
-            if (looksLikeDir)
-            {
-                bootSector.sectorsPerCluster = (uint8_t)spc;
-                cout << "      [INFO] Cluster Size " << spc << " matches Root Directory pattern.\n";
-                spcFound = true;
-                break;
-            }
-        }
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i)
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFFu;
     }
 
-    if (!spcFound)
+    // Kiểm tra checksum CRC32C của VHDX với trường checksum (4 byte tại pos) coi như 0
+    bool vhdxChecksumOK(vector<uint8_t> &block, size_t pos)
     {
-        bootSector.sectorsPerCluster = 8; // Default an toàn
-        cout << "      [WARN] Could not guess SPC. Defaulting to 8.\n";
+        uint32_t stored = read_u32_le(block.data() + pos);
+        memset(block.data() + pos, 0, 4);
+        return crc32c(block.data(), block.size()) == stored;
     }
 
-    // 5. Ghi Boot Sector "giả" xuống đĩa
-    bootSector.bootSignature = 0xAA55;
-    memcpy(bootSector.fsType, "FAT32   ", 8);
-    saveBootSector(partStartSector * 512);
+    // Checksum footer/header VHD: bù 1 của tổng mọi byte, bỏ qua chính trường checksum
+    bool vhdChecksumOK(const uint8_t *data, size_t size, size_t pos)
+    {
+        uint32_t sum = 0;
+        for (size_t i = 0; i < size; ++i)
+            if (i < pos || i >= pos + 4)
+                sum += data[i];
+        return ~sum == read_u32_be(data + pos);
+    }
+
+    // GUID ở dạng trên đĩa (3 trường đầu little-endian)
+    const uint8_t VHDX_BAT_GUID[16] = {0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42,
+                                       0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08};
+    const uint8_t VHDX_METADATA_GUID[16] = {0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B,
+                                            0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E};
+    const uint8_t VHDX_FILE_PARAMS_GUID[16] = {0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D,
+                                               0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B};
+    const uint8_t VHDX_DISK_SIZE_GUID[16] = {0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48,
+                                             0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8};
+    const uint8_t VHDX_SECTOR_SIZE_GUID[16] = {0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47,
+                                               0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F};
+
+    const uint64_t QCOW2_OFFSET_MASK = 0x00FFFFFFFFFFFE00ULL;
+    const uint64_t QCOW2_COMPRESSED = 1ULL << 62;
+    const uint64_t QCOW2_ZERO = 1ULL;
 }
 
+void BlockDevice::openContainer()
+{
+    uint8_t head[512] = {0};
+    if (readHost(0, head, sizeof(head)) < 8)
+        return;
 
-// ======================================================================
-//                       FILE SYSTEM (FAT32)
-// ======================================================================
+    if (memcmp(head, "vhdxfile", 8) == 0)
+        openVHDX();
+    else if (read_u32_be(head) == 0x514649FB) // "QFI\xfb"
+        openQCOW2();
+    else if (!openVHD())
+        return; // Raw image
 
-void FAT32Recovery::loadFAT()
-{
-    // Đảm bảo các thông số đã được khởi tạo từ readBootSector/selectPartition
-    if (bootSector.sectorsPerFat == 0 || bootSector.bytesPerSector == 0 || fatBegin == 0)
+    if (diskFormat == DISK_VHD_FIXED)
     {
-        throw runtime_error("FAT parameters not initialized. Call readBootSector/selectPartition first.");
+        cout << "[INFO] Container: fixed VHD (footer excluded from disk size).\n";
+        return;
     }
 
-    // 1. Tính toán kích thước của một bản sao FAT (bằng byte)
-    uint64_t fatSizeBytes = (uint64_t)bootSector.sectorsPerFat * bootSector.bytesPerSector;
+    uint64_t allocated = 0, total = 0;
+    if (diskFormat == DISK_QCOW2)
+    {
+        total = l1Table.size();
+        for (uint64_t e : l1Table)
+            allocated += (e & QCOW2_OFFSET_MASK) != 0;
+    }
+    else
+    {
+        total = blockMap.size();
+        for (uint64_t e : blockMap)
+            allocated += e != 0;
+    }
+    cout << "[INFO] Container: " << formatName() << ", block " << blockSize << " bytes, "
+         << allocated << "/" << total << (diskFormat == DISK_QCOW2 ? " L2 tables" : " blocks")
+         << " allocated. Unallocated areas read as zeros.\n";
+}
 
-    if (fatSizeBytes == 0)
+bool BlockDevice::openVHD()
+{
+    // Footer 512 byte ở cuối file; VHD dynamic còn một bản sao ở offset 0
+    uint8_t footer[512];
+    bool fromCopy = false;
+    if (hostSize < sizeof(footer) || readHost(hostSize - sizeof(footer), footer, sizeof(footer)) != sizeof(footer) ||
+        memcmp(footer, "conectix", 8) != 0)
     {
-        throw runtime_error("Calculated FAT size is zero.");
+        if (readHost(0, footer, sizeof(footer)) != sizeof(footer) || memcmp(footer, "conectix", 8) != 0)
+            return false;
+        fromCopy = true;
     }
 
-    cout << "[INFO] FAT table size: " << fatSizeBytes << " bytes. Reading from offset: 0x"
-         << hex << fatBegin << endl;
+    if (!vhdChecksumOK(footer, 85, 64))
+        cout << "[WARN] VHD footer checksum mismatch, using it anyway.\n";
+    if (fromCopy)
+        cout << "[WARN] VHD footer at end of file is missing, using the copy at offset 0.\n";
 
-    // 2. Chuẩn bị buffer và đọc toàn bộ FAT table từ đĩa
-    // vector<uint8_t> fatBuffer(fatSizeBytes);
+    uint64_t currentSize = read_u64_be(footer + 48);
+    uint32_t diskType = read_u32_be(footer + 60);
 
-    // ssize_t n = readBytes(fatBegin, fatBuffer.data(), fatSizeBytes);
+    if (diskType == 2 && !fromCopy)
+    {
+        diskFormat = DISK_VHD_FIXED;
+        diskSize = min<uint64_t>(currentSize, hostSize - sizeof(footer));
+        return true;
+    }
+    if (diskType == 4)
+        throw runtime_error("Differencing VHD needs its parent image, which is not supported.");
+    if (diskType != 3)
+        return false;
 
-    // if (n != (ssize_t)fatSizeBytes)
-    // {
-    //     // Xử lý lỗi đọc
-    //     throw runtime_error("Failed to read entire FAT table from disk. Read " +
-    //                         to_string(n) + " of " + to_string(fatSizeBytes) + " bytes.");
-    // }
+    // Dynamic header ("cxsparse") -> BAT: mỗi entry là sector bắt đầu của block, 0xFFFFFFFF = trống.
+    // Mỗi block bắt đầu bằng sector bitmap, dữ liệu nằm ngay sau.
+    uint8_t hdr[1024];
+    uint64_t headerOffset = read_u64_be(footer + 16);
+    if (readHost(headerOffset, hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr, "cxsparse", 8) != 0)
+        throw runtime_error("Dynamic VHD header is missing or damaged.");
+    if (!vhdChecksumOK(hdr, sizeof(hdr), 36))
+        cout << "[WARN] VHD dynamic header checksum mismatch, using it anyway.\n";
+
+    uint64_t tableOffset = read_u64_be(hdr + 16);
+    uint32_t entries = read_u32_be(hdr + 28);
+    blockSize = read_u32_be(hdr + 32);
+    if (blockSize < 512 || (blockSize & (blockSize - 1)) != 0)
+        throw runtime_error("Dynamic VHD has an invalid block size.");
+
+    uint64_t bitmapBytes = ((blockSize / 512 / 8) + 511) / 512 * 512;
+    vector<uint8_t> bat((size_t)entries * 4);
+    if (readHost(tableOffset, bat.data(), bat.size()) != (ssize_t)bat.size())
+        throw runtime_error("Cannot read dynamic VHD block allocation table.");
+
+    blockMap.assign(entries, 0);
+    for (uint32_t i = 0; i < entries; ++i)
+    {
+        uint32_t sector = read_u32_be(bat.data() + i * 4);
+        if (sector != 0xFFFFFFFF)
+            blockMap[i] = (uint64_t)sector * 512 + bitmapBytes;
+    }
+
+    diskFormat = DISK_VHD_DYNAMIC;
+    diskSize = min<uint64_t>(currentSize, (uint64_t)entries * blockSize);
+    return true;
+}
 
-    vector<uint8_t> fatBuffer(fatSizeBytes);
-    bool isFATValid = false;
+void BlockDevice::openVHDX()
+{
+    const uint64_t KB64 = 64 * 1024;
 
-    // Thử đọc FAT1
-    cout << "[INFO] Reading FAT1...\n";
-    if (readBytes(fatBegin, fatBuffer.data(), fatSizeBytes) == (ssize_t)fatSizeBytes)
+    // 1. Hai header (64 KB, 128 KB): lấy bản CRC hợp lệ có sequence number lớn nhất
+    vector<uint8_t> best;
+    uint64_t bestSeq = 0;
+    for (uint64_t off : {KB64, 2 * KB64})
     {
-        uint32_t entry0 = read_u32_le(fatBuffer.data());
-        // Entry 0 của FAT32 đĩa cứng thường là 0x0FFFFF8 (Media Type F8)
-        if ((entry0 & 0x0FFFFF00) == 0x0FFFFF00)
+        vector<uint8_t> h(4096);
+        if (readHost(off, h.data(), h.size()) != (ssize_t)h.size() || memcmp(h.data(), "head", 4) != 0 ||
+            !vhdxChecksumOK(h, 4))
+            continue;
+        uint64_t seq = read_u64_le(h.data() + 8);
+        if (best.empty() || seq > bestSeq)
         {
-            isFATValid = true;
+            best = h;
+            bestSeq = seq;
         }
     }
+    if (best.empty())
+        throw runtime_error("Both VHDX headers are damaged.");
+    if (read_u16_le(best.data() + 66) != 1)
+        throw runtime_error("Unsupported VHDX version.");
+
+    static const uint8_t zeroGuid[16] = {0};
+    if (memcmp(best.data() + 48, zeroGuid, 16) != 0)
+    {
+        // Log chưa replay: đọc vẫn được (có thể thiếu vài cập nhật metadata), không ghi
+        cout << "[WARN] VHDX log has not been replayed. Image opened for reading only.\n";
+        containerWritable = false;
+    }
 
-    // Nếu FAT1 lỗi, thử đọc FAT2 (Theo kiến trúc thực tế)
-    if (!isFATValid && bootSector.numFATs > 1)
+    // 2. Region table (192 KB, bản backup 256 KB): vị trí BAT và Metadata
+    uint64_t batOffset = 0, batLength = 0, metaOffset = 0, metaLength = 0;
+    bool regionsOK = false;
+    for (uint64_t off : {3 * KB64, 4 * KB64})
     {
-        cout << "[WARN] FAT1 corrupted. Attempting to read FAT2 (Redundancy Check)...\n";
-        uint64_t fat2Begin = fatBegin + fatSizeBytes; // FAT2 nằm ngay sau FAT1
+        vector<uint8_t> r(KB64);
+        if (readHost(off, r.data(), r.size()) != (ssize_t)r.size() || memcmp(r.data(), "regi", 4) != 0 ||
+            !vhdxChecksumOK(r, 4))
+            continue;
 
-        // Tái sử dụng buffer để đọc FAT2
-        if (readBytes(fat2Begin, fatBuffer.data(), fatSizeBytes) == (ssize_t)fatSizeBytes)
+        uint32_t count = min<uint32_t>(read_u32_le(r.data() + 8), 2047);
+        for (uint32_t i = 0; i < count; ++i)
         {
-            uint32_t entry0 = read_u32_le(fatBuffer.data());
-            if ((entry0 & 0x0FFFFF00) == 0x0FFFFF00)
+            const uint8_t *e = r.data() + 16 + i * 32;
+            if (memcmp(e, VHDX_BAT_GUID, 16) == 0)
             {
-                cout << "[SUCCESS] FAT2 is valid. Using FAT2 data.\n";
-                isFATValid = true;
-
-                // Tự động sửa FAT1 bằng FAT2
-                cout << "[FIX] Overwriting corrupted FAT1 with valid FAT2...\n";
-                vhd.seekp(fatBegin, ios::beg);
-                vhd.write((char *)fatBuffer.data(), fatSizeBytes);
-                vhd.flush();
+                batOffset = read_u64_le(e + 16);
+                batLength = read_u32_le(e + 24);
+            }
+            else if (memcmp(e, VHDX_METADATA_GUID, 16) == 0)
+            {
+                metaOffset = read_u64_le(e + 16);
+                metaLength = read_u32_le(e + 24);
+            }
+            else if (read_u32_le(e + 28) & 1)
+                throw runtime_error("VHDX has an unknown required region.");
+        }
+        regionsOK = true;
+        break;
+    }
+    if (!regionsOK || batOffset == 0 || metaOffset == 0)
+        throw runtime_error("VHDX region table is damaged.");
+
+    // 3. Metadata: block size, kích thước đĩa ảo, sector logic
+    vector<uint8_t> meta((size_t)min<uint64_t>(metaLength, 1 << 20));
+    if (meta.size() < 32 || readHost(metaOffset, meta.data(), meta.size()) != (ssize_t)meta.size() ||
+        memcmp(meta.data(), "metadata", 8) != 0)
+        throw runtime_error("VHDX metadata region is damaged.");
+
+    uint32_t fileFlags = 0, logicalSector = 0;
+    uint16_t items = min<uint16_t>(read_u16_le(meta.data() + 10), 2047);
+    for (uint16_t i = 0; i < items && 32 + (size_t(i) + 1) * 32 <= meta.size(); ++i)
+    {
+        const uint8_t *e = meta.data() + 32 + i * 32;
+        uint32_t itemOffset = read_u32_le(e + 16);
+        if (itemOffset + 8 > meta.size())
+            continue;
+        const uint8_t *item = meta.data() + itemOffset;
+        if (memcmp(e, VHDX_FILE_PARAMS_GUID, 16) == 0)
+        {
+            blockSize = read_u32_le(item);
+            fileFlags = read_u32_le(item + 4);
+        }
+        else if (memcmp(e, VHDX_DISK_SIZE_GUID, 16) == 0)
+            diskSize = read_u64_le(item);
+        else if (memcmp(e, VHDX_SECTOR_SIZE_GUID, 16) == 0)
+            logicalSector = read_u32_le(item);
+    }
+    if (fileFlags & 2)
+        throw runtime_error("Differencing VHDX needs its parent image, which is not supported.");
+    if (blockSize == 0 || logicalSector == 0 || diskSize == 0)
+        throw runtime_error("VHDX metadata is incomplete.");
+
+    // 4. BAT: sau mỗi chunkRatio entry payload là một entry sector bitmap (bỏ qua)
+    uint64_t chunkRatio = ((1ULL << 23) * logicalSector) / blockSize;
+    uint64_t dataBlocks = (diskSize + blockSize - 1) / blockSize;
+    uint64_t batEntries = dataBlocks + (dataBlocks - 1) / chunkRatio;
+    vector<uint8_t> bat((size_t)min<uint64_t>(batEntries * 8, batLength));
+    if (readHost(batOffset, bat.data(), bat.size()) != (ssize_t)bat.size())
+        throw runtime_error("Cannot read VHDX block allocation table.");
+
+    blockMap.assign(dataBlocks, 0);
+    for (uint64_t b = 0; b < dataBlocks; ++b)
+    {
+        uint64_t idx = b + b / chunkRatio;
+        if ((idx + 1) * 8 > bat.size())
+            break;
+        uint64_t entry = read_u64_le(bat.data() + idx * 8);
+        uint32_t state = entry & 7;
+        uint64_t fileOffset = (entry >> 20) << 20;
+        // 6 = FULLY_PRESENT, 7 = PARTIALLY_PRESENT; NOT_PRESENT/ZERO/UNMAPPED -> đọc ra 0
+        if ((state == 6 || state == 7) && fileOffset != 0)
+            blockMap[b] = fileOffset;
+    }
+    diskFormat = DISK_VHDX;
+}
+
+void BlockDevice::openQCOW2()
+{
+    uint8_t hdr[104] = {0};
+    if (readHost(0, hdr, sizeof(hdr)) < 72)
+        throw runtime_error("qcow2 header is truncated.");
+
+    uint32_t version = read_u32_be(hdr + 4);
+    uint32_t clusterBits = read_u32_be(hdr + 20);
+    uint32_t l1Size = read_u32_be(hdr + 36);
+    uint64_t l1Offset = read_u64_be(hdr + 40);
+    uint32_t snapshots = read_u32_be(hdr + 60);
+
+    if (version != 2 && version != 3)
+        throw runtime_error("Unsupported qcow2 version " + to_string(version) + ".");
+    if (read_u64_be(hdr + 8) != 0)
+        throw runtime_error("qcow2 image with a backing file is not supported.");
+    if (read_u32_be(hdr + 32) != 0)
+        throw runtime_error("Encrypted qcow2 image is not supported.");
+    if (clusterBits < 9 || clusterBits > 21)
+        throw runtime_error("qcow2 has an invalid cluster size.");
+
+    if (version == 3)
+    {
+        uint64_t incompatible = read_u64_be(hdr + 72);
+        if (incompatible & 2)
+            cout << "[WARN] qcow2 image is marked corrupt.\n";
+        // External data file / compression type / extended L2 đổi cách hiểu bảng L2
+        if (incompatible & ~3ULL)
+            throw runtime_error("qcow2 image uses unsupported incompatible features.");
+    }
+
+    blockSize = 1ULL << clusterBits;
+    diskSize = read_u64_be(hdr + 24);
+
+    vector<uint8_t> raw((size_t)l1Size * 8);
+    if (readHost(l1Offset, raw.data(), raw.size()) != (ssize_t)raw.size())
+        throw runtime_error("Cannot read qcow2 L1 table.");
+    l1Table.resize(l1Size);
+    for (uint32_t i = 0; i < l1Size; ++i)
+        l1Table[i] = read_u64_be(raw.data() + i * 8);
+
+    // Snapshot có thể dùng chung cluster -> ghi đè sẽ sửa cả snapshot
+    containerWritable = snapshots == 0;
+    diskFormat = DISK_QCOW2;
+}
+
+BlockDevice::MapResult BlockDevice::mapOffset(uint64_t offset, uint64_t &hostOffset, uint64_t &runBytes) const
+{
+    if (diskFormat == DISK_VHD_FIXED || diskFormat == DISK_RAW)
+    {
+        hostOffset = offset;
+        runBytes = diskSize > offset ? diskSize - offset : 0;
+        return MAP_HOST;
+    }
+
+    uint64_t within = offset % blockSize;
+    runBytes = blockSize - within;
+
+    if (diskFormat != DISK_QCOW2)
+    {
+        uint64_t block = offset / blockSize;
+        if (block >= blockMap.size() || blockMap[block] == 0)
+            return MAP_ZERO;
+        hostOffset = blockMap[block] + within;
+        return MAP_HOST;
+    }
+
+    // qcow2: cluster -> (L1, L2); L2 trống thì cả vùng nó phủ đều là 0
+    uint64_t l2Entries = blockSize / 8;
+    uint64_t cluster = offset / blockSize;
+    uint64_t l1Index = cluster / l2Entries;
+    uint64_t l2Index = cluster % l2Entries;
+    uint64_t l2Offset = l1Index < l1Table.size() ? (l1Table[l1Index] & QCOW2_OFFSET_MASK) : 0;
+    if (l2Offset == 0)
+    {
+        runBytes = (l2Entries - l2Index) * blockSize - within;
+        return MAP_ZERO;
+    }
+
+    uint64_t entry;
+    {
+        lock_guard<mutex> g(l2Lock);
+        auto it = l2Tables.find(l1Index);
+        if (it == l2Tables.end())
+        {
+            vector<uint8_t> raw(blockSize);
+            if (readHost(l2Offset, raw.data(), raw.size()) != (ssize_t)raw.size())
+                return MAP_ERROR;
+            vector<uint64_t> table(l2Entries);
+            for (uint64_t i = 0; i < l2Entries; ++i)
+                table[i] = read_u64_be(raw.data() + i * 8);
+            it = l2Tables.emplace(l1Index, move(table)).first;
+        }
+        entry = it->second[l2Index];
+    }
+
+    if (entry & QCOW2_COMPRESSED)
+    {
+        FAT32_LOG(LOG_ERROR, "compressed qcow2 clusters", "compressed qcow2 cluster at guest offset " << offset
+                                                                                                         << " is not supported");
+        return MAP_ERROR;
+    }
+    hostOffset = entry & QCOW2_OFFSET_MASK;
+    if ((entry & QCOW2_ZERO) || hostOffset == 0)
+        return MAP_ZERO;
+    hostOffset += within;
+    return MAP_HOST;
+}
+
+// ======================================================================
+//                      SPARSE REGIONS / ZERO BLOCKS
+// ======================================================================
+uint64_t BlockDevice::nextData(uint64_t offset) const
+{
+    if (offset >= diskSize)
+        return diskSize;
+
+    if (diskFormat == DISK_RAW || diskFormat == DISK_VHD_FIXED)
+    {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if (holeFd >= 0)
+        {
+            off_t r = ::lseek(holeFd, (off_t)offset, SEEK_DATA);
+            if (r >= 0)
+                return min<uint64_t>((uint64_t)r, diskSize);
+            if (errno == ENXIO)
+                return diskSize; // Không còn dữ liệu tới cuối file
+        }
+#endif
+        return offset;
+    }
+
+    if (diskFormat == DISK_QCOW2)
+    {
+        // mapOffset trả về cả vùng 0 liên tiếp (L2 trống phủ nhiều cluster một lần)
+        while (offset < diskSize)
+        {
+            uint64_t hostOffset, runBytes;
+            if (mapOffset(offset, hostOffset, runBytes) != MAP_ZERO)
+                return offset;
+            offset += runBytes;
+        }
+        return diskSize;
+    }
+
+    for (uint64_t b = offset / blockSize; b < blockMap.size(); ++b)
+    {
+        if (blockMap[b] != 0)
+            return max(offset, b * blockSize);
+    }
+    return diskSize;
+}
+
+uint64_t BlockDevice::nextHole(uint64_t offset) const
+{
+    if (offset >= diskSize)
+        return diskSize;
+
+    if (diskFormat == DISK_RAW || diskFormat == DISK_VHD_FIXED)
+    {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if (holeFd >= 0)
+        {
+            off_t r = ::lseek(holeFd, (off_t)offset, SEEK_HOLE);
+            if (r >= 0)
+                return min<uint64_t>((uint64_t)r, diskSize);
+        }
+#endif
+        return diskSize;
+    }
+
+    if (diskFormat == DISK_QCOW2)
+    {
+        while (offset < diskSize)
+        {
+            uint64_t hostOffset, runBytes;
+            if (mapOffset(offset, hostOffset, runBytes) == MAP_ZERO)
+                return offset;
+            offset += runBytes;
+        }
+        return diskSize;
+    }
+
+    for (uint64_t b = offset / blockSize; b < blockMap.size(); ++b)
+    {
+        if (blockMap[b] == 0)
+            return max(offset, b * blockSize);
+    }
+    return diskSize;
+}
+
+namespace
+{
+    // Kiểm tra nhanh vùng toàn 0: OR dồn 64 byte mỗi vòng (SSE2 nếu có), thoát sớm ở byte khác 0
+    bool isZeroBlock(const uint8_t *p, size_t size)
+    {
+        size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; i + 64 <= size; i += 64)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 16));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 32));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 48));
+            __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF)
+                return false;
+        }
+#endif
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            if (w != 0)
+                return false;
+        }
+        for (; i < size; ++i)
+            if (p[i] != 0)
+                return false;
+        return true;
+    }
+
+    // Kích thước cửa sổ đọc khi quét toàn đĩa
+    const size_t SCAN_WINDOW = 1 << 20;
+}
+
+// ======================================================================
+//                        CONSTRUCTOR / DESTRUCTOR
+// ======================================================================
+FAT32Recovery::FAT32Recovery(const string &path, bool readOnly)
+    : device(make_shared<BlockDevice>(path, readOnly))
+{
+    initDefaults();
+    memset(&mbr, 0, sizeof(MBR));
+}
+
+FAT32Recovery::FAT32Recovery(shared_ptr<BlockDevice> sharedDevice, const MBR &partitionTable,
+                             const vector<PartitionInfo> &partitionList)
+    : device(sharedDevice), partitions(partitionList)
+{
+    initDefaults();
+    mbr = partitionTable;
+}
+
+void FAT32Recovery::initDefaults()
+{
+    bootSector.bytesPerSector = 0;
+    bootSector.sectorsPerCluster = 0;
+    bootSector.reservedSectors = 0;
+    bootSector.numFATs = 0;
+    bootSector.sectorsPerFat = 0;
+    bootSector.rootCluster = 0;
+
+    fatBegin = 0;
+    dataBegin = 0;
+    totalClusters = 0;
+    sectorSize = FAT32Const::SECTOR_SIZE;
+    activePartition = -1;
+
+    memset(&fsInfo, 0, sizeof(fsInfo));
+    fsInfoOffset = 0;
+    freeClusters = 0;
+    nextFreeHint = FAT32Const::FSINFO_UNKNOWN;
+    fsInfoDirty = false;
+
+    ioThreads = max(1u, min(8u, thread::hardware_concurrency()));
+    maxRunBytes = 1 << 20; // 1 MiB mỗi lần đọc gộp
+    ownerMapBudget = size_t(256) << 20;
+
+    knownHashes = nullptr;
+    skipKnown = false;
+}
+
+FAT32Recovery::~FAT32Recovery()
+{
+    // Dừng pool I/O trước khi cache / device bị hủy (việc còn lại vẫn dùng chúng)
+    ioPool.reset();
+}
+
+// ======================================================================
+//                             LOW-LEVEL IO
+// ======================================================================
+string FAT32Recovery::formatShortName(const uint8_t name[11])
+{
+    string res;
+
+    // name part
+    for (int i = 0; i < 8; ++i)
+    {
+        if (name[i] == ' ')
+            break;
+        res.push_back(char(name[i]));
+    }
+
+    // extension part
+    string ext;
+    for (int i = 8; i < 11; ++i)
+    {
+        if (name[i] == ' ')
+            break;
+        ext.push_back(name[i]);
+    }
+
+    if (!ext.empty())
+        res += "." + ext;
+
+    return res;
+}
+
+ssize_t FAT32Recovery::readBytes(uint64_t offset, void *buf, size_t size) const
+{
+    return device->read(offset, buf, size);
+}
+
+bool FAT32Recovery::writeBytes(uint64_t offset, const void *buf, size_t size, bool invalidateCache)
+{
+    // Chế độ chỉ đọc: device bỏ qua việc ghi, coi như thành công (dry-run)
+    if (device->isReadOnly())
+        return true;
+    if (!device->write(offset, buf, size))
+        return false;
+
+    // Invalidate các cluster bị vùng ghi đè lên (nếu nằm trong Data Region)
+    uint64_t clusterSize = (uint64_t)bootSector.sectorsPerCluster * bootSector.bytesPerSector;
+    if (invalidateCache && clusterSize > 0 && dataBegin > 0 && size > 0 && offset + size > dataBegin)
+    {
+        uint64_t from = (offset > dataBegin ? offset - dataBegin : 0) / clusterSize;
+        uint64_t to = (offset + size - 1 - dataBegin) / clusterSize;
+        // invalidate tăng thế hệ shard: luồng nào đã miss trước lần ghi này sẽ không nạp lại bản cũ
+        for (uint64_t c = from; c <= to; ++c)
+            clusterCache.invalidate(uint32_t(c + 2));
+    }
+    return true;
+}
+
+// Ghi nguyên 1 cluster: write-through để cache giữ bản mới thay vì phải đọc lại
+void FAT32Recovery::writeCluster(uint32_t cluster, const vector<uint8_t> &buffer)
+{
+    if (device->isReadOnly())
+    {
+        // Giữ bản sửa trong overlay (không bị evict) để các bước sau thấy trạng thái nhất quán
+        clusterCache.putDirty(cluster, vector<uint8_t>(buffer));
+        return;
+    }
+
+    if (!writeBytes(cluster2Offset(cluster), buffer.data(), buffer.size(), false))
+        throw runtime_error("Failed to write cluster " + to_string(cluster));
+    clusterCache.writeThrough(cluster, buffer.data(), buffer.size());
+}
+
+void FAT32Recovery::writeAll(ostream &out, const void *buf, size_t size) const
+{
+    // Ép kiểu về const char* vì fstream yêu cầu char*
+    out.write(static_cast<const char *>(buf), size);
+
+    // Kiểm tra trạng thái stream sau khi ghi
+    if (out.fail() || out.bad())
+    {
+        // Có thể throw exception hoặc xử lý tùy logic của bạn
+        throw runtime_error("Failed to write data to output file.");
+    }
+}
+
+void FAT32Recovery::saveMBRToDisk()
+{
+    writeBytes(0, &mbr, sizeof(MBR));
+    cout << "[INFO] New MBR written to disk.\n";
+}
+
+void FAT32Recovery::listPartitions() const
+{
+    static const char *schemeNames[] = {"MBR", "EBR", "GPT", "NONE"};
+
+    cout << "[INFO] CURRENT PARTITION TABLE STATUS\n";
+    for (size_t i = 0; i < partitions.size(); i++)
+    {
+        const PartitionInfo &p = partitions[i];
+        cout << "[INFO] Partition #" << i << ": Start LBA=" << p.startLBA
+             << "       | Size=" << p.numSectors
+             << "       | Type=0x" << hex << (int)p.type << dec
+             << "       | " << schemeNames[p.scheme]
+             << (p.isFAT32 ? " FAT32" : "")
+             << (p.active ? " (Active)" : "") << endl;
+    }
+    cout << "================================================================\n\n";
+}
+
+void FAT32Recovery::parseBPB(const uint8_t *buffer)
+{
+    // Copy 512 byte raw vào struct BootSector
+    // (Giả sử struct BootSector đã được pack 1 byte chuẩn)
+    memcpy(&bootSector, buffer, sizeof(BootSector));
+}
+
+void FAT32Recovery::saveBootSector(uint64_t offset)
+{
+    writeBytes(offset, &bootSector, sizeof(BootSector));
+    cout << "[SUCCESS] Boot Sector written to disk at offset " << offset << ".\n";
+}
+
+void FAT32Recovery::printVolumeInfo() const
+{
+    cout << "[INFO] VOLUME PARAMETERS (ACTIVE)\n";
+    cout << "       | Bytes per Sector: " << bootSector.bytesPerSector << "\n";
+    cout << "       | Sectors per Cluster: " << (int)bootSector.sectorsPerCluster << "\n";
+    cout << "       | Reserved Sectors: " << bootSector.reservedSectors << "\n";
+    cout << "       | Number of FATs: " << (int)bootSector.numFATs << "\n";
+    cout << "       | Sectors per FAT: " << bootSector.sectorsPerFat << "\n";
+    cout << "       | Root Cluster: " << bootSector.rootCluster << "\n";
+    cout << "       | Total Sectors: " << bootSector.totalSectors32 << "\n";
+}
+
+// =====================================================================
+//                       HELPER: VALIDATOR FUNCTIONS
+// =====================================================================
+bool FAT32Recovery::isValidMBR(const MBR *mbrPtr) const
+{
+    // Kiểm tra chữ ký MBR
+    if (mbrPtr->signature != FAT32Const::SIGNATURE_LE)
+        return false;
+
+    // Chỉ kiểm tra cấu trúc bảng: entry rỗng bị bỏ qua, boot sector hỏng của
+    // một partition không làm hỏng cả bảng (initializeVolume tự dùng backup/reconstruct)
+    uint64_t diskSectors = device->size() / sectorSize;
+    bool hasEntry = false;
+    for (int i = 0; i < 4; ++i)
+    {
+        const ParEntry &p = mbrPtr->partitions[i];
+        if (p.partitionType == 0 || p.numSectors == 0)
+            continue;
+
+        // Boot flag chỉ có 0x00/0x80; entry trỏ vào sector 0 hoặc ra ngoài đĩa -> rác
+        if ((p.status & 0x7F) != 0 || p.lbaFirst == 0 || p.lbaFirst >= diskSectors)
+            return false;
+
+        // MBR bảo vệ của GPT thường ghi size 0xFFFFFFFF, không kiểm tra chồng lấn
+        if (p.partitionType != FAT32Const::PART_TYPE_GPT_PROTECTIVE)
+        {
+            for (int j = 0; j < i; ++j)
+            {
+                const ParEntry &q = mbrPtr->partitions[j];
+                if (q.partitionType == 0 || q.numSectors == 0 ||
+                    q.partitionType == FAT32Const::PART_TYPE_GPT_PROTECTIVE)
+                    continue;
+                if ((uint64_t)p.lbaFirst < (uint64_t)q.lbaFirst + q.numSectors &&
+                    (uint64_t)q.lbaFirst < (uint64_t)p.lbaFirst + p.numSectors)
+                    return false;
+            }
+        }
+        hasEntry = true;
+    }
+    return hasEntry;
+}
+
+bool FAT32Recovery::isValidFAT32BS(const uint8_t *buffer) const
+{
+    // Check Signature 0xAA55 ở cuối sector
+    uint16_t sig = read_u16_le(buffer + 510);
+    if (sig != FAT32Const::SIGNATURE_LE)
+        return false;
+
+    // Check chuỗi "FAT32   " ở offset 82 (0x52)
+    // Đây là dấu hiệu nhận biết Boot Sector của FAT32, phân biệt với NTFS/MBR
+    if (memcmp(buffer + 0x52, "FAT32", 5) != 0)
+        return false;
+
+    // Sanity Check (Kiểm tra tính hợp lý của thông số)
+    const BootSector *bs = reinterpret_cast<const BootSector *>(buffer);
+
+    // Bytes Per Sector phải chuẩn (thường là 512)
+    if (bs->bytesPerSector != 512 && bs->bytesPerSector != 1024 &&
+        bs->bytesPerSector != 2048 && bs->bytesPerSector != 4096)
+        return false;
+
+    // Cluster Size phải > 0
+    if (bs->sectorsPerCluster == 0 || bs->sectorsPerCluster > 128 ||
+        (bs->sectorsPerCluster & (bs->sectorsPerCluster - 1)) != 0)
+        return false;
+
+    // Reserved Sectors phải > 0
+    if (bs->reservedSectors == 0)
+        return false;
+
+    // Total Sectors phải > 0 (Nếu = 0 thì volume rỗng -> rác)
+    if (bs->totalSectors32 == 0)
+        return false;
+
+    // Sectors Per FAT phải > 0
+    if (bs->numFATs < 1 || bs->numFATs > 2)
+        return false;
+
+    // Root Cluster phải >= 2
+    if (bs->rootCluster < 2)
+        return false;
+
+    return true;
+}
+
+// ======================================================================
+//                       MBR PARSING / VALIDATION
+// ======================================================================
+void FAT32Recovery::initializeMBR()
+{
+    ScopedPhase timer(Metrics::PHASE_MBR);
+
+    cout << "\n=== MASTER BOOT RECORD (MBR) RECOVERY ===\n";
+    bool good = false;
+
+    sectorSize = detectSectorSize();
+    if (sectorSize != FAT32Const::SECTOR_SIZE)
+        cout << "[INFO] Logical sector size: " << sectorSize << " bytes (4Kn media).\n";
+
+    // BƯỚC 1: Kiểm tra Sector 0 xem có dùng được không, rồi đọc bảng (MBR/EBR/GPT)
+    if (checkMBR())
+    {
+        cout << "[SUCCESS] Primary MBR is valid.\n";
+        discoverPartitions();
+        good = any_of(partitions.begin(), partitions.end(),
+                      [](const PartitionInfo &p) { return p.isFAT32; });
+        if (good)
+            listPartitions(); // Xong, không cần deep scan
+        else
+            cout << "[WARN] Partition table has no FAT32 volume.\n";
+    }
+
+    if (!good)
+    {
+        // BƯỚC 2: Nếu không có bảng dùng được, quét đĩa để dựng lại (Bỏ qua tìm Backup)
+        cout << "[WARN] Primary MBR corrupted or empty. Starting Deep Scan...\n";
+        if (rebuildMBR())
+        {
+            cout << "[SUCCESS] MBR rebuilt from found volumes.\n";
+            listPartitions();
+            good = true;
+        }
+    }
+
+    cout << "================================================================\n\n";
+
+    // Nếu quét cũng không ra -> Lỗi nghiêm trọng
+    if (!good)
+        throw runtime_error("[CRITICAL] Failed to initialize MBR. Disk unrecognizable.");
+}
+
+bool FAT32Recovery::checkMBR()
+{
+    // Đọc Sector 0 vào biến thành viên `mbr`
+    if (readBytes(0, &mbr, sizeof(MBR)) != sizeof(MBR))
+    {
+        cerr << "[ERROR] Read Sector 0 failed.\n";
+        return false;
+    }
+
+    // Cả đĩa là một volume (superfloppy): Sector 0 chính là Boot Sector FAT32
+    if (isValidFAT32BS(reinterpret_cast<const uint8_t *>(&mbr)))
+    {
+        cout << "[INFO] Sector 0 is a FAT32 Boot Sector (no partition table).\n";
+        return true;
+    }
+
+    // Dùng Validator đã tách riêng để kiểm tra
+    if (!isValidMBR(&mbr))
+    {
+        cout << "[INFO] Sector 0 is invalid (Signature mismatch or bad partition entries).\n";
+        return false;
+    }
+
+    return true;
+}
+
+// Duyệt các sector trong [begin, end) theo cửa sổ lớn: hole (file thưa, block container
+// chưa cấp phát) được nhảy qua bằng nextData/nextHole, cửa sổ toàn 0 bỏ qua không phân tích.
+// visit nhận offset + 512 byte đầu sector, trả về offset cần xét tiếp theo
+// (offset + sectorSize để đi tiếp, lớn hơn để nhảy, >= end để dừng).
+void FAT32Recovery::scanSectors(uint64_t begin, uint64_t end,
+                                const function<uint64_t(uint64_t offset, const uint8_t *sector)> &visit) const
+{
+    end = min<uint64_t>(end, device->size());
+    vector<uint8_t> window(SCAN_WINDOW);
+    uint64_t pos = begin;
+    uint64_t holeAt = 0; // Hole kế tiếp đã biết (vùng [pos, holeAt) là dữ liệu)
+
+    while (pos < end)
+    {
+        if (pos >= holeAt)
+        {
+            uint64_t data = device->nextData(pos);
+            if (data > pos)
+            {
+                // Giữ căn lề sector so với begin
+                uint64_t skip = (data - pos) / sectorSize * sectorSize;
+                if (skip > 0)
+                {
+                    Metrics::add(Metrics::BYTES_SKIPPED, min<uint64_t>(skip, end - pos));
+                    pos += skip;
+                    continue;
+                }
+            }
+            holeAt = max<uint64_t>(device->nextHole(pos), pos + sectorSize);
+        }
+
+        size_t len = (size_t)min<uint64_t>({SCAN_WINDOW, end - pos, holeAt - pos});
+        len = max<size_t>(len / sectorSize * sectorSize, min<uint64_t>(sectorSize, end - pos));
+        ssize_t n = readBytes(pos, window.data(), len);
+        if (n < 512)
+            break;
+
+        if (isZeroBlock(window.data(), n))
+        {
+            Metrics::add(Metrics::BYTES_SKIPPED, n);
+            pos += n;
+            continue;
+        }
+
+        uint64_t next = pos + (uint64_t)n;
+        for (uint64_t off = 0; off + 512 <= (uint64_t)n; off += sectorSize)
+        {
+            uint64_t r = visit(pos + off, window.data() + off);
+            if (r != pos + off + sectorSize)
+            {
+                next = r;
+                break;
+            }
+        }
+        if (next <= pos)
+            break; // visit không được lùi lại
+        pos = next;
+    }
+}
+
+bool FAT32Recovery::rebuildMBR()
+{
+    // 1. Reset struct MBR trong bộ nhớ
+    memset(&mbr, 0, sizeof(MBR));
+    mbr.signature = FAT32Const::SIGNATURE_LE; // Đặt sẵn chữ ký đúng để chuẩn bị ghi
+
+    int partitionsFound = 0;
+    partitions.clear();
+
+    // Giới hạn quét: Toàn bộ đĩa
+    uint64_t maxSectors = device->size() / sectorSize;
+
+    cout << "   -> Scanning " << maxSectors << " sectors for FAT32 Signatures...\n";
+
+    // Bỏ qua Sector 0 (vì ta biết nó lỗi rồi mới vào đây); hole và vùng toàn 0 được nhảy qua
+    scanSectors(sectorSize, maxSectors * sectorSize, [&](uint64_t offset, const uint8_t *buf) -> uint64_t
+                {
+        uint64_t currentSector = offset / sectorSize;
+
+        // --- SỬ DỤNG HÀM VALIDATOR ĐÃ TÁCH ---
+        // Không phải Boot Sector -> Nhảy tiếp
+        if (!isValidFAT32BS(buf))
+            return offset + sectorSize;
+
+        // Kích thước volume đổi từ sector của Boot Sector sang sector của thiết bị
+        const BootSector *bs = reinterpret_cast<const BootSector *>(buf);
+        uint64_t volSize = (uint64_t)bs->totalSectors32 * bs->bytesPerSector / sectorSize;
+
+        cout << "   [+] Found Valid FAT32 Volume at Sector " << currentSector
+             << " | Size: " << volSize << "\n";
+
+        PartitionInfo info = {currentSector, volSize, FAT32Const::PART_TYPE_FAT32_LBA,
+                              SCHEME_MBR, partitionsFound == 0, true};
+
+        // Điền thông tin vào MBR Partition Table (MBR chỉ chứa được LBA/size 32-bit)
+        if (partitionsFound < 4 && currentSector + volSize <= UINT32_MAX)
+        {
+            ParEntry &p = mbr.partitions[partitionsFound];
+
+            p.status = (partitionsFound == 0) ? 0x80 : 0x00;   // Active partition đầu tiên
+            p.partitionType = FAT32Const::PART_TYPE_FAT32_LBA; // Type 0x0C
+            p.lbaFirst = (uint32_t)currentSector;
+            p.numSectors = (uint32_t)volSize;
+
+            partitionsFound++;
+        }
+        else
+        {
+            cout << "   [WARN] Volume does not fit in the MBR table, using it without a table entry.\n";
+            info.scheme = SCHEME_NONE;
+            info.active = false;
+        }
+        partitions.push_back(info);
+
+        // QUAN TRỌNG: Nhảy qua volume này để tìm cái tiếp theo
+        // Tránh việc quét trùng lặp bên trong volume vừa tìm thấy
+        return (currentSector + max<uint64_t>(volSize, 1)) * sectorSize; });
+
+    // Nếu tìm thấy ít nhất 1 partition -> Ghi MBR mới xuống đĩa
+    if (partitionsFound > 0)
+        saveMBRToDisk();
+    return !partitions.empty();
+}
+
+// ======================================================================
+//                  PARTITION DISCOVERY (MBR / EBR / GPT)
+// ======================================================================
+namespace
+{
+    // GUID type GPT ở dạng trên đĩa (3 trường đầu little-endian)
+    const uint8_t GPT_GUID_BASIC_DATA[16] = {0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+                                             0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7};
+    const uint8_t GPT_GUID_EFI_SYSTEM[16] = {0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+                                             0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B};
+
+    // Số EBR tối đa trong một chuỗi (chặn vòng lặp do link hỏng)
+    const size_t MAX_EBR_CHAIN = 256;
+
+    // CRC32 (IEEE 802.3, reflected) dùng cho header và mảng entry GPT
+    uint32_t crc32IEEE(const uint8_t *data, size_t size)
+    {
+        static const array<uint32_t, 256> table = []()
+        {
+            array<uint32_t, 256> t;
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i)
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    bool isExtendedType(uint8_t type)
+    {
+        return type == FAT32Const::PART_TYPE_EXTENDED_CHS ||
+               type == FAT32Const::PART_TYPE_EXTENDED_LBA ||
+               type == FAT32Const::PART_TYPE_LINUX_EXTENDED;
+    }
+
+    bool isFAT32Type(uint8_t type)
+    {
+        return type == FAT32Const::PART_TYPE_FAT32_LBA || type == FAT32Const::PART_TYPE_FAT32_CHS;
+    }
+}
+
+// Đoán kích thước sector logic: LBA trong MBR/GPT tính theo đơn vị này.
+// Thứ tự: Boot Sector ở sector 0 (superfloppy) -> vị trí header GPT (LBA 1)
+// -> entry MBR nào trỏ đúng vào Boot Sector FAT32 có bytesPerSector khớp
+// -> FSInfo (+1/+7) khi cả hai Boot Sector đều hỏng
+uint32_t FAT32Recovery::detectSectorSize() const
+{
+    const uint32_t candidates[] = {(uint32_t)FAT32Const::SECTOR_SIZE, (uint32_t)FAT32Const::SECTOR_SIZE_4KN};
+
+    uint8_t sector[512];
+    if (readBytes(0, sector, sizeof(sector)) != sizeof(sector))
+        return FAT32Const::SECTOR_SIZE;
+    if (isValidFAT32BS(sector))
+        return reinterpret_cast<const BootSector *>(sector)->bytesPerSector;
+
+    for (uint32_t ss : candidates)
+    {
+        uint8_t sig[8];
+        if (readBytes(ss, sig, sizeof(sig)) == sizeof(sig) && memcmp(sig, "EFI PART", 8) == 0)
+            return ss;
+    }
+
+    const MBR *table = reinterpret_cast<const MBR *>(sector);
+    if (table->signature != FAT32Const::SIGNATURE_LE)
+        return FAT32Const::SECTOR_SIZE;
+
+    uint8_t bs[512];
+    for (const ParEntry &p : table->partitions)
+    {
+        if (p.partitionType == 0 || p.numSectors == 0 || p.lbaFirst == 0)
+            continue;
+        for (uint32_t ss : candidates)
+        {
+            // Boot Sector chính hoặc backup (+6 sector)
+            for (uint64_t rel : {0, 6})
+            {
+                if (readBytes(((uint64_t)p.lbaFirst + rel) * ss, bs, sizeof(bs)) == sizeof(bs) &&
+                    isValidFAT32BS(bs) && reinterpret_cast<const BootSector *>(bs)->bytesPerSector == ss)
+                    return ss;
+            }
+        }
+    }
+
+    // FSInfo: "RRaA" ở đầu, "rrAa" ở offset 484, nằm ngay sau Boot Sector (chính/backup)
+    for (const ParEntry &p : table->partitions)
+    {
+        if (p.partitionType == 0 || p.numSectors == 0 || p.lbaFirst == 0)
+            continue;
+        for (uint32_t ss : candidates)
+        {
+            for (uint64_t rel : {1, 7})
+            {
+                if (readBytes(((uint64_t)p.lbaFirst + rel) * ss, bs, sizeof(bs)) == sizeof(bs) &&
+                    read_u32_le(bs) == FAT32Const::FSINFO_LEAD_SIG &&
+                    read_u32_le(bs + 484) == FAT32Const::FSINFO_STRUCT_SIG)
+                    return ss;
+            }
+        }
+    }
+    return FAT32Const::SECTOR_SIZE;
+}
+
+// Probe nhanh 1-2 sector: 1 = Boot Sector FAT32 (chính hoặc backup),
+// -1 = chắc chắn là filesystem khác, 0 = không nhận ra (có thể là FAT32 hỏng)
+int FAT32Recovery::probeFilesystem(uint64_t lba) const
+{
+    uint8_t sector[512];
+    if (readBytes(lba * sectorSize, sector, sizeof(sector)) != sizeof(sector))
+        return 0;
+    if (isValidFAT32BS(sector))
+        return 1;
+
+    if (read_u16_le(sector + 510) == FAT32Const::SIGNATURE_LE &&
+        (memcmp(sector + 3, "NTFS    ", 8) == 0 || memcmp(sector + 3, "EXFAT   ", 8) == 0 ||
+         memcmp(sector + 0x36, "FAT1", 4) == 0))
+        return -1;
+
+    if (readBytes((lba + 6) * sectorSize, sector, sizeof(sector)) == sizeof(sector) &&
+        isValidFAT32BS(sector))
+        return 1;
+    return 0;
+}
+
+// Đọc một header GPT (chính ở LBA 1 hoặc backup ở cuối đĩa) cùng mảng entry,
+// kiểm tra CRC32 của cả hai. alternateLBA nhận vị trí header còn lại nếu chữ ký đúng.
+bool FAT32Recovery::parseGPT(uint64_t headerLBA, vector<PartitionInfo> &out, uint64_t *alternateLBA) const
+{
+    const uint64_t ss = sectorSize;
+    uint8_t hdr[512]; // Header GPT chỉ dùng phần đầu sector (headerSize <= 512)
+    if (readBytes(headerLBA * ss, hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr, "EFI PART", 8) != 0)
+        return false;
+
+    if (alternateLBA)
+        *alternateLBA = read_u64_le(hdr + 32);
+
+    uint32_t headerSize = read_u32_le(hdr + 12);
+    if (headerSize < 92 || headerSize > sizeof(hdr))
+        return false;
+
+    // CRC header được tính với trường CRC = 0
+    uint32_t storedCRC = read_u32_le(hdr + 16);
+    memset(hdr + 16, 0, 4);
+    if (crc32IEEE(hdr, headerSize) != storedCRC || read_u64_le(hdr + 24) != headerLBA)
+    {
+        cout << "[WARN] GPT header at LBA " << headerLBA << " failed CRC check.\n";
+        return false;
+    }
+
+    uint64_t entriesLBA = read_u64_le(hdr + 72);
+    uint32_t count = read_u32_le(hdr + 80);
+    uint32_t entrySize = read_u32_le(hdr + 84);
+    if (count == 0 || entrySize < 128 || entrySize % 8 != 0 || (uint64_t)count * entrySize > (1u << 20))
+        return false;
+
+    vector<uint8_t> entries((size_t)count * entrySize);
+    if (readBytes(entriesLBA * ss, entries.data(), entries.size()) != (ssize_t)entries.size() ||
+        crc32IEEE(entries.data(), entries.size()) != read_u32_le(hdr + 88))
+    {
+        cout << "[WARN] GPT partition array at LBA " << entriesLBA << " failed CRC check.\n";
+        return false;
+    }
+
+    static const uint8_t zeroGuid[16] = {0};
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const uint8_t *e = entries.data() + (size_t)i * entrySize;
+        if (memcmp(e, zeroGuid, 16) == 0)
+            continue;
+
+        uint64_t first = read_u64_le(e + 32);
+        uint64_t last = read_u64_le(e + 40);
+        if (first == 0 || last < first)
+            continue;
+
+        PartitionInfo info = {first, last - first + 1, 0, SCHEME_GPT, false, false};
+        info.active = (read_u64_le(e + 48) & 0x4) != 0; // Legacy BIOS bootable
+
+        // Basic Data có thể là NTFS/exFAT -> chỉ nhận khi probe thấy Boot Sector FAT32
+        if ((memcmp(e, GPT_GUID_BASIC_DATA, 16) == 0 || memcmp(e, GPT_GUID_EFI_SYSTEM, 16) == 0) &&
+            probeFilesystem(first) > 0)
+        {
+            info.isFAT32 = true;
+            info.type = FAT32Const::PART_TYPE_FAT32_LBA;
+        }
+        out.push_back(info);
+    }
+    return true;
+}
+
+// Duyệt chuỗi EBR: entry 0 là partition logic (tương đối so với EBR hiện tại),
+// entry 1 trỏ tới EBR kế tiếp (tương đối so với đầu extended partition)
+void FAT32Recovery::walkEBRChain(uint64_t extendedStart, vector<PartitionInfo> &out) const
+{
+    set<uint64_t> visited;
+    uint64_t ebrLBA = extendedStart;
+
+    while (visited.size() < MAX_EBR_CHAIN && visited.insert(ebrLBA).second)
+    {
+        MBR ebr;
+        if (readBytes(ebrLBA * sectorSize, &ebr, sizeof(ebr)) != sizeof(ebr) ||
+            ebr.signature != FAT32Const::SIGNATURE_LE)
+        {
+            cout << "[WARN] Broken EBR at LBA " << ebrLBA << ", stopping logical partition walk.\n";
+            break;
+        }
+
+        const ParEntry &logical = ebr.partitions[0];
+        if (logical.partitionType != 0 && logical.numSectors > 0)
+        {
+            PartitionInfo info = {ebrLBA + logical.lbaFirst, logical.numSectors, logical.partitionType,
+                                  SCHEME_EBR, logical.status == 0x80, false};
+            int fs = probeFilesystem(info.startLBA);
+            info.isFAT32 = isFAT32Type(info.type) ? fs >= 0 : fs > 0;
+            out.push_back(info);
+        }
+
+        const ParEntry &link = ebr.partitions[1];
+        if (link.numSectors == 0 || !isExtendedType(link.partitionType))
+            break;
+        ebrLBA = extendedStart + link.lbaFirst;
+    }
+}
+
+// Dựng danh sách partition từ `mbr` hiện tại: entry chính theo thứ tự slot,
+// sau đó partition logic (EBR), sau đó entry GPT nếu có MBR bảo vệ.
+// Mỗi partition chỉ tốn 1-2 sector probe; deep scan chỉ dùng khi không có bảng.
+void FAT32Recovery::discoverPartitions()
+{
+    partitions.clear();
+
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(&mbr);
+    if (isValidFAT32BS(raw))
+    {
+        const BootSector *bs = reinterpret_cast<const BootSector *>(raw);
+        uint64_t volSectors = (uint64_t)bs->totalSectors32 * bs->bytesPerSector / sectorSize;
+        partitions.push_back({0, volSectors, FAT32Const::PART_TYPE_FAT32_LBA, SCHEME_NONE, false, true});
+        return;
+    }
+
+    vector<PartitionInfo> logicals;
+    bool protective = false;
+    for (int i = 0; i < 4; ++i)
+    {
+        const ParEntry &p = mbr.partitions[i];
+        if (p.partitionType == 0 || p.numSectors == 0)
+            continue;
+
+        if (p.partitionType == FAT32Const::PART_TYPE_GPT_PROTECTIVE)
+        {
+            protective = true;
+            continue;
+        }
+        if (isExtendedType(p.partitionType))
+        {
+            walkEBRChain(p.lbaFirst, logicals);
+            continue;
+        }
+
+        PartitionInfo info = {p.lbaFirst, p.numSectors, p.partitionType, SCHEME_MBR, p.status == 0x80, false};
+        // Type FAT32 mà Boot Sector hỏng vẫn nhận (sẽ dùng backup/reconstruct);
+        // type khác chỉ nhận khi probe thấy FAT32 thật
+        int fs = probeFilesystem(info.startLBA);
+        info.isFAT32 = isFAT32Type(info.type) ? fs >= 0 : fs > 0;
+        partitions.push_back(info);
+    }
+    partitions.insert(partitions.end(), logicals.begin(), logicals.end());
+
+    if (!protective)
+        return;
+
+    // GPT: header chính ở LBA 1, nếu hỏng thì dùng header backup (alternateLBA hoặc sector cuối)
+    vector<PartitionInfo> gpt;
+    uint64_t alternate = 0;
+    uint64_t lastLBA = device->size() / sectorSize - 1;
+    bool ok = parseGPT(1, gpt, &alternate);
+    if (!ok)
+    {
+        cout << "[WARN] Primary GPT header invalid. Trying backup header...\n";
+        gpt.clear();
+        if (alternate > 1 && alternate <= lastLBA)
+            ok = parseGPT(alternate, gpt, nullptr);
+        if (!ok && alternate != lastLBA)
+        {
+            gpt.clear();
+            ok = parseGPT(lastLBA, gpt, nullptr);
+        }
+        if (ok)
+            cout << "[SUCCESS] Backup GPT header is valid.\n";
+        else
+            cout << "[ERROR] Both GPT headers are invalid.\n";
+    }
+    partitions.insert(partitions.end(), gpt.begin(), gpt.end());
+}
+
+// ======================================================================
+//                       BOOT SECTOR PARSING / VALIDATION
+// ======================================================================
+bool FAT32Recovery::initializeVolume(int partitionIndex)
+{
+    ScopedPhase timer(Metrics::PHASE_BPB);
+
+    cout << "[INFO] VOLUME PARAMETER RECOVERY (PARTITION " << partitionIndex << ")\n";
+
+    // 1. Lấy thông tin LBA từ bảng partition (Mỏ neo vật lý)
+    if (partitionIndex < 0 || partitionIndex >= (int)partitions.size())
+    {
+        cout << "[ERROR] No partition #" << partitionIndex << ".\n";
+        return false;
+    }
+    const PartitionInfo &p = partitions[partitionIndex];
+
+    if (!p.isFAT32)
+        cout << "[WARN] Partition is not recognised as FAT32, trying anyway.\n";
+
+    // Tính Offset bắt đầu phân vùng
+    uint64_t partitionStartOffset = p.startLBA * sectorSize;
+
+    cout << "[INFO] Partition Start LBA: " << p.startLBA
+         << " (Offset: " << partitionStartOffset << ")\n";
+
+    // 2. Cố gắng Load Boot Sector (Main -> Backup -> Reconstruct)
+    bool bsLoaded = false;
+
+    // Check Main & Backup
+    if (checkAndFixBootSector(p.startLBA))
+    {
+        cout << "[SUCCESS] Boot Sector loaded from disk.\n";
+        bsLoaded = true;
+    }
+    // Nếu thất bại -> Reconstruct
+    else
+    {
+        cout << "[WARN] Boot Sectors corrupted. Reconstructing...\n";
+        reconstructBPB(p.startLBA, p.numSectors); // Hàm này đã sửa ở câu trả lời trước
+        cout << "[SUCCESS] Boot Sector reconstructed.\n";
+        bsLoaded = true;
+    }
+
+    if (!bsLoaded)
+        return false;
+
+    // Geometry thay đổi -> dữ liệu cache cũ không còn đúng
+    clusterCache.clear();
+
+    // Đảm bảo bytesPerSector hợp lệ để tránh chia cho 0 (Reconstruct đã set theo sector thiết bị)
+    if (bootSector.bytesPerSector == 0)
+        bootSector.bytesPerSector = sectorSize;
+
+    // A. Tính fatBegin
+    // fatBegin = Start_Partition + Reserved_Size
+    this->fatBegin = partitionStartOffset +
+                     ((uint64_t)bootSector.reservedSectors * bootSector.bytesPerSector);
+
+    // B. Tính dataBegin
+    // dataBegin = fatBegin + (NumFATs * FAT_Size)
+    uint64_t fatSizeInBytes = (uint64_t)bootSector.sectorsPerFat * bootSector.bytesPerSector;
+    this->dataBegin = this->fatBegin + ((uint64_t)bootSector.numFATs * fatSizeInBytes);
+
+    // C. Tính Total Clusters
+    // Data_Sectors = Total_Sectors - Reserved - FATs_Area
+    // Lưu ý: totalSectors32 có thể chưa chính xác nếu BS hỏng, nên ưu tiên dùng p.numSectors từ MBR nếu có thể
+    uint64_t totalSecs = (bootSector.totalSectors32 > 0)
+                             ? bootSector.totalSectors32
+                             : p.numSectors * sectorSize / bootSector.bytesPerSector;
+
+    uint64_t reservedArea = bootSector.reservedSectors;
+    uint64_t fatArea = (uint64_t)bootSector.numFATs * bootSector.sectorsPerFat;
+
+    if (totalSecs > (reservedArea + fatArea))
+    {
+        uint64_t dataSectors = totalSecs - reservedArea - fatArea;
+
+        if (bootSector.sectorsPerCluster > 0)
+        {
+            // FAT32 chỉ đánh số được tới 0x0FFFFFF5 cluster
+            this->totalClusters = (uint32_t)min<uint64_t>(dataSectors / bootSector.sectorsPerCluster, 0x0FFFFFF5);
+        }
+        else
+        {
+            this->totalClusters = 0;
+        }
+    }
+    else
+    {
+        this->totalClusters = 0;
+        cout << "[ERROR] Calculated Data Area is negative or zero. Geometry invalid.\n";
+        return false;
+    }
+
+    activePartition = partitionIndex;
+    dirTree.clear();
+    census.clear();
+    candidateClaims.clear();
+
+    // In kiểm tra
+    cout << "   -> FAT Begin Offset:  " << this->fatBegin << "\n";
+    cout << "   -> Data Begin Offset: " << this->dataBegin << "\n";
+    cout << "   -> Total Clusters:    " << this->totalClusters << "\n";
+
+    printVolumeInfo();
+    return true;
+}
+
+bool FAT32Recovery::checkAndFixBootSector(uint64_t partStartSector)
+{
+    uint8_t buf[512];
+    uint64_t mainOffset = partStartSector * sectorSize;
+
+    // --- BƯỚC 1: KIỂM TRA MAIN BOOT SECTOR ---
+    // "BR appears to be greatly important"
+    if (readBytes(mainOffset, buf, 512) == 512)
+    {
+        // Dùng Validator đã viết ở Phase 1 để kiểm tra
+        if (isValidFAT32BS(buf))
+        {
+            cout << "[SUCCESS] Main Boot Sector is healthy.\n";
+            parseBPB(buf); // Load vào bộ nhớ
+            return true;
+        }
+        else
+        {
+            cout << "[FAIL] Main Boot Sector is invalid/corrupted.\n";
+        }
+    }
+
+    // --- BƯỚC 2: KIỂM TRA BACKUP BOOT SECTOR ---
+    // "Copies of BR are usually at the top... finding it doesn't take much time"
+    // Với FAT32, vị trí mặc định là Sector 6 so với đầu phân vùng.
+    uint64_t backupOffset = (partStartSector + 6) * sectorSize;
+
+    if (readBytes(backupOffset, buf, 512) == 512)
+    {
+        // Kiểm tra bản sao này
+        if (isValidFAT32BS(buf))
+        {
+            cout << "[SUCCESS] Found valid Backup Boot Sector at +6.\n";
+
+            // "Copy it back to the MBR" (ở đây là BR)
+            cout << "[FIX] Restoring Backup to Main Boot Sector...\n";
+
+            // 1. Load vào bộ nhớ
+            parseBPB(buf);
+
+            // 2. Ghi đè lên vị trí Main BS hỏng
+            saveBootSector(mainOffset);
+
+            return true;
+        }
+        else
+        {
+            cout << "[FAIL] Backup Boot Sector is also corrupted.\n";
+        }
+    }
+
+    return false; // Cả hai đều hỏng
+}
+
+void FAT32Recovery::reconstructBPB(uint64_t partStartSector, uint64_t partSize)
+{
+    cout << "   -> Attempting Advanced Reconstruction (Scanning for FAT signatures)...\n";
+
+    // Xóa sạch struct
+    memset(&bootSector, 0, sizeof(BootSector));
+
+    // 1. Điền các tham số cơ bản (Mặc định). Sector của volume = sector thiết bị.
+    const uint64_t ss = sectorSize;
+    const uint64_t partStartOffset = partStartSector * ss;
+    bootSector.bytesPerSector = (uint16_t)ss;
+    bootSector.numFATs = 2;
+    bootSector.totalSectors32 = (uint32_t)min<uint64_t>(partSize, UINT32_MAX); // Giới hạn của FAT32
+    bootSector.hiddenSectors = (uint32_t)min<uint64_t>(partStartSector, UINT32_MAX);
+    bootSector.rootCluster = 2;
+
+    // 2. TẬN DỤNG LOGIC CŨ: Quét tìm bảng FAT để xác định Reserved Sectors
+    // (Logic cũ của bạn nằm trong reconstructBootSector cũ)
+
+    uint8_t buffer[512];
+    uint64_t fat1Offset = 0;
+    uint64_t fat2Offset = 0;
+    bool foundFAT1 = false;
+
+    // Chỉ quét trong partition (FAT2 nằm trước vùng Data nên không cần đi xa hơn)
+    uint64_t diskSectors = device->size() / ss;
+    uint64_t maxSectors = min<uint64_t>(partSize, diskSectors > partStartSector ? diskSectors - partStartSector : 0);
+    uint64_t partEnd = partStartOffset + maxSectors * ss;
+
+    // Signature đầu bảng FAT32: entry 0 = 0x0FFFFFF8 (media F8), entry 1 = EOC
+    // (4 bit cao của entry 1 là reserved: 0x0FFFFFFF hoặc 0xFFFFFFFF đều gặp)
+    auto isFATStart = [](const uint8_t *p)
+    { return read_u32_le(p) == 0x0FFFFFF8 && (read_u32_le(p + 4) & 0x0FFFFFFF) == 0x0FFFFFFF; };
+
+    // Reserved Sectors là trường 16-bit -> FAT1 không thể nằm xa hơn sector +65535
+    uint64_t fat1End = min<uint64_t>(partEnd, partStartOffset + ((uint64_t)UINT16_MAX + 1) * ss);
+    scanSectors(partStartOffset + ss, fat1End, [&](uint64_t offset, const uint8_t *sector) -> uint64_t
+                {
+        if (!isFATStart(sector))
+            return offset + ss;
+        uint64_t i = (offset - partStartOffset) / ss;
+        cout << "      [SCAN] Found Potential FAT1 at Sector +" << i << "\n";
+        fat1Offset = offset;
+        bootSector.reservedSectors = (uint16_t)i; // Tìm ra Reserved Sectors!
+        foundFAT1 = true;
+        return fat1End; });
+
+    if (foundFAT1)
+    {
+        scanSectors(fat1Offset + ss, partEnd, [&](uint64_t offset, const uint8_t *sector) -> uint64_t
+                    {
+            if (!isFATStart(sector))
+                return offset + ss;
+            cout << "      [SCAN] Found Potential FAT2 at Sector +" << (offset - partStartOffset) / ss << "\n";
+            fat2Offset = offset;
+            return partEnd; // Tìm thấy 2 bảng là đủ
+        });
+    }
+
+    // 3. Tính toán Sectors Per FAT
+    if (fat1Offset > 0 && fat2Offset > 0)
+    {
+        uint64_t dist = fat2Offset - fat1Offset;
+        bootSector.sectorsPerFat = (uint32_t)(dist / ss);
+        cout << "      [INFO] Calculated FAT Size: " << bootSector.sectorsPerFat << " sectors.\n";
+    }
+    else
+    {
+        // Fallback: Nếu không tìm thấy FAT, dùng công thức ước lượng (như câu trả lời trước)
+        cout << "      [WARN] Cannot find FAT tables. Using estimation.\n";
+        if (!foundFAT1)
+            bootSector.reservedSectors = 32;
+        bootSector.sectorsPerFat = (uint32_t)(partSize / 8 / (ss / 4)); // Ước lượng thô (SPC = 8)
+    }
+
+    // 4. Đoán Sectors Per Cluster: công cụ format chọn FAT vừa đủ chứa mọi cluster,
+    // nên SPC đúng là giá trị nhỏ nhất mà số entry của FAT còn đủ cho vùng Data
+    uint64_t fatEntries = (uint64_t)bootSector.sectorsPerFat * ss / 4;
+    uint64_t metaSectors = bootSector.reservedSectors + (uint64_t)bootSector.numFATs * bootSector.sectorsPerFat;
+    uint64_t dataSectors = bootSector.totalSectors32 > metaSectors ? bootSector.totalSectors32 - metaSectors : 0;
+    bool spcFound = false;
+
+    for (uint32_t spc = 1; spc <= 128; spc <<= 1)
+    {
+        if (dataSectors / spc + 2 > fatEntries)
+            continue;
+        bootSector.sectorsPerCluster = (uint8_t)spc;
+        spcFound = true;
+        break;
+    }
+
+    // Kiểm tra chéo: Root Cluster (2) nằm ngay đầu vùng Data, phải ra dáng thư mục
+    uint64_t dataStart = partStartOffset + metaSectors * ss;
+    if (spcFound && readBytes(dataStart, buffer, 512) == 512)
+    {
+        bool looksLikeDir = false;
+        for (int k = 0; k < 16; k++)
+        {
+            uint8_t attr = buffer[k * 32 + 11];
+            if ((attr & 0x18) || attr == 0x20)
+            { // Dir or Vol or Archive
+                looksLikeDir = true;
+                break;
+            }
+        }
+        if (looksLikeDir)
+            cout << "      [INFO] Cluster Size " << (int)bootSector.sectorsPerCluster
+                 << " matches FAT capacity and Root Directory pattern.\n";
+        else
+            cout << "      [WARN] Root Directory not recognised at data start.\n";
+    }
+
+    if (!spcFound)
+    {
+        bootSector.sectorsPerCluster = 8; // Default an toàn
+        cout << "      [WARN] Could not guess SPC. Defaulting to 8.\n";
+    }
+
+    // FSInfo thường nằm ngay sau Boot Sector; giữ lại nếu còn chữ ký
+    if (readBytes(partStartOffset + ss, buffer, 512) == 512 &&
+        read_u32_le(buffer) == FAT32Const::FSINFO_LEAD_SIG &&
+        read_u32_le(buffer + 484) == FAT32Const::FSINFO_STRUCT_SIG &&
+        bootSector.reservedSectors > 1)
+    {
+        bootSector.fsInfo = 1;
+    }
+
+    // 5. Ghi Boot Sector "giả" xuống đĩa
+    bootSector.bootSignature = 0xAA55;
+    memcpy(bootSector.fsType, "FAT32   ", 8);
+    saveBootSector(partStartOffset);
+}
+
+
+// ======================================================================
+//                       FILE SYSTEM (FAT32)
+// ======================================================================
+
+namespace
+{
+    // Giá trị đặc biệt của entry FAT32 (sau khi che 28 bit)
+    const uint32_t FAT_ENTRY_MASK = 0x0FFFFFFF;
+    const uint32_t FAT_ENTRY_BAD = 0x0FFFFFF7;
+    const uint32_t FAT_ENTRY_EOC = 0x0FFFFFF8;
+
+    // Kích thước khối khi đọc/so sánh các bản FAT (FAT lớn không phải nạp nguyên 2 bản vào RAM)
+    const uint64_t FAT_COMPARE_CHUNK = 4 << 20;
+
+    // Vị trí byte đầu tiên khác nhau giữa a và b (size nếu giống hệt).
+    // So 64 byte mỗi vòng (SSE2 nếu có) nên vùng giống nhau được lướt qua rất nhanh.
+    size_t firstMismatch(const uint8_t *a, const uint8_t *b, size_t size)
+    {
+        size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; i + 64 <= size; i += 64)
+        {
+            __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+                                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+            __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i + 16)),
+                                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i + 16)));
+            __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i + 32)),
+                                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i + 32)));
+            __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i + 48)),
+                                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i + 48)));
+            __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+            if (_mm_movemask_epi8(all) != 0xFFFF)
+                break; // khối 64 byte này có chỗ khác, tìm chính xác bằng vòng dưới
+        }
+#endif
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t x, y;
+            memcpy(&x, a + i, 8);
+            memcpy(&y, b + i, 8);
+            if (x != y)
+                break;
+        }
+        for (; i < size; ++i)
+            if (a[i] != b[i])
+                return i;
+        return size;
+    }
+}
+
+void FAT32Recovery::loadFAT()
+{
+    ScopedPhase timer(Metrics::PHASE_FAT_LOAD);
+
+    // Đảm bảo các thông số đã được khởi tạo từ readBootSector/selectPartition
+    if (bootSector.sectorsPerFat == 0 || bootSector.bytesPerSector == 0 || fatBegin == 0)
+    {
+        throw runtime_error("FAT parameters not initialized. Call readBootSector/selectPartition first.");
+    }
+
+    // 1. Tính toán kích thước của một bản sao FAT (bằng byte)
+    uint64_t fatSizeBytes = (uint64_t)bootSector.sectorsPerFat * bootSector.bytesPerSector;
+
+    if (fatSizeBytes == 0)
+    {
+        throw runtime_error("Calculated FAT size is zero.");
+    }
+
+    cout << "[INFO] FAT table size: " << fatSizeBytes << " bytes. Reading from offset: 0x"
+         << hex << fatBegin << dec << endl;
+
+    const uint32_t bps = bootSector.bytesPerSector;
+    const int copies = max<int>(bootSector.numFATs, 1);
+    const uint64_t numEntries = fatSizeBytes / sizeof(uint32_t);
+
+    // 2. Chọn bản gốc: bản FAT đầu tiên có entry 0 hợp lệ
+    // (Entry 0 của FAT32 đĩa cứng thường là 0x0FFFFFF8 - Media Type F8)
+    int base = -1;
+    vector<uint8_t> head(bps);
+    for (int k = 0; k < copies && base < 0; ++k)
+    {
+        cout << "[INFO] Reading FAT" << k + 1 << "...\n";
+        if (readBytes(fatBegin + k * fatSizeBytes, head.data(), bps) == (ssize_t)bps &&
+            (read_u32_le(head.data()) & 0x0FFFFF00) == 0x0FFFFF00)
+        {
+            base = k;
+        }
+        else if (k + 1 < copies)
+        {
+            cout << "[WARN] FAT" << k + 1 << " corrupted. Attempting to read FAT" << k + 2
+                 << " (Redundancy Check)...\n";
+        }
+    }
+
+    if (base < 0)
+    {
+        throw runtime_error("Critical Error: Both FAT tables are corrupted.");
+    }
+    if (base > 0)
+    {
+        cout << "[SUCCESS] FAT" << base + 1 << " is valid. Using it as the merge base.\n";
+    }
+
+    // 3. Đọc mọi bản FAT theo khối, so sánh với bản gốc.
+    // FAT giữ giá trị của bản gốc; entry khác nhau được ghi lại để hợp nhất ở bước 4.
+    // *Chú ý:* FAT32 chỉ dùng 28 bit thấp, 4 bit cao (reserved) không được tính là khác biệt.
+    FAT.assign(numEntries, 0);
+    clearFATDirty();
+
+    vector<uint32_t> diffIndex;  // entry khác nhau (tăng dần)
+    vector<uint32_t> diffValues; // copies giá trị cho mỗi entry, theo thứ tự bản FAT
+    vector<bool> readable(copies, true);
+    vector<vector<uint8_t>> chunk(copies);
+    const uint64_t chunkBytes = max<uint64_t>(bps, FAT_COMPARE_CHUNK / bps * bps);
+
+    for (uint64_t pos = 0; pos < fatSizeBytes; pos += chunkBytes)
+    {
+        const size_t n = (size_t)min(chunkBytes, fatSizeBytes - pos);
+        for (int k = 0; k < copies; ++k)
+        {
+            if (!readable[k])
+                continue;
+            chunk[k].resize(n);
+            if (readBytes(fatBegin + k * fatSizeBytes + pos, chunk[k].data(), n) != (ssize_t)n)
+            {
+                if (k == base)
+                    throw runtime_error("Failed to read FAT" + to_string(k + 1) + " at byte " + to_string(pos) + ".");
+                cout << "[WARN] FAT" << k + 1 << " is unreadable, it will be rewritten from the merged table.\n";
+                readable[k] = false;
+            }
+        }
+
+        const uint8_t *b = chunk[base].data();
+        const uint64_t first = pos / sizeof(uint32_t);
+        for (size_t i = 0; i < n / sizeof(uint32_t); ++i)
+            FAT[first + i] = read_u32_le(b + i * sizeof(uint32_t)) & FAT_ENTRY_MASK;
+
+        // Vùng giống hệt được bỏ qua bằng firstMismatch, chỉ dừng lại ở entry thực sự khác
+        vector<uint32_t> differ;
+        for (int k = 0; k < copies; ++k)
+        {
+            if (k == base || !readable[k])
+                continue;
+            const uint8_t *c = chunk[k].data();
+            size_t off = 0;
+            while ((off += firstMismatch(b + off, c + off, n - off)) < n)
+            {
+                size_t e = off / sizeof(uint32_t);
+                if ((read_u32_le(b + e * 4) ^ read_u32_le(c + e * 4)) & FAT_ENTRY_MASK)
+                    differ.push_back(uint32_t(first + e));
+                off = (e + 1) * sizeof(uint32_t);
+            }
+        }
+        sort(differ.begin(), differ.end());
+        differ.erase(unique(differ.begin(), differ.end()), differ.end());
+
+        for (uint32_t idx : differ)
+        {
+            diffIndex.push_back(idx);
+            for (int k = 0; k < copies; ++k)
+            {
+                size_t off = size_t(idx - first) * sizeof(uint32_t);
+                diffValues.push_back(readable[k] ? read_u32_le(chunk[k].data() + off) & FAT_ENTRY_MASK : FAT[idx]);
+            }
+        }
+    }
+
+    // 4. Hợp nhất entry khác nhau và ghi lại chỉ những sector lệch
+    if (!diffIndex.empty())
+        mergeFATCopies(diffIndex, diffValues, base);
+    else if (copies > 1)
+        cout << "[INFO] All " << copies << " FAT copies are consistent.\n";
+
+    vector<uint32_t> allSectors;
+    for (int k = 0; k < copies; ++k)
+    {
+        if (readable[k])
+            continue;
+        if (allSectors.empty())
+            for (uint32_t s = 0; s < bootSector.sectorsPerFat; ++s)
+                allSectors.push_back(s);
+        cout << "[FIX] Rewriting unreadable FAT" << k + 1 << " from the merged table...\n";
+        writeFATSectors(allSectors, k);
+    }
+
+    cout << "[INFO] Loaded FAT table successfully. Total entries (clusters): " << dec << FAT.size() << "\n";
+    cout << "       FAT[0] (Media Type): 0x" << hex << FAT[0] << "\n";
+    cout << "       FAT[1] (EOC Marker): 0x" << hex << FAT[1] << dec << "\n";
+
+    loadFSInfo();
+
+    // Dọn dẹp: Đảm bảo luồng cout không bị ảnh hưởng bởi hex/dec
+    cout << dec;
+    cout << "[SCAN] Checking directory and FAT structures\n";
+    scanAndAutoRepair(bootSector.rootCluster, true);
+    cout << flush;
+    Logger::drain(); // In cảnh báo của lần quét ngay trong phần này
+    cout << "================================================================\n\n";
+}
+
+// Hợp nhất các entry mà các bản FAT không thống nhất. Mỗi giá trị ứng viên được chấm điểm
+// theo độ hợp lý của chuỗi cluster (xem scoreValue), giá trị điểm cao nhất được giữ lại;
+// hòa điểm thì ưu tiên bản gốc. Sau đó mỗi bản FAT chỉ được ghi lại các sector chứa entry
+// khác với bảng đã hợp nhất.
+void FAT32Recovery::mergeFATCopies(const vector<uint32_t> &diffIndex, const vector<uint32_t> &diffValues, int base)
+{
+    const int copies = max<int>(bootSector.numFATs, 1);
+    const uint32_t bps = bootSector.bytesPerSector;
+    const uint64_t numEntries = FAT.size();
+    const uint64_t maxCluster = min<uint64_t>((uint64_t)totalClusters + 2, numEntries);
+
+    // Báo cáo các dải entry khác nhau
+    vector<pair<uint32_t, uint32_t>> ranges;
+    for (uint32_t idx : diffIndex)
+    {
+        if (!ranges.empty() && ranges.back().second + 1 == idx)
+            ranges.back().second = idx;
+        else
+            ranges.push_back({idx, idx});
+    }
+    cout << "[WARN] FAT copies differ in " << diffIndex.size() << " entries (" << ranges.size() << " ranges):\n";
+    const size_t SHOWN_RANGES = 8;
+    for (size_t r = 0; r < ranges.size() && r < SHOWN_RANGES; ++r)
+    {
+        cout << "       | entries " << ranges[r].first;
+        if (ranges[r].second != ranges[r].first)
+            cout << "-" << ranges[r].second;
+        cout << " (FAT sector " << (uint64_t)ranges[r].first * 4 / bps << ")\n";
+    }
+    if (ranges.size() > SHOWN_RANGES)
+        cout << "       | ... " << ranges.size() - SHOWN_RANGES << " more ranges\n";
+
+    auto isDiff = [&](uint32_t idx)
+    { return binary_search(diffIndex.begin(), diffIndex.end(), idx); };
+    auto isLink = [&](uint32_t v)
+    { return v >= 2 && v < maxCluster; };
+
+    // Số entry (đã thống nhất giữa các bản) trỏ tới từng cluster đáng quan tâm:
+    // chính các entry khác nhau và mọi đích mà giá trị ứng viên trỏ tới
+    unordered_map<uint32_t, uint32_t> predCount;
+    for (size_t d = 0; d < diffIndex.size(); ++d)
+    {
+        predCount[diffIndex[d]] = 0;
+        for (int k = 0; k < copies; ++k)
+            if (isLink(diffValues[d * copies + k]))
+                predCount[diffValues[d * copies + k]] = 0;
+    }
+    for (uint64_t i = 2; i < numEntries; ++i)
+    {
+        uint32_t v = FAT[i];
+        if (!isLink(v))
+            continue;
+        auto it = predCount.find(v);
+        if (it != predCount.end() && !isDiff(uint32_t(i)))
+            ++it->second;
+    }
+
+    // Cluster đích có đang được dùng không (theo bất kỳ bản FAT nào)
+    auto inUse = [&](uint32_t c)
+    {
+        if (FAT[c] != 0)
+            return true;
+        auto it = lower_bound(diffIndex.begin(), diffIndex.end(), c);
+        if (it == diffIndex.end() || *it != c)
+            return false;
+        size_t d = it - diffIndex.begin();
+        for (int k = 0; k < copies; ++k)
+            if (diffValues[d * copies + k] != 0)
+                return true;
+        return false;
+    };
+
+    // Điểm hợp lý của giá trị v cho entry idx (cao hơn = đáng tin hơn)
+    const int IMPOSSIBLE = -100;
+    auto scoreValue = [&](uint32_t idx, uint32_t v) -> int
+    {
+        if (idx == 0)
+            return (v & 0x0FFFFF00) == 0x0FFFFF00 ? 1 : IMPOSSIBLE;
+        if (idx == 1) // EOC, 2 bit cao có thể là cờ clean-shutdown / no-error
+            return (v & 0x03FFFFFF) == 0x03FFFFFF ? 1 : IMPOSSIBLE;
+
+        bool referenced = predCount[idx] > 0;
+        if (v == 0) // cluster trống mà vẫn có entry trỏ tới là gãy chuỗi
+            return referenced ? -4 : 0;
+
+        int s = referenced ? 2 : 0;
+        if (v >= FAT_ENTRY_EOC || v == FAT_ENTRY_BAD)
+            return s + 1;
+        if (!isLink(v) || v == idx) // giá trị reserved, ngoài volume hoặc tự trỏ
+            return IMPOSSIBLE;
+
+        s += inUse(v) ? 2 : -3;           // đích phải là cluster đang được dùng
+        s += predCount[v] == 0 ? 1 : -2;  // đích đã có entry khác trỏ tới = cross-link
+        if (v == idx + 1)
+            s += 1; // cấp phát liên tục là trường hợp phổ biến nhất
+        return s;
+    };
+
+    // Hợp nhất + ghi nhận sector lệch của từng bản
+    vector<vector<uint32_t>> staleSectors(copies);
+    size_t fromOther = 0;
+    for (size_t d = 0; d < diffIndex.size(); ++d)
+    {
+        uint32_t idx = diffIndex[d];
+        const uint32_t *values = &diffValues[d * copies];
+
+        int best = base;
+        int bestScore = scoreValue(idx, values[base]);
+        for (int k = 0; k < copies; ++k)
+        {
+            if (k == base || values[k] == values[base])
+                continue;
+            int s = scoreValue(idx, values[k]);
+            if (s > bestScore)
+            {
+                best = k;
+                bestScore = s;
+            }
+        }
+        if (best != base)
+            ++fromOther;
+        FAT[idx] = values[best];
+
+        uint32_t sector = uint32_t((uint64_t)idx * 4 / bps);
+        for (int k = 0; k < copies; ++k)
+        {
+            if (values[k] != FAT[idx] && (staleSectors[k].empty() || staleSectors[k].back() != sector))
+                staleSectors[k].push_back(sector);
+        }
+    }
+    Metrics::add(Metrics::FAT_ENTRIES_MERGED, diffIndex.size());
+
+    size_t written = 0;
+    for (int k = 0; k < copies; ++k)
+    {
+        if (staleSectors[k].empty())
+            continue;
+        writeFATSectors(staleSectors[k], k);
+        written += staleSectors[k].size();
+    }
+    cout << "[FIX] Merged " << diffIndex.size() << " FAT entries (" << fromOther
+         << " taken from another copy). Rewrote " << written << " of "
+         << (uint64_t)bootSector.sectorsPerFat * copies << " FAT sectors.\n";
+}
+
+void FAT32Recovery::clearFATDirty()
+{
+    fatDirty.assign(bootSector.sectorsPerFat, 0);
+    fatDirtySectors.clear();
+}
+
+// Cập nhật 1 entry FAT trong bộ nhớ và đánh dấu sector chứa nó; writeFAT ghi các sector này
+void FAT32Recovery::setFATEntry(uint32_t cluster, uint32_t value)
+{
+    if (cluster >= FAT.size())
+    {
+        FAT32_LOG(LOG_ERROR, "FAT entry writes out of range", "setFATEntry: cluster " << cluster << " out of range");
+        return;
+    }
+    value &= FAT_ENTRY_MASK; // 28-bit hợp lệ
+    const uint32_t old = FAT[cluster];
+    if (old == value)
+        return;
+    FAT[cluster] = value;
+
+    // Cập nhật số cluster trống (FSInfo) theo chuyển trạng thái trống <-> đã dùng
+    const uint64_t lastCluster = (uint64_t)totalClusters + 2;
+    if (cluster >= 2 && cluster < lastCluster && (old == 0) != (value == 0))
+    {
+        if (value != 0)
+        {
+            if (freeClusters > 0)
+                --freeClusters;
+            if (cluster == nextFreeHint)
+                nextFreeHint = cluster + 1 < lastCluster ? cluster + 1 : 2;
+        }
+        else
+        {
+            ++freeClusters;
+            if (nextFreeHint == FAT32Const::FSINFO_UNKNOWN || cluster < nextFreeHint)
+                nextFreeHint = cluster;
+        }
+        fsInfoDirty = true;
+    }
+
+    uint32_t sector = uint32_t((uint64_t)cluster * 4 / bootSector.bytesPerSector);
+    if (sector < fatDirty.size() && !fatDirty[sector])
+    {
+        fatDirty[sector] = 1;
+        fatDirtySectors.push_back(sector);
+    }
+}
+
+// Ghi các sector FAT (chỉ số sector trong một bản FAT) từ bảng trong bộ nhớ.
+// fatIndex < 0: ghi vào mọi bản sao. Sector liền kề được gộp thành 1 lần ghi.
+void FAT32Recovery::writeFATSectors(const vector<uint32_t> &sectors, int fatIndex)
+{
+    const uint64_t bytesPerSector = bootSector.bytesPerSector;
+    const uint64_t bytesPerFAT = (uint64_t)bootSector.sectorsPerFat * bytesPerSector;
+    const size_t entriesPerSector = bytesPerSector / 4;
+
+    vector<uint8_t> buf;
+    size_t i = 0;
+    while (i < sectors.size())
+    {
+        // Gom một run sector liên tiếp
+        size_t j = i + 1;
+        while (j < sectors.size() && sectors[j] == sectors[j - 1] + 1)
+            ++j;
+        uint64_t firstSector = sectors[i];
+        size_t count = j - i;
+
+        // Đóng gói các entry FAT của run vào bộ đệm (little-endian 32-bit)
+        buf.assign(count * bytesPerSector, 0);
+        size_t firstEntry = firstSector * entriesPerSector;
+        size_t entriesToWrite = min(count * entriesPerSector, FAT.size() > firstEntry ? FAT.size() - firstEntry : 0);
+        for (size_t e = 0; e < entriesToWrite; ++e)
+        {
+            uint32_t v = FAT[firstEntry + e] & FAT_ENTRY_MASK;
+            size_t off = e * 4;
+            buf[off + 0] = uint8_t(v & 0xFF);
+            buf[off + 1] = uint8_t((v >> 8) & 0xFF);
+            buf[off + 2] = uint8_t((v >> 16) & 0xFF);
+            buf[off + 3] = uint8_t((v >> 24) & 0xFF);
+        }
+
+        for (int k = 0; k < max<int>(bootSector.numFATs, 1); ++k)
+        {
+            if (fatIndex >= 0 && k != fatIndex)
+                continue;
+            uint64_t offset = fatBegin + uint64_t(k) * bytesPerFAT + firstSector * bytesPerSector;
+            if (!writeBytes(offset, buf.data(), buf.size()))
+            {
+                FAT32_LOG(LOG_ERROR, "FAT copy write failures", "write failed for FAT index " << k);
+            }
+        }
+        i = j;
+    }
+}
+
+// Ghi các sector FAT đã bị sửa (qua setFATEntry) vào mọi bản sao, kèm FSInfo nếu đã thay đổi
+void FAT32Recovery::writeFAT()
+{
+    if (!fatDirtySectors.empty())
+    {
+        sort(fatDirtySectors.begin(), fatDirtySectors.end());
+        writeFATSectors(fatDirtySectors, -1);
+        clearFATDirty();
+    }
+    if (fsInfoDirty)
+        writeFSInfo();
+}
+
+// Đọc và kiểm tra FSInfo. Số cluster trống luôn được đếm lại từ FAT (nguồn chuẩn);
+// FSInfo sai/thiếu được đánh dấu để writeFAT ghi lại, OS khỏi phải quét FAT khi mount.
+void FAT32Recovery::loadFSInfo()
+{
+    const uint64_t bps = bootSector.bytesPerSector;
+    const uint64_t lastCluster = min<uint64_t>((uint64_t)totalClusters + 2, FAT.size());
+
+    freeClusters = 0;
+    nextFreeHint = FAT32Const::FSINFO_UNKNOWN;
+    for (uint64_t c = 2; c < lastCluster; ++c)
+    {
+        if (FAT[c] != 0)
+            continue;
+        if (freeClusters++ == 0)
+            nextFreeHint = uint32_t(c);
+    }
+    fsInfoDirty = false;
+    fsInfoOffset = 0;
+
+    if (bootSector.fsInfo == 0 || bootSector.fsInfo == 0xFFFF || bootSector.fsInfo >= bootSector.reservedSectors)
+    {
+        cout << "[INFO] Volume has no FSInfo sector (" << freeClusters << " free clusters).\n";
+        return;
+    }
+
+    // FSInfo nằm trong vùng Reserved, tính từ đầu partition (= fatBegin - reservedSectors)
+    fsInfoOffset = fatBegin - (uint64_t)bootSector.reservedSectors * bps + (uint64_t)bootSector.fsInfo * bps;
+
+    bool valid = readBytes(fsInfoOffset, &fsInfo, sizeof(fsInfo)) == (ssize_t)sizeof(fsInfo) &&
+                 fsInfo.leadSignature == FAT32Const::FSINFO_LEAD_SIG &&
+                 fsInfo.structSignature == FAT32Const::FSINFO_STRUCT_SIG &&
+                 fsInfo.trailSignature == FAT32Const::FSINFO_TRAIL_SIG;
+    if (!valid)
+    {
+        cout << "[WARN] FSInfo sector is corrupted. It will be rebuilt from the FAT.\n";
+        memset(&fsInfo, 0, sizeof(fsInfo));
+        fsInfo.leadSignature = FAT32Const::FSINFO_LEAD_SIG;
+        fsInfo.structSignature = FAT32Const::FSINFO_STRUCT_SIG;
+        fsInfo.trailSignature = FAT32Const::FSINFO_TRAIL_SIG;
+        fsInfoDirty = true;
+    }
+    else
+    {
+        if (fsInfo.freeCount != freeClusters)
+        {
+            cout << "[WARN] FSInfo free count is stale (";
+            if (fsInfo.freeCount == FAT32Const::FSINFO_UNKNOWN)
+                cout << "unknown";
+            else
+                cout << fsInfo.freeCount;
+            cout << ", FAT has " << freeClusters << ").\n";
+            fsInfoDirty = true;
+        }
+
+        // Gợi ý next-free chỉ là điểm bắt đầu tìm: giữ nguyên nếu còn nằm trong volume
+        if (fsInfo.nextFree >= 2 && fsInfo.nextFree < lastCluster)
+            nextFreeHint = fsInfo.nextFree;
+        else if (fsInfo.nextFree != nextFreeHint)
+            fsInfoDirty = true;
+    }
+
+    cout << "[INFO] FSInfo: " << freeClusters << " free clusters, next free hint ";
+    if (nextFreeHint == FAT32Const::FSINFO_UNKNOWN)
+        cout << "none";
+    else
+        cout << nextFreeHint;
+    cout << (fsInfoDirty ? " (will be updated)" : "") << ".\n";
+}
+
+// Ghi FSInfo chính. Bản backup (sector 7) không được cập nhật, giống hành vi của Windows/Linux.
+void FAT32Recovery::writeFSInfo()
+{
+    fsInfoDirty = false;
+    if (fsInfoOffset == 0)
+        return;
+
+    fsInfo.freeCount = freeClusters;
+    fsInfo.nextFree = nextFreeHint;
+    if (!writeBytes(fsInfoOffset, &fsInfo, sizeof(fsInfo)))
+    {
+        FAT32_LOG(LOG_ERROR, "FSInfo write failures", "write failed for FSInfo at offset " << fsInfoOffset);
+    }
+}
+
+void FAT32Recovery::scanAndAutoRepair(uint32_t dirCluster, bool fix)
+{
+    ScopedPhase timer(Metrics::PHASE_SCAN);
+
+    vector<uint8_t> buf;
+    readCluster(dirCluster, buf);
+
+    size_t num = buf.size() / 32;
+    bool hasError = false;
+
+    for (size_t i = 0; i < num; i++)
+    {
+        DirEntry *e = (DirEntry *)(buf.data() + i * 32);
+
+        if (e->isdDir())
+        {
+            // Thư mục còn sống phải giữ cluster đầu; chỉ đánh dấu EOC khi FAT ghi là trống
+            // (bỏ qua entry trống/đã xóa và '.'/'..', không cắt chuỗi thư mục nhiều cluster)
+            uint32_t dc = e->getStartCluster();
+            if (fix && e->name[0] != 0x00 && !e->isDeleted() && e->name[0] != '.' &&
+                dc >= 2 && dc < FAT.size() && FAT[dc] == 0)
+            {
+                setFATEntry(dc, 0x0FFFFFFF);
+            }
+            continue;
+        }
+
+        if (e->name[0] == 0x00 || e->isDeleted() || e->isLFN())
+            continue;
+
+        uint32_t start = e->getStartCluster();
+        uint32_t need = e->fileSize;
+
+        auto chain = followFAT(start);
+        uint32_t bytesPerCluster =
+            bootSector.bytesPerSector * bootSector.sectorsPerCluster;
+
+        uint32_t must = uint32_t(((uint64_t)need + bytesPerCluster - 1) / bytesPerCluster);
+
+        if (chain.size() != must)
+        {
+            hasError = true;
+
+            FAT32_LOG(LOG_ERROR, "entries with wrong chain length",
+                      "Entry " << i << " (" << e->getNameString() << ")"
+                                << ": cluster chain size = " << chain.size()
+                                << ", expected = " << must);
+        }
+    }
+
+    if (fix)
+        writeFAT(); // chỉ ghi các sector FAT vừa bị sửa (nếu có)
+
+    if (hasError && fix)
+    {
+        cout << "[INFO] Repairing directory and FAT structures..." << endl;
+        repairFolderAndClusters(dirCluster); // phase 2
+    }
+    else if (hasError)
+    {
+        cout << "[ERROR] Errors detected, but fix = false -> no repair performed." << endl;
+    }
+    else
+    {
+        cout << "[INFO] No inconsistencies found." << endl;
+    }
+}
+
+// Sửa chữa các mục nhập thư mục (directory entries) và chuỗi FAT (FAT chains) bên dưới một cluster thư mục
+// Trả về số lần sửa chữa đã thực hiện
+int FAT32Recovery::repairFolderAndClusters(uint32_t dirCluster)
+{
+    // Tính toán số byte trên mỗi cluster
+    const uint32_t bytesPerCluster = uint32_t(bootSector.bytesPerSector) * uint32_t(bootSector.sectorsPerCluster);
+    int fixes = 0; // Biến đếm số lần sửa chữa
+
+    // Đọc tất cả các cluster của thư mục vào một bộ đệm duy nhất.
+    // Đối với các thư mục trải dài trên nhiều cluster, thao tác này sẽ đọc chúng từng cái một.
+    vector<uint8_t> clusterBuf;
+    readCluster(dirCluster, clusterBuf); // đọc cluster đầu tiên
+    // Nếu thư mục dài, hàm gọi (caller) có thể gọi hàm này cho mỗi chuỗi thư mục;
+    // để đơn giản, chúng ta sẽ giả định một thư mục cluster đơn hoặc rằng scanDirectory xử lý nhiều cluster.
+
+    // Owner map (dựng khi cần lần đầu): chuỗi cũ chỉ được trả về trống ở những cluster
+    // thuộc riêng entry đang sửa, không bao giờ ở cluster mà file khác đang dùng (cross-link).
+    // Cửa sổ owner map giới hạn theo ownerMapBudget (--mem); chuỗi vượt cửa sổ thì dựng lại
+    // map cho cửa sổ kế tiếp, mỗi cửa sổ một lượt qua mọi chuỗi như findCrossLinks
+    vector<LiveEntry> live;
+    map<pair<uint32_t, int>, uint32_t> liveIds; // (dirCluster, entryIndex) -> id trong owner map
+    ClusterOwnerMap owners;
+    bool liveReady = false;
+    const uint64_t clusterEnd = min<uint64_t>(FAT.size(), (uint64_t)totalClusters + 2);
+    const uint64_t ownerWindow = max<uint64_t>(ownerMapBudget / sizeof(uint32_t), 1);
+    auto ownerIdOf = [&](size_t ei) -> uint32_t
+    {
+        if (!liveReady)
+        {
+            live = listLiveEntries();
+            for (size_t k = 0; k < live.size(); ++k)
+                liveIds[{live[k].dirCluster, live[k].entryIndex}] = uint32_t(k + 1);
+            liveReady = true;
+        }
+        auto it = liveIds.find({dirCluster, (int)ei});
+        return it != liveIds.end() ? it->second : ClusterOwnerMap::NO_OWNER;
+    };
+    auto ownerOf = [&](uint32_t c) -> uint32_t
+    {
+        if (!owners.covers(c))
+        {
+            uint64_t first = 2 + (c - 2) / ownerWindow * ownerWindow;
+            uint64_t count = min<uint64_t>(ownerWindow, clusterEnd - first);
+            buildOwnerMap(live, uint32_t(first), uint32_t(count), owners, nullptr);
+        }
+        return owners.get(c);
+    };
+
+    // lặp qua các mục nhập (mỗi mục 32 byte)
+    size_t entries = clusterBuf.size() / 32;
+    for (size_t ei = 0; ei < entries; ++ei)
+    {
+        DirEntry *de = reinterpret_cast<DirEntry *>(clusterBuf.data() + ei * 32);
+
+        // bỏ qua các mục nhập trống/đã xóa và LFN (Tên dài)
+        if (de->name[0] == 0x00)
+            continue; // trống / kết thúc thư mục
+        if (de->isDeleted())
+            continue;
+        if (de->isLFN())
+            continue;
+
+        // tính toán cluster bắt đầu
+        uint32_t startCluster = ((uint32_t)de->firstClusterHigh << 16) | de->firstClusterLow;
+        uint32_t fileSize = de->fileSize;
+
+        if (startCluster == 0)
+        {
+            // tập tin không có cluster bắt đầu — cố gắng tìm một vùng liên tục
+            auto candidate = contiguousGuess(2 /*gợi ý bắt đầu: cluster 2*/, fileSize);
+            if (!candidate.empty())
+            {
+                // Đánh dấu (Claim) các cluster ứng cử viên
+                for (size_t k = 0; k < candidate.size(); ++k)
+                {
+                    uint32_t c = candidate[k];
+                    uint32_t next = (k + 1 < candidate.size()) ? candidate[k + 1] : 0x0FFFFFFF;
+                    setFATEntry(c, next);
+                }
+                // cập nhật các trường cluster bắt đầu của mục nhập thư mục
+                uint32_t newStart = candidate.front();
+                de->firstClusterHigh = uint16_t((newStart >> 16) & 0xFFFF);
+                de->firstClusterLow = uint16_t(newStart & 0xFFFF);
+                ++fixes;
+            }
+            continue;
+        }
+
+        // theo dõi chuỗi FAT hiện tại
+        vector<uint32_t> chain = followFAT(startCluster);
+
+        // số lượng cluster cần thiết cho kích thước tập tin
+        uint32_t needClusters = uint32_t(((uint64_t)fileSize + bytesPerCluster - 1) / bytesPerCluster);
+
+        // Nếu chuỗi trống, quá ngắn hoặc có đánh dấu không hợp lệ, cố gắng sửa
+        bool badChain = false;
+        if (chain.empty())
+            badChain = true;
+        else if (chain.size() < needClusters)
+            badChain = true;
+        else
+        {
+            // kiểm tra bất kỳ cluster nào được đánh dấu là xấu/không hợp lệ trong chuỗi
+            for (auto c : chain)
+            {
+                if (c < 2 || c >= totalClusters + 2)
+                {
+                    badChain = true;
+                    break;
+                }
+                uint32_t entry = FAT[c] & 0x0FFFFFFF;
+                // xem xét cluster trống (0) hoặc reserved (0x00000000) là xấu
+                if (entry == 0)
+                {
+                    badChain = true;
+                    break;
+                }
+            }
+        }
+
+        if (!badChain)
+            continue; // chuỗi có vẻ OK
+
+        // Thử đoán một chuỗi liên tục bắt đầu từ startCluster (hoặc gần đó)
+        auto candidate = contiguousGuess(startCluster, fileSize);
+        if (candidate.empty())
+        {
+            // dự phòng: thử đoán toàn cục bắt đầu từ cluster 2
+            candidate = contiguousGuess(2, fileSize);
+        }
+
+        if (!candidate.empty())
+        {
+            // Đánh dấu các cluster của chuỗi cũ là trống (nếu nằm trong phạm vi hợp lệ
+            // và không có entry nào khác cùng nhận)
+            // Xét theo thứ tự cluster để mỗi cửa sổ chỉ dựng một lần, và quyết định hết
+            // trước khi sửa FAT (map của cửa sổ sau được dựng từ FAT chưa bị đổi)
+            uint32_t self = ownerIdOf(ei);
+            vector<uint32_t> ordered(chain.begin(), chain.end()), release;
+            sort(ordered.begin(), ordered.end());
+            size_t kept = 0;
+            for (auto c : ordered)
+            {
+                if (c < 2 || c >= clusterEnd)
+                    continue;
+                if (self != ClusterOwnerMap::NO_OWNER && ownerOf(c) == self)
+                    release.push_back(c);
+                else
+                    ++kept;
+            }
+            for (auto c : release)
+                setFATEntry(c, 0); // trống
+            if (kept > 0)
+                FAT32_LOG(LOG_WARN, "cross-linked clusters kept during repair",
+                          kept << " clusters of entry " << ei << " in dir cluster " << dirCluster
+                               << " are shared with other files, left allocated");
+            // Ghi chuỗi ứng cử viên vào FAT
+            for (size_t k = 0; k < candidate.size(); ++k)
+            {
+                uint32_t c = candidate[k];
+                uint32_t next = (k + 1 < candidate.size()) ? candidate[k + 1] : 0x0FFFFFFF;
+                setFATEntry(c, next);
+            }
+            // Cập nhật các trường cluster bắt đầu của mục nhập thư mục nếu thay đổi
+            uint32_t newStart = candidate.front();
+            if (newStart != startCluster)
+            {
+                de->firstClusterHigh = uint16_t((newStart >> 16) & 0xFFFF);
+                de->firstClusterLow = uint16_t(newStart & 0xFFFF);
+            }
+            ++fixes;
+        }
+        else
+        {
+            // không thể tìm thấy ứng cử viên liên tục; giữ nguyên nhưng cảnh báo (tùy chọn)
+            FAT32_LOG(LOG_ERROR, "entries that could not be repaired",
+                      "unable to repair entry at dir cluster " << dirCluster << " entry index " << ei
+                                                               << " startCluster=" << startCluster << " size=" << fileSize);
+        }
+    } // for each dir entry
+
+    if (fixes > 0)
+    {
+        // ghi lại cluster thư mục đã sửa đổi (cập nhật nội dung thư mục trên đĩa)
+        writeCluster(dirCluster, clusterBuf);
+
+        // ghi lại các FAT đã sửa đổi vào đĩa
+        writeFAT();
+    }
+
+    return fixes;
+}
+
+// Hàm đoán chuỗi cluster liên tục cho file dựa trên fileSize
+vector<uint32_t> FAT32Recovery::contiguousGuess(uint32_t startHint, uint32_t fileSize) const
+{
+    vector<uint32_t> result;
+
+    const uint32_t bytesPerCluster =
+        bootSector.bytesPerSector * bootSector.sectorsPerCluster;
+
+    if (fileSize == 0)
+        return result;
+
+    uint32_t need = uint32_t(((uint64_t)fileSize + bytesPerCluster - 1) / bytesPerCluster);
+    uint32_t total = totalClusters; // số cluster hữu dụng
+
+    // FSInfo: không đủ cluster trống thì khỏi dò
+    if (need > freeClusters)
+        return result;
+
+    // Helper: kiểm tra đoạn free
+    auto isRangeFree = [&](uint32_t start, uint32_t len) -> bool
+    {
+        for (uint32_t i = 0; i < len; i++)
+        {
+            uint32_t c = start + i;
+            if (c >= FAT.size())
+                return false;
+            if ((FAT[c] & 0x0FFFFFFF) != 0)
+                return false; // không free
+        }
+        return true;
+    };
+
+    // ----------------------------------------------------
+    // 1. Thử đoán bắt đầu từ startHint
+    // ----------------------------------------------------
+    if (startHint >= 2 && startHint + need < FAT.size())
+    {
+        if (isRangeFree(startHint, need))
+        {
+            result.reserve(need);
+            for (uint32_t i = 0; i < need; i++)
+                result.push_back(startHint + i);
+            return result;
+        }
+    }
+
+    // ----------------------------------------------------
+    // 2. Dò toàn FAT để tìm 1 đoạn free đủ dài: bắt đầu từ gợi ý next-free
+    //    của FSInfo (vùng phía trước thường đã đầy), rồi vòng lại từ cluster 2
+    // ----------------------------------------------------
+    const uint64_t end = min<uint64_t>(FAT.size(), (uint64_t)total + 2);
+    if (end < (uint64_t)need + 2)
+        return result;
+    const uint32_t last = uint32_t(end - need); // cluster đầu lớn nhất còn chứa đủ need
+    const uint32_t from = (nextFreeHint >= 2 && nextFreeHint <= last) ? nextFreeHint : 2;
+
+    auto scan = [&](uint32_t first, uint32_t stop) -> bool
+    {
+        for (uint32_t c = first; c < stop; c++)
+        {
+            if (isRangeFree(c, need))
+            {
+                result.reserve(need);
+                for (uint32_t i = 0; i < need; i++)
+                    result.push_back(c + i);
+                return true;
+            }
+        }
+        return false;
+    };
+    if (scan(from, last + 1) || scan(2, from))
+        return result;
+
+    // ----------------------------------------------------
+    // 3. Không đoán được
+    // ----------------------------------------------------
+    return result;
+}
+
+// ======================================================================
+//                       DELETED FILE RECOVERY
+// ======================================================================
+namespace
+{
+    uint8_t lfnChecksum(const uint8_t name[11])
+    {
+        uint8_t sum = 0;
+        for (int i = 0; i < 11; ++i)
+            sum = uint8_t(((sum & 1) << 7) + (sum >> 1) + name[i]);
+        return sum;
+    }
+
+    // Entry LFN ngay trước entry 8.3 đã xóa mang checksum của tên 8.3 gốc. Ký tự đầu
+    // đã mất (0xE5) nên thử ký tự đầu của tên dài trước (thường trùng), sau đó mọi ký
+    // tự hợp lệ của tên 8.3: chỉ khớp nhờ vét cạn thì không kết luận (8 bit dễ trùng).
+    int8_t deletedLfnCheck(const uint8_t *dir, size_t index)
+    {
+        if (index == 0)
+            return 0;
+        const uint8_t *lfn = dir + (index - 1) * 32;
+        if ((lfn[11] & 0x0F) != 0x0F || lfn[26] != 0 || lfn[27] != 0)
+            return 0;
+
+        uint8_t name[11];
+        memcpy(name, dir + index * 32, 11);
+        uint8_t want = lfn[13];
+
+        if (lfn[2] == 0 && lfn[1] >= 0x20 && lfn[1] < 0x7F)
+        {
+            name[0] = (uint8_t)toupper(lfn[1]);
+            if (lfnChecksum(name) == want)
+                return 1;
+        }
+        static const char VALID[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!#$%&'()-@^_`{}~";
+        for (const char *c = VALID; *c; ++c)
+        {
+            name[0] = (uint8_t)*c;
+            if (lfnChecksum(name) == want)
+                return 0;
+        }
+        return -1;
+    }
+}
+
+// 1. PHÂN TÍCH XUNG ĐỘT (Collision Detection Strategy)
+vector<DeletedFileInfo> FAT32Recovery::analyzeRecoveryCandidates(uint32_t dirCluster)
+{
+    ScopedPhase timer(Metrics::PHASE_ANALYZE);
+
+    vector<DeletedFileInfo> candidates;
+    ClusterCache::Buffer pinned;
+    try
+    {
+        pinned = pinCluster(dirCluster);
+    }
+    catch (...)
+    {
+        return candidates;
+    }
+    const vector<uint8_t> &buf = *pinned;
+
+    size_t numEntries = buf.size() / 32;
+
+    // --- BƯỚC 1: Thu thập (Census) ---
+    for (size_t i = 0; i < numEntries; ++i)
+    {
+        const DirEntry *entry = reinterpret_cast<const DirEntry *>(buf.data() + (i * 32));
+
+        // Chỉ lấy các entry đánh dấu xóa (0xE5) và không phải tên dài (LFN)
+        if (entry->name[0] == 0xE5 && !entry->isLFN())
+        {
+            DeletedFileInfo info;
+            info.entryIndex = (int)i;
+            info.name = entry->getRecoveryName();
+            info.size = entry->fileSize;
+            info.startCluster = entry->getStartCluster();
+            info.isDir = entry->isdDir(); // Lấy cờ folder
+
+            // Lấy timestamps
+            info.lastWriteTime = entry->getWriteTimestamp();
+            info.creationTime = entry->getCreationTimestamp();
+            info.lastAccessDate = entry->lastAccDate;
+            info.lfnCheck = deletedLfnCheck(buf.data(), i);
+
+            info.isRecoverable = true;
+            info.statusReason = "Good";
+
+            candidates.push_back(info);
+        }
+    }
+
+    arbitrateCandidates(candidates);
+    return candidates;
+}
+
+// Bước 2-3 của phân tích: giả định liên tục, đối chiếu FAT và phân xử các file
+// đã xóa cùng đòi một cluster. Chỉ đọc FAT, không ghi gì.
+void FAT32Recovery::arbitrateCandidates(vector<DeletedFileInfo> &candidates) const
+{
+    uint32_t bytesPerCluster = bootSector.bytesPerSector * bootSector.sectorsPerCluster;
+
+    // --- BƯỚC 2: Map Cluster Claims ---
+    // Key: Cluster ID, Value: List of file indices wanting this cluster
+    map<uint32_t, vector<int>> clusterClaims;
+
+    for (int fileIdx = 0; fileIdx < (int)candidates.size(); ++fileIdx)
+    {
+        auto &file = candidates[fileIdx];
+        if (file.size == 0)
+            continue; // File rỗng không chiếm cluster
+
+        uint32_t needed = uint32_t(((uint64_t)file.size + bytesPerCluster - 1) / bytesPerCluster);
+
+        // Giả định file liên tục (Contiguous Assumption)
+        for (uint32_t c = 0; c < needed; ++c)
+        {
+            uint32_t currentClus = file.startCluster + c;
+
+            // Nếu cluster vượt quá giới hạn đĩa
+            if (currentClus >= totalClusters + 2)
+            {
+                file.isRecoverable = false;
+                file.statusReason = "Invalid Range";
+                break;
+            }
+            clusterClaims[currentClus].push_back(fileIdx);
+        }
+    }
+
+    // --- BƯỚC 3: Xử lý xung đột (Arbitration) ---
+    for (auto const &[clusterID, claimants] : clusterClaims)
+    {
+        // A. Kiểm tra với bảng FAT thực tế (File đang sống)
+        if ((FAT[clusterID] & 0x0FFFFFFF) != 0)
+        {
+            for (int idx : claimants)
+            {
+                candidates[idx].isRecoverable = false;
+                candidates[idx].statusReason = "Overwritten by Active File";
+            }
+            continue;
+        }
+
+        // B. Kiểm tra xung đột giữa các file đã xóa (Deleted vs Deleted)
+        if (claimants.size() > 1)
+        {
+            int winnerIdx = claimants[0];
+
+            // So sánh từng cặp để tìm người chiến thắng
+            for (size_t i = 1; i < claimants.size(); ++i)
+            {
+                int challengerIdx = claimants[i];
+                auto &winner = candidates[winnerIdx];
+                auto &challenger = candidates[challengerIdx];
+
+                // === LOGIC: Creation vs Last Write ===
+                // Nếu B được TẠO RA (Created) sau khi A đã GHI XONG (LastWrite)
+                // => B là kẻ đến sau đè lên A.
+                if (challenger.creationTime > winner.lastWriteTime)
+                {
+                    winnerIdx = challengerIdx;
+                }
+                else if (winner.creationTime > challenger.lastWriteTime)
+                {
+                    // Winner vẫn thắng, không đổi
+                }
+                else
+                {
+                    // Fallback: Ai có Last Write mới hơn thì thắng
+                    if (challenger.lastWriteTime > winner.lastWriteTime)
+                    {
+                        winnerIdx = challengerIdx;
+                    }
+                }
+            }
+
+            // Loại bỏ những kẻ thua cuộc
+            for (int idx : claimants)
+            {
+                if (idx != winnerIdx)
+                {
+                    candidates[idx].isRecoverable = false;
+                    candidates[idx].statusReason = "Collision (Lost Time Check)";
+                }
+            }
+        }
+    }
+}
+
+// 2. KHÔI PHỤC TẠI CHỖ (In-Place Restore)
+bool FAT32Recovery::restoreDeletedFile(uint32_t dirCluster, int entryIndex, char newChar)
+{
+    ScopedPhase timer(Metrics::PHASE_RESTORE);
+
+    cout << "[RESTORE] Processing entry " << entryIndex << " in dir " << dirCluster << "...\n";
+
+    // A. Đọc Directory Cluster
+    vector<uint8_t> dirBuf;
+    try
+    {
+        readCluster(dirCluster, dirBuf);
+    }
+    catch (...)
+    {
+        return false;
+    }
+
+    DirEntry *de = reinterpret_cast<DirEntry *>(dirBuf.data() + (entryIndex * 32));
+    if (de->name[0] != 0xE5)
+        return false;
+
+    uint32_t start = de->getStartCluster();
+    uint32_t size = de->fileSize;
+    uint32_t bytesPerClus = bootSector.bytesPerSector * bootSector.sectorsPerCluster;
+    uint32_t needed = uint32_t(((uint64_t)size + bytesPerClus - 1) / bytesPerClus);
+    if (size == 0)
+        needed = 0;
+
+    // B. Chuẩn bị danh sách cluster cần chiếm (Claim List)
+    vector<uint32_t> chainToClaim;
+    if (needed > 0)
+    {
+        for (uint32_t i = 0; i < needed; i++)
+        {
+            uint32_t c = start + i;
+            // Check an toàn lần cuối
+            if (c >= FAT.size() || (FAT[c] & 0x0FFFFFFF) != 0)
+            {
+                FAT32_LOG(LOG_ERROR, "restores aborted on collision", "Collision detected at " << c << " during write phase. Aborting.");
+                return false;
+            }
+            chainToClaim.push_back(c);
+        }
+    }
+
+    // C. Verify (Optional): Đọc thử cluster đầu tiên kiểm tra Signature
+    if (!chainToClaim.empty() && !de->isdDir())
+    {
+        if (!verifyFileSignature(chainToClaim[0], de->getRecoveryName()))
+        {
+            cout << "[WARN] Signature mismatch. Restoring anyway but file might be junk.\n";
+        }
+    }
+
+    // D. THỰC HIỆN GHI (Write Phase)
+
+    // 1. Sửa Dir Entry
+    de->name[0] = (uint8_t)newChar;
+
+    // 2. Cập nhật FAT Chain
+    if (!chainToClaim.empty())
+    {
+        for (size_t i = 0; i < chainToClaim.size(); i++)
+        {
+            uint32_t cur = chainToClaim[i];
+            uint32_t next = (i == chainToClaim.size() - 1) ? 0x0FFFFFFF : chainToClaim[i + 1];
+            setFATEntry(cur, next);
+        }
+        writeFAT(); // Ghi các sector FAT đã sửa xuống mọi bản
+    }
+
+    // 3. Ghi lại Directory Cluster (write-through cache)
+    writeCluster(dirCluster, dirBuf);
+
+    return true;
+}
+
+// 3. KHÔI PHỤC ĐỆ QUY (Recursive Tree)
+void FAT32Recovery::restoreTree(uint32_t dirClusterOfParent, int entryIndex)
+{
+    ScopedPhase timer(Metrics::PHASE_RESTORE);
+
+    cout << "[INFO] Starting recursive restore...\n";
+
+    // Bước 1: Cứu cha trước
+    if (!restoreDeletedFile(dirClusterOfParent, entryIndex, '_'))
+    {
+        cout << "[FAIL] Parent restore failed.\n";
+        return;
+    }
+
+    // Đọc lại để lấy start cluster chính xác (sau khi restore) - cache hit nhờ write-through
+    ClusterCache::Buffer buf = pinCluster(dirClusterOfParent);
+    const DirEntry *de = reinterpret_cast<const DirEntry *>(buf->data() + (entryIndex * 32));
+
+    if (de->isdDir())
+    {
+        recursiveRestoreLoop(de->getStartCluster());
+    }
+}
+
+void FAT32Recovery::recursiveRestoreLoop(uint32_t currentDirCluster)
+{
+    cout << "   [SCAN] Diving into cluster " << currentDirCluster << "...\n";
+
+    // Bước 2: Quét tìm con bằng thuật toán Collision Check
+    vector<DeletedFileInfo> children = analyzeRecoveryCandidates(currentDirCluster);
+
+    // Nạp trước cluster đầu của các thư mục con trong một batch
+    vector<uint32_t> childDirs;
+    for (const auto &child : children)
+    {
+        if (child.isDir && child.isRecoverable && child.startCluster >= 2 &&
+            child.startCluster < totalClusters + 2 && child.startCluster != currentDirCluster)
+            childDirs.push_back(child.startCluster);
+    }
+    try
+    {
+        prefetchClusters(childDirs);
+    }
+    catch (...)
+    {
+        // Prefetch chỉ là tối ưu, lỗi sẽ được báo lại khi đọc thật
+    }
+
+    for (const auto &child : children)
+    {
+        if (child.isRecoverable && child.name != "." && child.name != "..")
+        {
+            // Bước 3: Cứu con (In-place)
+            bool ok = restoreDeletedFile(currentDirCluster, child.entryIndex, '_');
+
+            // Bước 4: Đệ quy nếu con là Folder
+            if (ok && child.isDir)
+            {
+                // Tránh loop vô tận
+                if (child.startCluster != currentDirCluster && child.startCluster != 0)
+                    recursiveRestoreLoop(child.startCluster);
+            }
+        }
+    }
+}
+
+// Helper: Verify Signature đơn giản
+bool FAT32Recovery::verifyFileSignature(uint32_t startCluster, string filename)
+{
+    // Lấy extension
+    size_t dotPos = filename.find_last_of(".");
+    if (dotPos == string::npos)
+        return true;                          // Không có đuôi -> bỏ qua check
+    string ext = filename.substr(dotPos + 1); // Cần toUpper nếu muốn chắc chắn
+
+    ClusterCache::Buffer pinned;
+    try
+    {
+        pinned = pinCluster(startCluster);
+    }
+    catch (...)
+    {
+        return false;
+    }
+    const vector<uint8_t> &buf = *pinned;
+    if (buf.size() < 4)
+        return false;
+
+    // Check mẫu vài loại phổ biến
+    if (ext == "JPG" || ext == "JPEG")
+        return buf[0] == 0xFF && buf[1] == 0xD8;
+    if (ext == "PNG")
+        return buf[0] == 0x89 && buf[1] == 'P' && buf[2] == 'N' && buf[3] == 'G';
+
+    return true;
+}
+// ======================================================================
+//                       Scanning & recovery routines
+// ======================================================================
+vector<uint32_t> FAT32Recovery:: followFAT(uint32_t startCluster) const
+{
+    vector<uint32_t> chain;
+
+    // 0. Kiểm tra điều kiện tiên quyết
+    // Nếu bảng FAT chưa load hoặc startCluster là 0 (file rỗng), trả về rỗng ngay.
+    if (FAT.empty())
+    {
+        FAT32_LOG(LOG_ERROR, "followFAT on unloaded FAT", "FAT table is not loaded yet.");
+        return chain;
+    }
+    if (startCluster == 0)
+    {
+        return chain; // File rỗng, không có lỗi
+    }
+
+    // Dự đoán kích thước vector để giảm chi phí cấp phát bộ nhớ liên tục
+    // (Optional: Giả sử file trung bình có vài cluster)
+    chain.reserve(32);
+
+    // Sử dụng Set để phát hiện vòng lặp (Safety mechanism)
+    set<uint32_t> visited;
+
+    uint32_t current = startCluster;
+    const uint32_t FAT32_MASK = 0x0FFFFFFF;
+    const uint32_t EOC_MARK = 0x0FFFFFF8;
+    const uint32_t BAD_CLUS = 0x0FFFFFF7;
+
+    while (true)
+    {
+        // 1. Kiểm tra biên (Boundary Check)
+        // Cluster < 2 là reserved (trừ khi tính toán sai), >= size là lỗi
+        if (current < 2 || current >= FAT.size())
+        {
+            FAT32_LOG(LOG_WARN, "chains pointing out of FAT bounds",
+                      "Chain points to invalid cluster index: " << current << " (Out of FAT bounds)");
+            break;
+        }
+
+        // 2. Kiểm tra vòng lặp (Loop Detection)
+        // Nếu cluster đã tồn tại trong set -> Có vòng lặp
+        if (visited.find(current) != visited.end())
+        {
+            FAT32_LOG(LOG_WARN, "FAT cycles cut", "FAT Cycle detected at cluster " << current << ". Cutting chain here.");
+            break;
+        }
+
+        // 3. Đọc giá trị tiếp theo
+        uint32_t next = FAT[current] & FAT32_MASK;
+
+        // 4. Các điều kiện dừng
+
+        // A. End of Chain (EOC)
+        if (next >= EOC_MARK)
+        {
+            // Đây là kết thúc bình thường, không cần log lỗi
+            // Cluster hiện tại là cluster cuối của file -> vẫn thuộc chuỗi
+            chain.push_back(current);
+            break;
+        }
+
+        // B. Bad Cluster
+        if (next == BAD_CLUS)
+        {
+            FAT32_LOG(LOG_WARN, "chains hitting BAD CLUSTER", "Chain hit BAD CLUSTER at index " << current);
+            break;
+        }
+
+        // C. Free Cluster (0) - Broken Chain
+        if (next == 0)
+        {
+            // Trong recovery, file đang có dữ liệu mà trỏ về 0 nghĩa là mất đoạn sau.
+            FAT32_LOG(LOG_WARN, "chains broken to FREE", "Chain broken (points to FREE/0) at cluster " << current);
+            break;
+        }
+
+        // 5. Di chuyển tiếp
+        // Ghi nhận cluster
+        visited.insert(current);
+        chain.push_back(current);
+        current = next;
+    }
+
+    Metrics::add(Metrics::CLUSTERS_WALKED, chain.size());
+    return chain;
+}
+
+// ======================================================================
+//                       UTILS
+// ======================================================================
+ClusterCache::Buffer FAT32Recovery::pinCluster(uint32_t cluster) const
+{
+    // 1. Kiểm tra tính hợp lệ
+    // Cluster trong FAT32 bắt đầu từ 2. Các giá trị 0 và 1 được dành riêng.
+    if (cluster < 2)
+    {
+        // Có thể throw lỗi hoặc return rỗng tùy chiến lược xử lý lỗi
+        throw runtime_error("Invalid cluster number: " + to_string(cluster));
+    }
+
+    // 2. Tra cache trước, trúng thì không cần chạm đĩa
+    ClusterCache::Buffer cached = clusterCache.get(cluster);
+    if (cached)
+        return cached;
+    const uint64_t generation = clusterCache.generation(cluster);
+
+    // 3. Tính toán Offset (Vị trí byte trên đĩa)
+    // Công thức: Offset = Start_Data_Region + (Cluster_Index - 2) * Cluster_Size
+    uint32_t clusterSize = bootSector.sectorsPerCluster * bootSector.bytesPerSector;
+
+    // Cần ép kiểu uint64_t để tránh tràn số (overflow) với ổ đĩa lớn
+    uint64_t offset = dataBegin + (uint64_t)(cluster - 2) * clusterSize;
+
+    // 4. Đọc dữ liệu
+    vector<uint8_t> data(clusterSize);
+    ssize_t bytesRead = readBytes(offset, data.data(), clusterSize);
+
+    // 5. Kiểm tra lỗi đọc
+    if (bytesRead != (ssize_t)clusterSize)
+    {
+        throw runtime_error("Failed to read cluster " + to_string(cluster));
+    }
+
+    return clusterCache.put(cluster, move(data), generation);
+}
+
+void FAT32Recovery::readCluster(uint32_t cluster, vector<uint8_t> &buffer) const
+{
+    // Bản sao có thể sửa được (dùng cho các đường ghi tại chỗ)
+    ClusterCache::Buffer pinned = pinCluster(cluster);
+    buffer.assign(pinned->begin(), pinned->end());
+}
+
+// ======================================================================
+//                       ASYNC BATCHED CLUSTER READS
+// ======================================================================
+IOThreadPool::IOThreadPool(unsigned threads) : stopping(false)
+{
+    for (unsigned i = 0; i < max(1u, threads); ++i)
+        workers.emplace_back([this]()
+                             { run(); });
+}
+
+IOThreadPool::~IOThreadPool()
+{
+    {
+        lock_guard<mutex> g(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers)
+        t.join();
+}
+
+void IOThreadPool::submit(function<void()> job)
+{
+    {
+        lock_guard<mutex> g(lock);
+        jobs.push_back(move(job));
+    }
+    wake.notify_one();
+}
+
+void IOThreadPool::run()
+{
+    for (;;)
+    {
+        function<void()> job;
+        {
+            unique_lock<mutex> g(lock);
+            wake.wait(g, [this]()
+                      { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return; // stopping và đã hết việc
+            job = move(jobs.front());
+            jobs.pop_front();
+        }
+        job(); // việc tự bắt lỗi của mình (giao qua promise)
+    }
+}
+
+IOThreadPool &FAT32Recovery::getIOPool() const
+{
+    lock_guard<mutex> g(ioPoolLock);
+    if (!ioPool)
+        ioPool.reset(new IOThreadPool(ioThreads));
+    return *ioPool;
+}
+
+future<size_t> FAT32Recovery::readClustersAsync(const vector<uint32_t> &clusters, ClusterReadCallback callback) const
+{
+    const uint32_t clusterSize = bootSector.sectorsPerCluster * bootSector.bytesPerSector;
+    if (clusterSize == 0)
+        throw runtime_error("Volume geometry not initialized.");
+
+    // Trạng thái chung của một batch: việc cuối cùng xong sẽ giao kết quả qua promise
+    struct Batch
+    {
+        ClusterReadCallback callback;
+        vector<pair<uint32_t, ClusterCache::Buffer>> hits;
+        vector<pair<uint32_t, uint32_t>> runs;
+        atomic<size_t> remaining{0};
+        atomic<size_t> delivered{0};
+        atomic<bool> failed{false};
+        mutex errLock;
+        exception_ptr firstError;
+        promise<size_t> done;
+    };
+    shared_ptr<Batch> batch = make_shared<Batch>();
+    batch->callback = move(callback);
+
+    // 1. Sắp xếp + bỏ trùng, trả luôn các cluster đã có trong cache
+    vector<uint32_t> sorted(clusters);
+    sort(sorted.begin(), sorted.end());
+    sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+
+    vector<uint32_t> missing;
+    for (uint32_t c : sorted)
+    {
+        if (c < 2 || c >= totalClusters + 2)
+            throw runtime_error("Invalid cluster number: " + to_string(c));
+        ClusterCache::Buffer b = clusterCache.get(c);
+        if (b)
+            batch->hits.emplace_back(c, b);
+        else
+            missing.push_back(c);
+    }
+
+    // 2. Gộp các cluster liền kề thành run (first, count), giới hạn bởi maxRunBytes
+    const uint32_t runLimit = max<uint32_t>(1, uint32_t(maxRunBytes / clusterSize));
+    vector<pair<uint32_t, uint32_t>> &runs = batch->runs;
+    for (uint32_t c : missing)
+    {
+        if (!runs.empty() && runs.back().first + runs.back().second == c && runs.back().second < runLimit)
+            runs.back().second++;
+        else
+            runs.emplace_back(c, 1);
+    }
+
+    future<size_t> result = batch->done.get_future();
+    const size_t jobs = runs.size() + (batch->hits.empty() ? 0 : 1);
+    if (jobs == 0)
+    {
+        batch->done.set_value(0);
+        return result;
+    }
+    batch->remaining = jobs;
+
+    auto finish = [](Batch &b)
+    {
+        if (--b.remaining != 0)
+            return;
+        if (b.firstError)
+            b.done.set_exception(b.firstError);
+        else
+            b.done.set_value(b.delivered.load());
+    };
+    auto fail = [](Batch &b)
+    {
+        lock_guard<mutex> g(b.errLock);
+        if (!b.firstError)
+            b.firstError = current_exception();
+        b.failed = true; // các run chưa chạy sẽ bỏ qua
+    };
+
+    // 3. Mỗi run là một việc trên pool I/O; mỗi lần đọc mượn handle riêng từ pool của device
+    IOThreadPool &pool = getIOPool();
+    if (!batch->hits.empty())
+    {
+        pool.submit([batch, finish, fail]()
+                    {
+            try
+            {
+                for (auto &h : batch->hits)
+                {
+                    if (batch->callback)
+                        batch->callback(h.first, h.second);
+                    batch->delivered++;
+                }
+            }
+            catch (...)
+            {
+                fail(*batch);
+            }
+            finish(*batch); });
+    }
+    for (size_t r = 0; r < runs.size(); ++r)
+    {
+        pool.submit([this, batch, r, clusterSize, finish, fail]()
+                    {
+            try
+            {
+                if (!batch->failed)
+                {
+                    uint32_t first = batch->runs[r].first;
+                    uint32_t count = batch->runs[r].second;
+                    uint64_t offset = dataBegin + (uint64_t)(first - 2) * clusterSize;
+                    size_t bytes = (size_t)count * clusterSize;
+                    vector<uint8_t> runBuf(bytes);
+
+                    // Chốt thế hệ từng cluster trước khi đọc để không nạp bản cũ nếu có ghi xen vào
+                    vector<uint64_t> generations(count);
+                    for (uint32_t i = 0; i < count; ++i)
+                        generations[i] = clusterCache.generation(first + i);
+
+                    ssize_t n = readBytes(offset, runBuf.data(), bytes);
+                    if (n != (ssize_t)bytes)
+                        throw runtime_error("Failed to read cluster run at " + to_string(first));
+
+                    // Tách run thành từng cluster, nạp cache rồi giao cho callback
+                    for (uint32_t i = 0; i < count; ++i)
+                    {
+                        const uint8_t *p = runBuf.data() + (size_t)i * clusterSize;
+                        ClusterCache::Buffer b = clusterCache.put(first + i, vector<uint8_t>(p, p + clusterSize), generations[i]);
+                        if (batch->callback)
+                            batch->callback(first + i, b);
+                        batch->delivered++;
+                    }
+                }
+            }
+            catch (...)
+            {
+                fail(*batch);
+            }
+            finish(*batch); });
+    }
+    return result;
+}
+
+future<void> FAT32Recovery::readClusterRunAsync(uint32_t firstCluster, uint32_t count, uint8_t *dst) const
+{
+    shared_ptr<promise<void>> done = make_shared<promise<void>>();
+    future<void> result = done->get_future();
+    getIOPool().submit([this, firstCluster, count, dst, done]()
+                       {
+        try
+        {
+            readClusterRun(firstCluster, count, dst);
+            done->set_value();
+        }
+        catch (...)
+        {
+            done->set_exception(current_exception());
+        } });
+    return result;
+}
+
+void FAT32Recovery::prefetchClusters(const vector<uint32_t> &clusters) const
+{
+    if (clusters.empty())
+        return;
+    readClustersAsync(clusters, ClusterReadCallback()).get();
+}
+
+void FAT32Recovery::readClusterRun(uint32_t firstCluster, uint32_t count, uint8_t *dst) const
+{
+    if (firstCluster < 2 || (uint64_t)firstCluster + count > (uint64_t)totalClusters + 2)
+        throw runtime_error("Invalid cluster run: " + to_string(firstCluster) + "+" + to_string(count));
+
+    size_t bytes = (size_t)count * getClusterSize();
+    if (readBytes(cluster2Offset(firstCluster), dst, bytes) != (ssize_t)bytes)
+        throw runtime_error("Failed to read cluster run at " + to_string(firstCluster));
+    clusterCache.overlayDirty(firstCluster, count, getClusterSize(), dst);
+}
+
+uint32_t FAT32Recovery::getClusterSize() const
+{
+    return uint32_t(bootSector.sectorsPerCluster) * bootSector.bytesPerSector;
+}
+
+void FAT32Recovery::setIOThreads(unsigned threads)
+{
+    // Pool cũ chạy nốt việc đã xếp hàng rồi mới dừng; pool mới được tạo khi cần
+    lock_guard<mutex> g(ioPoolLock);
+    ioThreads = max(1u, threads);
+    ioPool.reset();
+}
+
+void FAT32Recovery::setCacheBudget(size_t bytes)
+{
+    clusterCache.setBudget(bytes);
+}
+
+ClusterCache::Stats FAT32Recovery::getCacheStats() const
+{
+    return clusterCache.getStats();
+}
+
+uint64_t FAT32Recovery::cluster2Offset(uint32_t cluster) const
+{
+    if (cluster < 2)
+        throw runtime_error("Invalid cluster number");
+
+    return dataBegin + uint64_t(cluster - 2) * bootSector.sectorsPerCluster * bootSector.bytesPerSector;
+}
+
+// ======================================================================
+//                       SEQUENTIAL CHAIN READER
+// ======================================================================
+ClusterChainReader::ClusterChainReader(const FAT32Recovery &volume, const vector<uint32_t> &chain,
+                                       uint64_t length, size_t readaheadBytes)
+    : vol(volume), extents(buildExtents(chain)), total(length), pos(0),
+      readahead(readaheadBytes), extentIdx(0), extentCursor(0), windowPos(0),
+      scheduled(0), asyncReadahead(false), aheadBytes(0)
+{
+    // Không cho đọc vượt quá dữ liệu thực có trong chuỗi
+    uint64_t available = (uint64_t)chain.size() * vol.getClusterSize();
+    if (total > available)
+        total = available;
+}
+
+ClusterChainReader::~ClusterChainReader()
+{
+    // Buffer đọc trước phải sống tới khi worker ghi xong
+    if (aheadPending.valid())
+        aheadPending.wait();
+}
+
+vector<ClusterChainReader::Extent> ClusterChainReader::buildExtents(const vector<uint32_t> &chain)
+{
+    vector<Extent> result;
+    for (uint32_t c : chain)
+    {
+        if (!result.empty() && result.back().firstCluster + result.back().count == c)
+            result.back().count++;
+        else
+            result.push_back({c, 1});
+    }
+    return result;
+}
+
+// Khối kế tiếp cần đọc: tối đa readahead byte của extent hiện tại, không vượt quá file
+bool ClusterChainReader::planChunk(Chunk &chunk)
+{
+    const uint32_t clusterSize = vol.getClusterSize();
+
+    // Bỏ qua các extent đã đọc hết
+    while (extentIdx < extents.size() && extentCursor >= extents[extentIdx].count)
+    {
+        extentIdx++;
+        extentCursor = 0;
+    }
+    if (extentIdx >= extents.size() || scheduled >= total || clusterSize == 0)
+        return false;
+
+    const Extent &ext = extents[extentIdx];
+    uint32_t maxClusters = max<uint32_t>(1, uint32_t(readahead / clusterSize));
+    uint32_t count = min(ext.count - extentCursor, maxClusters);
+
+    // Không đọc quá phần còn lại của file
+    uint64_t remaining = total - scheduled;
+    uint32_t neededClusters = uint32_t((remaining + clusterSize - 1) / clusterSize);
+    count = min(count, neededClusters);
+
+    chunk.firstCluster = ext.firstCluster + extentCursor;
+    chunk.count = count;
+    chunk.bytes = (size_t)min<uint64_t>((uint64_t)count * clusterSize, remaining); // cắt phần thừa ở cluster cuối
+    extentCursor += count;
+    scheduled += chunk.bytes;
+    return true;
+}
+
+bool ClusterChainReader::fill()
+{
+    const uint32_t clusterSize = vol.getClusterSize();
+
+    if (aheadPending.valid())
+    {
+        // Khối đã được đọc trước: lỗi đọc (nếu có) được ném ở đây như khi đọc đồng bộ
+        aheadPending.get();
+        window.swap(ahead);
+        window.resize(aheadBytes);
+    }
+    else
+    {
+        Chunk chunk;
+        if (!planChunk(chunk))
+            return false;
+        window.resize((size_t)chunk.count * clusterSize);
+        vol.readClusterRun(chunk.firstCluster, chunk.count, window.data());
+        window.resize(chunk.bytes);
+    }
+    windowPos = 0;
+
+    // Xếp lịch đọc khối sau trên pool I/O trong lúc caller xử lý khối này
+    Chunk nextChunk;
+    if (asyncReadahead && planChunk(nextChunk))
+    {
+        ahead.resize((size_t)nextChunk.count * clusterSize);
+        aheadBytes = nextChunk.bytes;
+        aheadPending = vol.readClusterRunAsync(nextChunk.firstCluster, nextChunk.count, ahead.data());
+    }
+    return true;
+}
+
+bool ClusterChainReader::next(const uint8_t *&data, size_t &size)
+{
+    if (windowPos >= window.size() && !fill())
+        return false;
+
+    data = window.data() + windowPos;
+    size = window.size() - windowPos;
+    windowPos = window.size();
+    pos += size;
+    return true;
+}
+
+size_t ClusterChainReader::read(uint8_t *dst, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        if (windowPos >= window.size() && !fill())
+            break;
+
+        size_t n = min(size - done, window.size() - windowPos);
+        memcpy(dst + done, window.data() + windowPos, n);
+        windowPos += n;
+        pos += n;
+        done += n;
+    }
+    return done;
+}
+
+// 4. XUẤT FILE RA NGOÀI (Export)
+vector<uint32_t> FAT32Recovery::contiguousRange(uint32_t startCluster, uint64_t fileSize) const
+{
+    const uint32_t bytesPerCluster = getClusterSize();
+    if (bytesPerCluster == 0)
+        throw runtime_error("Volume geometry not initialized.");
+    // 64-bit: file gần 4 GiB cộng thêm (bytesPerCluster - 1) sẽ tràn uint32_t
+    uint64_t needed = (fileSize + bytesPerCluster - 1) / bytesPerCluster;
+
+    vector<uint32_t> chain;
+    chain.reserve((size_t)needed);
+    for (uint64_t i = 0; i < needed; ++i)
+    {
+        uint64_t c = (uint64_t)startCluster + i;
+        if (c < 2 || c >= (uint64_t)totalClusters + 2)
+            throw runtime_error("Cluster range out of volume: " + to_string(c));
+        chain.push_back(uint32_t(c));
+    }
+    return chain;
+}
+
+bool FAT32Recovery::recoverFile(uint32_t startCluster, uint32_t fileSize, const string &outPath)
+{
+    ScopedPhase timer(Metrics::PHASE_EXPORT);
+
+    // File đã xóa: đúng dải liên tục mà arbitrateCandidates đã chấm. Không đi theo FAT vì
+    // cluster đầu có thể đã bị file khác dùng lại -> sẽ xuất nhầm dữ liệu của file đó
+    vector<uint32_t> chain = contiguousRange(startCluster, fileSize);
+
+    ofstream out(outPath, ios::out | ios::binary | ios::trunc);
+    if (!out.is_open())
+        throw runtime_error("Cannot create output file: " + outPath);
+
+    // Có hash set: băm ngay trong lượt ghi, không đọc lại
+    ClusterChainReader reader(*this, chain, fileSize);
+    reader.setAsyncReadahead(true);
+    XXHash64 hasher;
+    MD5Hash md5;
+    const bool useMD5 = knownUsesMD5();
+    const uint8_t *data;
+    size_t size;
+    while (reader.next(data, size))
+    {
+        writeAll(out, data, size);
+        if (useMD5)
+            md5.update(data, size);
+        else if (knownHashes)
+            hasher.update(data, size);
+    }
+
+    if (knownHashes && fileSize > 0)
+    {
+        uint64_t digest = hasher.digest();
+        if (isKnownContent(digest != 0 ? digest : 1, useMD5 ? md5.key64() : 0))
+        {
+            if (skipKnown)
+            {
+                out.close();
+                filesystem::remove(outPath);
+                cout << "[INFO] " << outPath << " matches the known-file hash set, skipped.\n";
+                return false;
+            }
+            cout << "[INFO] " << outPath << " matches the known-file hash set.\n";
+        }
+    }
+
+    cout << "[SUCCESS] Exported " << reader.position() << " bytes ("
+         << reader.getExtents().size() << " extent(s)) to " << outPath << "\n";
+    return true;
+}
+
+// 5. TÌM THƯ MỤC THEO ĐƯỜNG DẪN
+uint32_t FAT32Recovery::resolvePath(const string &path) const
+{
+    uint32_t current = bootSector.rootCluster;
+
+    // Tách path thành các thành phần, chấp nhận cả '/' và '\\'
+    vector<string> parts;
+    string part;
+    for (char ch : path + "/")
+    {
+        if (ch == '/' || ch == '\\')
+        {
+            if (!part.empty())
+                parts.push_back(part);
+            part.clear();
+        }
+        else
+            part.push_back((char)toupper((unsigned char)ch));
+    }
+
+    for (const string &name : parts)
+    {
+        uint32_t found = 0;
+        vector<uint32_t> dirChain = followFAT(current);
+        if (dirChain.empty())
+            dirChain.push_back(current);
+
+        for (uint32_t dc : dirChain)
+        {
+            ClusterCache::Buffer buf = pinCluster(dc);
+            for (size_t i = 0; i + 32 <= buf->size() && found == 0; i += 32)
+            {
+                const DirEntry *e = reinterpret_cast<const DirEntry *>(buf->data() + i);
+                if (e->name[0] == 0x00)
+                    break;
+                if (e->isDeleted() || e->isLFN() || !e->isdDir())
+                    continue;
+                if (formatShortName(e->name) == name)
+                    found = e->getStartCluster();
+            }
+            if (found != 0)
+                break;
+        }
+
+        // ".." trỏ về root được ghi là cluster 0
+        if (found == 0 && name == "..")
+            found = bootSector.rootCluster;
+        if (found == 0)
+            return 0;
+        current = found;
+    }
+    return current;
+}
+
+// ======================================================================
+//                       SIGNATURE CARVING
+// ======================================================================
+namespace
+{
+    struct CarveSignature
+    {
+        const char *type;
+        const char *header;
+        size_t headerLen;
+        const char *footer;
+        size_t footerLen;
+        size_t footerExtra; // số byte còn lại sau footer
+        bool compressed;    // thân file có entropy cao: gặp cluster text là đã sang file khác
+    };
+
+    const CarveSignature CARVE_SIGNATURES[] = {
+        {"jpg", "\xFF\xD8\xFF", 3, "\xFF\xD9", 2, 0, true},
+        {"png", "\x89PNG\r\n\x1A\n", 8, "IEND", 4, 4, true},
+        {"pdf", "%PDF-", 5, "%%EOF", 5, 0, false},
+        {"gif", "GIF8", 4, "\x00\x3B", 2, 0, true},
+        {"zip", "PK\x03\x04", 4, "PK\x05\x06", 4, 18, true},
+    };
+
+    const CarveSignature *matchHeader(const uint8_t *p, size_t len)
+    {
+        for (const auto &sig : CARVE_SIGNATURES)
+        {
+            if (len >= sig.headerLen && memcmp(p, sig.header, sig.headerLen) == 0)
+                return &sig;
+        }
+        return nullptr;
+    }
+}
+
+vector<CarvedFile> FAT32Recovery::carveFreeClusters(const string &outDir, size_t maxFiles, uint64_t maxFileBytes)
+{
+    ScopedPhase timer(Metrics::PHASE_CARVE);
+
+    vector<CarvedFile> found;
+    const uint32_t clusterSize = getClusterSize();
+    if (FAT.empty() || clusterSize == 0)
+        throw runtime_error("FAT table is not loaded yet.");
+
+    const uint32_t endCluster = min<uint32_t>(totalClusters + 2, (uint32_t)FAT.size());
+    const uint32_t maxClusters = (uint32_t)max<uint64_t>(1, maxFileBytes / clusterSize);
+
+    if (!outDir.empty())
+        filesystem::create_directories(outDir);
+
+    cout << "[CARVE] Scanning free clusters for file signatures...\n";
+
+    // Header được dò trên từng khối cluster trống liền nhau (~SCAN_WINDOW) đọc bằng 1 lần I/O,
+    // không qua cache chung: quét cả volume sẽ đẩy metadata ra khỏi cache.
+    // Khối trống kế tiếp được đọc trước trên pool I/O trong lúc khối hiện tại được dò
+    const uint32_t probeClusters = max<uint32_t>(1, uint32_t(SCAN_WINDOW / clusterSize));
+    vector<uint8_t> probe((size_t)probeClusters * clusterSize), probeAhead(probe.size());
+    uint32_t probeFirst = 0, probeCount = 0, aheadFirst = 0, aheadCount = 0;
+    future<void> aheadPending;
+    struct WaitPending
+    {
+        future<void> &f;
+        ~WaitPending()
+        {
+            if (f.valid())
+                f.wait(); // probeAhead phải sống tới khi worker ghi xong
+        }
+    } aheadGuard{aheadPending};
+
+    uint32_t c = 2;
+    uint64_t holeAt = 0; // Vùng trước holeAt (tính từ lần hỏi gần nhất) chắc chắn có dữ liệu
+
+    // Số cluster trống liền nhau từ first còn nằm trong vùng chắc chắn có dữ liệu (tối thiểu 1)
+    auto probeLength = [&](uint32_t first) -> uint32_t
+    {
+        uint64_t offset = cluster2Offset(first);
+        uint32_t n = 1;
+        while (n < probeClusters && first + n < endCluster && (FAT[first + n] & 0x0FFFFFFF) == 0 &&
+               offset + (uint64_t)(n + 1) * clusterSize <= holeAt)
+            ++n;
+        return n;
+    };
+    while (c < endCluster && found.size() < maxFiles)
+    {
+        if ((FAT[c] & 0x0FFFFFFF) != 0)
+        {
+            c++;
+            continue;
+        }
+
+        // Cluster nằm trọn trong hole (file thưa / block container chưa cấp phát) chỉ toàn 0,
+        // không thể chứa header -> nhảy tới vùng dữ liệu kế tiếp mà không đọc
+        uint64_t offset = cluster2Offset(c);
+        if (offset >= holeAt)
+        {
+            uint64_t data = device->nextData(offset);
+            if (data >= offset + clusterSize)
+            {
+                uint64_t skip = min<uint64_t>((data - offset) / clusterSize, endCluster - c);
+                Metrics::add(Metrics::BYTES_SKIPPED, skip * clusterSize);
+                c += (uint32_t)skip;
+                continue;
+            }
+            holeAt = device->nextHole(offset);
+        }
+
+        // Chỉ cần đầu cluster để so header
+        if (c < probeFirst || c - probeFirst >= probeCount)
+        {
+            if (aheadPending.valid())
+            {
+                aheadPending.get();
+                if (aheadFirst == c)
+                {
+                    probe.swap(probeAhead);
+                    probeFirst = aheadFirst;
+                    probeCount = aheadCount;
+                }
+            }
+            if (c < probeFirst || c - probeFirst >= probeCount)
+            {
+                probeCount = probeLength(c);
+                readClusterRun(c, probeCount, probe.data());
+                probeFirst = c;
+            }
+
+            // Đọc trước khối trống kế tiếp nếu nó chưa vượt qua vùng dữ liệu đã biết
+            uint32_t k = probeFirst + probeCount;
+            while (k < endCluster && (FAT[k] & 0x0FFFFFFF) != 0)
+                ++k;
+            if (k < endCluster && cluster2Offset(k) + clusterSize <= holeAt)
+            {
+                aheadFirst = k;
+                aheadCount = probeLength(k);
+                aheadPending = readClusterRunAsync(aheadFirst, aheadCount, probeAhead.data());
+            }
+        }
+        const CarveSignature *sig = matchHeader(probe.data() + (size_t)(c - probeFirst) * clusterSize, clusterSize);
+        if (!sig)
+        {
+            c++;
+            continue;
+        }
+
+        // Gom các cluster trống liên tiếp (giả định file không phân mảnh)
+        vector<uint32_t> run;
+        for (uint32_t k = c; k < endCluster && run.size() < maxClusters && (FAT[k] & 0x0FFFFFFF) == 0; ++k)
+            run.push_back(k);
+
+        // Stream qua run, tìm footer (giữ lại vài byte cuối để bắt footer nằm vắt qua 2 khối)
+        ClusterChainReader reader(*this, run, (uint64_t)run.size() * clusterSize);
+        vector<uint8_t> tail;
+        uint64_t consumed = 0;
+        uint64_t carvedSize = 0;
+        const uint8_t *data;
+        size_t size;
+        bool boundary = false;
+        while (carvedSize == 0 && !boundary && reader.next(data, size))
+        {
+            // Cluster toàn 0, hoặc text giữa một file nén, không thể là phần tiếp theo của file:
+            // cắt run tại đó thay vì kéo theo dữ liệu của file khác tới footer kế tiếp
+            size_t limit = size;
+            size_t classified = 0;
+            for (size_t off = consumed == 0 ? clusterSize : 0; off < size; off += clusterSize, ++classified)
+            {
+                ContentClass type = ContentClassifier::profile(data + off, min<size_t>(clusterSize, size - off)).type;
+                if (type == CONTENT_ZERO || (sig->compressed && type == CONTENT_TEXT))
+                {
+                    limit = off;
+                    boundary = true;
+                    break;
+                }
+            }
+            Metrics::add(Metrics::CLUSTERS_CLASSIFIED, classified);
+
+            vector<uint8_t> window(tail);
+            window.insert(window.end(), data, data + limit);
+            uint64_t windowStart = consumed - tail.size();
+
+            auto it = search(window.begin() + min<size_t>(window.size(), tail.empty() ? sig->headerLen : 0), window.end(),
+                             sig->footer, sig->footer + sig->footerLen);
+            if (it != window.end())
+                carvedSize = windowStart + (it - window.begin()) + sig->footerLen + sig->footerExtra;
+
+            consumed += limit;
+            size_t keep = min<size_t>(window.size(), sig->footerLen - 1);
+            tail.assign(window.end() - keep, window.end());
+        }
+        if (carvedSize == 0)
+            carvedSize = consumed; // Không thấy footer -> lấy tới ranh giới nội dung hoặc hết run
+        carvedSize = min<uint64_t>(carvedSize, (uint64_t)run.size() * clusterSize);
+
+        CarvedFile file;
+        file.startCluster = c;
+        file.size = carvedSize;
+        file.type = sig->type;
+
+        // Ghi ra và/hoặc băm để so với hash set trong cùng một lượt đọc
+        if (!outDir.empty() || knownHashes)
+        {
+            ofstream out;
+            if (!outDir.empty())
+            {
+                file.outPath = outDir + "/carve_" + to_string(c) + "." + sig->type;
+                out.open(file.outPath, ios::out | ios::binary | ios::trunc);
+                if (!out.is_open())
+                    throw runtime_error("Cannot create output file: " + file.outPath);
+            }
+
+            ClusterChainReader copy(*this, run, carvedSize);
+            copy.setAsyncReadahead(true);
+            XXHash64 hasher;
+            MD5Hash md5;
+            const bool useMD5 = knownUsesMD5();
+            while (copy.next(data, size))
+            {
+                hasher.update(data, size);
+                if (useMD5)
+                    md5.update(data, size);
+                if (out.is_open())
+                    writeAll(out, data, size);
+            }
+            uint64_t digest = hasher.digest();
+            file.contentHash = digest != 0 ? digest : 1;
+            file.known = isKnownContent(file.contentHash, useMD5 ? md5.key64() : 0);
+            if (file.known && skipKnown && out.is_open())
+            {
+                out.close();
+                filesystem::remove(file.outPath);
+                file.outPath.clear();
+            }
+        }
+
+        cout << "   [+] " << file.type << " at cluster " << c << " (" << carvedSize << " bytes)"
+             << (file.known ? " [known]" : "") << "\n";
+        found.push_back(file);
+
+        // Bỏ qua phần vừa carve
+        c += uint32_t((carvedSize + clusterSize - 1) / clusterSize);
+    }
+
+    cout << "[CARVE] Found " << found.size() << " file(s).\n";
+    return found;
+}
+
+// ======================================================================
+//                       DIRECTORY TREE / CENSUS
+// ======================================================================
+vector<DirNode> FAT32Recovery::scanDirectoryTree() const
+{
+    vector<DirNode> tree;
+    set<uint32_t> visited; // chống vòng lặp khi thư mục hỏng trỏ ngược lên
+
+    queue<size_t> pending;
+    tree.push_back({bootSector.rootCluster, 0, "/"});
+    visited.insert(bootSector.rootCluster);
+    pending.push(0);
+
+    while (!pending.empty())
+    {
+        DirNode node = tree[pending.front()];
+        pending.pop();
+
+        vector<uint32_t> dirChain = followFAT(node.cluster);
+        if (dirChain.empty())
+            dirChain.push_back(node.cluster);
+
+        for (uint32_t dc : dirChain)
+        {
+            ClusterCache::Buffer buf;
+            try
+            {
+                buf = pinCluster(dc);
+            }
+            catch (...)
+            {
+                break;
+            }
+
+            bool endOfDir = false;
+            for (size_t i = 0; i + 32 <= buf->size(); i += 32)
+            {
+                const DirEntry *e = reinterpret_cast<const DirEntry *>(buf->data() + i);
+                if (e->name[0] == 0x00)
+                {
+                    endOfDir = true;
+                    break;
+                }
+                if (e->isDeleted() || e->isLFN() || !e->isdDir() || (e->attr & 0x08))
+                    continue;
+                if (e->name[0] == '.')
+                    continue; // "." và ".."
+
+                uint32_t child = e->getStartCluster();
+                if (child < 2 || child >= totalClusters + 2 || !visited.insert(child).second)
+                    continue;
+
+                string base = node.path == "/" ? "" : node.path;
+                tree.push_back({child, node.cluster, base + "/" + formatShortName(e->name)});
+                pending.push(tree.size() - 1);
+            }
+            if (endOfDir)
+                break;
+        }
+    }
+    return tree;
+}
+
+void FAT32Recovery::buildCensus()
+{
+    dirTree = scanDirectoryTree();
+    census.clear();
+    candidateClaims.clear();
+
+    // Nạp trước cluster đầu của mọi thư mục trong một batch
+    vector<uint32_t> firstClusters;
+    for (const auto &node : dirTree)
+        firstClusters.push_back(node.cluster);
+    try
+    {
+        prefetchClusters(firstClusters);
+    }
+    catch (...)
+    {
+    }
+
+    size_t total = 0;
+    for (const auto &node : dirTree)
+    {
+        vector<DeletedFileInfo> found = analyzeRecoveryCandidates(node.cluster);
+        total += found.size();
+        if (!found.empty())
+            census[node.cluster] = move(found);
+    }
+    cout << "[INFO] Census: " << dirTree.size() << " directories, " << total << " deleted entries.\n";
+}
+
+// ======================================================================
+//                       DELETED TREE PREVIEW
+// ======================================================================
+DeletedTreeView::DeletedTreeView(const FAT32Recovery &volume, size_t maxCachedEntries)
+    : vol(volume), maxEntries(maxCachedEntries), cachedEntries(0)
+{
+}
+
+// Khối có giống một cluster thư mục không: mọi slot trước 0x00 phải có attr hợp lệ
+// và tên không chứa ký tự điều khiển (LFN được bỏ qua vì chứa UTF-16)
+bool DeletedTreeView::looksLikeDirBlock(const vector<uint8_t> &block, bool &terminated)
+{
+    terminated = false;
+    size_t used = 0;
+    for (size_t i = 0; i + 32 <= block.size(); i += 32)
+    {
+        const DirEntry *e = reinterpret_cast<const DirEntry *>(block.data() + i);
+        if (e->name[0] == 0x00)
+        {
+            terminated = true;
+            break;
+        }
+        ++used;
+        if (e->isLFN())
+            continue;
+        if (e->attr & 0xC0)
+            return false;
+        if (e->name[0] < 0x20 && e->name[0] != 0x05)
+            return false;
+        for (int k = 1; k < 11; ++k)
+            if (e->name[k] < 0x20)
+                return false;
+    }
+    return used > 0;
+}
+
+vector<uint32_t> DeletedTreeView::directoryClusters(uint32_t dirStart) const
+{
+    vector<uint32_t> clusters;
+    const uint64_t end = uint64_t(vol.getTotalClusters()) + 2;
+    if (dirStart < 2 || dirStart >= end)
+        return clusters;
+
+    ClusterCache::Buffer buf;
+    try
+    {
+        buf = vol.pinCluster(dirStart);
+    }
+    catch (...)
+    {
+        return clusters;
+    }
+    bool ended = false;
+    if (!looksLikeDirBlock(*buf, ended))
+        return clusters; // cluster đầu đã bị ghi đè bằng dữ liệu khác
+
+    // Chuỗi FAT còn (thư mục sống hoặc FAT chưa bị dọn): dùng luôn
+    if (vol.getFATEntry(dirStart) != 0)
+    {
+        clusters = vol.followFAT(dirStart);
+        if (!clusters.empty())
+            return clusters;
+    }
+
+    // FAT đã về 0: đoán các cluster trống liền sau vẫn còn là khối thư mục
+    clusters.push_back(dirStart);
+    for (uint64_t c = uint64_t(dirStart) + 1; !ended && c < end && clusters.size() < MAX_DIR_GUESS; ++c)
+    {
+        if (vol.getFATEntry(uint32_t(c)) != 0)
+            break; // đã thuộc về file đang sống
+        try
+        {
+            buf = vol.pinCluster(uint32_t(c));
+        }
+        catch (...)
+        {
+            break;
+        }
+        if (!looksLikeDirBlock(*buf, ended) || (*buf)[0] == '.')
+            break; // khối rác hoặc cluster đầu của một thư mục khác
+        clusters.push_back(uint32_t(c));
+    }
+    return clusters;
+}
+
+DeletedTreeView::Listing DeletedTreeView::children(uint32_t dirStart)
+{
+    auto hit = cache.find(dirStart);
+    if (hit != cache.end())
+        return hit->second;
+
+    ScopedPhase timer(Metrics::PHASE_ANALYZE);
+
+    vector<DeletedFileInfo> infos;
+    vector<Entry> entries;
+    bool endOfDir = false;
+    for (uint32_t dc : directoryClusters(dirStart))
+    {
+        ClusterCache::Buffer buf;
+        try
+        {
+            buf = vol.pinCluster(dc);
+        }
+        catch (...)
+        {
+            break;
+        }
+
+        for (size_t i = 0; i + 32 <= buf->size(); i += 32)
+        {
+            const DirEntry *e = reinterpret_cast<const DirEntry *>(buf->data() + i);
+            if (e->name[0] == 0x00)
+            {
+                endOfDir = true;
+                break;
+            }
+            if (e->isLFN() || (e->attr & 0x08) || e->name[0] == '.')
+                continue; // LFN, nhãn volume, "." và ".."
+
+            DeletedFileInfo info;
+            info.entryIndex = int(i / 32);
+            info.name = e->getRecoveryName();
+            info.size = e->fileSize;
+            info.startCluster = e->getStartCluster();
+            info.isDir = e->isdDir();
+            info.lastWriteTime = e->getWriteTimestamp();
+            info.creationTime = e->getCreationTimestamp();
+            info.lastAccessDate = e->lastAccDate;
+            if (e->isDeleted())
+                info.lfnCheck = deletedLfnCheck(buf->data(), i / 32);
+            info.isRecoverable = true;
+            info.statusReason = "Good";
+            infos.push_back(info);
+            entries.push_back({DeletedFileInfo(), dc, e->isDeleted()});
+        }
+        if (endOfDir)
+            break;
+    }
+
+    // Trạng thái khôi phục tính giống analyzeRecoveryCandidates (chỉ đọc FAT)
+    vol.arbitrateCandidates(infos);
+    for (size_t k = 0; k < entries.size(); ++k)
+    {
+        entries[k].info = move(infos[k]);
+        // Entry chưa mang dấu xóa mà chuỗi vẫn được cấp phát: là chính nó chứ không phải bị đè
+        if (!entries[k].deleted && vol.getFATEntry(entries[k].info.startCluster) != 0)
+        {
+            entries[k].info.isRecoverable = true;
+            entries[k].info.statusReason = "In Use";
+        }
+    }
+
+    Listing listing = make_shared<const vector<Entry>>(move(entries));
+    cache[dirStart] = listing;
+    order.push_back(dirStart);
+    cachedEntries += listing->size();
+
+    // Vượt giới hạn: bỏ các thư mục nạp sớm nhất (listing đang được giữ vẫn hợp lệ)
+    while (cachedEntries > maxEntries && order.size() > 1)
+    {
+        auto victim = cache.find(order.front());
+        order.pop_front();
+        cachedEntries -= victim->second->size();
+        cache.erase(victim);
+    }
+    return listing;
+}
+
+// ======================================================================
+//                       CONTENT HASHING / DEDUP
+// ======================================================================
+namespace
+{
+    const uint64_t XXH_P1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t XXH_P2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t XXH_P3 = 0x165667B19E3779F9ULL;
+    const uint64_t XXH_P4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t XXH_P5 = 0x27D4EB2F165667C5ULL;
+
+    inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    inline uint64_t read64(const uint8_t *p)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+
+    inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+    {
+        acc += input * XXH_P2;
+        return rotl64(acc, 31) * XXH_P1;
+    }
+
+    inline uint64_t xxhMerge(uint64_t h, uint64_t acc)
+    {
+        h ^= xxhRound(0, acc);
+        return h * XXH_P1 + XXH_P4;
+    }
+
+    // Tên file an toàn trên host: '?' của entry đã xóa và ký tự cấm đổi thành '_'.
+    // Tên chỉ gồm dấu chấm ("." / "..") cũng bị đổi để không trỏ ra ngoài thư mục đích
+    string hostFileName(const string &name)
+    {
+        string out = name.empty() ? string("_") : name;
+        for (char &c : out)
+            if (c == '?' || c == '/' || c == '\\' || c == ':' || c == '*' || c == '"' ||
+                c == '<' || c == '>' || c == '|' || (unsigned char)c < 0x20)
+                c = '_';
+        if (out.find_first_not_of('.') == string::npos)
+            out.assign(out.size(), '_');
+        return out;
+    }
+}
+
+XXHash64::XXHash64(uint64_t s) : tailSize(0), total(0), seed(s)
+{
+    acc[0] = seed + XXH_P1 + XXH_P2;
+    acc[1] = seed + XXH_P2;
+    acc[2] = seed;
+    acc[3] = seed - XXH_P1;
+}
+
+void XXHash64::update(const void *data, size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    total += size;
+
+    // Ghép nốt stripe dở từ lần gọi trước
+    if (tailSize > 0)
+    {
+        size_t take = min(size, sizeof(tail) - tailSize);
+        memcpy(tail + tailSize, p, take);
+        tailSize += take;
+        p += take;
+        size -= take;
+        if (tailSize < sizeof(tail))
+            return;
+        for (int i = 0; i < 4; ++i)
+            acc[i] = xxhRound(acc[i], read64(tail + i * 8));
+        tailSize = 0;
+    }
+
+    // 4 accumulator độc lập -> CPU chạy song song các phép nhân (ILP)
+    uint64_t v0 = acc[0], v1 = acc[1], v2 = acc[2], v3 = acc[3];
+    for (; size >= 32; p += 32, size -= 32)
+    {
+        v0 = xxhRound(v0, read64(p));
+        v1 = xxhRound(v1, read64(p + 8));
+        v2 = xxhRound(v2, read64(p + 16));
+        v3 = xxhRound(v3, read64(p + 24));
+    }
+    acc[0] = v0;
+    acc[1] = v1;
+    acc[2] = v2;
+    acc[3] = v3;
+
+    memcpy(tail, p, size);
+    tailSize = size;
+}
+
+uint64_t XXHash64::digest() const
+{
+    uint64_t h;
+    if (total >= 32)
+    {
+        h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxhMerge(h, acc[i]);
+    }
+    else
+        h = seed + XXH_P5;
+    h += total;
+
+    const uint8_t *p = tail;
+    size_t left = tailSize;
+    for (; left >= 8; p += 8, left -= 8)
+        h = rotl64(h ^ xxhRound(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (left >= 4)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h = rotl64(h ^ (uint64_t(v) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; ++p, --left)
+        h = rotl64(h ^ (uint64_t(*p) * XXH_P5), 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t XXHash64::hash(const void *data, size_t size, uint64_t seed)
+{
+    XXHash64 h(seed);
+    h.update(data, size);
+    return h.digest();
+}
+
+namespace
+{
+    const uint32_t MD5_K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    const uint8_t MD5_R[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+    inline uint32_t rotl32(uint32_t v, unsigned r) { return (v << r) | (v >> (32 - r)); }
+}
+
+MD5Hash::MD5Hash() : blockSize(0), total(0)
+{
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+}
+
+void MD5Hash::transform(uint32_t st[4], const uint8_t *p)
+{
+    uint32_t m[16];
+    for (int i = 0; i < 16; ++i)
+        m[i] = read_u32_le(p + i * 4);
+
+    uint32_t a = st[0], b = st[1], c = st[2], d = st[3];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t f;
+        int g;
+        if (i < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if (i < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        }
+        else if (i < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        uint32_t t = d;
+        d = c;
+        c = b;
+        b += rotl32(a + f + MD5_K[i] + m[g], MD5_R[i]);
+        a = t;
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+}
+
+void MD5Hash::update(const void *data, size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    total += size;
+
+    if (blockSize > 0)
+    {
+        size_t take = min(size, sizeof(block) - blockSize);
+        memcpy(block + blockSize, p, take);
+        blockSize += take;
+        p += take;
+        size -= take;
+        if (blockSize < sizeof(block))
+            return;
+        transform(state, block);
+        blockSize = 0;
+    }
+    for (; size >= 64; p += 64, size -= 64)
+        transform(state, p);
+    memcpy(block, p, size);
+    blockSize = size;
+}
+
+void MD5Hash::digest(uint8_t out[16]) const
+{
+    // Padding trên bản sao để có thể gọi digest giữa chừng
+    uint32_t st[4] = {state[0], state[1], state[2], state[3]};
+    uint8_t tail[128] = {0};
+    memcpy(tail, block, blockSize);
+    tail[blockSize] = 0x80;
+    size_t tailSize = blockSize < 56 ? 64 : 128;
+    uint64_t bits = total * 8;
+    for (int i = 0; i < 8; ++i)
+        tail[tailSize - 8 + i] = uint8_t(bits >> (8 * i));
+    for (size_t off = 0; off < tailSize; off += 64)
+        transform(st, tail + off);
+    for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j)
+            out[i * 4 + j] = uint8_t(st[i] >> (8 * j));
+}
+
+uint64_t MD5Hash::key64() const
+{
+    uint8_t d[16];
+    digest(d);
+    uint64_t key = 0;
+    for (int i = 0; i < 8; ++i)
+        key = (key << 8) | d[i];
+    return key;
+}
+
+// Đọc chuỗi cluster của ứng viên đúng 1 lần bằng I/O lớn (ClusterChainReader).
+// Hash 0 được dành cho "chưa băm" nên đổi thành 1.
+uint64_t FAT32Recovery::hashCandidate(uint32_t startCluster, uint32_t fileSize, ostream *copyTo,
+                                     uint64_t *md5Key) const
+{
+    ClusterChainReader reader(*this, contiguousRange(startCluster, fileSize), fileSize);
+    reader.setAsyncReadahead(true);
+    XXHash64 h;
+    MD5Hash md5;
+    const uint8_t *data;
+    size_t size;
+    while (reader.next(data, size))
+    {
+        h.update(data, size);
+        if (md5Key)
+            md5.update(data, size);
+        if (copyTo)
+            writeAll(*copyTo, data, size);
+    }
+    Metrics::add(Metrics::BYTES_HASHED, reader.position());
+    if (md5Key)
+        *md5Key = md5.key64();
+
+    uint64_t digest = h.digest();
+    return digest != 0 ? digest : 1;
+}
+
+size_t FAT32Recovery::dedupCensus(unsigned threads)
+{
+    ScopedPhase timer(Metrics::PHASE_HASH);
+
+    // Thứ tự census (dirCluster, entryIndex) cố định -> bản giữ lại luôn là bản xuất hiện đầu tiên
+    struct Candidate
+    {
+        uint32_t dirCluster;
+        DeletedFileInfo *info;
+    };
+    vector<Candidate> all;
+    vector<DeletedFileInfo *> pending; // chưa có hash (index cũ hoặc lần đầu)
+    for (auto &kv : census)
+    {
+        for (auto &f : kv.second)
+        {
+            f.duplicateOfDir = 0;
+            f.duplicateOfEntry = -1;
+            if (f.isDir || !f.isRecoverable || f.size == 0)
+                continue;
+            all.push_back({kv.first, &f});
+            if (f.contentHash == 0)
+                pending.push_back(&f);
+        }
+    }
+
+    // Băm song song: mỗi worker lấy ứng viên kế tiếp, mỗi ứng viên đọc đúng 1 lần
+    uint64_t pendingBytes = 0;
+    for (const DeletedFileInfo *f : pending)
+        pendingBytes += f->size;
+    if (threads == 0)
+        threads = max(1u, thread::hardware_concurrency());
+    unsigned workers = max(1u, min<unsigned>(threads, (unsigned)pending.size()));
+
+    atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < pending.size(); i = next++)
+        {
+            DeletedFileInfo &f = *pending[i];
+            try
+            {
+                f.contentHash = hashCandidate(f.startCluster, f.size);
+            }
+            catch (const exception &e)
+            {
+                FAT32_LOG(LOG_WARN, "candidates that could not be hashed",
+                          "Cannot hash " << f.name << " (cluster " << f.startCluster << "): " << e.what());
+            }
+        }
+    };
+    vector<thread> pool;
+    for (unsigned i = 1; i < workers; ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+
+    // Gom theo (kích thước, hash)
+    map<pair<uint32_t, uint64_t>, Candidate> keepers;
+    size_t duplicates = 0;
+    uint64_t duplicateBytes = 0;
+    for (const Candidate &c : all)
+    {
+        if (c.info->contentHash == 0)
+            continue;
+        auto ins = keepers.emplace(make_pair(c.info->size, c.info->contentHash), c);
+        if (ins.second)
+            continue;
+        c.info->duplicateOfDir = ins.first->second.dirCluster;
+        c.info->duplicateOfEntry = ins.first->second.info->entryIndex;
+        ++duplicates;
+        duplicateBytes += c.info->size;
+    }
+
+    cout << "[INFO] Dedup: " << all.size() << " candidates, " << pending.size() << " hashed now ("
+         << (pendingBytes >> 20) << " MiB, " << workers << " threads), " << duplicates << " duplicates ("
+         << (duplicateBytes >> 20) << " MiB) collapsed into " << keepers.size() << " unique files.\n";
+    return duplicates;
+}
+
+vector<ExportRecord> FAT32Recovery::exportCensus(const string &outDir)
+{
+    ScopedPhase timer(Metrics::PHASE_EXPORT);
+
+    // Đường dẫn trên host dựng lại từng thành phần: tên 8.3 thô có thể chứa '/' hay ".."
+    // nên thành phần lấy theo độ dài path của thư mục cha (cây BFS: cha luôn đứng trước)
+    map<uint32_t, string> dirPaths, rawPaths;
+    for (const auto &node : dirTree)
+    {
+        string raw = node.path == "/" ? "" : node.path;
+        rawPaths[node.cluster] = raw;
+        auto parent = rawPaths.find(node.parentCluster);
+        auto parentHost = dirPaths.find(node.parentCluster);
+        if (raw.empty())
+            dirPaths[node.cluster] = "";
+        else if (parent != rawPaths.end() && parentHost != dirPaths.end() && parent->first != node.cluster &&
+                 raw.size() > parent->second.size() && raw.compare(0, parent->second.size(), parent->second) == 0)
+            dirPaths[node.cluster] = parentHost->second + "/" + hostFileName(raw.substr(parent->second.size() + 1));
+        else
+            dirPaths[node.cluster] = "/" + to_string(node.cluster);
+    }
+
+    vector<ExportRecord> records;
+    set<string> used;
+    uint64_t exportedBytes = 0, skippedBytes = 0;
+    size_t exported = 0, skipped = 0, known = 0;
+    for (auto &kv : census)
+    {
+        auto dp = dirPaths.find(kv.first);
+        string dirPath = outDir + (dp != dirPaths.end() ? dp->second : "/" + to_string(kv.first));
+
+        for (auto &f : kv.second)
+        {
+            if (f.isDir || !f.isRecoverable)
+                continue;
+
+            ExportRecord rec = {kv.first, f.entryIndex, "", f.size, f.contentHash, "exported", false};
+            if (f.duplicateOfEntry >= 0)
+            {
+                rec.status = "duplicate";
+                records.push_back(rec);
+                ++skipped;
+                skippedBytes += f.size;
+                continue;
+            }
+
+            // Đã có hash (dedup): bỏ qua file đã biết mà không cần đọc
+            rec.known = isKnownContent(f.contentHash);
+            if (rec.known && skipKnown)
+            {
+                rec.status = "known";
+                records.push_back(rec);
+                ++known;
+                continue;
+            }
+
+            string path = dirPath + "/" + hostFileName(f.name);
+            if (!used.insert(path).second)
+            {
+                path += "~" + to_string(f.entryIndex);
+                used.insert(path);
+            }
+            rec.outPath = path;
+
+            try
+            {
+                filesystem::create_directories(dirPath);
+                ofstream out(path, ios::out | ios::binary | ios::trunc);
+                if (!out.is_open())
+                    throw runtime_error("Cannot create output file: " + path);
+                // Hash set MD5 không so được bằng hash dedup -> tính key MD5 trong lượt chép
+                uint64_t md5Key = 0;
+                uint64_t h = f.size > 0 ? hashCandidate(f.startCluster, f.size, &out, knownUsesMD5() ? &md5Key : nullptr) : 0;
+                if (f.contentHash == 0)
+                    f.contentHash = h;
+                rec.known = isKnownContent(f.contentHash, md5Key);
+                rec.contentHash = f.contentHash;
+                if (rec.known)
+                    ++known;
+                if (rec.known && skipKnown)
+                {
+                    out.close();
+                    filesystem::remove(path);
+                    rec.outPath.clear();
+                    rec.status = "known";
+                }
+                else
+                {
+                    ++exported;
+                    exportedBytes += f.size;
+                }
+            }
+            catch (const exception &e)
+            {
+                FAT32_LOG(LOG_WARN, "candidates that failed to export", "Cannot export " << path << ": " << e.what());
+                rec.status = "failed";
+            }
+            records.push_back(rec);
+        }
+    }
+
+    cout << "[SUCCESS] Exported " << exported << " files (" << exportedBytes << " bytes) to " << outDir
+         << ", skipped " << skipped << " duplicates (" << skippedBytes << " bytes).\n";
+    if (knownHashes)
+        cout << "[INFO] " << known << " files matched the known-file hash set ("
+             << (skipKnown ? "skipped" : "tagged") << ").\n";
+    return records;
+}
+
+// ======================================================================
+//                       CONTENT CLASSIFIER
+// ======================================================================
+namespace
+{
+    // c*log2(c) cho mọi số đếm tới kích thước cluster thường gặp, tránh gọi log2 cho từng ô
+    const size_t XLOGX_TABLE = 4097;
+
+    const float *xlogxTable()
+    {
+        static const vector<float> table = []
+        {
+            vector<float> t(XLOGX_TABLE, 0.0f);
+            for (size_t c = 2; c < XLOGX_TABLE; ++c)
+                t[c] = float(double(c) * log2(double(c)));
+            return t;
+        }();
+        return table.data();
+    }
+}
+
+ClusterProfile ContentClassifier::profile(const uint8_t *data, size_t size)
+{
+    ClusterProfile p = {0.0f, 0.0f, CONTENT_ZERO};
+    if (size == 0 || isZeroBlock(data, size))
+        return p;
+
+    // 4 histogram xen kẽ: byte liên tiếp (thường giống nhau) tăng vào 4 ô khác nhau
+    uint32_t hist[4][256];
+    memset(hist, 0, sizeof(hist));
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        ++hist[0][w & 0xFF];
+        ++hist[1][(w >> 8) & 0xFF];
+        ++hist[2][(w >> 16) & 0xFF];
+        ++hist[3][(w >> 24) & 0xFF];
+        ++hist[0][(w >> 32) & 0xFF];
+        ++hist[1][(w >> 40) & 0xFF];
+        ++hist[2][(w >> 48) & 0xFF];
+        ++hist[3][w >> 56];
+    }
+    for (; i < size; ++i)
+        ++hist[0][data[i]];
+
+    const float *xlogx = xlogxTable();
+    double sum = 0.0;
+    size_t text = 0, control = 0;
+    for (int b = 0; b < 256; ++b)
+    {
+        uint32_t c = hist[0][b] + hist[1][b] + hist[2][b] + hist[3][b];
+        if (c == 0)
+            continue;
+        sum += c < XLOGX_TABLE ? xlogx[c] : double(c) * log2(double(c));
+        if ((b >= 0x20 && b < 0x7F) || b == '\t' || b == '\n' || b == '\r')
+            text += c;
+        else if (b < 0x20 || b == 0x7F)
+            control += c;
+    }
+
+    double n = double(size);
+    p.entropy = float(log2(n) - sum / n);
+    p.printable = float(text / n);
+
+    // Text: gần như toàn ASCII in được, hoặc UTF-8 (byte >= 0x80) mà không có ký tự điều khiển
+    if (p.printable >= 0.95f || (control == 0 && p.printable >= 0.70f))
+        p.type = CONTENT_TEXT;
+    else if (p.entropy >= 7.2f)
+        p.type = CONTENT_COMPRESSED;
+    else
+        p.type = CONTENT_STRUCTURED;
+    return p;
+}
+
+const char *ContentClassifier::className(ContentClass type)
+{
+    static const char *names[] = {"zero", "text", "compressed", "structured"};
+    return type <= CONTENT_STRUCTURED ? names[type] : "unknown";
+}
+
+vector<ClusterProfile> FAT32Recovery::profileClusters(uint32_t first, uint32_t count, unsigned threads) const
+{
+    const uint32_t clusterSize = getClusterSize();
+    if (clusterSize == 0)
+        throw runtime_error("Volume geometry not initialized.");
+    if (first < 2 || (uint64_t)first + count > (uint64_t)totalClusters + 2)
+        throw runtime_error("Invalid cluster range: " + to_string(first) + "+" + to_string(count));
+
+    // Mỗi việc là một khối ~SCAN_WINDOW đọc bằng 1 lần I/O; kết quả ghi thẳng vào vị trí của nó
+    vector<ClusterProfile> profiles(count);
+    const uint32_t perChunk = max<uint32_t>(1, uint32_t(SCAN_WINDOW / clusterSize));
+    const size_t chunks = (count + (size_t)perChunk - 1) / perChunk;
+
+    if (threads == 0)
+        threads = max(1u, thread::hardware_concurrency());
+    unsigned workers = max(1u, min<unsigned>(threads, (unsigned)chunks));
+
+    atomic<size_t> next(0);
+    mutex errorLock;
+    exception_ptr failure;
+    auto worker = [&]()
+    {
+        vector<uint8_t> buffer((size_t)perChunk * clusterSize);
+        for (size_t k = next++; k < chunks; k = next++)
+        {
+            uint32_t offset = uint32_t(k * perChunk);
+            uint32_t n = min<uint32_t>(perChunk, count - offset);
+            try
+            {
+                readClusterRun(first + offset, n, buffer.data());
+            }
+            catch (...)
+            {
+                // Lỗi đọc đầu tiên được ném lại ở luồng gọi, các luồng khác dừng lấy việc
+                lock_guard<mutex> lk(errorLock);
+                if (!failure)
+                    failure = current_exception();
+                next = chunks;
+                return;
+            }
+            for (uint32_t i = 0; i < n; ++i)
+                profiles[offset + i] = ContentClassifier::profile(buffer.data() + (size_t)i * clusterSize, clusterSize);
+            Metrics::add(Metrics::CLUSTERS_CLASSIFIED, n);
+        }
+    };
+    vector<thread> pool;
+    for (unsigned i = 1; i < workers; ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+    if (failure)
+        rethrow_exception(failure);
+    return profiles;
+}
+
+// ======================================================================
+//                       RECOVERABILITY SCORING
+// ======================================================================
+namespace
+{
+    struct ExtensionMagic
+    {
+        const char *exts; // danh sách đuôi, cách nhau bởi '|'
+        const char *magic;
+        size_t magicLen;
+        bool compressed; // nội dung sau header có entropy cao
+    };
+
+    const ExtensionMagic EXTENSION_MAGIC[] = {
+        {"|JPG|JPEG|JPE|", "\xFF\xD8\xFF", 3, true},
+        {"|PNG|", "\x89PNG\r\n\x1A\n", 8, true},
+        {"|GIF|", "GIF8", 4, true},
+        {"|PDF|", "%PDF-", 5, false},
+        {"|ZIP|DOCX|XLSX|PPTX|ODT|ODS|JAR|APK|EPUB|", "PK\x03\x04", 4, true},
+        {"|7Z|", "7z\xBC\xAF\x27\x1C", 6, true},
+        {"|RAR|", "Rar!\x1A\x07", 6, true},
+        {"|GZ|TGZ|", "\x1F\x8B", 2, true},
+        {"|DOC|XLS|PPT|MSG|", "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1", 8, false},
+        {"|EXE|DLL|SYS|", "MZ", 2, false},
+        {"|BMP|", "BM", 2, false},
+    };
+
+    const char *const TEXT_EXTENSIONS = "|TXT|LOG|CSV|HTM|HTML|XML|JSON|INI|CFG|MD|C|CPP|H|HPP|PY|JS|CSS|BAT|SH|RTF|TEX|";
+
+    string upperExtension(const string &name)
+    {
+        size_t dot = name.find_last_of('.');
+        if (dot == string::npos)
+            return "";
+        string ext = name.substr(dot + 1);
+        for (char &c : ext)
+            c = (char)toupper((unsigned char)c);
+        return ext;
+    }
+
+    bool inList(const char *list, const string &ext)
+    {
+        return !ext.empty() && strstr(list, ("|" + ext + "|").c_str()) != nullptr;
+    }
+
+    double sigmoid(double x)
+    {
+        return 1.0 / (1.0 + exp(-x));
+    }
+}
+
+// Kết hợp các bằng chứng thành log-odds rồi đưa về xác suất. Trọng số chọn sao cho
+// một bằng chứng mạnh (cluster đã bị chiếm, header sai) đủ kéo điểm xuống dưới 0.5.
+float FAT32Recovery::scoreOne(const DeletedFileInfo &f, const DeletedFileInfo *prev, const DeletedFileInfo *next,
+                              unsigned samples, vector<uint8_t> &buffer, uint16_t &flags) const
+{
+    flags = 0;
+    const uint32_t clusterSize = getClusterSize();
+    const uint64_t end = (uint64_t)totalClusters + 2;
+    uint32_t needed = f.isDir ? 1 : (uint32_t)(((uint64_t)f.size + clusterSize - 1) / clusterSize);
+    if (needed == 0)
+        return f.isRecoverable ? 0.5f : 0.0f; // File rỗng: không có dữ liệu để đánh giá
+    if (f.startCluster < 2 || f.startCluster + (uint64_t)needed > end)
+        return 0.0f;
+
+    double logit = 0.5;
+
+    // 1. Tỷ lệ cluster (giả định liên tục) còn trống trong FAT
+    uint32_t freeCount = 0;
+    for (uint32_t i = 0; i < needed; ++i)
+        freeCount += (FAT[f.startCluster + i] & 0x0FFFFFFF) == 0;
+    double freeFrac = double(freeCount) / needed;
+    if (freeCount == needed)
+        logit += 2.0;
+    else
+    {
+        flags |= ScoreEvidence::PARTLY_USED;
+        logit -= 1.0 + 5.0 * (1.0 - freeFrac);
+    }
+    if (f.statusReason.compare(0, 9, "Collision") == 0)
+        logit -= 3.5; // Một file đã xóa khác đòi cùng cluster và mới hơn
+
+    // 2. Checksum LFN
+    if (f.lfnCheck > 0)
+    {
+        flags |= ScoreEvidence::LFN_OK;
+        logit += 1.0;
+    }
+    else if (f.lfnCheck < 0)
+    {
+        flags |= ScoreEvidence::LFN_BAD;
+        logit -= 1.5;
+    }
+
+    // 3. Timestamp: ngày hợp lệ và thứ tự tạo tăng dần theo vị trí entry trong thư mục
+    auto validDate = [](uint32_t stamp)
+    {
+        uint16_t date = uint16_t(stamp >> 16);
+        unsigned m = (date >> 5) & 0x0F, d = date & 0x1F;
+        return date != 0 && m >= 1 && m <= 12 && d >= 1;
+    };
+    bool timeOK = validDate(f.lastWriteTime) && (f.creationTime == 0 || validDate(f.creationTime));
+    if (timeOK && f.creationTime != 0)
+    {
+        if (prev && prev->creationTime != 0 && prev->creationTime > f.creationTime)
+            timeOK = false;
+        if (next && next->creationTime != 0 && next->creationTime < f.creationTime)
+            timeOK = false;
+    }
+    if (timeOK)
+        logit += 0.25;
+    else
+    {
+        flags |= ScoreEvidence::TIME_ORDER;
+        logit -= 0.75;
+    }
+
+    // 4. Cluster mẫu: đầu, cuối rồi rải đều ở giữa
+    vector<uint32_t> picks = {0};
+    if (needed > 1 && samples > 1)
+        picks.push_back(needed - 1);
+    for (unsigned s = 1; s + 1 < samples && picks.size() < needed; ++s)
+        picks.push_back(uint32_t(uint64_t(needed - 1) * s / (samples - 1)));
+    sort(picks.begin(), picks.end());
+    picks.erase(unique(picks.begin(), picks.end()), picks.end());
+
+    string ext = f.isDir ? "" : upperExtension(f.name);
+    const ExtensionMagic *magic = nullptr;
+    for (const auto &m : EXTENSION_MAGIC)
+        if (inList(m.exts, ext))
+            magic = &m;
+    bool textType = inList(TEXT_EXTENSIONS, ext);
+
+    buffer.resize(clusterSize);
+    unsigned zeroSamples = 0;
+    for (uint32_t pick : picks)
+    {
+        uint32_t cluster = f.startCluster + pick;
+        if (readBytes(cluster2Offset(cluster), buffer.data(), clusterSize) != (ssize_t)clusterSize)
+        {
+            flags |= ScoreEvidence::READ_ERROR;
+            logit -= 1.0;
+            continue;
+        }
+        clusterCache.overlayDirty(cluster, 1, clusterSize, buffer.data());
+        Metrics::add(Metrics::CLUSTERS_SAMPLED, 1);
+
+        size_t valid = clusterSize;
+        if (!f.isDir && pick == needed - 1 && f.size % clusterSize)
+            valid = f.size % clusterSize; // Bỏ phần slack sau cuối file
+
+        if (pick == 0)
+        {
+            if (f.isDir)
+            {
+                // Cluster đầu của thư mục luôn mở bằng entry "." có cờ thư mục
+                const DirEntry *dot = reinterpret_cast<const DirEntry *>(buffer.data());
+                bool isDirBlock = memcmp(dot->name, ".          ", 11) == 0 && dot->isdDir();
+                if (!isDirBlock)
+                    flags |= ScoreEvidence::NOT_DIRECTORY;
+                logit += isDirBlock ? 2.5 : -3.0;
+                continue;
+            }
+            if (magic)
+            {
+                bool match = valid >= magic->magicLen && memcmp(buffer.data(), magic->magic, magic->magicLen) == 0;
+                flags |= match ? ScoreEvidence::SIGNATURE_MATCH : ScoreEvidence::SIGNATURE_MISMATCH;
+                logit += match ? 2.5 : -3.0;
+            }
+        }
+
+        ClusterProfile profile = ContentClassifier::profile(buffer.data(), valid);
+        if (profile.type == CONTENT_ZERO)
+        {
+            if (valid >= 512) // Đuôi quá ngắn toàn 0 vẫn có thể là dữ liệu thật
+                ++zeroSamples;
+            continue;
+        }
+        // Header của file nén có thể có entropy thấp nên chỉ xét từ cluster thứ hai
+        bool mismatch = (textType && profile.type != CONTENT_TEXT) ||
+                        (magic && magic->compressed && pick != 0 && valid >= 512 && profile.type != CONTENT_COMPRESSED);
+        if (mismatch)
+        {
+            flags |= ScoreEvidence::TYPE_MISMATCH;
+            logit -= 3.0 / picks.size();
+        }
+    }
+    if (zeroSamples)
+    {
+        flags |= ScoreEvidence::ZERO_DATA;
+        logit -= 4.0 * zeroSamples / picks.size(); // Đã bị xóa trắng (TRIM / wipe)
+    }
+
+    return (float)sigmoid(logit);
+}
+
+void FAT32Recovery::scoreCandidates(vector<DeletedFileInfo> &candidates, unsigned samples) const
+{
+    ScopedPhase timer(Metrics::PHASE_SCORE);
+
+    vector<uint8_t> buffer;
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        DeletedFileInfo &f = candidates[i];
+        const DeletedFileInfo *prev = i > 0 ? &candidates[i - 1] : nullptr;
+        const DeletedFileInfo *next = i + 1 < candidates.size() ? &candidates[i + 1] : nullptr;
+        f.score = scoreOne(f, prev, next, samples, buffer, f.scoreFlags);
+    }
+}
+
+size_t FAT32Recovery::scoreCensus(unsigned threads, unsigned samples)
+{
+    ScopedPhase timer(Metrics::PHASE_SCORE);
+
+    // Mỗi việc = một entry; lân cận lấy trong cùng thư mục (census giữ thứ tự entryIndex)
+    struct Job
+    {
+        vector<DeletedFileInfo> *dir;
+        size_t index;
+    };
+    vector<Job> jobs;
+    for (auto &kv : census)
+        for (size_t i = 0; i < kv.second.size(); ++i)
+            jobs.push_back({&kv.second, i});
+
+    if (threads == 0)
+        threads = max(1u, thread::hardware_concurrency());
+    unsigned workers = max(1u, min<unsigned>(threads, (unsigned)jobs.size()));
+
+    atomic<size_t> next(0);
+    atomic<size_t> good(0);
+    auto worker = [&]()
+    {
+        vector<uint8_t> buffer;
+        for (size_t i = next++; i < jobs.size(); i = next++)
+        {
+            vector<DeletedFileInfo> &dir = *jobs[i].dir;
+            size_t k = jobs[i].index;
+            DeletedFileInfo &f = dir[k];
+            try
+            {
+                f.score = scoreOne(f, k > 0 ? &dir[k - 1] : nullptr, k + 1 < dir.size() ? &dir[k + 1] : nullptr,
+                                   samples, buffer, f.scoreFlags);
+            }
+            catch (const exception &e)
+            {
+                f.score = 0.0f;
+                f.scoreFlags = ScoreEvidence::READ_ERROR;
+                FAT32_LOG(LOG_WARN, "candidates that could not be scored",
+                          "Cannot score " << f.name << " (cluster " << f.startCluster << "): " << e.what());
+            }
+            if (f.score >= 0.5f)
+                ++good;
+        }
+    };
+    vector<thread> pool;
+    for (unsigned i = 1; i < workers; ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+
+    cout << "[INFO] Scoring: " << jobs.size() << " candidates (" << workers << " threads, up to " << samples
+         << " sampled clusters each), " << good.load() << " likely recoverable.\n";
+    return jobs.size();
+}
+
+vector<pair<uint32_t, const DeletedFileInfo *>> FAT32Recovery::topCandidates(size_t k) const
+{
+    vector<pair<uint32_t, const DeletedFileInfo *>> ranked;
+    for (const auto &kv : census)
+        for (const auto &f : kv.second)
+            if (f.score >= 0.0f)
+                ranked.emplace_back(kv.first, &f);
+
+    // Cùng điểm: giữ thứ tự census để kết quả ổn định
+    auto better = [](const pair<uint32_t, const DeletedFileInfo *> &a, const pair<uint32_t, const DeletedFileInfo *> &b)
+    {
+        if (a.second->score != b.second->score)
+            return a.second->score > b.second->score;
+        if (a.first != b.first)
+            return a.first < b.first;
+        return a.second->entryIndex < b.second->entryIndex;
+    };
+    if (k == 0 || k >= ranked.size())
+        sort(ranked.begin(), ranked.end(), better);
+    else
+    {
+        partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), better);
+        ranked.resize(k);
+    }
+    return ranked;
+}
+
+// ======================================================================
+//                       KNOWN-FILE HASH SET
+// ======================================================================
+namespace
+{
+    const char HASHSET_MAGIC[8] = {'F', '3', '2', 'H', 'S', 'E', 'T', 0};
+    const uint32_t HASHSET_VERSION = 1;
+
+#pragma pack(push, 1)
+    struct HashSetHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t bloomHashes;
+        uint64_t count;
+        uint64_t bloomBits;
+        uint64_t bloomOffset;
+        uint64_t keysOffset;
+        uint32_t digest; // KnownHashSet::Digest; file cũ để 0 = xxHash64
+        uint32_t reserved0;
+        uint64_t reserved1;
+    };
+#pragma pack(pop)
+
+    // Double hashing cho Bloom: hash nội dung đã phân bố đều, chỉ cần bước lẻ lấy từ nửa cao
+    inline uint64_t bloomStep(uint64_t key) { return ((key >> 32) | (key << 32)) | 1; }
+}
+
+KnownHashSet::KnownHashSet()
+    : base(nullptr), baseSize(0), mapped(false), bloom(nullptr), bloomBits(0), bloomHashes(0),
+      keys(nullptr), count(0), digestKind(DIGEST_XXH64), lookups(0), bloomRejects(0), matches(0)
+{
+}
+
+KnownHashSet::~KnownHashSet()
+{
+    close();
+}
+
+bool KnownHashSet::build(vector<uint64_t> hashes, const string &path, size_t bloomBudget, Digest digest)
+{
+    sort(hashes.begin(), hashes.end());
+    hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+    uint64_t n = hashes.size();
+
+    // ~16 bit mỗi hash nếu ngân sách cho phép (dương tính giả < 0.1%), làm tròn xuống lũy thừa 2
+    uint64_t want = min<uint64_t>(max<uint64_t>(64, n * 16), max<uint64_t>(64, uint64_t(bloomBudget) * 8));
+    uint64_t bits = 64;
+    while (bits * 2 <= want)
+        bits *= 2;
+    uint32_t k = (uint32_t)max(1.0, min(16.0, double(bits) / double(max<uint64_t>(n, 1)) * 0.693 + 0.5));
+
+    vector<uint64_t> filter(bits / 64, 0);
+    for (uint64_t h : hashes)
+    {
+        uint64_t step = bloomStep(h);
+        for (uint32_t i = 0; i < k; ++i)
+        {
+            uint64_t pos = (h + i * step) & (bits - 1);
+            filter[pos >> 6] |= 1ULL << (pos & 63);
+        }
+    }
+
+    HashSetHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HASHSET_MAGIC, sizeof(hdr.magic));
+    hdr.version = HASHSET_VERSION;
+    hdr.bloomHashes = k;
+    hdr.count = n;
+    hdr.bloomBits = bits;
+    hdr.bloomOffset = sizeof(HashSetHeader);
+    hdr.keysOffset = hdr.bloomOffset + bits / 8;
+    hdr.digest = digest;
+
+    // Ghi ra file tạm rồi rename để không bao giờ để lại hash set dở dang
+    string tmpPath = path + ".tmp";
+    {
+        ofstream out(tmpPath, ios::out | ios::binary | ios::trunc);
+        if (!out.is_open())
+            return false;
+        out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        out.write(reinterpret_cast<const char *>(filter.data()), filter.size() * sizeof(uint64_t));
+        out.write(reinterpret_cast<const char *>(hashes.data()), hashes.size() * sizeof(uint64_t));
+        if (!out)
+            return false;
+    }
+    error_code ec;
+    filesystem::rename(tmpPath, path, ec);
+    if (ec)
+        return false;
+
+    cout << "[INFO] Hash set saved: " << path << " (" << n << (digest == DIGEST_MD5 ? " MD5" : " xxHash64")
+         << " hashes, Bloom " << (bits >> 13) << " KiB, k=" << k << ")\n";
+    return true;
+}
+
+bool KnownHashSet::open(const string &path)
+{
+    close();
+    auto started = chrono::steady_clock::now();
+
+#if !defined(_WIN32)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(HashSetHeader))
+        {
+            void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                base = static_cast<const uint8_t *>(p);
+                baseSize = (size_t)st.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+    }
+#endif
+    if (!mapped)
+    {
+        // Không mmap được: đọc cả file (layout phẳng, dùng y như vùng mmap)
+        ifstream in(path, ios::in | ios::binary);
+        if (!in.is_open())
+            return false;
+        owned.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        base = owned.data();
+        baseSize = owned.size();
+    }
+
+    HashSetHeader h;
+    if (baseSize < sizeof(h))
+    {
+        close();
+        return false;
+    }
+    memcpy(&h, base, sizeof(h));
+    bool ok = memcmp(h.magic, HASHSET_MAGIC, sizeof(h.magic)) == 0 && h.version == HASHSET_VERSION &&
+              h.bloomBits >= 64 && (h.bloomBits & (h.bloomBits - 1)) == 0 && h.bloomHashes >= 1 &&
+              h.bloomOffset % 8 == 0 && h.keysOffset % 8 == 0 &&
+              h.bloomOffset + h.bloomBits / 8 <= h.keysOffset &&
+              h.keysOffset <= baseSize && h.count <= (baseSize - h.keysOffset) / 8 &&
+              h.digest <= DIGEST_MD5;
+    if (!ok)
+    {
+        cout << "[WARN] " << path << " is not a valid hash set file.\n";
+        close();
+        return false;
+    }
+
+    bloom = reinterpret_cast<const uint64_t *>(base + h.bloomOffset);
+    bloomBits = h.bloomBits;
+    bloomHashes = h.bloomHashes;
+    keys = reinterpret_cast<const uint64_t *>(base + h.keysOffset);
+    count = h.count;
+    digestKind = (Digest)h.digest;
+
+#if !defined(_WIN32)
+    if (mapped)
+    {
+        // Bloom luôn được chạm tới: nạp trước; mảng hash chỉ vài trang mỗi lần tìm
+        madvise(const_cast<uint8_t *>(base), h.keysOffset, MADV_WILLNEED);
+        madvise(const_cast<uint8_t *>(base + h.keysOffset), baseSize - h.keysOffset, MADV_RANDOM);
+    }
+#endif
+
+    auto ms = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count() / 1000.0;
+    cout << "[INFO] Known-file hash set: " << count << (digestKind == DIGEST_MD5 ? " MD5" : " xxHash64")
+         << " hashes, Bloom " << (bloomBits >> 13) << " KiB (k="
+         << bloomHashes << "), " << (mapped ? "mapped" : "loaded") << " in " << ms << " ms.\n";
+    return true;
+}
+
+void KnownHashSet::close()
+{
+#if !defined(_WIN32)
+    if (mapped && base)
+        munmap(const_cast<uint8_t *>(base), baseSize);
+#endif
+    owned.clear();
+    owned.shrink_to_fit();
+    base = nullptr;
+    baseSize = 0;
+    mapped = false;
+    bloom = nullptr;
+    keys = nullptr;
+    count = 0;
+    digestKind = DIGEST_XXH64;
+}
+
+bool KnownHashSet::contains(uint64_t hash) const
+{
+    if (!keys)
+        return false;
+    lookups.fetch_add(1, memory_order_relaxed);
+
+    uint64_t step = bloomStep(hash);
+    for (uint32_t i = 0; i < bloomHashes; ++i)
+    {
+        uint64_t pos = (hash + i * step) & (bloomBits - 1);
+        if (((bloom[pos >> 6] >> (pos & 63)) & 1) == 0)
+        {
+            bloomRejects.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+    }
+
+    bool hit = binary_search(keys, keys + count, hash);
+    if (hit)
+        matches.fetch_add(1, memory_order_relaxed);
+    return hit;
+}
+
+KnownHashSet::Stats KnownHashSet::getStats() const
+{
+    return {lookups.load(memory_order_relaxed), bloomRejects.load(memory_order_relaxed),
+            matches.load(memory_order_relaxed)};
+}
+
+void FAT32Recovery::setKnownHashes(const KnownHashSet *set, bool skipMatches)
+{
+    knownHashes = set && set->isOpen() ? set : nullptr;
+    skipKnown = skipMatches;
+}
+
+bool FAT32Recovery::isKnownContent(uint64_t contentHash, uint64_t md5Key) const
+{
+    if (!knownHashes)
+        return false;
+    uint64_t key = knownUsesMD5() ? md5Key : contentHash;
+    return key != 0 && knownHashes->contains(key);
+}
+
+bool FAT32Recovery::knownUsesMD5() const
+{
+    return knownHashes && knownHashes->digest() == KnownHashSet::DIGEST_MD5;
+}
+
+// ======================================================================
+//                       ORPHAN CHAINS / LOST.DIR
+// ======================================================================
+namespace
+{
+    // Bitmap 1 bit / cluster: 100M cluster chỉ tốn ~12 MB
+    struct ClusterBitmap
+    {
+        vector<uint64_t> words;
+        explicit ClusterBitmap(uint64_t n) : words((n + 63) / 64, 0) {}
+        bool test(uint32_t c) const { return (words[c >> 6] >> (c & 63)) & 1; }
+        void set(uint32_t c) { words[c >> 6] |= 1ULL << (c & 63); }
+    };
+
+    const uint8_t LOST_DIR_NAME[11] = {'L', 'O', 'S', 'T', ' ', ' ', ' ', ' ', 'D', 'I', 'R'};
+
+    bool isDotEntry(const DirEntry *e, bool dotdot)
+    {
+        static const char DOT[] = ".          ";
+        static const char DOTDOT[] = "..         ";
+        return (e->attr & 0x10) && memcmp(e->name, dotdot ? DOTDOT : DOT, 11) == 0;
+    }
+
+    // Entry thư mục mới với thời điểm hiện tại (định dạng DOS)
+    DirEntry makeDirEntry(const char name[11], uint8_t attr, uint32_t start, uint32_t size)
+    {
+        DirEntry e;
+        memset(&e, 0, sizeof(e));
+        memcpy(e.name, name, 11);
+        e.attr = attr;
+        e.firstClusterHigh = uint16_t(start >> 16);
+        e.firstClusterLow = uint16_t(start & 0xFFFF);
+        e.fileSize = size;
+
+        time_t now = time(nullptr);
+        tm t = *localtime(&now);
+        uint16_t date = uint16_t(((max(t.tm_year + 1900, 1980) - 1980) << 9) | ((t.tm_mon + 1) << 5) | t.tm_mday);
+        uint16_t tim = uint16_t((t.tm_hour << 11) | (t.tm_min << 5) | (t.tm_sec / 2));
+        e.crtDate = e.date = e.lastAccDate = date;
+        e.crtTime = e.time = tim;
+        return e;
+    }
+}
+
+// Tìm chuỗi mồ côi bằng 3 lượt tuyến tính:
+//  1. Đánh dấu mọi cluster đi tới được từ root (listLiveEntries, mỗi cluster 1 lần)
+//  2. Quét FAT 1 lượt: cluster đã cấp phát, chưa đánh dấu và không có entry FAT nào trỏ tới là đầu chuỗi
+//     (lượt bổ sung bắt các vòng lặp không có đầu)
+//  3. Đọc cluster đầu của các chuỗi (batch) để nhận ra thư mục qua '.'/'..'
+vector<OrphanChain> FAT32Recovery::findOrphanChains() const
+{
+    ScopedPhase timer(Metrics::PHASE_SCAN);
+
+    vector<OrphanChain> orphans;
+    const uint64_t end = min<uint64_t>(FAT.size(), (uint64_t)totalClusters + 2);
+    if (end <= 2)
+        return orphans;
+
+    auto isLink = [&](uint32_t v)
+    { return v >= 2 && v < end; };
+    auto isAllocated = [&](uint32_t c)
+    { return FAT[c] != 0 && FAT[c] != 0x0FFFFFF7; };
+
+    ClusterBitmap seen(end);
+    // Đánh dấu cả chuỗi; dừng ở cluster đã thấy (cross-link / vòng lặp) nên tổng chi phí là O(số cluster)
+    auto markChain = [&](uint32_t c) -> uint32_t
+    {
+        uint32_t n = 0;
+        while (isLink(c) && !seen.test(c))
+        {
+            seen.set(c);
+            ++n;
+            c = FAT[c];
+        }
+        return n;
+    };
+    // Các cluster của một thư mục (theo FAT, chặn vòng lặp bằng số bước)
+    auto dirClusters = [&](uint32_t first)
+    {
+        vector<uint32_t> chain;
+        for (uint32_t c = first; isLink(c) && chain.size() < end; c = FAT[c])
+        {
+            chain.push_back(c);
+            if (FAT[c] == 0)
+                break;
+        }
+        return chain;
+    };
+
+    // 1. Cây thư mục còn sống (mỗi cluster chỉ đánh dấu 1 lần)
+    markChain(bootSector.rootCluster);
+    for (const LiveEntry &e : listLiveEntries())
+        markChain(e.startCluster);
+
+    // 2. Đầu chuỗi: đã cấp phát, không đi tới được từ root, không có entry FAT nào trỏ tới
+    ClusterBitmap hasPred(end);
+    for (uint64_t c = 2; c < end; ++c)
+    {
+        if (isLink(FAT[c]))
+            hasPred.set(FAT[c]);
+    }
+    for (uint64_t c = 2; c < end; ++c)
+    {
+        if (!seen.test(uint32_t(c)) && isAllocated(uint32_t(c)) && !hasPred.test(uint32_t(c)))
+            orphans.push_back({uint32_t(c), 0, false, 0, false, ""});
+    }
+    for (auto &o : orphans)
+        o.clusters = markChain(o.head);
+
+    // Vòng lặp khép kín không có đầu: lấy cluster nhỏ nhất còn sót làm đầu
+    for (uint64_t c = 2; c < end; ++c)
+    {
+        if (!seen.test(uint32_t(c)) && isAllocated(uint32_t(c)))
+        {
+            OrphanChain o{uint32_t(c), 0, false, 0, false, ""};
+            o.clusters = markChain(o.head);
+            orphans.push_back(o);
+        }
+    }
+    if (orphans.empty())
+    {
+        cout << "[SCAN] No orphan chains found.\n";
+        return orphans;
+    }
+
+    // 3. Nhận diện thư mục: '.' phải trỏ chính nó, '..' ngay sau
+    vector<uint32_t> heads;
+    heads.reserve(orphans.size());
+    for (const auto &o : orphans)
+        heads.push_back(o.head);
+    vector<size_t> order(orphans.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    sort(order.begin(), order.end(), [&](size_t a, size_t b)
+         { return heads[a] < heads[b]; });
+    vector<uint32_t> sortedHeads;
+    for (size_t i : order)
+        sortedHeads.push_back(heads[i]);
+    auto orphanAt = [&](uint32_t cluster) -> long
+    {
+        auto it = lower_bound(sortedHeads.begin(), sortedHeads.end(), cluster);
+        return (it != sortedHeads.end() && *it == cluster) ? (long)order[it - sortedHeads.begin()] : -1;
+    };
+
+    vector<uint8_t> dirFlag(orphans.size(), 0);
+    vector<uint32_t> parent(orphans.size(), 0);
+    try
+    {
+        readClustersAsync(heads, [&](uint32_t cluster, const ClusterCache::Buffer &data)
+                          {
+            long idx = orphanAt(cluster);
+            if (idx < 0 || !data || data->size() < 64)
+                return;
+            const DirEntry *dot = reinterpret_cast<const DirEntry *>(data->data());
+            const DirEntry *dotdot = dot + 1;
+            if (isDotEntry(dot, false) && dot->getStartCluster() == cluster && isDotEntry(dotdot, true))
+            {
+                dirFlag[idx] = 1;
+                parent[idx] = dotdot->getStartCluster();
+            } })
+            .get();
+    }
+    catch (...)
+    {
+    }
+    for (size_t i = 0; i < orphans.size(); ++i)
+    {
+        orphans[i].isDir = dirFlag[i] != 0;
+        orphans[i].parentCluster = parent[i];
+    }
+
+    // Entry con của thư mục mồ côi: chuỗi được liệt kê sẽ đi theo thư mục cha, không graft riêng
+    for (const auto &o : orphans)
+    {
+        if (!o.isDir)
+            continue;
+        for (uint32_t dc : dirClusters(o.head))
+        {
+            ClusterCache::Buffer buf;
+            try
+            {
+                buf = pinCluster(dc);
+            }
+            catch (...)
+            {
+                break;
+            }
+            for (size_t i = 0; i + 32 <= buf->size(); i += 32)
+            {
+                const DirEntry *e = reinterpret_cast<const DirEntry *>(buf->data() + i);
+                if (e->name[0] == 0x00)
+                    break;
+                if (e->isDeleted() || e->isLFN() || (e->attr & 0x08) || e->name[0] == '.')
+                    continue;
+                long child = orphanAt(e->getStartCluster());
+                if (child >= 0 && orphans[child].head != o.head)
+                    orphans[child].nested = true;
             }
         }
     }
 
-    if (!isFATValid)
+    size_t dirs = 0, nested = 0;
+    for (const auto &o : orphans)
     {
-        throw runtime_error("Critical Error: Both FAT tables are corrupted.");
+        dirs += o.isDir;
+        nested += o.nested;
     }
+    cout << "[SCAN] Found " << orphans.size() << " orphan chains (" << dirs << " directories, "
+         << nested << " listed inside other orphan directories).\n";
+    return orphans;
+}
 
-    // 3. Xử lý các FAT entry
-    // Mỗi entry FAT32 là 4 bytes.
-    uint32_t numEntries = fatSizeBytes / sizeof(uint32_t);
-    FAT.reserve(numEntries); // Đặt trước kích thước để tối ưu hiệu suất
+// Cluster trống đầu tiên từ gợi ý next-free (vòng lại từ cluster 2) mà không ứng viên khôi phục
+// được nào trong census nhận (cùng giả định liên tục với arbitrateCandidates). Chưa đánh dấu FAT.
+// 0 = không còn cluster trống nào an toàn để dùng.
+uint32_t FAT32Recovery::findUnclaimedFreeCluster()
+{
+    const uint64_t end = min<uint64_t>(FAT.size(), (uint64_t)totalClusters + 2);
+    if (end <= 2)
+        return 0;
 
-    for (uint32_t i = 0; i < numEntries; ++i)
+    if (candidateClaims.empty())
     {
-        // Con trỏ tới vị trí 4-byte của entry hiện tại
-        const uint8_t *entryPtr = fatBuffer.data() + i * sizeof(uint32_t);
-
-        // Đọc giá trị 32-bit (4 bytes) theo kiểu Little Endian
-        uint32_t entry = read_u32_le(entryPtr);
+        ClusterBitmap claims(end);
+        const uint32_t clusterSize = getClusterSize();
+        for (const auto &kv : census)
+        {
+            for (const DeletedFileInfo &f : kv.second)
+            {
+                if (!f.isRecoverable)
+                    continue;
+                uint64_t needed = f.isDir ? 1 : ((uint64_t)f.size + clusterSize - 1) / clusterSize;
+                for (uint64_t c = max<uint64_t>(f.startCluster, 2); c < (uint64_t)f.startCluster + needed && c < end; ++c)
+                    claims.set(uint32_t(c));
+            }
+        }
+        candidateClaims = move(claims.words);
+    }
 
-        // *Chú ý quan trọng:* FAT32 chỉ sử dụng 28 bit thấp (0x0FFFFFFF).
-        // 4 bit cao nhất (MSBs) phải được che đi (masked out) vì chúng thường được dùng làm bit lỗi hoặc reserved.
-        FAT.push_back(entry & 0x0FFFFFFF);
+    auto claimed = [&](uint64_t c)
+    { return (candidateClaims[c >> 6] >> (c & 63)) & 1; };
+    const uint64_t from = (nextFreeHint >= 2 && nextFreeHint < end) ? nextFreeHint : 2;
+    for (uint64_t n = 0, c = from; n < end - 2; ++n, c = c + 1 < end ? c + 1 : 2)
+    {
+        if ((FAT[c] & 0x0FFFFFFF) == 0 && !claimed(c))
+            return uint32_t(c);
     }
+    return 0;
+}
 
-    cout << "[INFO] Loaded FAT table successfully. Total entries (clusters): " << dec << FAT.size() << "\n";
-    cout << "       FAT[0] (Media Type): 0x" << hex << FAT[0] << "\n";
-    cout << "       FAT[1] (EOC Marker): 0x" << hex << FAT[1] << dec << "\n";
+// Cấp 1 cluster trống không thuộc ứng viên khôi phục nào, ghi 0 và đánh dấu EOC; 0 = hết chỗ
+uint32_t FAT32Recovery::allocateCluster()
+{
+    uint32_t c = findUnclaimedFreeCluster();
+    if (c == 0)
+        return 0;
+    setFATEntry(c, 0x0FFFFFFF);
+    writeCluster(c, vector<uint8_t>(getClusterSize(), 0));
+    return c;
+}
 
-    // Dọn dẹp: Đảm bảo luồng cout không bị ảnh hưởng bởi hex/dec
-    cout << dec;
-    cout << "[SCAN] Checking directory and FAT structures\n";
-    scanAndAutoRepair(bootSector.rootCluster, true);
-    cout << "================================================================\n\n";
+// Thêm entry vào thư mục. Chỉ dùng slot 0x00 (sau entry cuối): slot 0xE5 có thể là
+// file đã xóa còn cần khôi phục. Thư mục đầy thì nối thêm 1 cluster vào chuỗi.
+bool FAT32Recovery::appendDirEntry(uint32_t dirCluster, const DirEntry &entry)
+{
+    const uint64_t end = (uint64_t)totalClusters + 2;
+    vector<uint8_t> buf;
+    uint32_t last = dirCluster;
+    uint64_t steps = 0;
+    for (uint32_t c = dirCluster; c >= 2 && c < end && steps++ < end; c = FAT[c])
+    {
+        readCluster(c, buf);
+        for (size_t off = 0; off + 32 <= buf.size(); off += 32)
+        {
+            if (buf[off] != 0x00)
+                continue;
+            memcpy(buf.data() + off, &entry, sizeof(entry));
+            writeCluster(c, buf);
+            return true;
+        }
+        last = c;
+    }
+
+    uint32_t fresh = allocateCluster();
+    if (fresh == 0)
+        return false;
+    setFATEntry(last, fresh);
+    buf.assign(getClusterSize(), 0);
+    memcpy(buf.data(), &entry, sizeof(entry));
+    writeCluster(fresh, buf);
+    return true;
 }
 
-void FAT32Recovery::writeFAT()
+// Graft các chuỗi mồ côi (không nested) vào /LOST.DIR: file -> FILEnnnn.CHK, thư mục -> DIRnnnn.
+// Thư mục mồ côi có '..' trỏ tới một thư mục mồ côi khác được gắn lại dưới thư mục đó,
+// còn lại gắn dưới LOST.DIR (và sửa '..'). Trả về số entry đã thêm.
+size_t FAT32Recovery::graftOrphans(vector<OrphanChain> &orphans)
 {
-    // số byte của mỗi bản sao FAT trên đĩa
-    const uint64_t bytesPerSector = bootSector.bytesPerSector;
-    const uint64_t sectorsPerFAT = bootSector.sectorsPerFat;
-    const uint64_t bytesPerFAT = sectorsPerFAT * bytesPerSector;
+    ScopedPhase timer(Metrics::PHASE_RESTORE);
 
-    // Mỗi mục nhập FAT là 4 byte
-    // Chuẩn bị một bộ đệm tạm thời để ghi một bản sao FAT
-    vector<uint8_t> buf(bytesPerFAT);
-    // Xóa bộ đệm (đặt về 0)
-    fill(buf.begin(), buf.end(), 0);
+    const uint32_t root = bootSector.rootCluster;
+    const uint64_t clusterSize = getClusterSize();
+    const uint64_t end = (uint64_t)totalClusters + 2;
 
-    // Đóng gói vector FAT vào bộ đệm (little-endian 32-bit)
-    size_t maxEntries = bytesPerFAT / 4;
-    size_t entriesToWrite = min(maxEntries, FAT.size());
-    for (size_t i = 0; i < entriesToWrite; ++i)
+    // Tên 8.3 đang có trong một thư mục (để đánh số không trùng)
+    map<uint32_t, set<string>> namesIn;
+    auto loadNames = [&](uint32_t dir) -> set<string> &
     {
-        uint32_t v = FAT[i] & 0x0FFFFFFF; // 28-bit hợp lệ
-        size_t off = i * 4;
-        buf[off + 0] = uint8_t(v & 0xFF);
-        buf[off + 1] = uint8_t((v >> 8) & 0xFF);
-        buf[off + 2] = uint8_t((v >> 16) & 0xFF);
-        buf[off + 3] = uint8_t((v >> 24) & 0xFF);
-    }
+        auto it = namesIn.find(dir);
+        if (it != namesIn.end())
+            return it->second;
+        set<string> &names = namesIn[dir];
+        vector<uint8_t> buf;
+        uint64_t steps = 0;
+        for (uint32_t c = dir; c >= 2 && c < end && steps++ < end; c = FAT[c])
+        {
+            readCluster(c, buf);
+            for (size_t off = 0; off + 32 <= buf.size() && buf[off] != 0x00; off += 32)
+                names.insert(string(reinterpret_cast<const char *>(buf.data() + off), 11));
+        }
+        return names;
+    };
 
-    // Ghi từng bản sao FAT
-    for (uint8_t fatIndex = 0; fatIndex < bootSector.numFATs; ++fatIndex)
+    // 1. LOST.DIR ở thư mục gốc: dùng lại nếu đã có, nếu không thì tạo mới
+    uint32_t lostDir = 0;
+    {
+        vector<uint8_t> buf;
+        uint64_t steps = 0;
+        for (uint32_t c = root; c >= 2 && c < end && steps++ < end && lostDir == 0; c = FAT[c])
+        {
+            readCluster(c, buf);
+            for (size_t off = 0; off + 32 <= buf.size() && buf[off] != 0x00; off += 32)
+            {
+                const DirEntry *e = reinterpret_cast<const DirEntry *>(buf.data() + off);
+                if (!e->isDeleted() && e->isdDir() && memcmp(e->name, LOST_DIR_NAME, 11) == 0)
+                {
+                    lostDir = e->getStartCluster();
+                    break;
+                }
+            }
+        }
+    }
+    if (lostDir == 0)
     {
-        uint64_t fatOffset = fatBegin + uint64_t(fatIndex) * bytesPerFAT;
-        // di chuyển con trỏ ghi và ghi
-        vhd.seekp(fatOffset, ios::beg);
-        if (!vhd.good())
+        lostDir = allocateCluster();
+        if (lostDir == 0)
+        {
+            cout << "[ERROR] No free cluster left for LOST.DIR.\n";
+            return 0;
+        }
+        vector<uint8_t> buf(clusterSize, 0);
+        DirEntry dot = makeDirEntry(".          ", 0x10, lostDir, 0);
+        DirEntry dotdot = makeDirEntry("..         ", 0x10, 0, 0); // '..' của con root = 0
+        memcpy(buf.data(), &dot, 32);
+        memcpy(buf.data() + 32, &dotdot, 32);
+        writeCluster(lostDir, buf);
+        if (!appendDirEntry(root, makeDirEntry(reinterpret_cast<const char *>(LOST_DIR_NAME), 0x10, lostDir, 0)))
         {
-            cerr << "[ERROR] seekp failed at offset " << fatOffset << "\n";
+            cout << "[ERROR] Cannot add LOST.DIR to the root directory.\n";
+            return 0;
+        }
+        cout << "[FIX] Created /LOST.DIR at cluster " << lostDir << ".\n";
+    }
+
+    // 2. Chọn thư mục đích cho từng chuỗi
+    map<uint32_t, size_t> dirByHead;
+    for (size_t i = 0; i < orphans.size(); ++i)
+        if (orphans[i].isDir && !orphans[i].nested)
+            dirByHead[orphans[i].head] = i;
+
+    // Thư mục đích: thư mục mồ côi theo '..' nếu chuỗi '..' không vòng, ngược lại LOST.DIR
+    vector<long> graftParent(orphans.size(), -1);
+    for (size_t i = 0; i < orphans.size(); ++i)
+    {
+        if (!orphans[i].isDir || orphans[i].nested)
+            continue;
+        auto it = dirByHead.find(orphans[i].parentCluster);
+        if (it == dirByHead.end() || it->second == i)
             continue;
+        size_t p = it->second, steps = 0;
+        bool loops = false;
+        while (true)
+        {
+            if (p == i || ++steps > orphans.size())
+            {
+                loops = true;
+                break;
+            }
+            auto up = dirByHead.find(orphans[p].parentCluster);
+            if (up == dirByHead.end() || up->second == p)
+                break;
+            p = up->second;
+        }
+        if (!loops)
+            graftParent[i] = (long)it->second;
+    }
+
+    // 3. Thêm entry; đường dẫn tính theo cha (cha luôn được xử lý trước nhờ đệ quy có memo)
+    size_t grafted = 0, fileNo = 0, dirNo = 0;
+    vector<uint8_t> done(orphans.size(), 0);
+    function<bool(size_t)> graft = [&](size_t i) -> bool
+    {
+        if (done[i])
+            return !orphans[i].lostPath.empty();
+        done[i] = 1;
+        OrphanChain &o = orphans[i];
+
+        uint32_t target = lostDir;
+        string base = "/LOST.DIR";
+        if (graftParent[i] >= 0 && graft((size_t)graftParent[i]))
+        {
+            target = orphans[graftParent[i]].head;
+            base = orphans[graftParent[i]].lostPath;
+        }
+
+        set<string> &names = loadNames(target);
+        char name[24];
+        size_t &counter = o.isDir ? dirNo : fileNo;
+        do
+        {
+            // Giống chkdsk: FILE0000.CHK / DIR0000; số lớn hơn thì 1 chữ + 7 số hex (đủ cho 2^28 cluster)
+            char stem[16];
+            if (o.isDir)
+                snprintf(stem, sizeof(stem), counter < 100000 ? "DIR%04zu" : "D%07zX", counter);
+            else
+                snprintf(stem, sizeof(stem), counter < 10000 ? "FILE%04zu" : "F%07zX", counter);
+            ++counter;
+            snprintf(name, sizeof(name), "%-8s%-3s", stem, o.isDir ? "" : "CHK");
+        } while (names.count(string(name, 11)));
+
+        uint32_t size = o.isDir ? 0 : (uint32_t)min<uint64_t>((uint64_t)o.clusters * clusterSize, UINT32_MAX);
+        if (!appendDirEntry(target, makeDirEntry(name, o.isDir ? 0x10 : 0x20, o.head, size)))
+        {
+            FAT32_LOG(LOG_ERROR, "orphan chains that could not be grafted",
+                      "cannot graft orphan chain at cluster " << o.head);
+            return false;
         }
-        vhd.write(reinterpret_cast<const char *>(buf.data()), buf.size());
-        if (!vhd.good())
+        names.insert(string(name, 11));
+
+        // Thư mục đổi cha -> sửa '..' cho khớp (root = 0)
+        if (o.isDir && o.parentCluster != target)
         {
-            cerr << "[ERROR] write failed for FAT index " << int(fatIndex) << "\n";
+            vector<uint8_t> buf;
+            readCluster(o.head, buf);
+            DirEntry *dotdot = reinterpret_cast<DirEntry *>(buf.data() + 32);
+            dotdot->firstClusterHigh = uint16_t(target >> 16);
+            dotdot->firstClusterLow = uint16_t(target & 0xFFFF);
+            writeCluster(o.head, buf);
+            o.parentCluster = target;
         }
-        vhd.flush();
+
+        o.lostPath = base + "/" + formatShortName(reinterpret_cast<const uint8_t *>(name));
+        ++grafted;
+        return true;
+    };
+    for (size_t i = 0; i < orphans.size(); ++i)
+    {
+        if (!orphans[i].nested)
+            graft(i);
     }
+
+    writeFAT(); // cluster cấp thêm cho LOST.DIR / thư mục được nối dài
+    cout << "[FIX] Grafted " << grafted << " orphan chains into /LOST.DIR.\n";
+    return grafted;
 }
 
-void FAT32Recovery::scanAndAutoRepair(uint32_t dirCluster, bool fix)
+// ======================================================================
+//                       LIVE ENTRIES / CROSS-LINKS
+// ======================================================================
+// Duyệt cây thư mục còn sống theo từng tầng; mỗi tầng nạp trước bằng một batch.
+// Mỗi thư mục chỉ được duyệt 1 lần (thư mục hỏng trỏ ngược lên không gây lặp).
+vector<LiveEntry> FAT32Recovery::listLiveEntries() const
 {
-    vector<uint8_t> buf;
-    readCluster(dirCluster, buf);
-
-    size_t num = buf.size() / 32;
-    bool hasError = false;
-
-    for (size_t i = 0; i < num; i++)
+    vector<LiveEntry> entries;
+    const uint64_t end = min<uint64_t>(FAT.size(), (uint64_t)totalClusters + 2);
+    auto isLink = [&](uint32_t v)
+    { return v >= 2 && v < end; };
+    if (!isLink(bootSector.rootCluster))
+        return entries;
+
+    struct PendingDir
     {
-        DirEntry *e = (DirEntry *)(buf.data() + i * 32);
+        uint32_t cluster;
+        string path;
+    };
+    ClusterBitmap dirSeen(end);
+    dirSeen.set(bootSector.rootCluster);
+    vector<PendingDir> level{{bootSector.rootCluster, ""}};
 
-        if (e->isdDir())
+    while (!level.empty())
+    {
+        // (cluster thư mục, chỉ số thư mục trong tầng)
+        vector<pair<uint32_t, size_t>> clusters;
+        vector<uint32_t> batch;
+        for (size_t d = 0; d < level.size(); ++d)
+        {
+            uint64_t n = 0;
+            for (uint32_t c = level[d].cluster; isLink(c) && n++ < end; c = FAT[c])
+            {
+                clusters.push_back({c, d});
+                batch.push_back(c);
+                if (FAT[c] == 0)
+                    break;
+            }
+        }
+        try
+        {
+            prefetchClusters(batch);
+        }
+        catch (...)
         {
-            FAT[e->getStartCluster()] = 0x0FFFFFFF;
-            writeFAT();
-            continue;
         }
 
-        if (e->name[0] == 0x00 || e->isDeleted() || e->isLFN())
-            continue;
+        vector<PendingDir> next;
+        vector<uint8_t> ended(level.size(), 0); // đã gặp entry 0x00 (hết thư mục)
+        for (const auto &dc : clusters)
+        {
+            if (ended[dc.second])
+                continue;
+            ClusterCache::Buffer buf;
+            try
+            {
+                buf = pinCluster(dc.first);
+            }
+            catch (...)
+            {
+                continue;
+            }
+            for (size_t i = 0; i + 32 <= buf->size(); i += 32)
+            {
+                const DirEntry *e = reinterpret_cast<const DirEntry *>(buf->data() + i);
+                if (e->name[0] == 0x00)
+                {
+                    ended[dc.second] = 1;
+                    break;
+                }
+                if (e->isDeleted() || e->isLFN() || (e->attr & 0x08) || e->name[0] == '.')
+                    continue;
 
-        uint32_t start = e->getStartCluster();
-        uint32_t need = e->fileSize;
+                uint32_t start = e->getStartCluster();
+                string path = level[dc.second].path + "/" + formatShortName(e->name);
+                entries.push_back({dc.first, int(i / 32), start, e->fileSize, e->isdDir(), path});
+                if (e->isdDir() && isLink(start) && !dirSeen.test(start))
+                {
+                    dirSeen.set(start);
+                    next.push_back({start, path});
+                }
+            }
+        }
+        level.swap(next);
+    }
+    return entries;
+}
 
-        auto chain = followFAT(start);
-        uint32_t bytesPerCluster =
-            bootSector.bytesPerSector * bootSector.sectorsPerCluster;
+// Điền owner cho các cluster trong cửa sổ [firstCluster, firstCluster + count) bằng 1 lượt qua
+// mọi chuỗi. Cluster đã có chủ khác được đánh dấu SHARED và ghi vào conflicts (nếu có).
+void FAT32Recovery::buildOwnerMap(const vector<LiveEntry> &entries, uint32_t firstCluster, uint32_t count,
+                                  ClusterOwnerMap &map, vector<CrossLink> *conflicts) const
+{
+    const uint64_t end = min<uint64_t>(FAT.size(), (uint64_t)totalClusters + 2);
+    map.firstCluster = firstCluster;
+    map.owner.assign(count, ClusterOwnerMap::NO_OWNER);
 
-        uint32_t must = (need + bytesPerCluster - 1) / bytesPerCluster;
+    vector<pair<uint32_t, uint32_t>> claims; // (cluster, chỉ số entry) của cluster bị dùng chung
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const uint32_t id = uint32_t(i + 1);
 
-        if (chain.size() != must)
+        // Phát hiện vòng lặp kiểu Brent: không cần bộ nhớ theo độ dài chuỗi,
+        // dừng sau tối đa ~2 vòng kể cả khi chuỗi chạy ngoài cửa sổ
+        uint32_t checkpoint = 0;
+        uint64_t power = 1, lambda = 0;
+        for (uint32_t c = entries[i].startCluster; c >= 2 && c < end; c = FAT[c])
         {
-            hasError = true;
+            if (c == checkpoint)
+                break;
+            if (++lambda == power)
+            {
+                checkpoint = c;
+                power <<= 1;
+                lambda = 0;
+            }
 
-            cout << "[ERROR] Entry " << i
-                 << " (" << e->getNameString() << ")"
-                 << ": cluster chain size = " << chain.size()
-                 << ", expected = " << must << endl;
+            if (map.covers(c))
+            {
+                uint32_t &o = map.owner[c - firstCluster];
+                if (o == id)
+                    break; // quay lại cluster của chính chuỗi này
+                if (o == ClusterOwnerMap::NO_OWNER)
+                    o = id;
+                else
+                {
+                    if (conflicts)
+                    {
+                        if (o != ClusterOwnerMap::SHARED)
+                            claims.push_back({c, o - 1});
+                        claims.push_back({c, uint32_t(i)});
+                    }
+                    o = ClusterOwnerMap::SHARED;
+                }
+            }
+            if (FAT[c] == 0)
+                break;
         }
     }
 
-    if (hasError && fix)
+    if (!conflicts || claims.empty())
+        return;
+    sort(claims.begin(), claims.end());
+    claims.erase(unique(claims.begin(), claims.end()), claims.end());
+    for (const auto &cl : claims)
     {
-        cout << "[INFO] Repairing directory and FAT structures..." << endl;
-        repairFolderAndClusters(dirCluster); // phase 2
+        if (conflicts->empty() || conflicts->back().cluster != cl.first)
+            conflicts->push_back({cl.first, {}});
+        conflicts->back().owners.push_back(cl.second);
     }
-    else if (hasError)
+}
+
+// Mọi cluster bị nhiều entry còn sống cùng nhận, tăng dần theo cluster.
+// Owner array 4 byte / cluster; vượt memBudget thì chia volume thành nhiều cửa sổ.
+vector<CrossLink> FAT32Recovery::findCrossLinks(const vector<LiveEntry> &entries, size_t memBudget) const
+{
+    ScopedPhase timer(Metrics::PHASE_SCAN);
+
+    vector<CrossLink> links;
+    const uint64_t end = min<uint64_t>(FAT.size(), (uint64_t)totalClusters + 2);
+    const uint64_t window = max<uint64_t>(memBudget / sizeof(uint32_t), 1);
+
+    ClusterOwnerMap map;
+    size_t passes = 0;
+    for (uint64_t first = 2; first < end; first += window, ++passes)
+        buildOwnerMap(entries, uint32_t(first), uint32_t(min<uint64_t>(window, end - first)), map, &links);
+
+    cout << "[SCAN] Cross-link check: " << entries.size() << " live entries, " << links.size()
+         << " shared clusters (" << passes << " owner-map pass" << (passes == 1 ? "" : "es") << ").\n";
+    return links;
+}
+
+// Copy-out: ở mỗi cluster dùng chung, một entry giữ bản gốc (ưu tiên chuỗi có độ dài khớp
+// kích thước, hòa thì entry đứng trước); các entry còn lại nhận bản sao của phần đuôi từ
+// cluster đầu tiên mà chúng không giữ. Trả về số entry đã được tách.
+size_t FAT32Recovery::resolveCrossLinks(const vector<LiveEntry> &entries, const vector<CrossLink> &links)
+{
+    ScopedPhase timer(Metrics::PHASE_RESTORE);
+    if (links.empty())
+        return 0;
+
+    const uint64_t clusterSize = getClusterSize();
+
+    // Chuỗi (theo FAT hiện tại) và độ dài mong đợi của các entry liên quan
+    map<uint32_t, vector<uint32_t>> chains;
+    for (const auto &l : links)
+        for (uint32_t o : l.owners)
+            if (!chains.count(o))
+                chains[o] = followFAT(entries[o].startCluster);
+
+    auto expected = [&](uint32_t i) -> uint64_t
     {
-        cout << "[ERROR] Errors detected, but fix = false -> no repair performed." << endl;
+        if (entries[i].isDir)
+            return chains[i].size();
+        return (entries[i].size + clusterSize - 1) / clusterSize;
+    };
+    auto better = [&](uint32_t a, uint32_t b)
+    {
+        bool ea = chains[a].size() == expected(a), eb = chains[b].size() == expected(b);
+        return ea != eb ? ea : a < b;
+    };
+
+    // Entry giữ bản gốc ở từng cluster dùng chung (links đã sắp theo cluster)
+    vector<uint32_t> keeper(links.size());
+    for (size_t k = 0; k < links.size(); ++k)
+    {
+        keeper[k] = links[k].owners.front();
+        for (uint32_t o : links[k].owners)
+            if (better(o, keeper[k]))
+                keeper[k] = o;
     }
-    else
+    auto keeperOf = [&](uint32_t cluster) -> long
     {
-        cout << "[INFO] No inconsistencies found." << endl;
+        auto it = lower_bound(links.begin(), links.end(), cluster,
+                              [](const CrossLink &l, uint32_t c)
+                              { return l.cluster < c; });
+        return (it != links.end() && it->cluster == cluster) ? (long)keeper[it - links.begin()] : -1;
+    };
+
+    size_t resolved = 0;
+    vector<uint8_t> buf;
+    for (auto &kv : chains)
+    {
+        const uint32_t i = kv.first;
+        const vector<uint32_t> &chain = kv.second;
+        const LiveEntry &e = entries[i];
+
+        size_t pos = 0;
+        while (pos < chain.size())
+        {
+            long k = keeperOf(chain[pos]);
+            if (k >= 0 && (uint32_t)k != i)
+                break;
+            ++pos;
+        }
+        if (pos == chain.size())
+            continue; // giữ bản gốc ở mọi cluster dùng chung
+
+        uint64_t need = min<uint64_t>(expected(i) > pos ? expected(i) - pos : 0, chain.size() - pos);
+
+        // Chép phần đuôi sang cluster mới (không lấy cluster của file đã xóa còn cứu được)
+        vector<uint32_t> fresh;
+        for (uint64_t n = 0; n < need; ++n)
+        {
+            uint32_t c = findUnclaimedFreeCluster();
+            if (c == 0)
+                break;
+            setFATEntry(c, 0x0FFFFFFF);
+            if (!fresh.empty())
+                setFATEntry(fresh.back(), c);
+            readCluster(chain[pos + n], buf);
+            writeCluster(c, buf);
+            fresh.push_back(c);
+        }
+        if (fresh.size() != need)
+        {
+            for (uint32_t c : fresh)
+                setFATEntry(c, 0);
+            FAT32_LOG(LOG_ERROR, "cross-links that could not be resolved",
+                      "no free space to copy " << need << " clusters for " << e.path);
+            continue;
+        }
+
+        // Nối phần đầu riêng của entry vào bản sao (hoặc cắt chuỗi nếu entry không cần phần đuôi)
+        uint32_t newTail = fresh.empty() ? 0 : fresh.front();
+        if (pos > 0)
+            setFATEntry(chain[pos - 1], fresh.empty() ? 0x0FFFFFFF : newTail);
+        else
+        {
+            readCluster(e.dirCluster, buf);
+            DirEntry *de = reinterpret_cast<DirEntry *>(buf.data() + e.entryIndex * 32);
+            de->firstClusterHigh = uint16_t(newTail >> 16);
+            de->firstClusterLow = uint16_t(newTail & 0xFFFF);
+            writeCluster(e.dirCluster, buf);
+        }
+
+        cout << "[FIX] " << e.path << ": ";
+        if (fresh.empty())
+            cout << "chain truncated before shared cluster " << chain[pos] << ".\n";
+        else
+            cout << "copied " << fresh.size() << " shared clusters from " << chain[pos] << " to " << newTail << ".\n";
+        ++resolved;
     }
+
+    writeFAT();
+    cout << "[FIX] Resolved cross-links for " << resolved << " entries.\n";
+    return resolved;
 }
 
-// Sửa chữa các mục nhập thư mục (directory entries) và chuỗi FAT (FAT chains) bên dưới một cluster thư mục
-// Trả về số lần sửa chữa đã thực hiện
-int FAT32Recovery::repairFolderAndClusters(uint32_t dirCluster)
+// ======================================================================
+//                       MAC TIMELINE
+// ======================================================================
+namespace
 {
-    // Tính toán số byte trên mỗi cluster
-    const uint32_t bytesPerCluster = uint32_t(bootSector.bytesPerSector) * uint32_t(bootSector.sectorsPerCluster);
-    int fixes = 0; // Biến đếm số lần sửa chữa
-
-    // Đọc tất cả các cluster của thư mục vào một bộ đệm duy nhất.
-    // Đối với các thư mục trải dài trên nhiều cluster, thao tác này sẽ đọc chúng từng cái một.
-    vector<uint8_t> clusterBuf;
-    readCluster(dirCluster, clusterBuf); // đọc cluster đầu tiên
-    // Nếu thư mục dài, hàm gọi (caller) có thể gọi hàm này cho mỗi chuỗi thư mục;
-    // để đơn giản, chúng ta sẽ giả định một thư mục cluster đơn hoặc rằng scanDirectory xử lý nhiều cluster.
+    // Ngày giờ FAT -> giây kể từ 1970 (giờ địa phương của volume, FAT không lưu múi giờ).
+    // 0 = không có mốc (ngày 0 hoặc không hợp lệ).
+    int64_t dosToUnix(uint16_t date, uint16_t time)
+    {
+        int y = 1980 + (date >> 9);
+        unsigned m = (date >> 5) & 0x0F;
+        unsigned d = date & 0x1F;
+        if (date == 0 || m < 1 || m > 12 || d < 1)
+            return 0;
+
+        // days_from_civil (lịch Gregory)
+        y -= m <= 2;
+        int64_t era = y / 400;
+        unsigned yoe = unsigned(y - era * 400);
+        unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        int64_t days = era * 146097 + int64_t(doe) - 719468;
+
+        return days * 86400 + int64_t(time >> 11) * 3600 + int64_t((time >> 5) & 0x3F) * 60 + int64_t(time & 0x1F) * 2;
+    }
 
-    // lặp qua các mục nhập (mỗi mục 32 byte)
-    size_t entries = clusterBuf.size() / 32;
-    for (size_t ei = 0; ei < entries; ++ei)
+    string formatDosTime(uint16_t date, uint16_t time)
     {
-        DirEntry *de = reinterpret_cast<DirEntry *>(clusterBuf.data() + ei * 32);
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u", 1980u + (date >> 9), (date >> 5) & 0x0Fu,
+                 date & 0x1Fu, time >> 11, (time >> 5) & 0x3Fu, (time & 0x1Fu) * 2);
+        return buf;
+    }
 
-        // bỏ qua các mục nhập trống/đã xóa và LFN (Tên dài)
-        if (de->name[0] == 0x00)
-            continue; // trống / kết thúc thư mục
-        if (de->isDeleted())
-            continue;
-        if (de->isLFN())
-            continue;
+    string csvQuote(const string &s)
+    {
+        string r = "\"";
+        for (char c : s)
+        {
+            if (c == '"')
+                r += '"';
+            r += c;
+        }
+        return r + "\"";
+    }
 
-        // tính toán cluster bắt đầu
-        uint32_t startCluster = ((uint32_t)de->firstClusterHigh << 16) | de->firstClusterLow;
-        uint32_t fileSize = de->fileSize;
+    // Sort ngoài theo dòng: mỗi dòng bắt đầu bằng khóa hex cố định KEY_LEN ký tự nên
+    // so sánh chuỗi = so sánh thời gian. Vượt ngân sách -> sort và spill thành run,
+    // cuối cùng trộn k-way (nhiều lượt nếu quá MAX_FAN_IN run).
+    class ExternalLineSorter
+    {
+    public:
+        static const size_t KEY_LEN = 17; // 16 hex + '\t'
+        static const size_t MAX_FAN_IN = 128;
 
-        if (startCluster == 0)
+        ExternalLineSorter(size_t budget, const string &dir)
+            : budget(max<size_t>(budget, 64 << 10)), bytes(0), tmpDir(dir)
         {
-            // tập tin không có cluster bắt đầu — cố gắng tìm một vùng liên tục
-            auto candidate = contiguousGuess(2 /*gợi ý bắt đầu: cluster 2*/, fileSize);
-            if (!candidate.empty())
-            {
-                // Đánh dấu (Claim) các cluster ứng cử viên
-                for (size_t k = 0; k < candidate.size(); ++k)
-                {
-                    uint32_t c = candidate[k];
-                    uint32_t next = (k + 1 < candidate.size()) ? candidate[k + 1] : 0x0FFFFFFF;
-                    FAT[c] = next & 0x0FFFFFFF;
-                }
-                // cập nhật các trường cluster bắt đầu của mục nhập thư mục
-                uint32_t newStart = candidate.front();
-                de->firstClusterHigh = uint16_t((newStart >> 16) & 0xFFFF);
-                de->firstClusterLow = uint16_t(newStart & 0xFFFF);
-                ++fixes;
-            }
-            continue;
+            if (tmpDir.empty())
+                tmpDir = filesystem::temp_directory_path().string();
         }
 
-        // theo dõi chuỗi FAT hiện tại
-        vector<uint32_t> chain = followFAT(startCluster);
+        ~ExternalLineSorter()
+        {
+            error_code ec;
+            for (const auto &r : runs)
+                filesystem::remove(r, ec);
+        }
 
-        // số lượng cluster cần thiết cho kích thước tập tin
-        uint32_t needClusters = (fileSize + bytesPerCluster - 1) / bytesPerCluster;
+        void add(string &&line)
+        {
+            bytes += line.size() + sizeof(string);
+            lines.push_back(move(line));
+            if (bytes >= budget)
+                spill();
+        }
 
-        // Nếu chuỗi trống, quá ngắn hoặc có đánh dấu không hợp lệ, cố gắng sửa
-        bool badChain = false;
-        if (chain.empty())
-            badChain = true;
-        else if (chain.size() < needClusters)
-            badChain = true;
-        else
+        // Ghi toàn bộ theo thứ tự (bỏ khóa), trả về số run đã spill
+        size_t finish(ostream &out)
         {
-            // kiểm tra bất kỳ cluster nào được đánh dấu là xấu/không hợp lệ trong chuỗi
-            for (auto c : chain)
+            size_t spilled = runs.size();
+            if (runs.empty())
             {
-                if (c < 2 || c >= totalClusters + 2)
-                {
-                    badChain = true;
-                    break;
-                }
-                uint32_t entry = FAT[c] & 0x0FFFFFFF;
-                // xem xét cluster trống (0) hoặc reserved (0x00000000) là xấu
-                if (entry == 0)
+                sort(lines.begin(), lines.end());
+                for (const auto &l : lines)
+                    out.write(l.data() + KEY_LEN, l.size() - KEY_LEN) << '\n';
+                lines.clear();
+                return 0;
+            }
+
+            spill();
+            spilled = runs.size();
+            while (runs.size() > MAX_FAN_IN)
+            {
+                vector<string> next;
+                for (size_t i = 0; i < runs.size(); i += MAX_FAN_IN)
                 {
-                    badChain = true;
-                    break;
+                    vector<string> group(runs.begin() + i, runs.begin() + min(runs.size(), i + MAX_FAN_IN));
+                    string merged = newRunPath();
+                    ofstream o(merged, ios::out | ios::binary | ios::trunc);
+                    merge(group, o, false);
+                    next.push_back(merged);
                 }
+                runs.swap(next);
             }
+            merge(runs, out, true);
+            return spilled;
         }
 
-        if (!badChain)
-            continue; // chuỗi có vẻ OK
+    private:
+        size_t budget;
+        size_t bytes;
+        string tmpDir;
+        vector<string> lines;
+        vector<string> runs;
+        size_t runSeq = 0;
 
-        // Thử đoán một chuỗi liên tục bắt đầu từ startCluster (hoặc gần đó)
-        auto candidate = contiguousGuess(startCluster, fileSize);
-        if (candidate.empty())
+        string newRunPath()
         {
-            // dự phòng: thử đoán toàn cục bắt đầu từ cluster 2
-            candidate = contiguousGuess(2, fileSize);
+            return (filesystem::path(tmpDir) / ("fat32_timeline_" + to_string(chrono::steady_clock::now().time_since_epoch().count()) + "_" +
+                                                to_string(uintptr_t(this)) + "_" + to_string(runSeq++) + ".run"))
+                .string();
         }
 
-        if (!candidate.empty())
+        void spill()
         {
-            // Đánh dấu các cluster của chuỗi cũ là trống (nếu nằm trong phạm vi hợp lệ)
-            for (auto c : chain)
-            {
-                if (c >= 2 && c < FAT.size())
-                {
-                    FAT[c] = 0; // trống
-                }
-            }
-            // Ghi chuỗi ứng cử viên vào FAT
-            for (size_t k = 0; k < candidate.size(); ++k)
+            if (lines.empty())
+                return;
+            sort(lines.begin(), lines.end());
+            string path = newRunPath();
+            ofstream o(path, ios::out | ios::binary | ios::trunc);
+            if (!o.is_open())
+                throw runtime_error("Cannot create timeline run file " + path);
+            for (const auto &l : lines)
+                o << l << '\n';
+            if (!o)
+                throw runtime_error("Failed to write timeline run file " + path);
+            runs.push_back(path);
+            lines.clear();
+            lines.shrink_to_fit();
+            bytes = 0;
+        }
+
+        // Trộn các run (đã sort) vào out; các run đầu vào bị xóa sau khi trộn
+        void merge(const vector<string> &inputs, ostream &out, bool stripKey)
+        {
+            vector<unique_ptr<ifstream>> in;
+            using Head = pair<string, size_t>;
+            priority_queue<Head, vector<Head>, greater<Head>> heap;
+            for (const auto &p : inputs)
             {
-                uint32_t c = candidate[k];
-                uint32_t next = (k + 1 < candidate.size()) ? candidate[k + 1] : 0x0FFFFFFF;
-                FAT[c] = next & 0x0FFFFFFF;
+                in.emplace_back(new ifstream(p, ios::in | ios::binary));
+                string l;
+                if (getline(*in.back(), l))
+                    heap.push({move(l), in.size() - 1});
             }
-            // Cập nhật các trường cluster bắt đầu của mục nhập thư mục nếu thay đổi
-            uint32_t newStart = candidate.front();
-            if (newStart != startCluster)
+            while (!heap.empty())
             {
-                de->firstClusterHigh = uint16_t((newStart >> 16) & 0xFFFF);
-                de->firstClusterLow = uint16_t(newStart & 0xFFFF);
+                Head h = heap.top();
+                heap.pop();
+                if (stripKey)
+                    out.write(h.first.data() + KEY_LEN, h.first.size() - KEY_LEN) << '\n';
+                else
+                    out << h.first << '\n';
+                if (getline(*in[h.second], h.first))
+                    heap.push(move(h));
             }
-            ++fixes;
-        }
-        else
-        {
-            // không thể tìm thấy ứng cử viên liên tục; giữ nguyên nhưng cảnh báo (tùy chọn)
-            cout << "[ERROR] unable to repair entry at dir cluster " << dirCluster
-                 << " entry index " << ei << " startCluster=" << startCluster << " size=" << fileSize << "\n";
+            in.clear();
+            error_code ec;
+            for (const auto &p : inputs)
+                filesystem::remove(p, ec);
         }
-    } // for each dir entry
-
-    if (fixes > 0)
-    {
-        // ghi lại cluster thư mục đã sửa đổi (cập nhật nội dung thư mục trên đĩa)
-        uint64_t dirOffset = cluster2Offset(dirCluster);
-        vhd.seekp(dirOffset, ios::beg);
-        vhd.write(reinterpret_cast<const char *>(clusterBuf.data()), clusterBuf.size());
-        vhd.flush();
-
-        // ghi lại các FAT đã sửa đổi vào đĩa
-        writeFAT();
-    }
-
-    return fixes;
+    };
 }
 
-// Hàm đoán chuỗi cluster liên tục cho file dựa trên fileSize
-vector<uint32_t> FAT32Recovery::contiguousGuess(uint32_t startHint, uint32_t fileSize) const
+TimelineStats FAT32Recovery::writeTimeline(ostream &out, const string &format, size_t memBudget, const string &tmpDir) const
 {
-    vector<uint32_t> result;
-
-    const uint32_t bytesPerCluster =
-        bootSector.bytesPerSector * bootSector.sectorsPerCluster;
+    ScopedPhase timer(Metrics::PHASE_ANALYZE);
 
-    if (fileSize == 0)
-        return result;
+    bool body = format == "body";
+    if (!body && format != "csv")
+        throw runtime_error("Unknown timeline format: " + format + " (expected csv or body)");
 
-    uint32_t need = (fileSize + bytesPerCluster - 1) / bytesPerCluster;
-    uint32_t total = totalClusters; // số cluster hữu dụng
+    TimelineStats stats = {0, 0, 0};
+    ExternalLineSorter sorter(memBudget, tmpDir);
+    DeletedTreeView view(*this, 1 << 16); // chỉ duyệt 1 lượt, không cần giữ cache lớn
 
-    // Helper: kiểm tra đoạn free
-    auto isRangeFree = [&](uint32_t start, uint32_t len) -> bool
+    // Thư mục sống được duyệt hết trước để thư mục đã xóa không "chiếm" cluster của thư mục sống
+    struct PendingDir
     {
-        for (uint32_t i = 0; i < len; i++)
-        {
-            uint32_t c = start + i;
-            if (c >= FAT.size())
-                return false;
-            if ((FAT[c] & 0x0FFFFFFF) != 0)
-                return false; // không free
-        }
-        return true;
+        uint32_t cluster;
+        string path;
     };
+    const uint64_t end = (uint64_t)totalClusters + 2;
+    ClusterBitmap seen(end);
+    deque<PendingDir> liveDirs{{bootSector.rootCluster, ""}};
+    deque<PendingDir> deletedDirs;
+    seen.set(bootSector.rootCluster);
 
-    // ----------------------------------------------------
-    // 1. Thử đoán bắt đầu từ startHint
-    // ----------------------------------------------------
-    if (startHint >= 2 && startHint + need < FAT.size())
-    {
-        if (isRangeFree(startHint, need))
-        {
-            result.reserve(need);
-            for (uint32_t i = 0; i < need; i++)
-                result.push_back(startHint + i);
-            return result;
-        }
-    }
+    if (!body)
+        out << "time,macb,size,deleted,recoverable,status,start_cluster,path\n";
 
-    // ----------------------------------------------------
-    // 2. Dò toàn FAT để tìm 1 đoạn free đủ dài
-    // ----------------------------------------------------
-    for (uint32_t c = 2; c < FAT.size() - need; c++)
+    while (!liveDirs.empty() || !deletedDirs.empty())
     {
-        if (isRangeFree(c, need))
+        bool inDeleted = liveDirs.empty();
+        deque<PendingDir> &queue = inDeleted ? deletedDirs : liveDirs;
+        PendingDir dir = move(queue.front());
+        queue.pop_front();
+
+        DeletedTreeView::Listing listing = view.children(dir.cluster);
+        for (const auto &e : *listing)
         {
-            result.reserve(need);
-            for (uint32_t i = 0; i < need; i++)
-                result.push_back(c + i);
-            return result;
+            const DeletedFileInfo &f = e.info;
+            bool deleted = inDeleted || e.deleted;
+            string path = dir.path + "/" + f.name;
+            ++stats.entries;
+
+            uint16_t mDate = uint16_t(f.lastWriteTime >> 16), mTime = uint16_t(f.lastWriteTime & 0xFFFF);
+            uint16_t bDate = uint16_t(f.creationTime >> 16), bTime = uint16_t(f.creationTime & 0xFFFF);
+            int64_t m = dosToUnix(mDate, mTime);
+            int64_t a = dosToUnix(f.lastAccessDate, 0);
+            int64_t b = dosToUnix(bDate, bTime);
+
+            if (body)
+            {
+                // MD5|name|inode|mode|UID|GID|size|atime|mtime|ctime|crtime (FAT không có ctime)
+                out << "0|" << path << (deleted ? " (deleted)" : "") << "|" << e.dirCluster << "-" << f.entryIndex
+                    << "|" << (f.isDir ? "d/drwxrwxrwx" : "r/rrwxrwxrwx") << "|0|0|" << f.size << "|" << a << "|"
+                    << m << "|0|" << b << "\n";
+                stats.events += (m != 0) + (a != 0) + (b != 0);
+            }
+            else
+            {
+                // Các mốc trùng nhau gộp thành 1 sự kiện, cột macb giống mactime ("m..b")
+                struct Stamp
+                {
+                    int64_t t;
+                    uint16_t date, time;
+                };
+                const Stamp stamps[3] = {{m, mDate, mTime}, {a, f.lastAccessDate, 0}, {b, bDate, bTime}};
+                for (int i = 0; i < 3; ++i)
+                {
+                    const Stamp &st = stamps[i];
+                    bool first = st.t != 0;
+                    for (int j = 0; j < i && first; ++j)
+                        first = stamps[j].t != st.t;
+                    if (!first)
+                        continue;
+
+                    string macb = {m == st.t ? 'm' : '.', a == st.t ? 'a' : '.', '.', b == st.t ? 'b' : '.'};
+                    char key[ExternalLineSorter::KEY_LEN + 1];
+                    snprintf(key, sizeof(key), "%016llx\t", (unsigned long long)st.t);
+
+                    string line = key;
+                    line += formatDosTime(st.date, st.time) + "," + macb + "," + to_string(f.size) + "," +
+                            (deleted ? "1" : "0") + "," + (f.isRecoverable ? "1" : "0") + "," + csvQuote(f.statusReason) +
+                            "," + to_string(f.startCluster) + "," + csvQuote(path + (f.isDir ? "/" : ""));
+                    sorter.add(move(line));
+                    ++stats.events;
+                }
+            }
+
+            // Thư mục đã xóa chỉ được mở khi cluster đầu vẫn còn trống trong FAT
+            uint32_t start = f.startCluster;
+            if (!f.isDir || start < 2 || start >= end || seen.test(start))
+                continue;
+            if (deleted && (FAT[start] & 0x0FFFFFFF) != 0)
+                continue;
+            seen.set(start);
+            (deleted ? deletedDirs : liveDirs).push_back({start, path});
         }
     }
 
-    // ----------------------------------------------------
-    // 3. Không đoán được
-    // ----------------------------------------------------
-    return result;
+    if (!body)
+        stats.runs = sorter.finish(out);
+
+    cout << "[INFO] Timeline: " << stats.entries << " entries, " << stats.events << " events"
+         << (stats.runs ? ", " + to_string(stats.runs) + " sorted runs merged" : string()) << ".\n";
+    return stats;
 }
 
 // ======================================================================
-//                       DELETED FILE RECOVERY
+//                       ALLOCATION MAP
 // ======================================================================
-// 1. PHÂN TÍCH XUNG ĐỘT (Collision Detection Strategy)
-vector<DeletedFileInfo> FAT32Recovery::analyzeRecoveryCandidates(uint32_t dirCluster)
+namespace
 {
-    vector<DeletedFileInfo> candidates;
-    vector<uint8_t> buf;
-    try
-    {
-        readCluster(dirCluster, buf);
-    }
-    catch (...)
+    const char *const ALLOC_CLASS_NAMES[ALLOC_CLASS_COUNT] = {"free", "live", "deleted", "contested", "bad", "orphan"};
+    const char ALLOC_MAP_MAGIC[8] = {'F', '3', '2', 'A', 'M', 'A', 'P', '\0'};
+    const uint32_t ALLOC_MAP_VERSION = 1;
+
+    template <typename T>
+    void writeRaw(ostream &out, const T &v)
     {
-        return candidates;
+        out.write(reinterpret_cast<const char *>(&v), sizeof(v));
     }
 
-    size_t numEntries = buf.size() / 32;
-    uint32_t bytesPerCluster = bootSector.bytesPerSector * bootSector.sectorsPerCluster;
-
-    // --- BƯỚC 1: Thu thập (Census) ---
-    for (size_t i = 0; i < numEntries; ++i)
+    void writeLEB128(ostream &out, uint64_t v)
     {
-        const DirEntry *entry = reinterpret_cast<const DirEntry *>(buf.data() + (i * 32));
-
-        // Chỉ lấy các entry đánh dấu xóa (0xE5) và không phải tên dài (LFN)
-        if (entry->name[0] == 0xE5 && !entry->isLFN())
+        char buf[10];
+        int n = 0;
+        do
         {
-            DeletedFileInfo info;
-            info.entryIndex = (int)i;
-            info.name = entry->getNameString();
-            info.size = entry->fileSize;
-            info.startCluster = entry->getStartCluster();
-            info.isDir = entry->isdDir(); // Lấy cờ folder
-
-            // Lấy timestamps
-            info.lastWriteTime = entry->getWriteTimestamp();
-            info.creationTime = entry->getCreationTimestamp();
+            uint8_t b = v & 0x7F;
+            v >>= 7;
+            buf[n++] = char(v ? (b | 0x80) : b);
+        } while (v);
+        out.write(buf, n);
+    }
+}
 
-            info.isRecoverable = true;
-            info.statusReason = "Good";
+AllocationMapStats FAT32Recovery::writeAllocationMap(ostream &out, const string &format) const
+{
+    ScopedPhase timer(Metrics::PHASE_SCAN);
 
-            candidates.push_back(info);
-        }
-    }
+    bool json = format == "json";
+    if (!json && format != "bin")
+        throw runtime_error("Unknown allocation map format: " + format + " (expected json or bin)");
 
-    // --- BƯỚC 2: Map Cluster Claims ---
-    // Key: Cluster ID, Value: List of file indices wanting this cluster
-    map<uint32_t, vector<int>> clusterClaims;
+    AllocationMapStats stats;
+    memset(&stats, 0, sizeof(stats));
+    const uint64_t end = min<uint64_t>(FAT.size(), (uint64_t)totalClusters + 2);
+    if (end <= 2)
+        throw runtime_error("FAT table is not loaded yet.");
 
-    for (int fileIdx = 0; fileIdx < (int)candidates.size(); ++fileIdx)
+    // 1. Chuỗi mồ côi (findOrphanChains) -> bitmap; phần đã cấp phát còn lại là của cây sống
+    ClusterBitmap orphan(end);
+    for (const OrphanChain &o : findOrphanChains())
     {
-        auto &file = candidates[fileIdx];
-        if (file.size == 0)
-            continue; // File rỗng không chiếm cluster
-
-        uint32_t needed = (file.size + bytesPerCluster - 1) / bytesPerCluster;
+        uint32_t c = o.head;
+        for (uint32_t i = 0; i < o.clusters && c >= 2 && c < end; ++i, c = FAT[c] & 0x0FFFFFFF)
+            orphan.set(c);
+    }
 
-        // Giả định file liên tục (Contiguous Assumption)
-        for (uint32_t c = 0; c < needed; ++c)
+    // 2. Cluster các file đã xóa nhận (cùng giả định liên tục với arbitrateCandidates):
+    //    2 bitmap đủ phân biệt "một người nhận" và "nhiều người nhận"
+    const uint32_t clusterSize = getClusterSize();
+    ClusterBitmap claimed(end), claimedTwice(end);
+    for (const auto &kv : census)
+    {
+        for (const DeletedFileInfo &f : kv.second)
         {
-            uint32_t currentClus = file.startCluster + c;
-
-            // Nếu cluster vượt quá giới hạn đĩa
-            if (currentClus >= totalClusters + 2)
+            uint64_t needed = f.isDir ? 1 : ((uint64_t)f.size + clusterSize - 1) / clusterSize;
+            for (uint64_t c = f.startCluster; c < (uint64_t)f.startCluster + needed && c < end; ++c)
             {
-                file.isRecoverable = false;
-                file.statusReason = "Invalid Range";
-                break;
+                if (c < 2)
+                    continue;
+                if (claimed.test(uint32_t(c)))
+                    claimedTwice.set(uint32_t(c));
+                claimed.set(uint32_t(c));
             }
-            clusterClaims[currentClus].push_back(fileIdx);
         }
     }
 
-    // --- BƯỚC 3: Xử lý xung đột (Arbitration) ---
-    for (auto const &[clusterID, claimants] : clusterClaims)
+    // 3. Một lượt qua FAT, ghi run ngay khi đổi trạng thái
+    if (json)
     {
-        // A. Kiểm tra với bảng FAT thực tế (File đang sống)
-        if ((FAT[clusterID] & 0x0FFFFFFF) != 0)
+        out << "{\"clusterSize\":" << clusterSize << ",\"firstCluster\":2,\"clusterCount\":" << end - 2
+            << ",\"classes\":[";
+        for (int k = 0; k < ALLOC_CLASS_COUNT; ++k)
+            out << (k ? "," : "") << "\"" << ALLOC_CLASS_NAMES[k] << "\"";
+        out << "],\"runs\":[";
+    }
+    else
+    {
+        out.write(ALLOC_MAP_MAGIC, sizeof(ALLOC_MAP_MAGIC));
+        writeRaw(out, ALLOC_MAP_VERSION);
+        writeRaw(out, clusterSize);
+        writeRaw(out, uint32_t(2));
+        writeRaw(out, uint64_t(end - 2));
+    }
+
+    AllocClass runClass = ALLOC_FREE;
+    uint64_t runLength = 0;
+    auto flush = [&]()
+    {
+        if (runLength == 0)
+            return;
+        if (json)
+            out << (stats.runs ? "," : "") << "[" << int(runClass) << "," << runLength << "]";
+        else
         {
-            for (int idx : claimants)
-            {
-                candidates[idx].isRecoverable = false;
-                candidates[idx].statusReason = "Overwritten by Active File";
-            }
-            continue;
+            out.put(char(runClass));
+            writeLEB128(out, runLength);
         }
-
-        // B. Kiểm tra xung đột giữa các file đã xóa (Deleted vs Deleted)
-        if (claimants.size() > 1)
+        ++stats.runs;
+        if (runClass == ALLOC_FREE)
         {
-            int winnerIdx = claimants[0];
-
-            // So sánh từng cặp để tìm người chiến thắng
-            for (size_t i = 1; i < claimants.size(); ++i)
-            {
-                int challengerIdx = claimants[i];
-                auto &winner = candidates[winnerIdx];
-                auto &challenger = candidates[challengerIdx];
+            ++stats.freeRuns;
+            stats.largestFreeRun = (uint32_t)max<uint64_t>(stats.largestFreeRun, runLength);
+        }
+    };
 
-                // === LOGIC: Creation vs Last Write ===
-                // Nếu B được TẠO RA (Created) sau khi A đã GHI XONG (LastWrite)
-                // => B là kẻ đến sau đè lên A.
-                if (challenger.creationTime > winner.lastWriteTime)
-                {
-                    winnerIdx = challengerIdx;
-                }
-                else if (winner.creationTime > challenger.lastWriteTime)
-                {
-                    // Winner vẫn thắng, không đổi
-                }
-                else
-                {
-                    // Fallback: Ai có Last Write mới hơn thì thắng
-                    if (challenger.lastWriteTime > winner.lastWriteTime)
-                    {
-                        winnerIdx = challengerIdx;
-                    }
-                }
-            }
+    for (uint64_t i = 2; i < end; ++i)
+    {
+        uint32_t c = uint32_t(i);
+        uint32_t v = FAT[c] & 0x0FFFFFFF;
+        AllocClass cls;
+        if (v == 0x0FFFFFF7)
+            cls = ALLOC_BAD;
+        else if (claimed.test(c) && (v != 0 || claimedTwice.test(c)))
+            cls = ALLOC_CONTESTED;
+        else if (v != 0)
+            cls = orphan.test(c) ? ALLOC_ORPHAN : ALLOC_LIVE;
+        else
+            cls = claimed.test(c) ? ALLOC_DELETED : ALLOC_FREE;
 
-            // Loại bỏ những kẻ thua cuộc
-            for (int idx : claimants)
-            {
-                if (idx != winnerIdx)
-                {
-                    candidates[idx].isRecoverable = false;
-                    candidates[idx].statusReason = "Collision (Lost Time Check)";
-                }
-            }
+        ++stats.clusters[cls];
+        if (cls != runClass)
+        {
+            flush();
+            runClass = cls;
+            runLength = 0;
         }
+        ++runLength;
     }
-    return candidates;
+    flush();
+
+    if (json)
+    {
+        out << "],\"summary\":{";
+        for (int k = 0; k < ALLOC_CLASS_COUNT; ++k)
+            out << (k ? "," : "") << "\"" << ALLOC_CLASS_NAMES[k] << "\":" << stats.clusters[k];
+        out << ",\"runs\":" << stats.runs << ",\"freeRuns\":" << stats.freeRuns
+            << ",\"largestFreeRun\":" << stats.largestFreeRun << "}}\n";
+    }
+    else
+    {
+        out.put(char(0xFF));
+        writeRaw(out, stats.runs);
+    }
+
+    cout << "[INFO] Allocation map: " << (end - 2) << " clusters in " << stats.runs << " runs (";
+    for (int k = 0; k < ALLOC_CLASS_COUNT; ++k)
+        cout << (k ? ", " : "") << stats.clusters[k] << " " << ALLOC_CLASS_NAMES[k];
+    cout << "); " << stats.freeRuns << " free runs, largest " << stats.largestFreeRun << " clusters.\n";
+    return stats;
 }
 
-// 2. KHÔI PHỤC TẠI CHỖ (In-Place Restore)
-bool FAT32Recovery::restoreDeletedFile(uint32_t dirCluster, int entryIndex, char newChar)
+// ======================================================================
+//                       PERSISTENT ANALYSIS INDEX
+// ======================================================================
+// Layout (little-endian, kích thước cố định -> có thể mmap trực tiếp):
+//   IndexHeader | FAT runs | DirNode records | Census records | String table
+namespace
 {
-    cout << "[RESTORE] Processing entry " << entryIndex << " in dir " << dirCluster << "...\n";
+    const char INDEX_MAGIC[8] = {'F', '3', '2', 'I', 'D', 'X', 0, 0};
+    const uint32_t INDEX_VERSION = 4;
+    const uint32_t INDEX_FAT_SAMPLES = 64; // Số sector FAT1 băm khi mở index
 
-    // A. Đọc Directory Cluster
-    vector<uint8_t> dirBuf;
-    try
+#pragma pack(push, 1)
+    struct IndexHeader
+    {
+        char magic[8];
+        uint32_t version;
+        int32_t partitionIndex;
+        uint64_t imageSize;
+        int64_t imageMtime;
+        uint64_t fatHash;       // FAT đã hợp nhất trong RAM (kiểm tra giải nén run)
+        uint64_t diskFatHash;   // FAT1 nguyên trạng trên đĩa
+        uint64_t diskSampleHash; // INDEX_FAT_SAMPLES sector của FAT1 trên đĩa
+        uint64_t fatBegin;
+        uint64_t dataBegin;
+        uint32_t totalClusters;
+        uint32_t fatEntries;
+        uint32_t sectorSize;
+        uint32_t reserved;
+        MBR mbr;
+        BootSector bootSector;
+        uint64_t fatRunsOffset;
+        uint64_t fatRunCount;
+        uint64_t dirOffset;
+        uint64_t dirCount;
+        uint64_t censusOffset;
+        uint64_t censusCount;
+        uint64_t stringsOffset;
+        uint64_t stringsSize;
+    };
+
+    // FAT nén theo run: LINK = chuỗi liên tục (FAT[i] = i + 1), FILL = cùng một giá trị
+    enum FatRunKind : uint32_t
     {
-        readCluster(dirCluster, dirBuf);
-    }
-    catch (...)
+        RUN_FILL = 0,
+        RUN_LINK = 1
+    };
+
+    struct FatRun
     {
-        return false;
-    }
+        uint32_t start;
+        uint32_t count;
+        uint32_t value;
+        uint32_t kind;
+    };
 
-    DirEntry *de = reinterpret_cast<DirEntry *>(dirBuf.data() + (entryIndex * 32));
-    if (de->name[0] != 0xE5)
-        return false;
+    struct DirRecord
+    {
+        uint32_t cluster;
+        uint32_t parentCluster;
+        uint32_t pathOffset;
+        uint32_t pathLen;
+    };
 
-    uint32_t start = de->getStartCluster();
-    uint32_t size = de->fileSize;
-    uint32_t bytesPerClus = bootSector.bytesPerSector * bootSector.sectorsPerCluster;
-    uint32_t needed = (size + bytesPerClus - 1) / bytesPerClus;
-    if (size == 0)
-        needed = 0;
+    struct CensusRecord
+    {
+        uint32_t dirCluster;
+        int32_t entryIndex;
+        uint32_t size;
+        uint32_t startCluster;
+        uint32_t lastWriteTime;
+        uint32_t creationTime;
+        uint8_t isRecoverable;
+        uint8_t isDir;
+        uint16_t lastAccessDate;
+        uint32_t nameOffset;
+        uint32_t nameLen;
+        uint32_t reasonOffset;
+        uint32_t reasonLen;
+        uint64_t contentHash; // 0 = chưa băm (dedupCensus)
+        uint32_t duplicateOfDir;
+        int32_t duplicateOfEntry;
+        float score; // -1 = chưa chấm (scoreCensus)
+        uint16_t scoreFlags;
+        int8_t lfnCheck;
+        uint8_t reserved;
+    };
+#pragma pack(pop)
 
-    // B. Chuẩn bị danh sách cluster cần chiếm (Claim List)
-    vector<uint32_t> chainToClaim;
-    if (needed > 0)
+    uint64_t hashFAT(const vector<uint32_t> &fat)
     {
-        for (uint32_t i = 0; i < needed; i++)
+        // FNV-1a trên từng entry 32-bit
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (uint32_t v : fat)
         {
-            uint32_t c = start + i;
-            // Check an toàn lần cuối
-            if (c >= FAT.size() || (FAT[c] & 0x0FFFFFFF) != 0)
-            {
-                cerr << "[ERROR] Collision detected at " << c << " during write phase. Aborting.\n";
-                return false;
-            }
-            chainToClaim.push_back(c);
+            h ^= v;
+            h *= 0x100000001b3ULL;
         }
+        return h;
     }
 
-    // C. Verify (Optional): Đọc thử cluster đầu tiên kiểm tra Signature
-    if (!chainToClaim.empty() && !de->isdDir())
+    // Cùng FNV-1a nhưng trên giá trị thô đọc từ đĩa (giữ cả 4 bit reserved)
+    void hashRawFAT(uint64_t &h, const uint8_t *p, size_t size)
     {
-        if (!verifyFileSignature(chainToClaim[0], de->getNameString()))
+        for (size_t i = 0; i + 4 <= size; i += 4)
         {
-            cout << "[WARN] Signature mismatch. Restoring anyway but file might be junk.\n";
+            h ^= read_u32_le(p + i);
+            h *= 0x100000001b3ULL;
         }
     }
 
-    // D. THỰC HIỆN GHI (Write Phase)
-
-    // 1. Sửa Dir Entry
-    de->name[0] = (uint8_t)newChar;
-
-    // 2. Cập nhật FAT Chain
-    if (!chainToClaim.empty())
+    // Index mở chỉ đọc: mmap khi được (chỉ trang cần dùng mới được nạp), không thì đọc cả file
+    struct IndexFile
     {
-        for (size_t i = 0; i < chainToClaim.size(); i++)
+        const uint8_t *base = nullptr;
+        size_t size = 0;
+        bool mapped = false;
+        vector<uint8_t> owned;
+
+        bool open(const string &path)
         {
-            uint32_t cur = chainToClaim[i];
-            uint32_t next = (i == chainToClaim.size() - 1) ? 0x0FFFFFFF : chainToClaim[i + 1];
-            FAT[cur] = next;
+#if !defined(_WIN32)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED)
+                {
+                    base = static_cast<const uint8_t *>(p);
+                    size = (size_t)st.st_size;
+                    mapped = true;
+                }
+            }
+            ::close(fd);
+#endif
+            if (!mapped)
+            {
+                ifstream in(path, ios::in | ios::binary);
+                if (!in.is_open())
+                    return false;
+                owned.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+                base = owned.data();
+                size = owned.size();
+            }
+            return true;
         }
-        writeFAT(); // Ghi 2 bảng FAT xuống đĩa
-    }
 
-    // 3. Ghi lại Directory Cluster
-    uint64_t dirOffset = cluster2Offset(dirCluster);
-    vhd.clear();
-    vhd.seekp(dirOffset, ios::beg);
-    vhd.write(reinterpret_cast<const char *>(dirBuf.data()), dirBuf.size());
-    vhd.flush();
+        ~IndexFile()
+        {
+#if !defined(_WIN32)
+            if (mapped)
+                munmap(const_cast<uint8_t *>(base), size);
+#endif
+        }
+    };
 
-    return true;
+    bool imageStamp(const string &path, uint64_t &size, int64_t &mtime)
+    {
+        error_code ec;
+        size = filesystem::file_size(path, ec);
+        if (ec)
+            return false;
+        auto t = filesystem::last_write_time(path, ec);
+        if (ec)
+            return false;
+        mtime = (int64_t)t.time_since_epoch().count();
+        return true;
+    }
 }
 
-// 3. KHÔI PHỤC ĐỆ QUY (Recursive Tree)
-void FAT32Recovery::restoreTree(uint32_t dirClusterOfParent, int entryIndex)
+bool FAT32Recovery::hashFAT1OnDisk(uint64_t fatOffset, uint64_t fatBytes, uint32_t bps, bool sampled,
+                                   uint64_t &hash) const
 {
-    cout << "[INFO] Starting recursive restore...\n";
+    hash = 0xcbf29ce484222325ULL;
+    if (bps == 0 || fatBytes < bps)
+        return false;
 
-    // Bước 1: Cứu cha trước
-    if (!restoreDeletedFile(dirClusterOfParent, entryIndex, '_'))
+    if (sampled)
     {
-        cout << "[FAIL] Parent restore failed.\n";
-        return;
+        // Sector đầu, sector cuối và các sector rải đều ở giữa: vài chục lần đọc nhỏ
+        const uint64_t sectors = fatBytes / bps;
+        const uint64_t samples = min<uint64_t>(INDEX_FAT_SAMPLES, sectors);
+        vector<uint8_t> sector(bps);
+        for (uint64_t k = 0; k < samples; ++k)
+        {
+            uint64_t s = samples > 1 ? k * (sectors - 1) / (samples - 1) : 0;
+            if (readBytes(fatOffset + s * bps, sector.data(), bps) != (ssize_t)bps)
+                return false;
+            hashRawFAT(hash, sector.data(), bps);
+        }
+        return true;
     }
 
-    // Đọc lại để lấy start cluster chính xác (sau khi restore)
-    vector<uint8_t> buf;
-    readCluster(dirClusterOfParent, buf);
-    const DirEntry *de = reinterpret_cast<const DirEntry *>(buf.data() + (entryIndex * 32));
-
-    if (de->isdDir())
+    const uint64_t chunkBytes = max<uint64_t>(bps, FAT_COMPARE_CHUNK / bps * bps);
+    vector<uint8_t> chunk;
+    for (uint64_t pos = 0; pos < fatBytes; pos += chunkBytes)
     {
-        recursiveRestoreLoop(de->getStartCluster());
+        const size_t n = (size_t)min(chunkBytes, fatBytes - pos);
+        chunk.resize(n);
+        if (readBytes(fatOffset + pos, chunk.data(), n) != (ssize_t)n)
+            return false;
+        hashRawFAT(hash, chunk.data(), n);
     }
+    return true;
 }
 
-void FAT32Recovery::recursiveRestoreLoop(uint32_t currentDirCluster)
+bool FAT32Recovery::saveIndex(const string &indexPath) const
 {
-    cout << "   [SCAN] Diving into cluster " << currentDirCluster << "...\n";
-
-    // Bước 2: Quét tìm con bằng thuật toán Collision Check
-    vector<DeletedFileInfo> children = analyzeRecoveryCandidates(currentDirCluster);
+    if (FAT.empty() || activePartition < 0)
+        return false;
 
-    for (const auto &child : children)
+    IndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.version = INDEX_VERSION;
+    h.partitionIndex = activePartition;
+    if (!imageStamp(device->path(), h.imageSize, h.imageMtime))
+        return false;
+    h.fatHash = hashFAT(FAT);
+    // FAT1 trên đĩa có thể khác FAT trong RAM (đã hợp nhất/sửa mà chưa ghi ở chế độ chỉ đọc)
+    // -> băm riêng đúng những gì loadIndex sẽ đọc lại
+    const uint64_t fatBytes = (uint64_t)bootSector.sectorsPerFat * bootSector.bytesPerSector;
+    if (!hashFAT1OnDisk(fatBegin, fatBytes, bootSector.bytesPerSector, false, h.diskFatHash) ||
+        !hashFAT1OnDisk(fatBegin, fatBytes, bootSector.bytesPerSector, true, h.diskSampleHash))
+        return false;
+    h.fatBegin = fatBegin;
+    h.dataBegin = dataBegin;
+    h.totalClusters = totalClusters;
+    h.fatEntries = (uint32_t)FAT.size();
+    h.sectorSize = sectorSize;
+    h.mbr = mbr;
+    h.bootSector = bootSector;
+
+    // 1. Nén FAT thành các run
+    vector<FatRun> runs;
+    for (uint32_t i = 0; i < FAT.size(); ++i)
     {
-        if (child.isRecoverable && child.name != "." && child.name != "..")
+        uint32_t v = FAT[i];
+        if (!runs.empty())
         {
-            // Bước 3: Cứu con (In-place)
-            bool ok = restoreDeletedFile(currentDirCluster, child.entryIndex, '_');
-
-            // Bước 4: Đệ quy nếu con là Folder
-            if (ok && child.isDir)
+            FatRun &r = runs.back();
+            if (r.start + r.count == i)
             {
-                // Tránh loop vô tận
-                if (child.startCluster != currentDirCluster && child.startCluster != 0)
-                    recursiveRestoreLoop(child.startCluster);
+                if (r.kind == RUN_FILL && v == r.value)
+                {
+                    r.count++;
+                    continue;
+                }
+                if (r.kind == RUN_LINK && v == i + 1)
+                {
+                    r.count++;
+                    continue;
+                }
+                // Run FILL một phần tử có thể đổi thành LINK
+                if (r.count == 1 && r.kind == RUN_FILL && r.value == r.start + 1 && v == i + 1)
+                {
+                    r.kind = RUN_LINK;
+                    r.count++;
+                    continue;
+                }
             }
         }
+        runs.push_back({i, 1, v, RUN_FILL});
     }
-}
 
-// Helper: Verify Signature đơn giản
-bool FAT32Recovery::verifyFileSignature(uint32_t startCluster, string filename)
-{
-    // Lấy extension
-    size_t dotPos = filename.find_last_of(".");
-    if (dotPos == string::npos)
-        return true;                          // Không có đuôi -> bỏ qua check
-    string ext = filename.substr(dotPos + 1); // Cần toUpper nếu muốn chắc chắn
+    // 2. Cây thư mục + census, chuỗi gom vào string table
+    string strings;
+    auto addString = [&](const string &str, uint32_t &off, uint32_t &len)
+    {
+        off = (uint32_t)strings.size();
+        len = (uint32_t)str.size();
+        strings += str;
+    };
 
-    vector<uint8_t> buf;
-    try
+    vector<DirRecord> dirs;
+    for (const auto &node : dirTree)
     {
-        readCluster(startCluster, buf);
+        DirRecord d = {node.cluster, node.parentCluster, 0, 0};
+        addString(node.path, d.pathOffset, d.pathLen);
+        dirs.push_back(d);
     }
-    catch (...)
+
+    vector<CensusRecord> records;
+    for (const auto &kv : census)
     {
-        return false;
+        for (const auto &f : kv.second)
+        {
+            CensusRecord r;
+            memset(&r, 0, sizeof(r));
+            r.dirCluster = kv.first;
+            r.entryIndex = f.entryIndex;
+            r.size = f.size;
+            r.startCluster = f.startCluster;
+            r.lastWriteTime = f.lastWriteTime;
+            r.creationTime = f.creationTime;
+            r.isRecoverable = f.isRecoverable;
+            r.isDir = f.isDir;
+            r.lastAccessDate = f.lastAccessDate;
+            addString(f.name, r.nameOffset, r.nameLen);
+            addString(f.statusReason, r.reasonOffset, r.reasonLen);
+            r.contentHash = f.contentHash;
+            r.duplicateOfDir = f.duplicateOfDir;
+            r.duplicateOfEntry = f.duplicateOfEntry;
+            r.score = f.score;
+            r.scoreFlags = f.scoreFlags;
+            r.lfnCheck = f.lfnCheck;
+            records.push_back(r);
+        }
     }
-    if (buf.size() < 4)
-        return false;
 
-    // Check mẫu vài loại phổ biến
-    if (ext == "JPG" || ext == "JPEG")
-        return buf[0] == 0xFF && buf[1] == 0xD8;
-    if (ext == "PNG")
-        return buf[0] == 0x89 && buf[1] == 'P' && buf[2] == 'N' && buf[3] == 'G';
+    h.fatRunsOffset = sizeof(IndexHeader);
+    h.fatRunCount = runs.size();
+    h.dirOffset = h.fatRunsOffset + runs.size() * sizeof(FatRun);
+    h.dirCount = dirs.size();
+    h.censusOffset = h.dirOffset + dirs.size() * sizeof(DirRecord);
+    h.censusCount = records.size();
+    h.stringsOffset = h.censusOffset + records.size() * sizeof(CensusRecord);
+    h.stringsSize = strings.size();
+
+    // Ghi ra file tạm rồi rename để không bao giờ để lại index dở dang
+    string tmpPath = indexPath + ".tmp";
+    {
+        ofstream out(tmpPath, ios::out | ios::binary | ios::trunc);
+        if (!out.is_open())
+            return false;
+        writeAll(out, &h, sizeof(h));
+        writeAll(out, runs.data(), runs.size() * sizeof(FatRun));
+        writeAll(out, dirs.data(), dirs.size() * sizeof(DirRecord));
+        writeAll(out, records.data(), records.size() * sizeof(CensusRecord));
+        writeAll(out, strings.data(), strings.size());
+    }
+    error_code ec;
+    filesystem::rename(tmpPath, indexPath, ec);
+    if (ec)
+        return false;
 
+    cout << "[INFO] Index saved: " << indexPath << " (" << runs.size() << " FAT runs, "
+         << dirs.size() << " dirs, " << records.size() << " deleted entries)\n";
     return true;
 }
-// ======================================================================
-//                       Scanning & recovery routines
-// ======================================================================
-vector<uint32_t> FAT32Recovery:: followFAT(uint32_t startCluster) const
-{
-    vector<uint32_t> chain;
 
-    // 0. Kiểm tra điều kiện tiên quyết
-    // Nếu bảng FAT chưa load hoặc startCluster là 0 (file rỗng), trả về rỗng ngay.
-    if (FAT.empty())
-    {
-        cerr << "[ERROR] FAT table is not loaded yet.\n";
-        return chain;
-    }
-    if (startCluster == 0)
+bool FAT32Recovery::loadIndex(const string &indexPath, int partitionIndex, bool verifyFAT)
+{
+    // mmap: index lệch khóa chỉ chạm trang header, phần còn lại dùng thẳng trên vùng map
+    IndexFile file;
+    if (!file.open(indexPath))
+        return false;
+    const uint64_t fileSize = file.size;
+    if (fileSize < sizeof(IndexHeader))
+        return false;
+    const uint8_t *raw = file.base;
+
+    IndexHeader h;
+    memcpy(&h, raw, sizeof(h));
+
+    // 1. Khóa: magic/version + partition + kích thước/mtime của image
+    uint64_t imgSize;
+    int64_t imgMtime;
+    if (memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) != 0 || h.version != INDEX_VERSION ||
+        h.partitionIndex != partitionIndex || !imageStamp(device->path(), imgSize, imgMtime) ||
+        imgSize != h.imageSize || imgMtime != h.imageMtime ||
+        (h.sectorSize != FAT32Const::SECTOR_SIZE && h.sectorSize != FAT32Const::SECTOR_SIZE_4KN))
     {
-        return chain; // File rỗng, không có lỗi
+        cout << "[INFO] Index " << indexPath << " is stale or does not match this image.\n";
+        return false;
     }
 
-    // Dự đoán kích thước vector để giảm chi phí cấp phát bộ nhớ liên tục
-    // (Optional: Giả sử file trung bình có vài cluster)
-    chain.reserve(32);
-
-    // Sử dụng Set để phát hiện vòng lặp (Safety mechanism)
-    set<uint32_t> visited;
-
-    uint32_t current = startCluster;
-    const uint32_t FAT32_MASK = 0x0FFFFFFF;
-    const uint32_t EOC_MARK = 0x0FFFFFF8;
-    const uint32_t BAD_CLUS = 0x0FFFFFF7;
+    auto inBounds = [&](uint64_t off, uint64_t count, size_t recSize)
+    { return off <= fileSize && count <= (fileSize - off) / recSize; };
+    if (!inBounds(h.fatRunsOffset, h.fatRunCount, sizeof(FatRun)) ||
+        !inBounds(h.dirOffset, h.dirCount, sizeof(DirRecord)) ||
+        !inBounds(h.censusOffset, h.censusCount, sizeof(CensusRecord)) ||
+        !inBounds(h.stringsOffset, h.stringsSize, 1))
+        return false;
 
-    while (true)
+    const char *strings = (const char *)raw + h.stringsOffset;
+    auto getString = [&](uint32_t off, uint32_t len) -> string
     {
-        // 1. Kiểm tra biên (Boundary Check)
-        // Cluster < 2 là reserved (trừ khi tính toán sai), >= size là lỗi
-        if (current < 2 || current >= FAT.size())
-        {
-            cerr << "[WARN] Chain points to invalid cluster index: " << current << " (Out of FAT bounds)\n";
-            break;
-        }
-
-        // 2. Kiểm tra vòng lặp (Loop Detection)
-        // Nếu cluster đã tồn tại trong set -> Có vòng lặp
-        if (visited.find(current) != visited.end())
-        {
-            cerr << "[WARN] FAT Cycle detected at cluster " << current << ". Cutting chain here.\n";
-            break;
-        }
-
-        // 3. Đọc giá trị tiếp theo
-        uint32_t next = FAT[current] & FAT32_MASK;
-
-        // 4. Các điều kiện dừng
+        if ((uint64_t)off + len > h.stringsSize)
+            return string();
+        return string(strings + off, len);
+    };
 
-        // A. End of Chain (EOC)
-        if (next >= EOC_MARK)
-        {
-            // Đây là kết thúc bình thường, không cần log lỗi
-            break;
-        }
+    // 2. FAT1 trên đĩa: mặc định chỉ băm vài sector lấy mẫu (mili giây), verifyFAT băm cả bảng.
+    //    Bắt được ghi vào image sau khi lưu index mà giữ nguyên mtime (dd conv=notrunc, công cụ khác...)
+    const uint64_t fatBytes = (uint64_t)h.bootSector.sectorsPerFat * h.bootSector.bytesPerSector;
+    uint64_t diskHash;
+    if (!hashFAT1OnDisk(h.fatBegin, fatBytes, h.bootSector.bytesPerSector, !verifyFAT, diskHash) ||
+        diskHash != (verifyFAT ? h.diskFatHash : h.diskSampleHash))
+    {
+        cout << "[INFO] FAT on disk differs from index " << indexPath << ", rescanning.\n";
+        return false;
+    }
 
-        // B. Bad Cluster
-        if (next == BAD_CLUS)
-        {
-            cerr << "[WARN] Chain hit BAD CLUSTER at index " << current << "\n";
-            break;
-        }
+    // 3. Giải nén FAT đã hợp nhất từ các run (FAT trong RAM là vector phẳng)
+    vector<uint32_t> fat(h.fatEntries, 0);
+    const FatRun *runs = reinterpret_cast<const FatRun *>(raw + h.fatRunsOffset);
+    for (uint64_t r = 0; r < h.fatRunCount; ++r)
+    {
+        FatRun run;
+        memcpy(&run, &runs[r], sizeof(run));
+        if ((uint64_t)run.start + run.count > fat.size())
+            return false;
+        for (uint32_t i = 0; i < run.count; ++i)
+            fat[run.start + i] = run.kind == RUN_LINK ? run.start + i + 1 : run.value;
+    }
+    if (hashFAT(fat) != h.fatHash)
+        return false;
 
-        // C. Free Cluster (0) - Broken Chain
-        if (next == 0)
-        {
-            // Trong recovery, file đang có dữ liệu mà trỏ về 0 nghĩa là mất đoạn sau.
-            cerr << "[WARN] Chain broken (points to FREE/0) at cluster " << current << "\n";
-            break;
-        }
+    // 4. Khôi phục trạng thái volume
+    mbr = h.mbr;
+    sectorSize = h.sectorSize;
+    discoverPartitions(); // Chỉ đọc vài sector (EBR/GPT), để scan/analyze thấy đúng danh sách
+    bootSector = h.bootSector;
+    fatBegin = h.fatBegin;
+    dataBegin = h.dataBegin;
+    totalClusters = h.totalClusters;
+    FAT = move(fat);
+    clearFATDirty();
+    loadFSInfo();
+    activePartition = partitionIndex;
+    clusterCache.clear();
+
+    dirTree.clear();
+    const DirRecord *dirs = reinterpret_cast<const DirRecord *>(raw + h.dirOffset);
+    for (uint64_t i = 0; i < h.dirCount; ++i)
+    {
+        DirRecord d;
+        memcpy(&d, &dirs[i], sizeof(d));
+        dirTree.push_back({d.cluster, d.parentCluster, getString(d.pathOffset, d.pathLen)});
+    }
 
-        // 5. Di chuyển tiếp
-        // Ghi nhận cluster
-        visited.insert(current);
-        chain.push_back(current);
-        current = next;
+    census.clear();
+    candidateClaims.clear();
+    const CensusRecord *recs = reinterpret_cast<const CensusRecord *>(raw + h.censusOffset);
+    for (uint64_t i = 0; i < h.censusCount; ++i)
+    {
+        CensusRecord r;
+        memcpy(&r, &recs[i], sizeof(r));
+        DeletedFileInfo f;
+        f.entryIndex = r.entryIndex;
+        f.name = getString(r.nameOffset, r.nameLen);
+        f.size = r.size;
+        f.startCluster = r.startCluster;
+        f.lastWriteTime = r.lastWriteTime;
+        f.creationTime = r.creationTime;
+        f.isRecoverable = r.isRecoverable != 0;
+        f.statusReason = getString(r.reasonOffset, r.reasonLen);
+        f.isDir = r.isDir != 0;
+        f.lastAccessDate = r.lastAccessDate;
+        f.contentHash = r.contentHash;
+        f.duplicateOfDir = r.duplicateOfDir;
+        f.duplicateOfEntry = r.duplicateOfEntry;
+        f.score = r.score;
+        f.scoreFlags = r.scoreFlags;
+        f.lfnCheck = r.lfnCheck;
+        census[r.dirCluster].push_back(f);
     }
 
-    return chain;
+    cout << "[SUCCESS] Loaded analysis index " << indexPath << " (" << dirTree.size()
+         << " dirs, " << h.censusCount << " deleted entries). Skipping rescans.\n";
+    return true;
 }
 
 // ======================================================================
-//                       UTILS
+//                       MULTI-PARTITION PROCESSING
 // ======================================================================
-void FAT32Recovery::readCluster(uint32_t cluster, vector<uint8_t> &buffer) const
+unique_ptr<FAT32Recovery> FAT32Recovery::openVolume() const
 {
-    // 1. Kiểm tra tính hợp lệ
-    // Cluster trong FAT32 bắt đầu từ 2. Các giá trị 0 và 1 được dành riêng.
-    if (cluster < 2)
-    {
-        // Có thể throw lỗi hoặc return rỗng tùy chiến lược xử lý lỗi
-        throw runtime_error("Invalid cluster number: " + to_string(cluster));
-    }
-
-    // 2. Tính toán Offset (Vị trí byte trên đĩa)
-    // Công thức: Offset = Start_Data_Region + (Cluster_Index - 2) * Cluster_Size
-    uint32_t clusterSize = bootSector.sectorsPerCluster * bootSector.bytesPerSector;
+    unique_ptr<FAT32Recovery> vol(new FAT32Recovery(device, mbr, partitions));
+    vol->sectorSize = sectorSize;
+    vol->setIOThreads(ioThreads);
+    vol->setCacheBudget(clusterCache.getBudget());
+    vol->setOwnerMapBudget(ownerMapBudget);
+    return vol;
+}
 
-    // Cần ép kiểu uint64_t để tránh tràn số (overflow) với ổ đĩa lớn
-    uint64_t offset = dataBegin + (uint64_t)(cluster - 2) * clusterSize;
+vector<VolumeReport> FAT32Recovery::analyzeAllPartitions(unsigned threads)
+{
+    // Chỉ lấy các partition FAT32 (tránh reconstructBPB ghi đè lên partition lạ)
+    vector<int> targets;
+    for (size_t i = 0; i < partitions.size(); ++i)
+        if (partitions[i].isFAT32)
+            targets.push_back((int)i);
 
-    // 3. Chuẩn bị Buffer
-    // Resize buffer đúng bằng kích thước 1 cluster để chứa dữ liệu
-    buffer.resize(clusterSize);
+    vector<VolumeReport> reports(targets.size());
+    if (targets.empty())
+        return reports;
 
-    // 4. Đọc dữ liệu
-    // Gọi hàm readBytes (đã viết lại dùng fstream)
-    ssize_t bytesRead = readBytes(offset, buffer.data(), clusterSize);
+    // Chia budget cache cho các volume để tổng bộ nhớ không vượt giới hạn
+    size_t perVolumeBudget = clusterCache.getBudget() / targets.size();
+    atomic<size_t> next(0);
 
-    // 5. Kiểm tra lỗi đọc
-    if (bytesRead != (ssize_t)clusterSize)
+    auto worker = [&]()
     {
-        throw runtime_error("Failed to read cluster " + to_string(cluster));
-    }
-}
+        for (size_t k = next++; k < targets.size(); k = next++)
+        {
+            VolumeReport &r = reports[k];
+            r.partitionIndex = targets[k];
+            r.ok = false;
+            try
+            {
+                unique_ptr<FAT32Recovery> vol = openVolume();
+                vol->setCacheBudget(perVolumeBudget);
+                if (!vol->initializeVolume(targets[k]))
+                    throw runtime_error("Cannot initialize partition " + to_string(targets[k]));
+                vol->loadFAT();
+                vol->buildCensus();
+                r.tree = vol->getDirectoryTree();
+                r.census = vol->getCensus();
+                r.ok = true;
+            }
+            catch (const exception &e)
+            {
+                r.error = e.what();
+            }
+        }
+    };
 
-uint64_t FAT32Recovery::cluster2Offset(uint32_t cluster) const
-{
-    if (cluster < 2)
-        throw runtime_error("Invalid cluster number");
+    unsigned workers = max(1u, min<unsigned>(threads, (unsigned)targets.size()));
+    vector<thread> pool;
+    for (unsigned i = 1; i < workers; ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
 
-    return dataBegin + uint64_t(cluster - 2) * bootSector.sectorsPerCluster * bootSector.bytesPerSector;
-}
\ No newline at end of file
+    return reports;
+}
@@ -12,13 +12,30 @@
 #include <cstring>
 #include <stdexcept>
 #include <cerrno>
+#include <mutex>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <sstream>
 
 using namespace std;
 
 // Utils
 static inline uint16_t read_u16_le(const uint8_t *p) { return uint16_t(p[0]) | (uint16_t(p[1]) << 8); }
 static inline uint32_t read_u32_le(const uint8_t *p) { return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24); }
+static inline uint64_t read_u64_le(const uint8_t *p) { return uint64_t(read_u32_le(p)) | (uint64_t(read_u32_le(p + 4)) << 32); }
+#if defined(_MSC_VER)
 typedef signed long long ssize_t;
+#else
+#include <sys/types.h> // POSIX/MinGW đã có sẵn ssize_t
+#endif
 
 // Constants
 namespace FAT32Const
@@ -26,9 +43,174 @@ namespace FAT32Const
     const uint16_t SIGNATURE_LE = 0xAA55;
     const uint8_t PART_TYPE_FAT32_LBA = 0x0C; // Chuẩn LBA
     const uint8_t PART_TYPE_FAT32_CHS = 0x0B; // Chuẩn cũ
-    const uint64_t SECTOR_SIZE = 512;
+    const uint8_t PART_TYPE_EXTENDED_CHS = 0x05; // Extended (chuỗi EBR)
+    const uint8_t PART_TYPE_EXTENDED_LBA = 0x0F;
+    const uint8_t PART_TYPE_LINUX_EXTENDED = 0x85;
+    const uint8_t PART_TYPE_GPT_PROTECTIVE = 0xEE; // MBR bảo vệ của đĩa GPT
+    const uint64_t SECTOR_SIZE = 512;       // Sector logic mặc định
+    const uint64_t SECTOR_SIZE_4KN = 4096;  // Đĩa 4Kn (Advanced Format native)
+    const uint32_t FSINFO_LEAD_SIG = 0x41615252;   // "RRaA"
+    const uint32_t FSINFO_STRUCT_SIG = 0x61417272; // "rrAa"
+    const uint32_t FSINFO_TRAIL_SIG = 0xAA550000;
+    const uint32_t FSINFO_UNKNOWN = 0xFFFFFFFF;    // free count / next free chưa biết
 }
 
+// Logging có cấp độ, không chặn luồng gọi: bản ghi được đẩy vào ring buffer
+// lock-free và một luồng nền ghi ra stderr. Cảnh báo lặp lại (cùng key) chỉ
+// in N lần đầu, phần còn lại được đếm và in tổng kết khi shutdown.
+enum LogLevel
+{
+    LOG_DEBUG = 0,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF
+};
+
+// Cấp độ tối thiểu lúc biên dịch: bản ghi thấp hơn bị loại bỏ hoàn toàn
+#ifndef FAT32_LOG_MIN_LEVEL
+#define FAT32_LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+class Logger
+{
+public:
+    static void setLevel(LogLevel level) { runtimeLevel.store(level, memory_order_relaxed); }
+    static LogLevel getLevel() { return (LogLevel)runtimeLevel.load(memory_order_relaxed); }
+    static bool enabled(LogLevel level)
+    {
+        return level >= FAT32_LOG_MIN_LEVEL && level >= runtimeLevel.load(memory_order_relaxed);
+    }
+
+    // Số bản ghi tối đa được in cho mỗi key (0 = không giới hạn)
+    static void setRateLimit(unsigned perKey) { rateLimit.store(perKey, memory_order_relaxed); }
+
+    // key phải là chuỗi hằng (so sánh theo con trỏ), dùng làm nhãn khi tổng kết
+    static void log(LogLevel level, const char *key, string message);
+
+    // Ghi hết các bản ghi đang chờ (đồng bộ)
+    static void drain();
+    // drain + in tổng kết các cảnh báo bị gộp + dừng luồng nền
+    static void shutdown();
+
+private:
+    static atomic<int> runtimeLevel;
+    static atomic<unsigned> rateLimit;
+};
+
+#define FAT32_LOG(level, key, expr)                  \
+    do                                                \
+    {                                                 \
+        if (Logger::enabled(level))                   \
+        {                                             \
+            ostringstream fat32LogStream_;            \
+            fat32LogStream_ << expr;                  \
+            Logger::log(level, key, fat32LogStream_.str()); \
+        }                                             \
+    } while (0)
+
+// Đo đạc: bộ đếm + thời gian từng pha. Khi tắt, mỗi lần gọi chỉ tốn 1 lần đọc atomic.
+class Metrics
+{
+public:
+    enum Counter
+    {
+        BYTES_READ,
+        BYTES_WRITTEN,
+        READ_CALLS,
+        WRITE_CALLS,
+        CACHE_HITS,
+        CACHE_MISSES,
+        CLUSTERS_WALKED,
+        BYTES_SKIPPED, // Vùng hole / toàn 0 mà scan bỏ qua không cần phân tích
+        FAT_ENTRIES_MERGED, // Entry FAT khác nhau giữa các bản sao, đã được hợp nhất
+        BYTES_HASHED,       // Dữ liệu ứng viên đã băm (dedup)
+        CLUSTERS_SAMPLED,   // Cluster đọc mẫu khi chấm điểm ứng viên
+        CLUSTERS_CLASSIFIED, // Cluster đã phân loại nội dung (entropy / histogram)
+        COUNTER_COUNT
+    };
+
+    enum Phase
+    {
+        PHASE_NONE = -1,
+        PHASE_MBR,
+        PHASE_BPB,
+        PHASE_FAT_LOAD,
+        PHASE_SCAN,
+        PHASE_ANALYZE,
+        PHASE_RESTORE,
+        PHASE_EXPORT,
+        PHASE_CARVE,
+        PHASE_HASH,
+        PHASE_SCORE,
+        PHASE_COUNT
+    };
+
+    static void enable(bool on) { enabledFlag.store(on, memory_order_relaxed); }
+    static bool isEnabled() { return enabledFlag.load(memory_order_relaxed); }
+
+    static void add(Counter c, uint64_t value)
+    {
+        if (isEnabled())
+            counters[c].fetch_add(value, memory_order_relaxed);
+    }
+
+    static uint64_t get(Counter c) { return counters[c].load(memory_order_relaxed); }
+
+    static void addPhase(Phase p, uint64_t nanos);
+    // Pha hiện tại tính theo từng luồng (nhiều volume có thể được phân tích song song)
+    static Phase enterPhase(Phase p);
+    static void leavePhase(Phase previous);
+
+    static void reset();
+    static string toJSON();
+    static string toPrometheus();
+
+    // Dòng tiến độ định kỳ ra stderr (intervalMs = 0 -> tắt)
+    static void startProgress(unsigned intervalMs);
+    static void stopProgress();
+
+private:
+    static atomic<bool> enabledFlag;
+    static atomic<uint64_t> counters[COUNTER_COUNT];
+    static atomic<uint64_t> phaseNanos[PHASE_COUNT];
+    static atomic<uint64_t> phaseCalls[PHASE_COUNT];
+    static atomic<int> activeThreads[PHASE_COUNT]; // Số luồng đang ở pha này (pha trong cùng)
+    static thread_local Phase currentPhase;
+
+    static void switchPhase(Phase from, Phase to);
+};
+
+// Đo thời gian một pha theo scope (RAII)
+class ScopedPhase
+{
+public:
+    explicit ScopedPhase(Metrics::Phase p) : phase(p), active(Metrics::isEnabled())
+    {
+        if (active)
+        {
+            previous = Metrics::enterPhase(p);
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    ~ScopedPhase()
+    {
+        if (active)
+        {
+            auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            Metrics::addPhase(phase, (uint64_t)ns);
+            Metrics::leavePhase(previous);
+        }
+    }
+
+private:
+    Metrics::Phase phase;
+    Metrics::Phase previous = Metrics::PHASE_NONE;
+    bool active;
+    chrono::steady_clock::time_point start;
+};
+
 // Struct lưu thông tin file bị xóa (Dùng cho phân tích)
 struct DeletedFileInfo
 {
@@ -40,10 +222,261 @@ struct DeletedFileInfo
     // Timestamps để so sánh xung đột
     uint32_t lastWriteTime;
     uint32_t creationTime;
+    uint16_t lastAccessDate = 0; // FAT chỉ lưu ngày truy cập (dùng cho timeline)
 
     bool isRecoverable;
     string statusReason; // Lý do (Good, Collision, Overwritten...)
     bool isDir;          // Cờ đánh dấu là Folder
+
+    // Dedup (dedupCensus): xxHash64 của nội dung, 0 = chưa băm.
+    // duplicateOfEntry >= 0: trùng nội dung với entry (duplicateOfDir, duplicateOfEntry)
+    uint64_t contentHash = 0;
+    uint32_t duplicateOfDir = 0;
+    int duplicateOfEntry = -1;
+
+    // Checksum LFN đứng ngay trước entry: 1 = khớp, -1 = có LFN nhưng không khớp, 0 = không kết luận
+    int8_t lfnCheck = 0;
+
+    // Chấm điểm (scoreCandidates): xác suất khôi phục được 0..1, -1 = chưa chấm.
+    // scoreFlags: các bằng chứng ScoreEvidence đã thấy
+    float score = -1.0f;
+    uint16_t scoreFlags = 0;
+};
+
+// Bằng chứng dùng khi chấm điểm ứng viên (bit trong DeletedFileInfo::scoreFlags)
+namespace ScoreEvidence
+{
+    const uint16_t SIGNATURE_MATCH = 1 << 0;    // Header khớp đuôi file
+    const uint16_t SIGNATURE_MISMATCH = 1 << 1; // Đuôi đã biết nhưng header khác
+    const uint16_t ZERO_DATA = 1 << 2;          // Có cluster mẫu toàn 0
+    const uint16_t TYPE_MISMATCH = 1 << 3;      // Entropy / cấu trúc không hợp với loại file
+    const uint16_t LFN_OK = 1 << 4;
+    const uint16_t LFN_BAD = 1 << 5;
+    const uint16_t TIME_ORDER = 1 << 6;         // Timestamp lệch thứ tự so với entry lân cận
+    const uint16_t PARTLY_USED = 1 << 7;        // Một phần cluster đã bị file sống chiếm
+    const uint16_t READ_ERROR = 1 << 8;
+    const uint16_t NOT_DIRECTORY = 1 << 9;      // Thư mục nhưng cluster đầu không còn là bảng entry
+}
+
+// Thống kê một lần dựng timeline
+struct TimelineStats
+{
+    uint64_t entries; // entry đã duyệt (sống + đã xóa)
+    uint64_t events;  // mốc thời gian đã ghi
+    size_t runs;      // số run đã spill ra đĩa khi sort ngoài (0 = sort trong RAM)
+};
+
+// Kết quả xuất hàng loạt (exportCensus) cho từng ứng viên
+struct ExportRecord
+{
+    uint32_t dirCluster;
+    int entryIndex;
+    string outPath; // rỗng nếu không ghi ra
+    uint64_t size;
+    uint64_t contentHash;
+    string status; // "exported", "duplicate", "known", "failed"
+    bool known;    // khớp hash set file đã biết (status "known" nếu bị bỏ qua)
+};
+
+// xxHash64 dạng stream: 4 accumulator độc lập trên mỗi stripe 32 byte
+class XXHash64
+{
+public:
+    explicit XXHash64(uint64_t seed = 0);
+    void update(const void *data, size_t size);
+    uint64_t digest() const;
+
+    static uint64_t hash(const void *data, size_t size, uint64_t seed = 0);
+
+private:
+    uint64_t acc[4];
+    uint8_t tail[32];
+    size_t tailSize;
+    uint64_t total;
+    uint64_t seed;
+};
+
+// MD5 dạng stream (RFC 1321): chỉ để so với hash set chuẩn (NSRL, md5sum).
+// key64 = 8 byte đầu của digest (big-endian) = 16 ký tự hex đầu tiên
+class MD5Hash
+{
+public:
+    MD5Hash();
+    void update(const void *data, size_t size);
+    void digest(uint8_t out[16]) const;
+    uint64_t key64() const;
+
+private:
+    uint32_t state[4];
+    uint8_t block[64];
+    size_t blockSize;
+    uint64_t total;
+
+    static void transform(uint32_t state[4], const uint8_t *p);
+};
+
+// Loại nội dung của một cluster, suy từ histogram byte
+enum ContentClass : uint8_t
+{
+    CONTENT_ZERO,       // Toàn 0 (chưa ghi / đã xóa trắng)
+    CONTENT_TEXT,       // Gần như toàn ký tự in được
+    CONTENT_COMPRESSED, // Entropy gần 8 bit/byte (nén, mã hóa, media)
+    CONTENT_STRUCTURED  // Còn lại: nhị phân có cấu trúc, bảng, header...
+};
+
+struct ClusterProfile
+{
+    float entropy;   // Shannon, bit/byte (0..8)
+    float printable; // Tỷ lệ byte ASCII in được (kể cả \t \n \r)
+    ContentClass type;
+};
+
+// Phân loại nội dung theo histogram byte: 4 histogram xen kẽ để các lần tăng liền nhau
+// không phụ thuộc cùng một ô nhớ, vùng toàn 0 được nhận ra bằng SSE2 mà không cần đếm
+class ContentClassifier
+{
+public:
+    static ClusterProfile profile(const uint8_t *data, size_t size);
+    static const char *className(ContentClass type);
+};
+
+// Hash set file đã biết (kiểu NSRL) trên xxHash64 nội dung:
+//   header | Bloom filter | mảng hash đã sắp xếp
+// File được mmap nên mở gần như tức thì và không tốn heap; Bloom filter (giới hạn theo
+// ngân sách lúc dựng) loại phần lớn truy vấn trước khi phải tìm nhị phân trong mảng.
+class KnownHashSet
+{
+public:
+    struct Stats
+    {
+        uint64_t lookups;
+        uint64_t bloomRejects;
+        uint64_t matches;
+    };
+
+    // Loại digest của các key trong file (MD5: key = 64 bit đầu của digest)
+    enum Digest : uint32_t
+    {
+        DIGEST_XXH64 = 0,
+        DIGEST_MD5 = 1
+    };
+
+    KnownHashSet();
+    ~KnownHashSet();
+    KnownHashSet(const KnownHashSet &) = delete;
+    KnownHashSet &operator=(const KnownHashSet &) = delete;
+
+    static bool build(vector<uint64_t> hashes, const string &path, size_t bloomBudget = 64 << 20,
+                      Digest digest = DIGEST_XXH64);
+
+    bool open(const string &path);
+    void close();
+    bool isOpen() const { return keys != nullptr; }
+    uint64_t size() const { return count; }
+    Digest digest() const { return digestKind; }
+
+    bool contains(uint64_t hash) const;
+    Stats getStats() const;
+
+private:
+    const uint8_t *base;
+    size_t baseSize;
+    bool mapped;
+    vector<uint8_t> owned; // khi không mmap được: đọc cả file
+
+    const uint64_t *bloom;
+    uint64_t bloomBits; // lũy thừa của 2
+    uint32_t bloomHashes;
+    const uint64_t *keys;
+    uint64_t count;
+    Digest digestKind;
+
+    mutable atomic<uint64_t> lookups;
+    mutable atomic<uint64_t> bloomRejects;
+    mutable atomic<uint64_t> matches;
+};
+
+// Một thư mục còn sống trong cây thư mục của volume
+struct DirNode
+{
+    uint32_t cluster;
+    uint32_t parentCluster;
+    string path; // "/DIR/SUB"
+};
+
+// Entry còn sống (file hoặc thư mục) tìm được khi duyệt cây từ root
+struct LiveEntry
+{
+    uint32_t dirCluster; // cluster thư mục chứa entry (giống analyze/restore)
+    int entryIndex;      // vị trí entry trong cluster đó
+    uint32_t startCluster;
+    uint32_t size;
+    bool isDir;
+    string path; // "/DIR/FILE.TXT"
+};
+
+// Chủ sở hữu của từng cluster trong cửa sổ [firstCluster, firstCluster + owner.size()):
+// 1 id 32-bit / cluster (chỉ số LiveEntry + 1). Volume lớn hơn ngân sách bộ nhớ được
+// xử lý theo nhiều cửa sổ, mỗi cửa sổ 1 lượt qua mọi chuỗi.
+struct ClusterOwnerMap
+{
+    static constexpr uint32_t NO_OWNER = 0;
+    static constexpr uint32_t SHARED = 0xFFFFFFFF; // nhiều entry cùng nhận (cross-link)
+
+    uint32_t firstCluster = 0;
+    vector<uint32_t> owner;
+
+    bool covers(uint32_t c) const { return c >= firstCluster && c - firstCluster < owner.size(); }
+    uint32_t get(uint32_t c) const { return covers(c) ? owner[c - firstCluster] : NO_OWNER; }
+};
+
+// Một cluster bị nhiều entry còn sống cùng nhận trong chuỗi FAT
+struct CrossLink
+{
+    uint32_t cluster;
+    vector<uint32_t> owners; // chỉ số trong danh sách LiveEntry, tăng dần
+};
+
+// Trạng thái từng cluster trong bản đồ cấp phát (writeAllocationMap)
+enum AllocClass : uint8_t
+{
+    ALLOC_FREE,      // FAT = 0, không ứng viên nào nhận
+    ALLOC_LIVE,      // Thuộc cây thư mục còn sống
+    ALLOC_DELETED,   // Trống, đúng một file đã xóa nhận (giả định liên tục)
+    ALLOC_CONTESTED, // File đã xóa nhận nhưng đã bị cấp phát lại hoặc nhiều file cùng nhận
+    ALLOC_BAD,       // 0x0FFFFFF7
+    ALLOC_ORPHAN,    // Đã cấp phát nhưng không đi tới được từ root
+    ALLOC_CLASS_COUNT
+};
+
+struct AllocationMapStats
+{
+    uint64_t clusters[ALLOC_CLASS_COUNT];
+    uint64_t runs;
+    uint32_t largestFreeRun;
+    uint64_t freeRuns; // số đoạn trống: càng nhiều càng phân mảnh
+};
+
+// Chuỗi cluster mồ côi: đã cấp phát trong FAT nhưng không entry thư mục nào trỏ tới
+struct OrphanChain
+{
+    uint32_t head;          // cluster đầu chuỗi (không có entry FAT nào trỏ tới)
+    uint32_t clusters;      // độ dài chuỗi
+    bool isDir;             // cluster đầu có '.' (trỏ chính nó) và '..' hợp lệ
+    uint32_t parentCluster; // '..' của thư mục mồ côi (0 = root)
+    bool nested;            // được một thư mục mồ côi khác liệt kê -> đi theo thư mục đó
+    string lostPath;        // vị trí sau khi graft ("/LOST.DIR/FILE0000.CHK"), rỗng nếu chưa graft
+};
+
+// Kết quả carving (file tìm được trong vùng cluster trống theo signature)
+struct CarvedFile
+{
+    uint32_t startCluster;
+    uint64_t size;
+    string type;    // jpg, png, pdf, gif, zip
+    string outPath; // Rỗng nếu chỉ liệt kê (hoặc bị bỏ qua vì khớp hash set)
+    uint64_t contentHash = 0; // xxHash64, chỉ có khi đã ghi ra hoặc có hash set
+    bool known = false;       // khớp hash set file đã biết
 };
 
 #pragma pack(push, 1)
@@ -98,6 +531,18 @@ struct BootSector
     uint16_t bootSignature;
 };
 
+// Sector FSInfo (thường ở sector 1 của volume, backup ở sector 7)
+struct FSInfo
+{
+    uint32_t leadSignature;   // 0x41615252
+    uint8_t reserved1[480];
+    uint32_t structSignature; // 0x61417272
+    uint32_t freeCount;       // số cluster trống, 0xFFFFFFFF = chưa biết
+    uint32_t nextFree;        // gợi ý cluster trống tiếp theo cho bộ cấp phát
+    uint8_t reserved2[12];
+    uint32_t trailSignature;  // 0xAA550000
+};
+
 // CẬP NHẬT STRUCT QUAN TRỌNG
 struct DirEntry
 {
@@ -123,6 +568,7 @@ struct DirEntry
     bool isdDir() const;
     uint32_t getStartCluster() const;
     string getNameString() const;
+    string getRecoveryName() const; // Tên 8.3 của entry đã xóa, ký tự đầu thay bằng '?'
 
     // Helper lấy timestamp dạng số nguyên (Date << 16 | Time)
     uint32_t getWriteTimestamp() const;
@@ -130,25 +576,279 @@ struct DirEntry
 };
 #pragma pack(pop)
 
-class FAT32Recovery
+// Cache cluster dùng chung cho mọi hàm đọc (LRU chia shard, thread-safe)
+// Buffer trả ra là shared_ptr: còn người giữ thì entry bị "pin", không bị evict.
+class ClusterCache
 {
+public:
+    typedef shared_ptr<const vector<uint8_t>> Buffer;
+
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t bytesCached;
+        uint64_t budgetBytes;
+    };
+
+    explicit ClusterCache(size_t budgetBytes = 64ULL << 20, size_t shardCount = 16);
+
+    void setBudget(size_t budgetBytes);
+    size_t getBudget() const;
+
+    static const uint64_t ANY_GENERATION = UINT64_MAX;
+
+    Buffer get(uint32_t cluster);
+    // Thế hệ của shard chứa cluster: lấy TRƯỚC khi đọc đĩa lúc miss rồi truyền vào put,
+    // nếu giữa chừng có invalidate/writeThrough thì put bỏ qua việc nạp bản cũ
+    uint64_t generation(uint32_t cluster) const;
+    Buffer put(uint32_t cluster, vector<uint8_t> &&data, uint64_t expectedGeneration = ANY_GENERATION);
+
+    // Hook cho các đường ghi tại chỗ
+    void writeThrough(uint32_t cluster, const uint8_t *data, size_t size);
+    void invalidate(uint32_t cluster);
+    void clear();
+
+    // Overlay cho bản sửa ở chế độ chỉ đọc: không bao giờ bị evict, get/put luôn trả bản này.
+    // Đường đọc thẳng từ đĩa (run, mẫu) vá lại bằng overlayDirty.
+    void putDirty(uint32_t cluster, vector<uint8_t> &&data);
+    bool hasDirty() const { return dirtyCount.load(memory_order_relaxed) != 0; }
+    void overlayDirty(uint32_t firstCluster, uint32_t count, size_t clusterSize, uint8_t *dst) const;
+
+    Stats getStats() const;
+
 private:
-    fstream vhd;
+    typedef list<pair<uint32_t, Buffer>> LruList;
+
+    struct Shard
+    {
+        mutex lock;
+        LruList lru; // front = mới dùng nhất
+        unordered_map<uint32_t, LruList::iterator> index;
+        size_t bytes = 0;
+        uint64_t generation = 0; // tăng mỗi lần dữ liệu trên đĩa đổi (invalidate/writeThrough/clear)
+        unordered_map<uint32_t, Buffer> dirty; // overlay, không tính vào budget
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    atomic<size_t> budget;
+    atomic<uint64_t> hits;
+    atomic<uint64_t> misses;
+    atomic<uint64_t> evictions;
+    atomic<size_t> dirtyCount;
+
+    Shard &shardFor(uint32_t cluster) const;
+    void evictLocked(Shard &s);
+};
+
+// Thiết bị khối (file image) dùng chung giữa các volume của cùng một đĩa.
+// Ghi đi qua một handle có khóa; đọc lấy handle từ pool nên nhiều luồng
+// (nhiều volume) đọc song song mà không tranh nhau con trỏ seek.
+// Định dạng file image: raw hoặc container đĩa ảo (offset guest != offset trong file)
+enum DiskFormat
+{
+    DISK_RAW = 0,
+    DISK_VHD_FIXED,
+    DISK_VHD_DYNAMIC,
+    DISK_VHDX,
+    DISK_QCOW2
+};
+
+class BlockDevice
+{
+public:
+    BlockDevice(const string &path, bool readOnly);
+    ~BlockDevice();
+
+    // offset/size tính theo đĩa guest; block chưa cấp phát đọc ra 0 mà không tốn I/O
+    ssize_t read(uint64_t offset, void *buf, size_t size) const;
+    bool write(uint64_t offset, const void *buf, size_t size);
+
+    uint64_t size() const { return diskSize; }
+    const string &path() const { return imagePath; }
+    bool isReadOnly() const { return readOnly; }
+    DiskFormat format() const { return diskFormat; }
+    const char *formatName() const;
+
+    // Offset đầu tiên >= offset có thể chứa dữ liệu / là hole (đọc ra toàn 0).
+    // Dùng SEEK_DATA/SEEK_HOLE của file thưa hoặc bảng cấp phát của container;
+    // nếu không biết thì coi mọi thứ là dữ liệu (nextData = offset, nextHole = size()).
+    uint64_t nextData(uint64_t offset) const;
+    uint64_t nextHole(uint64_t offset) const;
+
+private:
+    // Kết quả ánh xạ một offset guest
+    enum MapResult
+    {
+        MAP_HOST, // Dữ liệu nằm trong file tại hostOffset
+        MAP_ZERO, // Block chưa cấp phát / cờ zero -> toàn 0
+        MAP_ERROR // Không hỗ trợ (cluster nén, ...)
+    };
+
     string imagePath;
-    uint64_t diskSize;
+    bool readOnly;
+    uint64_t diskSize; // Kích thước đĩa guest (không tính footer/metadata của container)
+    uint64_t hostSize;
+
+    // Container: guest chia thành block cố định; blockMap giữ offset trong file của
+    // từng block (0 = chưa cấp phát). qcow2 dùng bảng L1 + L2 nạp lười thay cho blockMap.
+    DiskFormat diskFormat;
+    uint64_t blockSize;
+    vector<uint64_t> blockMap;
+    bool containerWritable;
+
+    vector<uint64_t> l1Table;
+    mutable mutex l2Lock;
+    mutable unordered_map<uint64_t, vector<uint64_t>> l2Tables;
+
+    fstream writer;
+    mutex writeLock;
+    int holeFd; // fd riêng cho lseek(SEEK_DATA/SEEK_HOLE), -1 nếu không hỗ trợ
+
+    mutable mutex poolLock;
+    mutable vector<unique_ptr<ifstream>> idleReaders;
+
+    void openContainer();
+    bool openVHD();
+    void openVHDX();
+    void openQCOW2();
+    ssize_t readHost(uint64_t offset, void *buf, size_t size) const;
+    MapResult mapOffset(uint64_t offset, uint64_t &hostOffset, uint64_t &runBytes) const;
+};
+
+// Kết quả phân tích một partition (dùng cho xử lý nhiều partition song song)
+struct VolumeReport
+{
+    int partitionIndex;
+    bool ok;
+    string error;
+    vector<DirNode> tree;
+    map<uint32_t, vector<DeletedFileInfo>> census;
+};
+
+// Một partition tìm được trên đĩa: entry MBR chính, partition logic trong chuỗi EBR,
+// entry GPT, hoặc cả đĩa là một volume (superfloppy, không có bảng partition)
+enum PartitionScheme
+{
+    SCHEME_MBR = 0,
+    SCHEME_EBR,
+    SCHEME_GPT,
+    SCHEME_NONE
+};
+
+struct PartitionInfo
+{
+    uint64_t startLBA;
+    uint64_t numSectors;
+    uint8_t type; // Mã type MBR; với GPT: 0x0C nếu là FAT32, 0 nếu không
+    PartitionScheme scheme;
+    bool active;
+    bool isFAT32; // Theo type/GUID + probe boot sector (chính hoặc backup)
+};
+
+// Callback cho đọc bất đồng bộ: gọi trên luồng worker, mỗi cluster một lần.
+// Callback không được chờ một lần đọc bất đồng bộ khác (cùng pool -> có thể kẹt)
+typedef function<void(uint32_t cluster, const ClusterCache::Buffer &data)> ClusterReadCallback;
+
+// Pool worker I/O sống cùng volume: mọi lần đọc bất đồng bộ (batch, readahead) dùng chung,
+// không tạo thread mới cho mỗi lần gọi. Hủy pool thì các việc đã xếp hàng vẫn được chạy hết.
+class IOThreadPool
+{
+public:
+    explicit IOThreadPool(unsigned threads);
+    ~IOThreadPool();
+
+    void submit(function<void()> job);
+    unsigned size() const { return (unsigned)workers.size(); }
+
+private:
+    void run();
+
+    mutex lock;
+    condition_variable wake;
+    deque<function<void()>> jobs;
+    bool stopping;
+    vector<thread> workers;
+};
+
+class FAT32Recovery
+{
+private:
+    // Image dùng chung giữa các volume; readOnly: mọi sửa chữa chỉ nằm trong RAM
+    shared_ptr<BlockDevice> device;
     MBR mbr;
     BootSector bootSector;
+    // Danh sách partition đã phát hiện; partitionIndex ở mọi API là chỉ số trong đây
+    vector<PartitionInfo> partitions;
 
-    uint32_t fatBegin;
-    uint32_t dataBegin;
+    // Offset byte tuyệt đối trên image (64-bit: image/partition có thể vượt 4 GB, 2 TB)
+    uint64_t fatBegin;
+    uint64_t dataBegin;
     uint32_t totalClusters;
+    // Kích thước sector logic của thiết bị (đơn vị của LBA trong MBR/GPT): 512 hoặc 4096
+    uint32_t sectorSize;
     vector<uint32_t> FAT;
+    int activePartition;
+
+    // Sector FAT đã bị sửa qua setFATEntry (bitmap + danh sách) để writeFAT chỉ ghi phần thay đổi
+    vector<uint8_t> fatDirty;
+    vector<uint32_t> fatDirtySectors;
+
+    // FSInfo: số cluster trống được cập nhật dần qua setFATEntry, ghi lại cùng writeFAT
+    FSInfo fsInfo;
+    uint64_t fsInfoOffset; // 0 = volume không có FSInfo
+    uint32_t freeClusters;
+    uint32_t nextFreeHint;
+    bool fsInfoDirty;
+
+    // Cây thư mục + danh sách file đã xóa theo từng thư mục (nạp từ index hoặc buildCensus)
+    vector<DirNode> dirTree;
+    map<uint32_t, vector<DeletedFileInfo>> census;
+    // Bitmap cluster mà ứng viên khôi phục được trong census nhận (rỗng = chưa dựng);
+    // bộ cấp phát bỏ qua các cluster này để sửa chữa không ghi đè dữ liệu còn cứu được
+    vector<uint64_t> candidateClaims;
+
+    // Cache cluster riêng của volume
+    mutable ClusterCache clusterCache;
+
+    // Đọc batch bất đồng bộ: số worker và kích thước tối đa một lần đọc gộp
+    unsigned ioThreads;
+    size_t maxRunBytes;
+    size_t ownerMapBudget;
+    // Pool I/O tạo khi cần lần đầu với ioThreads worker
+    mutable mutex ioPoolLock;
+    mutable unique_ptr<IOThreadPool> ioPool;
+    IOThreadPool &getIOPool() const;
+
+    // Hash set file đã biết, kiểm tra trên đường export / carve (không sở hữu)
+    const KnownHashSet *knownHashes;
+    bool skipKnown;
 
     bool isValidMBR(const MBR *mbrPtr) const;
     bool isValidFAT32BS(const uint8_t *buffer) const;
+    void scanSectors(uint64_t begin, uint64_t end,
+                     const function<uint64_t(uint64_t offset, const uint8_t *sector)> &visit) const;
+    uint32_t detectSectorSize() const;
+    int probeFilesystem(uint64_t lba) const;
+    bool parseGPT(uint64_t headerLBA, vector<PartitionInfo> &out, uint64_t *alternateLBA) const;
+    void walkEBRChain(uint64_t extendedStart, vector<PartitionInfo> &out) const;
 
     ssize_t readBytes(uint64_t offset, void *buf, size_t size) const;
+    bool writeBytes(uint64_t offset, const void *buf, size_t size, bool invalidateCache = true);
+    void initDefaults();
+    void writeCluster(uint32_t cluster, const vector<uint8_t> &buffer);
     void saveMBRToDisk();
+    void clearFATDirty();
+    void loadFSInfo();
+    void writeFSInfo();
+    void mergeFATCopies(const vector<uint32_t> &diffIndex, const vector<uint32_t> &diffValues, int base);
+    void writeFATSectors(const vector<uint32_t> &sectors, int fatIndex);
+    // Hash FAT1 đúng như trên đĩa (chưa hợp nhất); sampled = chỉ băm vài sector rải đều
+    bool hashFAT1OnDisk(uint64_t fatOffset, uint64_t fatBytes, uint32_t bps, bool sampled, uint64_t &hash) const;
+    uint32_t findUnclaimedFreeCluster();
+    uint32_t allocateCluster();
+    bool appendDirEntry(uint32_t dirCluster, const DirEntry &entry);
 
     void parseBPB(const uint8_t *buffer);
     void saveBootSector(uint64_t offset);
@@ -158,11 +858,19 @@ private:
 
     // Helper cho đệ quy
     void recursiveRestoreLoop(uint32_t currentDirCluster);
+    // Hash set xxHash64: so contentHash; hash set MD5: so md5Key (0 = chưa tính -> không biết)
+    bool isKnownContent(uint64_t contentHash, uint64_t md5Key = 0) const;
+    bool knownUsesMD5() const;
+    float scoreOne(const DeletedFileInfo &f, const DeletedFileInfo *prev, const DeletedFileInfo *next,
+                   unsigned samples, vector<uint8_t> &buffer, uint16_t &flags) const;
     // Helper kiểm tra chữ ký file (Optional safety check)
     bool verifyFileSignature(uint32_t startCluster, string filename);
 
 public:
-    FAT32Recovery(const string &path);
+    FAT32Recovery(const string &path, bool readOnly = false);
+    // Volume anh em: dùng chung device và bảng partition với volume gốc
+    FAT32Recovery(shared_ptr<BlockDevice> sharedDevice, const MBR &partitionTable,
+                  const vector<PartitionInfo> &partitionList);
     ~FAT32Recovery();
 
     // Init logic
@@ -170,28 +878,71 @@ public:
     bool checkMBR();
     bool rebuildMBR();
     void listPartitions() const;
+    void discoverPartitions();
+    const vector<PartitionInfo> &getPartitions() const { return partitions; }
+    uint32_t getSectorSize() const { return sectorSize; }
 
     bool initializeVolume(int partitionIndex);
     bool checkAndFixBootSector(uint64_t partStartSector);
-    void reconstructBPB(uint64_t partStartSector, uint32_t partSize);
+    void reconstructBPB(uint64_t partStartSector, uint64_t partSize);
     void printVolumeInfo() const;
+    const MBR &getMBR() const { return mbr; }
+    uint32_t getRootCluster() const { return bootSector.rootCluster; }
+    bool isReadOnly() const { return device->isReadOnly(); }
+
+    // Nhiều partition: mở volume riêng cho từng partition, phân tích song song
+    unique_ptr<FAT32Recovery> openVolume() const;
+    vector<VolumeReport> analyzeAllPartitions(unsigned threads);
 
     // Core FAT operations
     void loadFAT();
     void writeFAT();
+    void setFATEntry(uint32_t cluster, uint32_t value);
+    uint32_t getFreeClusters() const { return freeClusters; }
+    uint32_t getTotalClusters() const { return totalClusters; }
+    uint64_t getFatBegin() const { return fatBegin; }
+    uint64_t getDataBegin() const { return dataBegin; }
+    // Giá trị FAT (28 bit); ngoài phạm vi coi như cluster hỏng để không bị nhầm là trống
+    uint32_t getFATEntry(uint32_t cluster) const
+    {
+        return cluster < FAT.size() ? FAT[cluster] & 0x0FFFFFFF : 0x0FFFFFF7;
+    }
     void scanAndAutoRepair(uint32_t dirCluster, bool fix);
     int repairFolderAndClusters(uint32_t dirCluster);
     vector<uint32_t> contiguousGuess(uint32_t startCluster, uint32_t fileSize) const;
     vector<uint32_t> followFAT(uint32_t startCluster) const;
+    // Dải liên tục start..start+needed mà arbitrateCandidates giả định cho file đã xóa;
+    // ném lỗi nếu vượt ra ngoài volume (không bao giờ tìm chỗ khác như contiguousGuess)
+    vector<uint32_t> contiguousRange(uint32_t startCluster, uint64_t fileSize) const;
 
     // Utils
     uint64_t cluster2Offset(uint32_t cluster) const;
     void readCluster(uint32_t cluster, vector<uint8_t> &buffer) const;
+    ClusterCache::Buffer pinCluster(uint32_t cluster) const;
+
+    // Đọc batch: gộp các cluster liền kề thành 1 request lớn, chạy trên nhiều worker.
+    // future trả về số cluster đã giao cho callback.
+    future<size_t> readClustersAsync(const vector<uint32_t> &clusters, ClusterReadCallback callback) const;
+    void prefetchClusters(const vector<uint32_t> &clusters) const;
+    void setIOThreads(unsigned threads);
+
+    // Đọc nguyên một run cluster liên tục bằng 1 lần I/O (dùng cho ClusterChainReader).
+    // Bản async chạy trên pool I/O, không qua cache; dst phải sống tới khi future xong
+    void readClusterRun(uint32_t firstCluster, uint32_t count, uint8_t *dst) const;
+    future<void> readClusterRunAsync(uint32_t firstCluster, uint32_t count, uint8_t *dst) const;
+    uint32_t getClusterSize() const;
+
+    // Cache
+    void setCacheBudget(size_t bytes);
+    // Ngân sách owner map khi sửa chuỗi FAT (repairFolderAndClusters), mặc định 256 MiB
+    void setOwnerMapBudget(size_t bytes) { ownerMapBudget = max<size_t>(bytes, sizeof(uint32_t)); }
+    ClusterCache::Stats getCacheStats() const;
 
     // --- RECOVERY FUNCTIONS (NEW) ---
 
     // 1. Phân tích xung đột & tìm ứng viên (Collision Detection)
     vector<DeletedFileInfo> analyzeRecoveryCandidates(uint32_t dirCluster);
+    void arbitrateCandidates(vector<DeletedFileInfo> &candidates) const;
 
     // 2. Khôi phục 1 file/folder tại chỗ (In-Place)
     bool restoreDeletedFile(uint32_t dirCluster, int entryIndex, char newChar);
@@ -199,8 +950,172 @@ public:
     // 3. Khôi phục đệ quy cả cây thư mục (Recursive Tree)
     void restoreTree(uint32_t dirClusterOfParent, int entryIndex);
 
-    // 4. Xuất file ra ngoài (Export)
-    void recoverFile(uint32_t startCluster, uint32_t fileSize, const string &outPath);
+    // 4. Xuất file đã xóa ra ngoài (Export) theo dải liên tục từ startCluster.
+    //    Trả về false nếu file khớp hash set và bị bỏ qua
+    bool recoverFile(uint32_t startCluster, uint32_t fileSize, const string &outPath);
+    // File khớp hash set: skipMatches = bỏ không ghi, ngược lại chỉ gắn cờ known
+    void setKnownHashes(const KnownHashSet *set, bool skipMatches);
+    // Băm nội dung ứng viên trong 1 lượt đọc (đồng thời chép ra copyTo nếu có).
+    // md5Key != nullptr: tính thêm key MD5 cho hash set chuẩn trong cùng lượt đọc
+    uint64_t hashCandidate(uint32_t startCluster, uint32_t fileSize, ostream *copyTo = nullptr,
+                           uint64_t *md5Key = nullptr) const;
+    // Băm song song mọi ứng viên khôi phục được trong census và gom các bản trùng nội dung.
+    // Trả về số bản trùng.
+    size_t dedupCensus(unsigned threads = 0);
+
+    // Chấm điểm khả năng khôi phục: tỷ lệ cluster còn trống, signature, entropy của
+    // tối đa `samples` cluster mẫu, checksum LFN và thứ tự timestamp với entry lân cận.
+    // Chỉ đọc các cluster mẫu, không đổi isRecoverable.
+    void scoreCandidates(vector<DeletedFileInfo> &candidates, unsigned samples = 3) const;
+    size_t scoreCensus(unsigned threads = 0, unsigned samples = 3);
+    // K ứng viên điểm cao nhất của census (k = 0: tất cả), giảm dần theo điểm
+    vector<pair<uint32_t, const DeletedFileInfo *>> topCandidates(size_t k) const;
+
+    // Phân loại count cluster liên tiếp từ first: đọc theo khối lớn, chia cho nhiều luồng
+    vector<ClusterProfile> profileClusters(uint32_t first, uint32_t count, unsigned threads = 0) const;
+    // Xuất mọi file khôi phục được trong census ra outDir (giữ cây thư mục), bỏ qua bản trùng
+    vector<ExportRecord> exportCensus(const string &outDir);
+
+    // 5. Tìm cluster thư mục theo đường dẫn ("/DIR/SUB"), trả về 0 nếu không thấy
+    uint32_t resolvePath(const string &path) const;
+
+    // 7. Quét cây thư mục còn sống và phân tích toàn bộ file đã xóa
+    vector<DirNode> scanDirectoryTree() const;
+    void buildCensus();
+    const vector<DirNode> &getDirectoryTree() const { return dirTree; }
+    const map<uint32_t, vector<DeletedFileInfo>> &getCensus() const { return census; }
+
+    // 8. Index lưu cạnh image để mở lại không cần quét lại. Khóa: partition + size/mtime của image
+    //    + hash vài sector FAT1 lấy mẫu; verifyFAT: băm lại toàn bộ FAT1 trên đĩa (chậm, tùy chọn)
+    bool saveIndex(const string &indexPath) const;
+    bool loadIndex(const string &indexPath, int partitionIndex, bool verifyFAT = false);
+
+    // 6. Carving theo signature trong các cluster trống (outDir rỗng = chỉ liệt kê)
+    vector<CarvedFile> carveFreeClusters(const string &outDir, size_t maxFiles, uint64_t maxFileBytes = 64ULL << 20);
+
+    // 9. Chuỗi cluster mồ côi và dựng lại cây LOST.DIR (thời gian tuyến tính theo FAT)
+    vector<OrphanChain> findOrphanChains() const;
+    size_t graftOrphans(vector<OrphanChain> &orphans);
+
+    // 10. Cross-link giữa các entry còn sống: owner array theo cửa sổ (ngân sách bộ nhớ),
+    //     giải quyết bằng cách chép phần đuôi dùng chung ra cluster mới (copy-out)
+    vector<LiveEntry> listLiveEntries() const;
+    void buildOwnerMap(const vector<LiveEntry> &entries, uint32_t firstCluster, uint32_t count,
+                       ClusterOwnerMap &map, vector<CrossLink> *conflicts) const;
+    vector<CrossLink> findCrossLinks(const vector<LiveEntry> &entries, size_t memBudget = 256 << 20) const;
+    size_t resolveCrossLinks(const vector<LiveEntry> &entries, const vector<CrossLink> &links);
+
+    // 11. Timeline MAC của cả volume (entry sống, entry đã xóa và nội dung thư mục đã xóa).
+    //     format "body": bodyfile (TSK/mactime) ghi ngay khi duyệt;
+    //     format "csv": từng sự kiện theo thứ tự thời gian, sort ngoài trong memBudget byte.
+    TimelineStats writeTimeline(ostream &out, const string &format, size_t memBudget = 64 << 20,
+                                const string &tmpDir = "") const;
+
+    // 12. Bản đồ cấp phát toàn volume, nén RLE, ghi dạng stream trong một lượt qua FAT.
+    //     Ứng viên đã xóa lấy từ census (cần buildCensus trước). format "json" hoặc "bin":
+    //     "F32AMAP\0" | version u32 | clusterSize u32 | firstCluster u32 | clusterCount u64 |
+    //     các run (class u8, độ dài LEB128) | 0xFF | runCount u64
+    AllocationMapStats writeAllocationMap(ostream &out, const string &format) const;
+};
+
+// Đọc tuần tự một chuỗi cluster: chia chuỗi thành các extent (run cluster liên tiếp),
+// mỗi extent đọc bằng I/O lớn (tối đa readaheadBytes) thay vì 1 read / cluster.
+// Không đi qua ClusterCache để file lớn không đẩy metadata ra khỏi cache.
+class ClusterChainReader
+{
+public:
+    struct Extent
+    {
+        uint32_t firstCluster;
+        uint32_t count;
+    };
+
+    ClusterChainReader(const FAT32Recovery &volume, const vector<uint32_t> &chain,
+                       uint64_t length, size_t readaheadBytes = 4 << 20);
+    ~ClusterChainReader();
+
+    // Đọc trước khối kế tiếp trên pool I/O trong lúc caller xử lý khối hiện tại.
+    // Chỉ bật khi sẽ đọc hết chuỗi (export, hash, carve): đọc dở thì khối đọc trước bị bỏ phí
+    void setAsyncReadahead(bool on) { asyncReadahead = on; }
+
+    static vector<Extent> buildExtents(const vector<uint32_t> &chain);
+    const vector<Extent> &getExtents() const { return extents; }
+
+    // Đọc tối đa size byte tiếp theo, trả về số byte đã đọc (0 = hết dữ liệu)
+    size_t read(uint8_t *dst, size_t size);
+
+    // Stream view: trả về khối dữ liệu kế tiếp trong buffer nội bộ
+    // (hợp lệ tới lần gọi next/read tiếp theo)
+    bool next(const uint8_t *&data, size_t &size);
+
+    uint64_t position() const { return pos; }
+    uint64_t length() const { return total; }
+
+private:
+    const FAT32Recovery &vol;
+    vector<Extent> extents;
+    uint64_t total;
+    uint64_t pos;
+    size_t readahead;
+
+    size_t extentIdx;      // extent đang đọc
+    uint32_t extentCursor; // số cluster đã đọc trong extent hiện tại
+
+    vector<uint8_t> window;
+    size_t windowPos;
+
+    struct Chunk
+    {
+        uint32_t firstCluster;
+        uint32_t count;
+        size_t bytes; // số byte hữu ích (cluster cuối có thể bị cắt)
+    };
+    uint64_t scheduled; // số byte đã lên lịch đọc (>= pos khi có đọc trước)
+    bool asyncReadahead;
+    vector<uint8_t> ahead;
+    size_t aheadBytes;
+    future<void> aheadPending;
+
+    bool planChunk(Chunk &chunk);
+    bool fill();
+};
+
+// Xem trước cây con của thư mục đã xóa mà không ghi gì xuống đĩa.
+// Con của mỗi thư mục chỉ được parse khi được hỏi tới (lazy) và giữ trong cache
+// (giới hạn theo số entry), duyệt lại không phải đọc lại cluster.
+class DeletedTreeView
+{
+public:
+    struct Entry
+    {
+        DeletedFileInfo info; // trạng thái khôi phục như analyzeRecoveryCandidates
+        uint32_t dirCluster;  // cluster chứa entry
+        bool deleted;         // entry mang dấu 0xE5
+    };
+    using Listing = shared_ptr<const vector<Entry>>;
+
+    explicit DeletedTreeView(const FAT32Recovery &volume, size_t maxCachedEntries = 4 << 20);
+
+    // Các cluster của thư mục: chuỗi FAT nếu còn, nếu không thì đoán liên tục
+    // (dừng ở cluster đang được dùng, khối không giống thư mục hoặc entry kết thúc 0x00)
+    vector<uint32_t> directoryClusters(uint32_t dirStart) const;
+
+    // Con của thư mục bắt đầu tại dirStart (bỏ "." / ".." và LFN)
+    Listing children(uint32_t dirStart);
+
+    size_t cachedDirectories() const { return cache.size(); }
+    size_t cachedEntryCount() const { return cachedEntries; }
+
+    static constexpr uint32_t MAX_DIR_GUESS = 4096; // số cluster tối đa đoán cho 1 thư mục
+
+private:
+    const FAT32Recovery &vol;
+    size_t maxEntries;
+    size_t cachedEntries;
+    unordered_map<uint32_t, Listing> cache;
+    list<uint32_t> order; // thứ tự nạp, bỏ cũ nhất khi vượt giới hạn
+
+    static bool looksLikeDirBlock(const vector<uint8_t> &block, bool &terminated);
 };
 
 #endif //__FAT32__
\ No newline at end of file
@@ -0,0 +1,409 @@
+#include "ImageGenerator.h"
+
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+namespace
+{
+    const uint32_t EOC = 0x0FFFFFFF;
+    const uint32_t GPT_ENTRIES = 128;
+    const uint32_t GPT_ENTRY_SIZE = 128;
+
+    void put16(uint8_t *p, uint16_t v)
+    {
+        p[0] = uint8_t(v);
+        p[1] = uint8_t(v >> 8);
+    }
+
+    void put32(uint8_t *p, uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+            p[i] = uint8_t(v >> (8 * i));
+    }
+
+    // Đóng gói một entry 8.3 (32 byte)
+    void makeEntry(uint8_t *e, const char name11[11], uint8_t attr, uint32_t cluster, uint32_t size,
+                   uint16_t crtDate, uint16_t crtTime, uint16_t wrtDate, uint16_t wrtTime)
+    {
+        memset(e, 0, 32);
+        memcpy(e, name11, 11);
+        e[11] = attr;
+        put16(e + 0x0E, crtTime);
+        put16(e + 0x10, crtDate);
+        put16(e + 0x12, wrtDate);
+        put16(e + 0x14, uint16_t(cluster >> 16));
+        put16(e + 0x16, wrtTime);
+        put16(e + 0x18, wrtDate);
+        put16(e + 0x1A, uint16_t(cluster & 0xFFFF));
+        put32(e + 0x1C, size);
+    }
+
+    uint16_t fatDate(int year, int month, int day)
+    {
+        return uint16_t(((year - 1980) << 9) | (month << 5) | day);
+    }
+
+    uint16_t fatTime(int hour, int minute, int sec)
+    {
+        return uint16_t((hour << 11) | (minute << 5) | (sec / 2));
+    }
+
+    void put64(uint8_t *p, uint64_t v)
+    {
+        for (int i = 0; i < 8; ++i)
+            p[i] = uint8_t(v >> (8 * i));
+    }
+
+    // CRC32 (IEEE) cho header và mảng entry GPT
+    uint32_t crc32(const uint8_t *data, size_t size)
+    {
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i)
+        {
+            crc ^= data[i];
+            for (int k = 0; k < 8; ++k)
+                crc = (crc & 1) ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    void writeAt(fstream &f, uint64_t offset, const void *buf, size_t size)
+    {
+        f.seekp(offset, ios::beg);
+        f.write(static_cast<const char *>(buf), size);
+        if (!f.good())
+            throw runtime_error("Image write failed at offset " + to_string(offset));
+    }
+}
+
+GeneratedImage generateImage(const string &path, const ImageSpec &spec)
+{
+    mt19937_64 rng(spec.seed);
+    auto chance = [&](double p)
+    { return uniform_real_distribution<double>(0.0, 1.0)(rng) < p; };
+    auto randRange = [&](uint32_t lo, uint32_t hi)
+    { return uniform_int_distribution<uint32_t>(lo, hi)(rng); };
+
+    // 1. Geometry
+    const uint32_t SECTOR = spec.sectorSize;
+    if (SECTOR != 512 && SECTOR != 4096)
+        throw runtime_error("Unsupported sector size: " + to_string(SECTOR));
+    if (!spec.gpt && spec.partitionStartLBA > UINT32_MAX)
+        throw runtime_error("Partition start does not fit in an MBR entry, use GPT");
+
+    const uint32_t reserved = 32;
+    const uint32_t numFATs = 2;
+    const uint32_t spc = spec.sectorsPerCluster;
+    if (spec.volumeBytes / SECTOR > UINT32_MAX)
+        throw runtime_error("Volume too large for FAT32 totalSectors32");
+    const uint32_t totalSectors = uint32_t(spec.volumeBytes / SECTOR);
+
+    // GPT: header + mảng entry ở đầu đĩa, bản backup ở cuối đĩa
+    const uint64_t gptEntrySectors = (GPT_ENTRIES * GPT_ENTRY_SIZE + SECTOR - 1) / SECTOR;
+    if (spec.gpt && spec.partitionStartLBA < 2 + gptEntrySectors)
+        throw runtime_error("Partition overlaps the GPT header");
+
+    uint32_t sectorsPerFat = 1;
+    uint32_t clusters = 0;
+    for (int iter = 0; iter < 4; ++iter)
+    {
+        clusters = (totalSectors - reserved - numFATs * sectorsPerFat) / spc;
+        sectorsPerFat = uint32_t(((uint64_t)(clusters + 2) * 4 + SECTOR - 1) / SECTOR);
+    }
+    clusters = (totalSectors - reserved - numFATs * sectorsPerFat) / spc;
+
+    GeneratedImage img;
+    img.path = path;
+    img.sectorSize = SECTOR;
+    img.clusterSize = spc * SECTOR;
+    img.totalClusters = clusters;
+    img.fatBytes = (uint64_t)sectorsPerFat * SECTOR;
+
+    const uint64_t partOffset = (uint64_t)spec.partitionStartLBA * SECTOR;
+    const uint64_t fatOffset = partOffset + (uint64_t)reserved * SECTOR;
+    const uint64_t dataOffset = fatOffset + (uint64_t)numFATs * img.fatBytes;
+    img.fatBeginOffset = fatOffset;
+    img.dataBeginOffset = dataOffset;
+    img.imageBytes = partOffset + (uint64_t)totalSectors * SECTOR;
+    if (spec.gpt)
+        img.imageBytes += (gptEntrySectors + 1) * SECTOR;
+
+    auto clusterOffset = [&](uint32_t c)
+    { return dataOffset + (uint64_t)(c - 2) * img.clusterSize; };
+
+    // Tạo file thưa (sparse) đúng kích thước, chỉ ghi các vùng có dữ liệu
+    {
+        ofstream create(path, ios::out | ios::binary | ios::trunc);
+        if (!create.is_open())
+            throw runtime_error("Cannot create image: " + path);
+    }
+    filesystem::resize_file(path, img.imageBytes);
+    fstream f(path, ios::in | ios::out | ios::binary);
+
+    vector<uint32_t> fat(clusters + 2, 0);
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = EOC;
+    uint32_t nextFree = 2;
+
+    auto allocRun = [&](uint32_t count, vector<uint32_t> &out) -> bool
+    {
+        if (nextFree + count > clusters + 2)
+            return false;
+        for (uint32_t i = 0; i < count; ++i)
+            out.push_back(nextFree++);
+        return true;
+    };
+
+    // 2. Cây thư mục: mỗi thư mục 1 cluster
+    struct Dir
+    {
+        uint32_t cluster;
+        uint32_t parent;
+        uint32_t depth;
+        vector<uint8_t> data;
+        uint32_t used;
+    };
+    vector<Dir> dirs;
+    const uint32_t slotsPerDir = img.clusterSize / 32;
+
+    vector<uint32_t> rootRun;
+    allocRun(1, rootRun);
+    fat[rootRun[0]] = EOC;
+    {
+        // Root: entry đầu là nhãn volume
+        vector<uint8_t> rootData(img.clusterSize, 0);
+        char label[11];
+        memcpy(label, "BENCHVOL   ", 11);
+        makeEntry(rootData.data(), label, 0x08, 0, 0, 0, 0, fatDate(2024, 1, 1), 0);
+        dirs.push_back({rootRun[0], 0, 0, move(rootData), 1});
+    }
+
+    uint16_t baseDate = fatDate(2024, 1, 1);
+    for (size_t i = 0; i < dirs.size(); ++i)
+    {
+        if (dirs[i].depth >= spec.dirDepth)
+            continue;
+        for (uint32_t k = 0; k < spec.dirFanout && dirs[i].used < slotsPerDir; ++k)
+        {
+            vector<uint32_t> run;
+            if (!allocRun(1, run))
+                break;
+            fat[run[0]] = EOC;
+
+            char name[16];
+            snprintf(name, sizeof(name), "DIR%05u   ", (unsigned)dirs.size() % 100000);
+            makeEntry(dirs[i].data.data() + dirs[i].used * 32, name, 0x10, run[0], 0, baseDate, 0, baseDate, 0);
+            dirs[i].used++;
+
+            Dir child = {run[0], dirs[i].cluster, dirs[i].depth + 1, vector<uint8_t>(img.clusterSize, 0), 2};
+            uint32_t parentRef = dirs[i].depth == 0 ? 0 : dirs[i].cluster; // ".." của con root = 0
+            makeEntry(child.data.data(), ".          ", 0x10, run[0], 0, baseDate, 0, baseDate, 0);
+            makeEntry(child.data.data() + 32, "..         ", 0x10, parentRef, 0, baseDate, 0, baseDate, 0);
+            dirs.push_back(child);
+        }
+    }
+
+    // 3. File: phân bổ (có thể phân mảnh), ghi dữ liệu, xóa ngẫu nhiên
+    vector<uint8_t> clusterBuf(img.clusterSize);
+    size_t dirCursor = 0;
+    for (uint32_t n = 0; n < spec.fileCount; ++n)
+    {
+        // Tìm thư mục còn slot (round-robin)
+        size_t tries = 0;
+        while (tries < dirs.size() && dirs[dirCursor].used >= slotsPerDir)
+        {
+            dirCursor = (dirCursor + 1) % dirs.size();
+            tries++;
+        }
+        if (tries == dirs.size())
+            break; // Hết chỗ trong mọi thư mục
+        Dir &dir = dirs[dirCursor];
+        dirCursor = (dirCursor + 1) % dirs.size();
+
+        uint32_t need = randRange(1, max<uint32_t>(1, spec.maxFileClusters));
+        uint32_t size = (need - 1) * img.clusterSize + randRange(1, img.clusterSize);
+
+        GeneratedFile gf;
+        gf.dirCluster = dir.cluster;
+        gf.entryIndex = int(dir.used);
+        gf.size = size;
+        gf.deleted = chance(spec.deletionRatio);
+
+        bool ok = true;
+        if (need >= 2 && chance(spec.fragmentation))
+        {
+            // Chia thành 2-4 mảnh, chừa khoảng trống giữa các mảnh
+            uint32_t pieces = randRange(2, min<uint32_t>(4, need));
+            uint32_t left = need;
+            for (uint32_t p = 0; p < pieces && ok; ++p)
+            {
+                uint32_t len = (p == pieces - 1) ? left : randRange(1, left - (pieces - 1 - p));
+                ok = allocRun(len, gf.clusters);
+                left -= len;
+                nextFree += randRange(1, 8);
+            }
+        }
+        else
+            ok = allocRun(need, gf.clusters);
+
+        if (!ok || nextFree > clusters + 2)
+            break; // Volume đầy
+        gf.startCluster = gf.clusters.front();
+
+        // Chuỗi FAT (file đã xóa: FAT về 0 như Windows làm)
+        for (size_t k = 0; k < gf.clusters.size(); ++k)
+            fat[gf.clusters[k]] = gf.deleted ? 0 : (k + 1 < gf.clusters.size() ? gf.clusters[k + 1] : EOC);
+
+        bool isJpg = (n % 4) == 0;
+        char name[16];
+        snprintf(name, sizeof(name), "F%07u%s", (unsigned)n % 10000000, isJpg ? "JPG" : "BIN");
+        if (gf.deleted)
+            name[0] = char(0xE5);
+
+        int year = int(randRange(2020, 2024));
+        uint16_t crt = fatDate(year, randRange(1, 6), randRange(1, 28));
+        uint16_t wrt = fatDate(year, randRange(7, 12), randRange(1, 28));
+        makeEntry(dir.data.data() + dir.used * 32, name, 0x20, gf.startCluster, size,
+                  crt, fatTime(randRange(0, 23), randRange(0, 59), 0), wrt, fatTime(randRange(0, 23), randRange(0, 59), 0));
+        dir.used++;
+
+        if (spec.writeFileData)
+        {
+            for (size_t k = 0; k < gf.clusters.size(); ++k)
+            {
+                // Nội dung tất định theo (file, cluster)
+                uint64_t x = (uint64_t(n) << 32) ^ k ^ spec.seed;
+                for (size_t b = 0; b < clusterBuf.size(); b += 8)
+                {
+                    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+                    memcpy(clusterBuf.data() + b, &x, min<size_t>(8, clusterBuf.size() - b));
+                }
+                if (k == 0 && isJpg)
+                    memcpy(clusterBuf.data(), "\xFF\xD8\xFF\xE0", 4);
+                writeAt(f, clusterOffset(gf.clusters[k]), clusterBuf.data(), clusterBuf.size());
+            }
+        }
+        img.files.push_back(gf);
+    }
+
+    for (const auto &d : dirs)
+    {
+        writeAt(f, clusterOffset(d.cluster), d.data.data(), d.data.size());
+        img.dirClusters.push_back(d.cluster);
+    }
+
+    // 4. MBR (hoặc MBR bảo vệ + GPT), Boot Sector (+ backup tại +6), FSInfo, 2 bản FAT
+    const uint64_t lastLBA = img.imageBytes / SECTOR - 1;
+    uint8_t mbr[512] = {0};
+    uint8_t *pe = mbr + 446;
+    if (spec.gpt)
+    {
+        pe[4] = 0xEE;
+        put32(pe + 8, 1);
+        put32(pe + 12, uint32_t(min<uint64_t>(lastLBA, UINT32_MAX)));
+    }
+    else
+    {
+        pe[0] = 0x80;
+        pe[4] = 0x0C;
+        put32(pe + 8, uint32_t(spec.partitionStartLBA));
+        put32(pe + 12, totalSectors);
+    }
+    put16(mbr + 510, 0xAA55);
+    writeAt(f, 0, mbr, sizeof(mbr));
+
+    if (spec.gpt)
+    {
+        // Một entry Basic Data phủ đúng volume
+        static const uint8_t basicData[16] = {0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+                                              0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7};
+        vector<uint8_t> entries(GPT_ENTRIES * GPT_ENTRY_SIZE, 0);
+        memcpy(entries.data(), basicData, 16);
+        put64(entries.data() + 16, spec.seed);
+        put64(entries.data() + 24, ~spec.seed);
+        put64(entries.data() + 32, spec.partitionStartLBA);
+        put64(entries.data() + 40, spec.partitionStartLBA + totalSectors - 1);
+        const uint32_t entriesCRC = crc32(entries.data(), entries.size());
+
+        auto writeHeader = [&](uint64_t myLBA, uint64_t altLBA, uint64_t entriesLBA)
+        {
+            uint8_t hdr[512] = {0};
+            memcpy(hdr, "EFI PART", 8);
+            put32(hdr + 8, 0x00010000);
+            put32(hdr + 12, 92);
+            put64(hdr + 24, myLBA);
+            put64(hdr + 32, altLBA);
+            put64(hdr + 40, 2 + gptEntrySectors);
+            put64(hdr + 48, lastLBA - gptEntrySectors - 1);
+            put64(hdr + 56, spec.seed ^ 0x5A5A5A5A5A5A5A5AULL);
+            put64(hdr + 72, entriesLBA);
+            put32(hdr + 80, GPT_ENTRIES);
+            put32(hdr + 84, GPT_ENTRY_SIZE);
+            put32(hdr + 88, entriesCRC);
+            put32(hdr + 16, crc32(hdr, 92));
+            writeAt(f, myLBA * SECTOR, hdr, sizeof(hdr));
+            writeAt(f, entriesLBA * SECTOR, entries.data(), entries.size());
+        };
+        writeHeader(1, lastLBA, 2);
+        writeHeader(lastLBA, 1, lastLBA - gptEntrySectors);
+    }
+
+    uint8_t bs[512] = {0};
+    memcpy(bs, "\xEB\x58\x90MSWIN4.1", 11);
+    put16(bs + 11, SECTOR);
+    bs[13] = uint8_t(spc);
+    put16(bs + 14, uint16_t(reserved));
+    bs[16] = uint8_t(numFATs);
+    bs[21] = 0xF8;
+    put16(bs + 24, 63);
+    put16(bs + 26, 255);
+    put32(bs + 28, uint32_t(min<uint64_t>(spec.partitionStartLBA, UINT32_MAX)));
+    put32(bs + 32, totalSectors);
+    put32(bs + 36, sectorsPerFat);
+    put32(bs + 44, 2);
+    put16(bs + 48, 1);
+    put16(bs + 50, 6);
+    bs[64] = 0x80;
+    bs[66] = 0x29;
+    put32(bs + 67, uint32_t(spec.seed));
+    memcpy(bs + 71, "BENCHVOL   FAT32   ", 19);
+    put16(bs + 510, 0xAA55);
+    writeAt(f, partOffset, bs, sizeof(bs));
+    writeAt(f, partOffset + 6 * SECTOR, bs, sizeof(bs));
+
+    uint32_t freeCount = 0;
+    for (uint32_t c = 2; c < clusters + 2; ++c)
+        freeCount += fat[c] == 0;
+    uint8_t fsInfo[512] = {0};
+    put32(fsInfo, 0x41615252);
+    put32(fsInfo + 484, 0x61417272);
+    put32(fsInfo + 488, freeCount);
+    put32(fsInfo + 492, nextFree);
+    put32(fsInfo + 508, 0xAA550000);
+    writeAt(f, partOffset + SECTOR, fsInfo, sizeof(fsInfo));
+
+    vector<uint8_t> fatBytes(img.fatBytes, 0);
+    for (size_t i = 0; i < fat.size(); ++i)
+        put32(fatBytes.data() + i * 4, fat[i]);
+    for (uint32_t k = 0; k < numFATs; ++k)
+        writeAt(f, fatOffset + k * img.fatBytes, fatBytes.data(), fatBytes.size());
+
+    // 5. Cấy lỗi
+    uint8_t garbage[512];
+    for (auto &b : garbage)
+        b = uint8_t(rng());
+    if (spec.corruption & CORRUPT_MBR)
+        writeAt(f, 510, "\0\0", 2);
+    if (spec.corruption & (CORRUPT_BOOT_SECTOR | CORRUPT_BOTH_BOOT_SECTORS))
+        writeAt(f, partOffset, garbage, sizeof(garbage));
+    if (spec.corruption & CORRUPT_BOTH_BOOT_SECTORS)
+        writeAt(f, partOffset + 6 * SECTOR, garbage, sizeof(garbage));
+    if (spec.corruption & CORRUPT_FAT1)
+        writeAt(f, fatOffset, garbage, sizeof(garbage));
+
+    return img;
+}
@@ -0,0 +1,67 @@
+#ifndef __FAT32_IMAGE_GENERATOR__
+#define __FAT32_IMAGE_GENERATOR__
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Các kiểu hỏng có thể cấy vào image (kết hợp bằng OR)
+enum ImageCorruption : uint32_t
+{
+    CORRUPT_NONE = 0,
+    CORRUPT_MBR = 1,              // Xóa signature của MBR -> buộc deep scan
+    CORRUPT_BOOT_SECTOR = 2,      // Hỏng Boot Sector chính (backup còn tốt)
+    CORRUPT_BOTH_BOOT_SECTORS = 4, // Hỏng cả backup -> buộc reconstructBPB
+    CORRUPT_FAT1 = 8              // Hỏng FAT1 -> loadFAT phải dùng FAT2
+};
+
+// Thông số image cần sinh. Cùng seed -> cùng image từng byte.
+struct ImageSpec
+{
+    uint64_t volumeBytes = 256ULL << 20;
+    uint32_t sectorSize = 512;          // 512 hoặc 4096 (4Kn); LBA tính theo đơn vị này
+    uint64_t partitionStartLBA = 2048;  // > 2^32 thì bắt buộc dùng GPT
+    bool gpt = false;                   // MBR bảo vệ + GPT (header chính và backup)
+    uint8_t sectorsPerCluster = 8;
+    uint32_t fileCount = 2000;
+    uint32_t maxFileClusters = 16;
+    double fragmentation = 0.0; // Xác suất một file bị chia thành nhiều mảnh
+    double deletionRatio = 0.2; // Tỉ lệ file bị đánh dấu xóa (0xE5, FAT về 0)
+    uint32_t dirDepth = 2;
+    uint32_t dirFanout = 4;
+    uint32_t corruption = CORRUPT_NONE;
+    bool writeFileData = true;
+    uint64_t seed = 1;
+};
+
+// Thông tin từng file đã sinh (dùng làm "đáp án" cho benchmark)
+struct GeneratedFile
+{
+    uint32_t dirCluster;
+    int entryIndex;
+    uint32_t startCluster;
+    uint32_t size;
+    vector<uint32_t> clusters;
+    bool deleted;
+};
+
+struct GeneratedImage
+{
+    string path;
+    uint64_t imageBytes;
+    uint32_t sectorSize;
+    uint32_t clusterSize;
+    uint32_t totalClusters;
+    uint64_t fatBytes;
+    uint64_t fatBeginOffset;  // Offset byte tuyệt đối của FAT1 trên image
+    uint64_t dataBeginOffset; // Offset byte tuyệt đối của cluster 2
+    vector<uint32_t> dirClusters;
+    vector<GeneratedFile> files;
+};
+
+GeneratedImage generateImage(const string &path, const ImageSpec &spec);
+
+#endif //__FAT32_IMAGE_GENERATOR__
@@ -0,0 +1,469 @@
+// Benchmark các pha chính của FAT32Recovery trên image sinh tự động.
+// Build (target riêng, không dính vào tool chính):
+//   cmake -S . -B build && cmake --build build --target fat32bench
+// Ví dụ:
+//   ./fat32bench --size 1024 --files 20000 --scenario all
+//   ./fat32bench --generate test.img --frag 0.3 --corrupt fat1
+//   ./fat32bench --generate big.img --gpt --start-lba 6442450944   (volume sau mốc 3 TiB, file thưa)
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+#include <map>
+#include "FAT32.h"
+#include "ImageGenerator.h"
+
+using namespace std;
+
+struct Scenario
+{
+    string name;
+    double fragmentation;
+    uint32_t corruption;
+    uint32_t sectorSize;      // 0 = giữ theo tùy chọn dòng lệnh
+    uint64_t partitionStartLBA; // 0 = giữ theo tùy chọn dòng lệnh
+    bool gpt;
+};
+
+struct PhaseResult
+{
+    string phase;
+    double seconds;
+    uint64_t bytes;
+    uint64_t entries;
+};
+
+// 3 TiB tính theo sector 512 byte: vượt giới hạn LBA 32-bit của MBR
+static const uint64_t LBA_3TIB = (3ULL << 40) / 512;
+
+static const vector<Scenario> SCENARIOS = {
+    {"clean", 0.0, CORRUPT_NONE, 0, 0, false},
+    {"fragmented", 0.3, CORRUPT_NONE, 0, 0, false},
+    {"broken-mbr", 0.0, CORRUPT_MBR, 0, 0, false},
+    {"broken-bs", 0.0, CORRUPT_BOOT_SECTOR, 0, 0, false},
+    {"broken-bs-both", 0.0, CORRUPT_BOTH_BOOT_SECTORS, 0, 0, false},
+    {"broken-fat1", 0.0, CORRUPT_FAT1, 0, 0, false},
+    {"4kn", 0.0, CORRUPT_NONE, 4096, 256, false},
+    {"4kn-broken-bs", 0.0, CORRUPT_BOTH_BOOT_SECTORS, 4096, 256, false},
+    {"gpt-3tb", 0.0, CORRUPT_NONE, 0, LBA_3TIB, true},
+};
+
+static void printUsage()
+{
+    cerr << "Usage: fat32bench [options]\n"
+         << "  --size MB          Volume size in MiB (default 256)\n"
+         << "  --files N          Number of files (default 2000)\n"
+         << "  --max-clusters N   Max clusters per file (default 16)\n"
+         << "  --frag F           Fragmentation probability 0..1 (overrides scenario)\n"
+         << "  --delete R         Deletion ratio 0..1 (default 0.2)\n"
+         << "  --depth D          Directory depth (default 2)\n"
+         << "  --fanout F         Sub-directories per directory (default 4)\n"
+         << "  --seed S           RNG seed (default 1)\n"
+         << "  --sector-size N    Logical sector size, 512 or 4096 (default 512)\n"
+         << "  --start-lba N      Partition start LBA (default 2048)\n"
+         << "  --gpt              Use a protective MBR + GPT partition table\n"
+         << "  --scenario NAME    clean|fragmented|broken-mbr|broken-bs|broken-bs-both|broken-fat1|\n"
+         << "                     4kn|4kn-broken-bs|gpt-3tb|all\n"
+         << "  --repeat N         Runs per scenario, best time is reported (default 3)\n"
+         << "  --dir PATH         Where to put temporary images (default .)\n"
+         << "  --generate FILE    Only write an image (use with --corrupt mbr,bs,bs-both,fat1)\n"
+         << "  --json             JSON Lines output\n";
+}
+
+static uint32_t parseCorruption(const string &list)
+{
+    uint32_t flags = CORRUPT_NONE;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        if (item == "mbr")
+            flags |= CORRUPT_MBR;
+        else if (item == "bs")
+            flags |= CORRUPT_BOOT_SECTOR;
+        else if (item == "bs-both")
+            flags |= CORRUPT_BOTH_BOOT_SECTORS;
+        else if (item == "fat1")
+            flags |= CORRUPT_FAT1;
+        else if (item != "none")
+            throw runtime_error("Unknown corruption: " + item);
+    }
+    return flags;
+}
+
+// Chạy fn với cout/cerr bị tắt để log [INFO] không làm sai số đo
+static double timed(const function<void()> &fn)
+{
+    ostringstream sink;
+    streambuf *oldOut = cout.rdbuf(sink.rdbuf());
+    streambuf *oldErr = cerr.rdbuf(sink.rdbuf());
+
+    auto t0 = chrono::steady_clock::now();
+    try
+    {
+        fn();
+    }
+    catch (...)
+    {
+        cout.rdbuf(oldOut);
+        cerr.rdbuf(oldErr);
+        throw;
+    }
+    auto t1 = chrono::steady_clock::now();
+
+    cout.rdbuf(oldOut);
+    cerr.rdbuf(oldErr);
+    return chrono::duration<double>(t1 - t0).count();
+}
+
+// Số byte thực sự đọc từ thiết bị trong lúc chạy fn (Metrics::BYTES_READ)
+static double timedRead(const function<void()> &fn, uint64_t &bytesRead)
+{
+    uint64_t before = Metrics::get(Metrics::BYTES_READ);
+    double t = timed(fn);
+    bytesRead = Metrics::get(Metrics::BYTES_READ) - before;
+    return t;
+}
+
+// So kết quả tool đọc được với "đáp án" của generator; sai lệch -> ném lỗi kèm vài mẫu
+class GroundTruthCheck
+{
+public:
+    template <typename A, typename B>
+    void expect(const string &what, const A &got, const B &want)
+    {
+        if (got == want)
+            return;
+        ++mismatches;
+        if (samples.size() < 5)
+        {
+            ostringstream os;
+            os << what << ": got " << got << ", expected " << want;
+            samples.push_back(os.str());
+        }
+    }
+
+    void finish() const
+    {
+        if (mismatches == 0)
+            return;
+        string msg = "ground truth mismatch (" + to_string(mismatches) + ")";
+        for (const auto &s : samples)
+            msg += "; " + s;
+        throw runtime_error(msg);
+    }
+
+private:
+    size_t mismatches = 0;
+    vector<string> samples;
+};
+
+static string chainText(const vector<uint32_t> &chain)
+{
+    ostringstream os;
+    os << "[";
+    for (size_t i = 0; i < chain.size() && i < 8; ++i)
+        os << (i ? "," : "") << chain[i];
+    if (chain.size() > 8)
+        os << ",...(" << chain.size() << ")";
+    os << "]";
+    return os.str();
+}
+
+static void verifyAgainstGenerator(FAT32Recovery &tool, const GeneratedImage &img,
+                                   const map<uint32_t, vector<DeletedFileInfo>> &deletedByDir)
+{
+    GroundTruthCheck check;
+
+    // Hình học: offset 64-bit sai (GPT > 2 TiB) hay BPB dựng lại sai sectorsPerCluster vẫn có
+    // thể parse được, nên phải so từng giá trị với spec
+    check.expect("sectorSize", tool.getSectorSize(), img.sectorSize);
+    check.expect("fatBegin", tool.getFatBegin(), img.fatBeginOffset);
+    check.expect("dataBegin", tool.getDataBegin(), img.dataBeginOffset);
+    check.expect("clusterSize", tool.getClusterSize(), img.clusterSize);
+    check.expect("totalClusters", tool.getTotalClusters(), img.totalClusters);
+    check.finish();
+
+    // Entry còn sống: khóa (dirCluster, entryIndex)
+    map<pair<uint32_t, int>, LiveEntry> live;
+    size_t liveDirs = 0;
+    for (const auto &e : tool.listLiveEntries())
+    {
+        if (e.isDir)
+            ++liveDirs;
+        else
+            live[{e.dirCluster, e.entryIndex}] = e;
+    }
+    check.expect("live directories", liveDirs, img.dirClusters.size() - 1);
+
+    size_t liveFiles = 0, deletedFiles = 0;
+    for (const auto &f : img.files)
+    {
+        string where = "dir " + to_string(f.dirCluster) + " entry " + to_string(f.entryIndex);
+        if (f.deleted)
+        {
+            ++deletedFiles;
+            auto it = deletedByDir.find(f.dirCluster);
+            const DeletedFileInfo *hit = nullptr;
+            if (it != deletedByDir.end())
+                for (const auto &c : it->second)
+                    if (c.entryIndex == f.entryIndex)
+                        hit = &c;
+            check.expect(where + " deleted entry found", hit != nullptr, true);
+            if (hit)
+            {
+                check.expect(where + " deleted startCluster", hit->startCluster, f.startCluster);
+                check.expect(where + " deleted size", hit->size, f.size);
+            }
+            continue;
+        }
+
+        ++liveFiles;
+        auto it = live.find({f.dirCluster, f.entryIndex});
+        check.expect(where + " live entry found", it != live.end(), true);
+        if (it == live.end())
+            continue;
+        check.expect(where + " startCluster", it->second.startCluster, f.startCluster);
+        check.expect(where + " size", it->second.size, f.size);
+        check.expect(where + " chain", chainText(tool.followFAT(f.startCluster)), chainText(f.clusters));
+    }
+    check.expect("live files", live.size(), liveFiles);
+
+    size_t candidates = 0;
+    for (const auto &d : deletedByDir)
+        for (const auto &c : d.second)
+            candidates += c.isDir ? 0 : 1;
+    check.expect("deleted entries", candidates, deletedFiles);
+
+    check.finish();
+}
+
+static vector<PhaseResult> runOnce(const GeneratedImage &img)
+{
+    vector<PhaseResult> results;
+    FAT32Recovery *toolPtr = nullptr;
+    uint64_t bytes = 0;
+
+    double t = timed([&]()
+                     { toolPtr = new FAT32Recovery(img.path); });
+    unique_ptr<FAT32Recovery> tool(toolPtr);
+
+    // MBR: nếu hỏng thì deep scan toàn bộ vùng trước partition
+    t = timedRead([&]()
+                  { tool->initializeMBR(); }, bytes);
+    results.push_back({"mbr", t, bytes, 1});
+
+    t = timedRead([&]()
+                  {
+        if (!tool->initializeVolume(0))
+            throw runtime_error("initializeVolume failed"); }, bytes);
+    results.push_back({"bpb", t, bytes, 1});
+
+    t = timedRead([&]()
+                  { tool->loadFAT(); }, bytes);
+    results.push_back({"loadFAT", t, bytes, img.fatBytes / 4});
+
+    // followFAT trên mọi file còn sống: FAT đã nằm trong RAM nên chỉ tính entry/s
+    uint64_t walked = 0;
+    t = timedRead([&]()
+                  {
+        for (const auto &f : img.files)
+        {
+            if (!f.deleted)
+                walked += tool->followFAT(f.startCluster).size();
+        } }, bytes);
+    results.push_back({"followFAT", t, bytes, walked});
+
+    // Phân tích file đã xóa trên từng thư mục
+    map<uint32_t, vector<DeletedFileInfo>> deletedByDir;
+    t = timedRead([&]()
+                  {
+        for (uint32_t dc : img.dirClusters)
+            deletedByDir[dc] = tool->analyzeRecoveryCandidates(dc); }, bytes);
+    results.push_back({"analyze", t, bytes, (uint64_t)img.dirClusters.size() * (img.clusterSize / 32)});
+
+    // Ngoài phần đo: so với đáp án để bắt lỗi parse "im lặng"
+    ostringstream sink;
+    streambuf *oldOut = cout.rdbuf(sink.rdbuf());
+    try
+    {
+        verifyAgainstGenerator(*tool, img, deletedByDir);
+    }
+    catch (...)
+    {
+        cout.rdbuf(oldOut);
+        throw;
+    }
+    cout.rdbuf(oldOut);
+
+    return results;
+}
+
+int main(int argc, char **argv)
+{
+    ImageSpec spec;
+    string scenarioName = "all";
+    string workDir = ".";
+    string generateOnly;
+    int repeat = 3;
+    bool json = false;
+    bool fragOverride = false;
+    int failures = 0;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            string a = argv[i];
+            auto value = [&]() -> string
+            {
+                if (i + 1 >= argc)
+                    throw runtime_error("Missing value for " + a);
+                return argv[++i];
+            };
+
+            if (a == "--size")
+                spec.volumeBytes = stoull(value()) << 20;
+            else if (a == "--files")
+                spec.fileCount = stoul(value());
+            else if (a == "--max-clusters")
+                spec.maxFileClusters = stoul(value());
+            else if (a == "--frag")
+            {
+                spec.fragmentation = stod(value());
+                fragOverride = true;
+            }
+            else if (a == "--delete")
+                spec.deletionRatio = stod(value());
+            else if (a == "--depth")
+                spec.dirDepth = stoul(value());
+            else if (a == "--fanout")
+                spec.dirFanout = stoul(value());
+            else if (a == "--sector-size")
+                spec.sectorSize = stoul(value());
+            else if (a == "--start-lba")
+                spec.partitionStartLBA = stoull(value());
+            else if (a == "--gpt")
+                spec.gpt = true;
+            else if (a == "--seed")
+                spec.seed = stoull(value());
+            else if (a == "--scenario")
+                scenarioName = value();
+            else if (a == "--repeat")
+                repeat = max(1, stoi(value()));
+            else if (a == "--dir")
+                workDir = value();
+            else if (a == "--generate")
+                generateOnly = value();
+            else if (a == "--corrupt")
+                spec.corruption = parseCorruption(value());
+            else if (a == "--json")
+                json = true;
+            else
+            {
+                printUsage();
+                return 2;
+            }
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "[ERROR] " << e.what() << "\n";
+        printUsage();
+        return 2;
+    }
+
+    try
+    {
+        if (!generateOnly.empty())
+        {
+            GeneratedImage img = generateImage(generateOnly, spec);
+            cout << "[INFO] Generated " << img.path << ": " << img.imageBytes << " bytes, "
+                 << img.totalClusters << " clusters, " << img.files.size() << " files, "
+                 << img.dirClusters.size() << " dirs\n";
+            return 0;
+        }
+
+        Metrics::enable(true);
+        if (!json)
+        {
+            cout << left << setw(16) << "Scenario" << setw(12) << "Phase" << right
+                 << setw(12) << "Time (ms)" << setw(12) << "MB/s" << setw(16) << "Entries/s" << "\n";
+            cout << string(68, '-') << "\n";
+        }
+
+        for (const auto &sc : SCENARIOS)
+        {
+            if (scenarioName != "all" && scenarioName != sc.name)
+                continue;
+
+            ImageSpec s = spec;
+            if (!fragOverride)
+                s.fragmentation = sc.fragmentation;
+            s.corruption |= sc.corruption;
+            if (sc.sectorSize)
+                s.sectorSize = sc.sectorSize;
+            if (sc.partitionStartLBA)
+                s.partitionStartLBA = sc.partitionStartLBA;
+            s.gpt = s.gpt || sc.gpt;
+            string path = workDir + "/bench_" + sc.name + ".img";
+
+            // Mỗi lần chạy sinh lại image vì các pha sửa chữa ghi xuống đĩa
+            vector<PhaseResult> best;
+            try
+            {
+                for (int r = 0; r < repeat; ++r)
+                {
+                    GeneratedImage img = generateImage(path, s);
+                    vector<PhaseResult> res = runOnce(img);
+                    if (best.empty())
+                        best = res;
+                    else
+                        for (size_t k = 0; k < res.size(); ++k)
+                            best[k].seconds = min(best[k].seconds, res[k].seconds);
+                }
+            }
+            catch (const exception &e)
+            {
+                // Một kịch bản hỏng không làm dừng cả bộ benchmark, nhưng exit code sẽ khác 0
+                if (json)
+                    cout << "{\"scenario\":\"" << sc.name << "\",\"error\":\"" << e.what() << "\"}\n";
+                else
+                    cout << left << setw(16) << sc.name << "FAILED: " << e.what() << "\n";
+                best.clear();
+                ++failures;
+            }
+            error_code ec;
+            filesystem::remove(path, ec);
+
+            for (const auto &p : best)
+            {
+                double sec = max(p.seconds, 1e-9);
+                double mbps = p.bytes / sec / (1024.0 * 1024.0);
+                double eps = p.entries / sec;
+                if (json)
+                    cout << "{\"scenario\":\"" << sc.name << "\",\"phase\":\"" << p.phase
+                         << "\",\"seconds\":" << p.seconds << ",\"bytes\":" << p.bytes
+                         << ",\"entries\":" << p.entries << ",\"mbPerSec\":" << mbps
+                         << ",\"entriesPerSec\":" << eps << "}\n";
+                else
+                    cout << left << setw(16) << sc.name << setw(12) << p.phase << right << fixed
+                         << setprecision(2) << setw(12) << p.seconds * 1000.0 << setw(12) << mbps
+                         << setprecision(0) << setw(16) << eps << "\n";
+            }
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "[CRITICAL ERROR] " << e.what() << "\n";
+        return 1;
+    }
+    if (failures)
+    {
+        cerr << "[ERROR] " << failures << " scenario(s) failed\n";
+        return 1;
+    }
+    return 0;
+}
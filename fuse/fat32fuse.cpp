@@ -0,0 +1,502 @@
+// Mount chỉ đọc một image FAT32 qua FUSE: cây thư mục còn sống và thư mục .deleted/
+// chứa mọi entry đã xóa còn khôi phục được (dữ liệu lấy theo followFAT / contiguousGuess),
+// không cần ghi gì vào image như restoreDeletedFile.
+// Build (target riêng, cần libfuse3):
+//   cmake -S . -B build && cmake --build build --target fat32fuse   (target chỉ có khi tìm thấy fuse3)
+// Ví dụ:
+//   ./fat32fuse disk.img /mnt/rec -f
+//   ./fat32fuse disk.img /mnt/rec --partition 1 --readahead 8M --mem 512M
+//   rsync -a /mnt/rec/.deleted/ out/ && fusermount3 -u /mnt/rec
+#define FUSE_USE_VERSION 31
+
+#if defined(__has_include)
+#if !__has_include(<fuse.h>)
+#error "fat32fuse requires libfuse3 (build with $(pkg-config --cflags --libs fuse3))"
+#endif
+#endif
+
+#include <fuse.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <ctime>
+#include <deque>
+#include <algorithm>
+#include "FAT32.h"
+
+using namespace std;
+
+enum NodeKind
+{
+    NODE_LIVE,   // cây còn sống
+    NODE_SHADOW, // .deleted/<thư mục sống>: entry đã xóa của thư mục đó + thư mục sống con
+    NODE_DELETED // entry đã xóa (thư mục thì duyệt tiếp bằng DeletedTreeView)
+};
+
+struct Node
+{
+    NodeKind kind;
+    bool isDir;
+    bool listed; // con đã được nạp
+    uint32_t startCluster;
+    uint64_t size;
+    time_t mtime;
+    map<string, size_t> children;
+};
+
+// Extent của một file kèm offset byte bắt đầu của từng extent (tìm nhị phân khi đọc ngẫu nhiên)
+struct FileExtents
+{
+    vector<ClusterChainReader::Extent> extents;
+    vector<uint64_t> starts;
+    uint64_t bytes; // tổng số byte các extent phủ được
+};
+
+// Mỗi lần open: cửa sổ đọc trước riêng, tăng gấp đôi khi đọc tuần tự
+struct OpenFile
+{
+    shared_ptr<const FileExtents> map;
+    uint64_t size;
+    mutex lock;
+    vector<uint8_t> window;
+    uint64_t windowOff = 0;
+    uint64_t nextOff = 0; // offset của lần đọc kế tiếp nếu đọc tuần tự
+    size_t readahead = 0;
+};
+
+static const size_t MIN_READAHEAD = 128 << 10;
+
+struct MountState
+{
+    unique_ptr<FAT32Recovery> vol;
+    unique_ptr<DeletedTreeView> view;
+    uint32_t clusterSize = 0;
+    size_t maxReadahead = 4 << 20;
+
+    mutex treeLock; // bảo vệ nodes và view
+    deque<Node> nodes;
+
+    // Cache extent theo node: mở lại file không phải đi lại FAT
+    mutex extentLock;
+    size_t maxExtentFiles = 4096;
+    unordered_map<size_t, shared_ptr<const FileExtents>> extentCache;
+    list<size_t> extentOrder;
+};
+
+static MountState &mountState()
+{
+    return *static_cast<MountState *>(fuse_get_context()->private_data);
+}
+
+// Ngày giờ FAT (date << 16 | time) sang time_t theo giờ địa phương
+static time_t dosToTime(uint32_t stamp)
+{
+    uint16_t date = uint16_t(stamp >> 16);
+    uint16_t tod = uint16_t(stamp & 0xFFFF);
+    if (date == 0)
+        return 0;
+    struct tm tm = {};
+    tm.tm_year = ((date >> 9) & 0x7F) + 80;
+    tm.tm_mon = ((date >> 5) & 0x0F) - 1;
+    tm.tm_mday = date & 0x1F;
+    tm.tm_hour = tod >> 11;
+    tm.tm_min = (tod >> 5) & 0x3F;
+    tm.tm_sec = (tod & 0x1F) * 2;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Nạp con của một thư mục lần đầu được hỏi tới (gọi khi đang giữ treeLock)
+static void loadChildren(MountState &s, size_t id)
+{
+    if (s.nodes[id].listed)
+        return;
+    s.nodes[id].listed = true;
+    NodeKind parentKind = s.nodes[id].kind;
+
+    DeletedTreeView::Listing listing = s.view->children(s.nodes[id].startCluster);
+    for (const auto &e : *listing)
+    {
+        const DeletedFileInfo &f = e.info;
+        NodeKind kind = NODE_DELETED;
+        if (parentKind == NODE_LIVE)
+        {
+            if (e.deleted)
+                continue;
+            kind = NODE_LIVE;
+        }
+        else if (parentKind == NODE_SHADOW && !e.deleted)
+        {
+            if (!f.isDir)
+                continue;
+            kind = NODE_SHADOW;
+        }
+        else if (!f.isRecoverable)
+            continue;
+
+        // Tên trùng (nhiều "?HOTO.JPG" cùng thư mục): thêm chỉ số entry, vẫn trùng
+        // (một file thật tên "X~5") thì thêm tiếp bộ đếm tới khi chưa có ai dùng
+        string name = f.name;
+        if (name.empty() || s.nodes[id].children.count(name))
+        {
+            string base = name + "~" + to_string(f.entryIndex);
+            name = base;
+            for (unsigned n = 2; s.nodes[id].children.count(name); ++n)
+                name = base + "_" + to_string(n);
+        }
+
+        s.nodes.push_back({kind, f.isDir, false, f.startCluster, f.isDir ? 0 : uint64_t(f.size),
+                           dosToTime(f.lastWriteTime), {}});
+        s.nodes[id].children[name] = s.nodes.size() - 1;
+    }
+}
+
+// Đường dẫn -> chỉ số node, hoặc -errno
+static long resolve(MountState &s, const char *path)
+{
+    size_t id = 0;
+    string p(path);
+    for (size_t pos = 1; pos < p.size();)
+    {
+        size_t slash = p.find('/', pos);
+        if (slash == string::npos)
+            slash = p.size();
+        string comp = p.substr(pos, slash - pos);
+        pos = slash + 1;
+        if (comp.empty())
+            continue;
+
+        if (!s.nodes[id].isDir)
+            return -ENOTDIR;
+        loadChildren(s, id);
+        auto it = s.nodes[id].children.find(comp);
+        if (it == s.nodes[id].children.end())
+            return -ENOENT;
+        id = it->second;
+    }
+    return long(id);
+}
+
+static shared_ptr<const FileExtents> extentsFor(MountState &s, size_t id, NodeKind kind,
+                                                uint32_t startCluster, uint64_t size)
+{
+    {
+        lock_guard<mutex> g(s.extentLock);
+        auto it = s.extentCache.find(id);
+        if (it != s.extentCache.end())
+            return it->second;
+    }
+
+    // File sống đi theo FAT, file đã xóa dùng đúng dải liên tục mà analyzeRecoveryCandidates
+    // đã kiểm tra (vượt ngoài volume -> ném lỗi, không bao giờ lấy cluster ở chỗ khác)
+    vector<uint32_t> chain;
+    if (size > 0)
+        chain = kind == NODE_LIVE ? s.vol->followFAT(startCluster)
+                                  : s.vol->contiguousRange(startCluster, size);
+
+    auto fe = make_shared<FileExtents>();
+    fe->extents = ClusterChainReader::buildExtents(chain);
+    fe->bytes = 0;
+    for (const auto &e : fe->extents)
+    {
+        fe->starts.push_back(fe->bytes);
+        fe->bytes += uint64_t(e.count) * s.clusterSize;
+    }
+
+    lock_guard<mutex> g(s.extentLock);
+    auto inserted = s.extentCache.emplace(id, fe);
+    if (inserted.second)
+    {
+        s.extentOrder.push_back(id);
+        while (s.extentOrder.size() > s.maxExtentFiles)
+        {
+            s.extentCache.erase(s.extentOrder.front());
+            s.extentOrder.pop_front();
+        }
+    }
+    return inserted.first->second;
+}
+
+// Đọc [pos, pos + want) (làm tròn theo cluster) vào cửa sổ của file; mỗi extent 1 lần I/O
+static bool fillWindow(MountState &s, OpenFile &f, uint64_t pos, uint64_t want)
+{
+    const FileExtents &fe = *f.map;
+    const uint64_t cs = s.clusterSize;
+    uint64_t begin = pos / cs * cs;
+    uint64_t end = min(fe.bytes, (pos + want + cs - 1) / cs * cs);
+
+    f.windowOff = begin;
+    f.window.clear();
+    if (begin >= end)
+        return true;
+    f.window.resize(end - begin);
+
+    size_t k = size_t(upper_bound(fe.starts.begin(), fe.starts.end(), begin) - fe.starts.begin()) - 1;
+    uint64_t cur = begin;
+    try
+    {
+        for (; cur < end && k < fe.extents.size(); ++k)
+        {
+            const auto &e = fe.extents[k];
+            uint64_t stop = min(end, fe.starts[k] + uint64_t(e.count) * cs);
+            uint32_t first = e.firstCluster + uint32_t((cur - fe.starts[k]) / cs);
+            s.vol->readClusterRun(first, uint32_t((stop - cur) / cs), f.window.data() + (cur - begin));
+            cur = stop;
+        }
+    }
+    catch (const exception &ex)
+    {
+        FAT32_LOG(LOG_WARN, "FUSE reads failed", "Read failed at offset " << cur << ": " << ex.what());
+        f.window.resize(cur - begin);
+        return false;
+    }
+    return true;
+}
+
+// ======================================================================
+//                       FUSE OPERATIONS
+// ======================================================================
+static void *fsInit(struct fuse_conn_info *, struct fuse_config *cfg)
+{
+    // Image không đổi trong suốt phiên mount: cho kernel giữ cache trang và thuộc tính
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = 3600;
+    cfg->attr_timeout = 3600;
+    return fuse_get_context()->private_data;
+}
+
+static int fsGetattr(const char *path, struct stat *st, struct fuse_file_info *)
+{
+    MountState &s = mountState();
+    lock_guard<mutex> g(s.treeLock);
+    long id = resolve(s, path);
+    if (id < 0)
+        return int(id);
+
+    const Node &n = s.nodes[id];
+    memset(st, 0, sizeof(*st));
+    st->st_mode = n.isDir ? (S_IFDIR | 0555) : (S_IFREG | 0444);
+    st->st_nlink = n.isDir ? 2 : 1;
+    st->st_size = off_t(n.size);
+    st->st_blksize = s.clusterSize;
+    st->st_blocks = blkcnt_t((n.size + 511) / 512);
+    st->st_atime = st->st_mtime = st->st_ctime = n.mtime;
+    return 0;
+}
+
+static int fsReaddir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, struct fuse_file_info *,
+                     enum fuse_readdir_flags)
+{
+    MountState &s = mountState();
+    lock_guard<mutex> g(s.treeLock);
+    long id = resolve(s, path);
+    if (id < 0)
+        return int(id);
+    if (!s.nodes[id].isDir)
+        return -ENOTDIR;
+
+    loadChildren(s, size_t(id));
+    filler(buf, ".", nullptr, 0, fuse_fill_dir_flags(0));
+    filler(buf, "..", nullptr, 0, fuse_fill_dir_flags(0));
+    for (const auto &c : s.nodes[id].children)
+        filler(buf, c.first.c_str(), nullptr, 0, fuse_fill_dir_flags(0));
+    return 0;
+}
+
+static int fsOpen(const char *path, struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+
+    MountState &s = mountState();
+    NodeKind kind;
+    uint32_t start;
+    uint64_t size;
+    long id;
+    {
+        lock_guard<mutex> g(s.treeLock);
+        id = resolve(s, path);
+        if (id < 0)
+            return int(id);
+        if (s.nodes[id].isDir)
+            return -EISDIR;
+        kind = s.nodes[id].kind;
+        start = s.nodes[id].startCluster;
+        size = s.nodes[id].size;
+    }
+
+    OpenFile *f = new OpenFile();
+    try
+    {
+        f->map = extentsFor(s, size_t(id), kind, start, size);
+    }
+    catch (const exception &)
+    {
+        delete f;
+        return -EIO;
+    }
+    f->size = size;
+    f->readahead = MIN_READAHEAD;
+    fi->fh = reinterpret_cast<uint64_t>(f);
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int fsRead(const char *, char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    MountState &s = mountState();
+    OpenFile &f = *reinterpret_cast<OpenFile *>(fi->fh);
+    lock_guard<mutex> g(f.lock);
+
+    if (off < 0 || uint64_t(off) >= f.size)
+        return 0;
+    size = size_t(min<uint64_t>(size, f.size - off));
+
+    size_t done = 0;
+    bool failed = false;
+    while (done < size)
+    {
+        uint64_t pos = uint64_t(off) + done;
+        if (pos < f.windowOff || pos >= f.windowOff + f.window.size())
+        {
+            // Đọc tuần tự: nhân đôi cửa sổ tới maxReadahead; nhảy cóc: về mức nhỏ nhất
+            f.readahead = pos == f.nextOff ? min(f.readahead * 2, s.maxReadahead) : MIN_READAHEAD;
+            failed = !fillWindow(s, f, pos, max<uint64_t>(f.readahead, size - done));
+            if (pos >= f.windowOff + f.window.size())
+                break; // hết extent (chuỗi ngắn hơn kích thước file) hoặc lỗi đọc
+        }
+        size_t n = size_t(min<uint64_t>(f.windowOff + f.window.size() - pos, size - done));
+        memcpy(buf + done, f.window.data() + (pos - f.windowOff), n);
+        done += n;
+    }
+    f.nextOff = uint64_t(off) + done;
+    return done == 0 && failed ? -EIO : int(done);
+}
+
+static int fsRelease(const char *, struct fuse_file_info *fi)
+{
+    delete reinterpret_cast<OpenFile *>(fi->fh);
+    return 0;
+}
+
+// ======================================================================
+//                       MAIN
+// ======================================================================
+static void printUsage()
+{
+    cerr << "Usage: fat32fuse <image> <mountpoint> [options] [FUSE options]\n"
+         << "  --partition N     Partition index as listed by 'fat32tool scan' (default 0)\n"
+         << "  --readahead SIZE  Max readahead per open file (default 4M)\n"
+         << "  --mem SIZE        Cluster cache budget (e.g. 256M, 1G)\n"
+         << "  --threads N       I/O worker threads\n"
+         << "Other options (-f, -d, -o allow_other, ...) are passed to FUSE; the mount is always read-only.\n"
+         << "Recoverable deleted entries appear under <mountpoint>/.deleted/.\n";
+}
+
+static size_t parseSize(const string &s)
+{
+    char *end = nullptr;
+    double v = strtod(s.c_str(), &end);
+    switch (end && *end ? toupper((unsigned char)*end) : 0)
+    {
+    case 'K':
+        v *= 1024.0;
+        break;
+    case 'M':
+        v *= 1024.0 * 1024.0;
+        break;
+    case 'G':
+        v *= 1024.0 * 1024.0 * 1024.0;
+        break;
+    }
+    return (size_t)v;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printUsage();
+        return 2;
+    }
+
+    string image = argv[1];
+    int partition = 0;
+    size_t memBudget = 0;
+    unsigned threads = 0;
+    MountState s;
+
+    // Tùy chọn của tool được tách ra, phần còn lại chuyển nguyên cho FUSE
+    string fsOptions = "ro,fsname=fat32fuse,subtype=fat32";
+    vector<char *> fuseArgs = {argv[0], argv[2]};
+    try
+    {
+        for (int i = 3; i < argc; ++i)
+        {
+            string a = argv[i];
+            auto value = [&]() -> string
+            {
+                if (i + 1 >= argc)
+                    throw runtime_error("Missing value for " + a);
+                return argv[++i];
+            };
+            if (a == "--partition")
+                partition = stoi(value());
+            else if (a == "--readahead")
+                s.maxReadahead = max(MIN_READAHEAD, parseSize(value()));
+            else if (a == "--mem")
+                memBudget = parseSize(value());
+            else if (a == "--threads")
+                threads = (unsigned)stoul(value());
+            else
+                fuseArgs.push_back(argv[i]);
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "[ERROR] " << e.what() << "\n";
+        printUsage();
+        return 2;
+    }
+    fuseArgs.push_back(const_cast<char *>("-o"));
+    fuseArgs.push_back(&fsOptions[0]);
+
+    try
+    {
+        // Chỉ đọc: mọi sửa chữa MBR/BPB/FAT khi nạp chỉ nằm trong RAM
+        s.vol.reset(new FAT32Recovery(image, true));
+        if (threads > 0)
+            s.vol->setIOThreads(threads);
+        if (memBudget > 0)
+            s.vol->setCacheBudget(memBudget);
+        s.vol->initializeMBR();
+        if (!s.vol->initializeVolume(partition))
+            throw runtime_error("Cannot initialize partition " + to_string(partition));
+        s.vol->loadFAT();
+    }
+    catch (const exception &e)
+    {
+        cerr << "[ERROR] " << e.what() << "\n";
+        return 1;
+    }
+
+    s.clusterSize = s.vol->getClusterSize();
+    s.view.reset(new DeletedTreeView(*s.vol));
+
+    // Node 0 = gốc còn sống, node 1 = .deleted (bóng của gốc)
+    uint32_t root = s.vol->getRootCluster();
+    s.nodes.push_back({NODE_LIVE, true, false, root, 0, 0, {}});
+    s.nodes.push_back({NODE_SHADOW, true, false, root, 0, 0, {}});
+    s.nodes[0].children[".deleted"] = 1;
+
+    struct fuse_operations ops = {};
+    ops.init = fsInit;
+    ops.getattr = fsGetattr;
+    ops.readdir = fsReaddir;
+    ops.open = fsOpen;
+    ops.read = fsRead;
+    ops.release = fsRelease;
+
+    cout << "[INFO] Mounting " << image << " (partition " << partition << ") read-only on " << argv[2] << "\n";
+    return fuse_main(int(fuseArgs.size()), fuseArgs.data(), &ops, &s);
+}
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <cstdlib>
+#include <filesystem>
 #include "FAT32.h"
 
 using namespace std;
@@ -23,7 +25,8 @@ string formatTimestamp(uint32_t date, uint32_t time)
     return string(buffer);
 }
 
-int main()
+// Chế độ tương tác cũ (không truyền tham số)
+int runInteractive()
 {
     // 1. Kiểm tra tham số đầu vào
     string diskPath = "VHDFAT32.vhd"; // Mặc định
@@ -45,7 +48,7 @@ int main()
         // Giả sử ta chọn Partition đầu tiên (Index 0) để làm việc
         // Trong thực tế bạn có thể cho người dùng nhập cin >> partIndex
         int partIndex = 0;
-        cout << "Select partition (0, 1, 2, 3): ";
+        cout << "Select partition (0.." << (int)tool.getPartitions().size() - 1 << "): ";
         cin >> partIndex;
         cout << "\n>>> Selecting Partition " << partIndex << "...\n";
 
@@ -55,8 +58,8 @@ int main()
         tool.loadFAT(); // Tải bảng FAT vào RAM
 
         // 4. QUÉT VÀ PHÂN TÍCH (Analysis Phase)
-        // Quét thư mục gốc (Root Cluster thường là 2)
-        uint32_t currentDirCluster = 2;
+        // Quét thư mục gốc (lấy từ Boot Sector thay vì giả định là 2)
+        uint32_t currentDirCluster = tool.getRootCluster();
         cout << "\n>>> Analyzing Deleted Files in Root Directory (Cluster " << currentDirCluster << ")...\n";
 
         // Gọi hàm thông minh có logic xử lý xung đột (Collision Detection)
@@ -84,14 +87,14 @@ int main()
             string type = file.isDir ? "<DIR>" : "FILE";
             string status = file.isRecoverable ? "GOOD" : "LOST";
 
-            // Tách Time/Date từ timestamp gộp (nếu muốn in đẹp)
-            uint32_t rawTime = file.lastWriteTime;
+            // Tách Time/Date từ timestamp gộp
+            string lastWrite = formatTimestamp(file.lastWriteTime >> 16, file.lastWriteTime & 0xFFFF);
 
             cout << left << setw(5) << file.entryIndex
                  << setw(15) << file.name
                  << setw(10) << type
                  << setw(10) << file.size
-                 << setw(22) << rawTime // Hoặc dùng formatTimestamp nếu tách ra
+                 << setw(22) << lastWrite
                  << setw(15) << status
                  << file.statusReason << endl;
         }
@@ -154,4 +157,1004 @@ int main()
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// ======================================================================
+//                       BATCH CLI (non-interactive)
+// ======================================================================
+struct CliOptions
+{
+    string command;
+    string image;
+    int partition = 0;
+    uint32_t cluster = 0; // 0 = root
+    string path;
+    int entry = -1;
+    string out;
+    unsigned threads = 0;
+    size_t memBudget = 0;
+    size_t maxFiles = 1000;
+    uint64_t count = 0; // classify: số cluster, 0 = tới cuối volume
+    unsigned depth = 1; // preview: số tầng con (0 = toàn bộ)
+    string format; // timeline: csv (mặc định) hoặc body; allocmap: json (mặc định) hoặc bin
+    bool json = false;
+    bool yes = false;
+    bool repair = false; // cho phép ghi sửa chữa MBR/BPB/FAT khi scan/analyze
+    bool all = false;    // analyze / export toàn bộ cây thư mục
+    bool dedup = false;  // băm nội dung, gom các bản trùng
+    bool score = false;  // chấm điểm khả năng khôi phục
+    size_t top = 0;      // analyze --score: chỉ in K ứng viên điểm cao nhất
+    string known;        // hash set file đã biết
+    bool skipKnown = false;
+    string from; // hashset: thư mục file tham chiếu hoặc danh sách hash
+    string digest; // hashset: "xxh64" hoặc "md5" (rỗng = mặc định / tự nhận từ danh sách)
+    bool useIndex = false;
+    bool verifyIndex = false; // băm lại toàn bộ FAT1 khi mở index
+    string indexPath;
+    string metrics; // "", "json" hoặc "prom"
+    string metricsOut;
+    unsigned progressMs = 0;
+    LogLevel logLevel = LOG_INFO;
+    int logRate = -1; // -1 = mặc định
+};
+
+static void printUsage()
+{
+    cerr << "Usage: fat32tool <command> <image> [options]\n"
+         << "  <image> may be a raw disk, a fixed/dynamic VHD, a VHDX or a qcow2 file\n"
+         << "Commands:\n"
+         << "  scan      Check/rebuild MBR and list partitions\n"
+         << "  analyze   List deleted entries of a directory\n"
+         << "  restore   Restore an entry in place (--entry)\n"
+         << "  export    Copy a deleted file out of the image (--entry, --out),\n"
+         << "            or every recoverable file with --all (duplicates are skipped)\n"
+         << "  carve     Carve files from free clusters by signature (--out DIR)\n"
+         << "  orphans   Find unreachable cluster chains and graft them into /LOST.DIR\n"
+         << "  crosslinks  Find clusters shared by live files and copy the shared tails out\n"
+         << "  hashset   Build a known-file hash set; <image> is the output file (--from DIR|LIST)\n"
+         << "  preview   List what a deleted directory contains without writing (--entry, --depth)\n"
+         << "  timeline  MAC timeline of live and deleted entries (--format csv|body, --out FILE)\n"
+         << "  allocmap  Run-length map of free/live/deleted/contested/bad/orphan clusters (--format json|bin)\n"
+         << "  classify  Content class (zero/text/compressed/structured) of cluster runs (--cluster, --count)\n"
+         << "Options:\n"
+         << "  --partition N    Partition index as listed by scan (default 0), or 'all' for analyze\n"
+         << "  --cluster N      Directory cluster (default: root)\n"
+         << "  --path /A/B      Directory path (instead of --cluster)\n"
+         << "  --entry N        Entry index inside the directory\n"
+         << "  --out PATH       Output file / directory\n"
+         << "  --max N          Max carved files (default 1000)\n"
+         << "  --count N        classify: number of clusters from --cluster (default: to the end)\n"
+         << "  --threads N      I/O worker threads\n"
+         << "  --mem SIZE       Cluster cache budget (e.g. 256M, 1G); timeline: sort buffer\n"
+         << "  --all            analyze/export: every directory of the volume\n"
+         << "  --dedup          analyze --all: hash candidates and mark identical copies\n"
+         << "  --score          analyze: rate each candidate 0..1 from FAT, signature, sampled data, LFN, times\n"
+         << "  --top K          analyze --score: print only the K best candidates, best first\n"
+         << "  --known PATH     export/carve: tag files found in this hash set\n"
+         << "  --skip-known     export/carve: do not write files found in the hash set\n"
+         << "  --from PATH      hashset: directory of reference files, or a hash list: md5sum output,\n"
+         << "                   an NSRL-style CSV with an MD5 column, or xxHash64 hex values (SHA-1 is not supported)\n"
+         << "  --digest D       hashset: xxh64 (default) or md5 for --from DIR\n"
+         << "  --depth N        preview: levels to expand (default 1, 0 = whole subtree)\n"
+         << "  --format F       timeline: csv (sorted, default) or body (TSK bodyfile for mactime)\n"
+         << "                   allocmap: json (default) or bin\n"
+         << "  --index [PATH]   Reuse/create the sidecar analysis index (default <image>.p<N>.f32idx)\n"
+         << "  --verify-index   Hash the whole FAT1 before trusting the index (default: sampled sectors)\n"
+         << "  --json           JSON Lines on stdout, logs on stderr\n"
+         << "  --metrics FMT    Dump phase timers/counters at exit (json|prom)\n"
+         << "  --metrics-out P  Write the metrics dump to file P instead of stderr\n"
+         << "  --progress MS    Print a progress line to stderr every MS milliseconds\n"
+         << "  --log-level L    debug|info|warn|error|off (default info)\n"
+         << "  --log-rate N     Print at most N warnings of one kind, then aggregate (0 = all)\n"
+         << "  --repair         Allow scan/analyze/export/carve/orphans/crosslinks to write repairs\n"
+         << "  --yes            Restore or export entries marked LOST\n";
+}
+
+static size_t parseSize(const string &s)
+{
+    char *end = nullptr;
+    double v = strtod(s.c_str(), &end);
+    switch (end && *end ? toupper((unsigned char)*end) : 0)
+    {
+    case 'K':
+        v *= 1024.0;
+        break;
+    case 'M':
+        v *= 1024.0 * 1024.0;
+        break;
+    case 'G':
+        v *= 1024.0 * 1024.0 * 1024.0;
+        break;
+    }
+    return (size_t)v;
+}
+
+static bool parseArgs(int argc, char **argv, CliOptions &opt)
+{
+    if (argc < 3)
+        return false;
+    opt.command = argv[1];
+    opt.image = argv[2];
+
+    for (int i = 3; i < argc; ++i)
+    {
+        string a = argv[i];
+        auto value = [&]() -> string
+        {
+            if (i + 1 >= argc)
+                throw runtime_error("Missing value for " + a);
+            return argv[++i];
+        };
+
+        if (a == "--partition")
+        {
+            string v = value();
+            opt.partition = v == "all" ? -1 : stoi(v); // -1 = mọi partition FAT32
+        }
+        else if (a == "--cluster")
+            opt.cluster = (uint32_t)stoul(value());
+        else if (a == "--path")
+            opt.path = value();
+        else if (a == "--entry")
+            opt.entry = stoi(value());
+        else if (a == "--out")
+            opt.out = value();
+        else if (a == "--max")
+            opt.maxFiles = stoul(value());
+        else if (a == "--count")
+            opt.count = stoull(value());
+        else if (a == "--depth")
+            opt.depth = (unsigned)stoul(value());
+        else if (a == "--format")
+            opt.format = value();
+        else if (a == "--threads")
+            opt.threads = (unsigned)stoul(value());
+        else if (a == "--mem")
+            opt.memBudget = parseSize(value());
+        else if (a == "--json")
+            opt.json = true;
+        else if (a == "--yes")
+            opt.yes = true;
+        else if (a == "--repair")
+            opt.repair = true;
+        else if (a == "--all")
+            opt.all = true;
+        else if (a == "--dedup")
+            opt.dedup = true;
+        else if (a == "--score")
+            opt.score = true;
+        else if (a == "--top")
+            opt.top = stoul(value());
+        else if (a == "--known")
+            opt.known = value();
+        else if (a == "--digest")
+        {
+            opt.digest = value();
+            if (opt.digest != "xxh64" && opt.digest != "md5")
+                throw runtime_error("Unknown digest: " + opt.digest);
+        }
+        else if (a == "--skip-known")
+            opt.skipKnown = true;
+        else if (a == "--from")
+            opt.from = value();
+        else if (a == "--metrics")
+        {
+            opt.metrics = value();
+            if (opt.metrics != "json" && opt.metrics != "prom")
+                throw runtime_error("--metrics expects json or prom");
+        }
+        else if (a == "--log-level")
+        {
+            string lv = value();
+            if (lv == "debug")
+                opt.logLevel = LOG_DEBUG;
+            else if (lv == "info")
+                opt.logLevel = LOG_INFO;
+            else if (lv == "warn")
+                opt.logLevel = LOG_WARN;
+            else if (lv == "error")
+                opt.logLevel = LOG_ERROR;
+            else if (lv == "off")
+                opt.logLevel = LOG_OFF;
+            else
+                throw runtime_error("Unknown log level: " + lv);
+        }
+        else if (a == "--log-rate")
+            opt.logRate = stoi(value());
+        else if (a == "--metrics-out")
+            opt.metricsOut = value();
+        else if (a == "--progress")
+            opt.progressMs = (unsigned)stoul(value());
+        else if (a == "--index")
+        {
+            opt.useIndex = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                opt.indexPath = argv[++i];
+        }
+        else if (a == "--verify-index")
+            opt.verifyIndex = true;
+        else
+            throw runtime_error("Unknown option: " + a);
+    }
+    // Mặc định mỗi partition một index, đổi --partition không ghi đè index của partition khác
+    if (opt.indexPath.empty())
+        opt.indexPath = opt.image + ".p" + to_string(opt.partition) + ".f32idx";
+    return true;
+}
+
+static string jsonEscape(const string &s)
+{
+    string r;
+    for (unsigned char c : s)
+    {
+        switch (c)
+        {
+        case '"':
+            r += "\\\"";
+            break;
+        case '\\':
+            r += "\\\\";
+            break;
+        case '\n':
+            r += "\\n";
+            break;
+        default:
+            if (c < 0x20 || c >= 0x7F)
+            {
+                // Tên 8.3 là OEM code page, không chắc là UTF-8 -> escape
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                r += buf;
+            }
+            else
+                r.push_back((char)c);
+        }
+    }
+    return r;
+}
+
+static string hexHash(uint64_t h)
+{
+    ostringstream ss;
+    ss << hex << setw(16) << setfill('0') << h;
+    return ss.str();
+}
+
+// Tên các bằng chứng chấm điểm, ngăn cách bởi dấu phẩy
+static string evidenceNames(uint16_t flags)
+{
+    static const pair<uint16_t, const char *> names[] = {
+        {ScoreEvidence::SIGNATURE_MATCH, "signature"},
+        {ScoreEvidence::SIGNATURE_MISMATCH, "signature_mismatch"},
+        {ScoreEvidence::ZERO_DATA, "zero_data"},
+        {ScoreEvidence::TYPE_MISMATCH, "type_mismatch"},
+        {ScoreEvidence::LFN_OK, "lfn"},
+        {ScoreEvidence::LFN_BAD, "lfn_mismatch"},
+        {ScoreEvidence::TIME_ORDER, "time_order"},
+        {ScoreEvidence::PARTLY_USED, "partly_used"},
+        {ScoreEvidence::READ_ERROR, "read_error"},
+        {ScoreEvidence::NOT_DIRECTORY, "not_directory"},
+    };
+    string s;
+    for (const auto &n : names)
+        if (flags & n.first)
+            s += (s.empty() ? "" : ",") + string(n.second);
+    return s;
+}
+
+static void printJsonEntry(ostream &out, const string &image, int partition, uint32_t dirCluster, const DeletedFileInfo &f)
+{
+    out << "{\"type\":\"deleted\",\"image\":\"" << jsonEscape(image) << "\""
+        << ",\"partition\":" << partition
+        << ",\"dirCluster\":" << dirCluster
+        << ",\"entry\":" << f.entryIndex
+        << ",\"name\":\"" << jsonEscape(f.name) << "\""
+        << ",\"isDir\":" << (f.isDir ? "true" : "false")
+        << ",\"size\":" << f.size
+        << ",\"startCluster\":" << f.startCluster
+        << ",\"lastWrite\":\"" << formatTimestamp(f.lastWriteTime >> 16, f.lastWriteTime & 0xFFFF) << "\""
+        << ",\"created\":\"" << formatTimestamp(f.creationTime >> 16, f.creationTime & 0xFFFF) << "\""
+        << ",\"recoverable\":" << (f.isRecoverable ? "true" : "false")
+        << ",\"reason\":\"" << jsonEscape(f.statusReason) << "\"";
+    if (f.contentHash != 0)
+        out << ",\"contentHash\":\"" << hexHash(f.contentHash) << "\"";
+    if (f.duplicateOfEntry >= 0)
+        out << ",\"duplicateOf\":{\"dirCluster\":" << f.duplicateOfDir << ",\"entry\":" << f.duplicateOfEntry << "}";
+    if (f.score >= 0.0f)
+    {
+        out << ",\"score\":" << f.score << ",\"evidence\":[";
+        string names = evidenceNames(f.scoreFlags);
+        for (size_t pos = 0, n = 0; pos < names.size(); ++n)
+        {
+            size_t comma = names.find(',', pos);
+            if (comma == string::npos)
+                comma = names.size();
+            out << (n ? "," : "") << "\"" << names.substr(pos, comma - pos) << "\"";
+            pos = comma + 1;
+        }
+        out << "]";
+    }
+    out << "}\n";
+}
+
+// Text output: score và bằng chứng (cột cuối)
+static void printScore(ostream &out, const DeletedFileInfo &f)
+{
+    if (f.score < 0.0f)
+        return;
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%.3f", f.score);
+    string names = evidenceNames(f.scoreFlags);
+    out << "\t" << buf << "\t" << (names.empty() ? "-" : names);
+}
+
+static const DeletedFileInfo *findEntry(const vector<DeletedFileInfo> &report, int entry)
+{
+    for (const auto &f : report)
+    {
+        if (f.entryIndex == entry)
+            return &f;
+    }
+    return nullptr;
+}
+
+// In cây con của thư mục đã xóa theo chiều sâu; chỉ thư mục được mở mới bị đọc
+static void printPreview(ostream &out, const CliOptions &opt, DeletedTreeView &view, uint32_t dirStart,
+                         const string &basePath, unsigned level, set<uint32_t> &visited)
+{
+    DeletedTreeView::Listing listing = view.children(dirStart);
+    for (const auto &e : *listing)
+    {
+        const DeletedFileInfo &f = e.info;
+        string path = basePath + "/" + f.name;
+        if (opt.json)
+            out << "{\"type\":\"preview\",\"image\":\"" << jsonEscape(opt.image) << "\""
+                << ",\"partition\":" << opt.partition
+                << ",\"path\":\"" << jsonEscape(path) << "\""
+                << ",\"dirCluster\":" << e.dirCluster
+                << ",\"entry\":" << f.entryIndex
+                << ",\"deleted\":" << (e.deleted ? "true" : "false")
+                << ",\"isDir\":" << (f.isDir ? "true" : "false")
+                << ",\"size\":" << f.size
+                << ",\"startCluster\":" << f.startCluster
+                << ",\"lastWrite\":\"" << formatTimestamp(f.lastWriteTime >> 16, f.lastWriteTime & 0xFFFF) << "\""
+                << ",\"recoverable\":" << (f.isRecoverable ? "true" : "false")
+                << ",\"reason\":\"" << jsonEscape(f.statusReason) << "\"}\n";
+        else
+            out << path << "\t" << (f.isDir ? "DIR" : "FILE") << "\t" << f.size << "\t"
+                << (f.isRecoverable ? "GOOD" : "LOST") << "\t" << f.statusReason << "\n";
+
+        if (f.isDir && (opt.depth == 0 || level < opt.depth) && visited.insert(f.startCluster).second)
+            printPreview(out, opt, view, f.startCluster, path, level + 1, visited);
+    }
+}
+
+// Hash cho hash set: băm mọi file trong thư mục tham chiếu (xxHash64, hoặc MD5 với --digest md5),
+// hoặc đọc danh sách hex: mỗi dòng một hash ở cột đầu tiên (md5sum, danh sách xxHash64), hoặc
+// CSV kiểu NSRL có dòng tiêu đề chứa cột "MD5". Bỏ qua dòng trống và dòng '#'.
+// Digest của danh sách tự nhận theo độ dài hex: 32 = MD5, <= 16 = xxHash64. SHA-1 chưa hỗ trợ.
+static vector<uint64_t> collectHashes(const string &from, KnownHashSet::Digest &digest, bool digestGiven)
+{
+    vector<uint64_t> hashes;
+    if (filesystem::is_directory(from))
+    {
+        vector<char> buf(1 << 20);
+        for (const auto &e : filesystem::recursive_directory_iterator(from, filesystem::directory_options::skip_permission_denied))
+        {
+            if (!e.is_regular_file() || e.file_size() == 0)
+                continue;
+            ifstream in(e.path(), ios::in | ios::binary);
+            XXHash64 h;
+            MD5Hash md5;
+            while (in.read(buf.data(), buf.size()) || in.gcount() > 0)
+            {
+                if (digest == KnownHashSet::DIGEST_MD5)
+                    md5.update(buf.data(), (size_t)in.gcount());
+                else
+                    h.update(buf.data(), (size_t)in.gcount());
+            }
+            uint64_t d = digest == KnownHashSet::DIGEST_MD5 ? md5.key64() : h.digest();
+            hashes.push_back(d != 0 ? d : 1); // cùng quy ước với hashCandidate
+        }
+        return hashes;
+    }
+
+    ifstream in(from);
+    if (!in.is_open())
+        throw runtime_error("Cannot open " + from);
+    auto splitFields = [](const string &line)
+    {
+        vector<string> fields;
+        string cur;
+        for (char ch : line + ",")
+        {
+            if (ch == ',' || ch == ' ' || ch == '\t' || ch == ';' || ch == '\r')
+            {
+                if (!cur.empty())
+                    fields.push_back(cur);
+                cur.clear();
+            }
+            else if (ch != '"')
+                cur.push_back(ch);
+        }
+        return fields;
+    };
+
+    int listDigest = -1; // chưa biết
+    size_t column = 0;
+    string line;
+    while (getline(in, line))
+    {
+        vector<string> fields = splitFields(line);
+        if (fields.empty() || fields[0][0] == '#')
+            continue;
+        if (column >= fields.size() || fields[column].find_first_not_of("0123456789abcdefABCDEF") != string::npos)
+        {
+            // Dòng tiêu đề NSRL ("SHA-1","MD5",...): lấy cột MD5
+            auto md5Col = find(fields.begin(), fields.end(), "MD5");
+            if (md5Col != fields.end() && hashes.empty())
+            {
+                column = size_t(md5Col - fields.begin());
+                continue;
+            }
+            cerr << "[WARN] Ignoring malformed hash line: " << line << "\n";
+            continue;
+        }
+        const string &tok = fields[column];
+        int kind = tok.size() == 32 ? KnownHashSet::DIGEST_MD5 : tok.size() <= 16 ? KnownHashSet::DIGEST_XXH64 : -1;
+        if (kind < 0)
+            throw runtime_error("Unsupported hash length " + to_string(tok.size()) +
+                                " in " + from + " (expected xxHash64 or MD5)");
+        if (listDigest >= 0 && kind != listDigest)
+            throw runtime_error("Hash list " + from + " mixes xxHash64 and MD5 values");
+        listDigest = kind;
+        // MD5: giữ 64 bit đầu, đúng key mà MD5Hash::key64 tính khi so
+        hashes.push_back(stoull(tok.substr(0, 16), nullptr, 16));
+    }
+
+    if (listDigest >= 0)
+    {
+        if (digestGiven && listDigest != (int)digest)
+            throw runtime_error("--digest does not match the hashes in " + from);
+        digest = (KnownHashSet::Digest)listDigest;
+    }
+    return hashes;
+}
+
+static int runBatch(const CliOptions &opt, ostream &out)
+{
+    if (opt.command == "hashset")
+    {
+        if (opt.from.empty())
+            throw runtime_error("hashset requires --from DIR|LIST");
+        KnownHashSet::Digest digest = opt.digest == "md5" ? KnownHashSet::DIGEST_MD5 : KnownHashSet::DIGEST_XXH64;
+        vector<uint64_t> hashes = collectHashes(opt.from, digest, !opt.digest.empty());
+        // --mem giới hạn Bloom filter (mặc định 64 MiB)
+        bool ok = KnownHashSet::build(hashes, opt.image, opt.memBudget > 0 ? opt.memBudget : size_t(64) << 20, digest);
+        if (!ok)
+            throw runtime_error("Cannot write hash set " + opt.image);
+        return 0;
+    }
+
+    // Chỉ restore mới ghi xuống đĩa, trừ khi người dùng bật --repair
+    bool readOnly = !(opt.command == "restore" || opt.repair);
+    FAT32Recovery tool(opt.image, readOnly);
+
+    KnownHashSet known;
+    if (!opt.known.empty())
+    {
+        if (!known.open(opt.known))
+            throw runtime_error("Cannot open hash set " + opt.known);
+        tool.setKnownHashes(&known, opt.skipKnown);
+    }
+
+    if (opt.threads > 0)
+        tool.setIOThreads(opt.threads);
+    if (opt.memBudget > 0)
+    {
+        tool.setCacheBudget(opt.memBudget);
+        tool.setOwnerMapBudget(opt.memBudget);
+    }
+
+    if (opt.partition < 0)
+    {
+        // Mọi partition FAT32 cùng lúc, mỗi partition một luồng
+        if (opt.command != "analyze")
+            throw runtime_error("--partition all is only supported by analyze");
+        tool.initializeMBR();
+
+        unsigned threads = opt.threads > 0 ? opt.threads : 4;
+        int rc = 0;
+        for (const auto &r : tool.analyzeAllPartitions(threads))
+        {
+            if (!r.ok)
+            {
+                cerr << "[ERROR] Partition " << r.partitionIndex << ": " << r.error << "\n";
+                if (opt.json)
+                    out << "{\"type\":\"error\",\"image\":\"" << jsonEscape(opt.image) << "\",\"partition\":"
+                        << r.partitionIndex << ",\"message\":\"" << jsonEscape(r.error) << "\"}\n";
+                rc = 1;
+                continue;
+            }
+            for (const auto &kv : r.census)
+            {
+                for (const auto &f : kv.second)
+                {
+                    if (opt.json)
+                        printJsonEntry(out, opt.image, r.partitionIndex, kv.first, f);
+                    else
+                        out << r.partitionIndex << "\t" << kv.first << "\t" << f.entryIndex << "\t" << f.name << "\t"
+                            << (f.isDir ? "DIR" : "FILE") << "\t" << f.size << "\t"
+                            << (f.isRecoverable ? "GOOD" : "LOST") << "\t" << f.statusReason << "\n";
+                }
+            }
+        }
+        return rc;
+    }
+
+    // Index còn hợp lệ -> bỏ qua MBR/BPB/FAT và quét cây
+    bool fromIndex = opt.useIndex && opt.command != "restore" && tool.loadIndex(opt.indexPath, opt.partition, opt.verifyIndex);
+    if (!fromIndex)
+        tool.initializeMBR();
+
+    if (opt.command == "scan")
+    {
+        if (opt.json)
+        {
+            static const char *schemeNames[] = {"mbr", "ebr", "gpt", "none"};
+            const vector<PartitionInfo> &parts = tool.getPartitions();
+            for (size_t i = 0; i < parts.size(); ++i)
+            {
+                const PartitionInfo &p = parts[i];
+                out << "{\"type\":\"partition\",\"image\":\"" << jsonEscape(opt.image) << "\""
+                    << ",\"index\":" << i
+                    << ",\"scheme\":\"" << schemeNames[p.scheme] << "\""
+                    << ",\"startLBA\":" << p.startLBA
+                    << ",\"sectors\":" << p.numSectors
+                    << ",\"partType\":" << (int)p.type
+                    << ",\"fat32\":" << (p.isFAT32 ? "true" : "false")
+                    << ",\"active\":" << (p.active ? "true" : "false") << "}\n";
+            }
+        }
+        return 0;
+    }
+
+    if (!fromIndex)
+    {
+        if (!tool.initializeVolume(opt.partition))
+            throw runtime_error("Cannot initialize partition " + to_string(opt.partition));
+        tool.loadFAT();
+
+        if (opt.useIndex && opt.command != "restore")
+        {
+            tool.buildCensus();
+            if (!tool.saveIndex(opt.indexPath))
+                cerr << "[WARN] Could not write index " << opt.indexPath << "\n";
+        }
+    }
+
+    if ((opt.command == "analyze" || opt.command == "export") && opt.all)
+    {
+        if (tool.getDirectoryTree().empty())
+            tool.buildCensus();
+        // Export luôn dedup để không ghi cùng một nội dung nhiều lần; hash được lưu vào index
+        if (opt.dedup || opt.command == "export")
+            tool.dedupCensus(opt.threads);
+        if (opt.score)
+            tool.scoreCensus(opt.threads);
+        if ((opt.dedup || opt.score || opt.command == "export") && opt.useIndex && !tool.saveIndex(opt.indexPath))
+            cerr << "[WARN] Could not write index " << opt.indexPath << "\n";
+    }
+
+    if (opt.command == "export" && opt.all)
+    {
+        if (opt.out.empty())
+            throw runtime_error("export --all requires --out DIR");
+        for (const auto &r : tool.exportCensus(opt.out))
+        {
+            if (opt.json)
+                out << "{\"type\":\"" << (r.status == "exported" ? "exported" : "skipped") << "\""
+                    << ",\"status\":\"" << r.status << "\""
+                    << ",\"dirCluster\":" << r.dirCluster << ",\"entry\":" << r.entryIndex
+                    << ",\"size\":" << r.size << ",\"contentHash\":\"" << hexHash(r.contentHash) << "\""
+                    << ",\"known\":" << (r.known ? "true" : "false")
+                    << ",\"outPath\":\"" << jsonEscape(r.outPath) << "\"}\n";
+            else
+                out << r.status << "\t" << r.dirCluster << "\t" << r.entryIndex << "\t" << r.size << "\t"
+                    << hexHash(r.contentHash) << "\t" << (r.known ? "known" : "-") << "\t" << r.outPath << "\n";
+        }
+        return 0;
+    }
+
+    if (opt.command == "analyze" && opt.all)
+    {
+        // --score: thứ tự giảm dần theo điểm, nếu không thì theo census
+        vector<pair<uint32_t, const DeletedFileInfo *>> rows;
+        if (opt.score)
+            rows = tool.topCandidates(opt.top);
+        else
+            for (const auto &kv : tool.getCensus())
+                for (const auto &f : kv.second)
+                    rows.emplace_back(kv.first, &f);
+
+        for (const auto &row : rows)
+        {
+            const DeletedFileInfo &f = *row.second;
+            if (opt.json)
+                printJsonEntry(out, opt.image, opt.partition, row.first, f);
+            else
+            {
+                out << row.first << "\t" << f.entryIndex << "\t" << f.name << "\t" << (f.isDir ? "DIR" : "FILE") << "\t"
+                    << f.size << "\t" << (f.isRecoverable ? "GOOD" : "LOST") << "\t" << f.statusReason;
+                if (opt.score)
+                    printScore(out, f);
+                if (opt.dedup && f.contentHash != 0)
+                {
+                    out << "\t" << hexHash(f.contentHash);
+                    if (f.duplicateOfEntry >= 0)
+                        out << "\tduplicate of " << f.duplicateOfDir << ":" << f.duplicateOfEntry;
+                }
+                out << "\n";
+            }
+        }
+        return 0;
+    }
+
+    if (opt.command == "carve")
+    {
+        vector<CarvedFile> files = tool.carveFreeClusters(opt.out, opt.maxFiles);
+        if (opt.json)
+        {
+            for (const auto &f : files)
+            {
+                out << "{\"type\":\"carved\",\"image\":\"" << jsonEscape(opt.image) << "\""
+                    << ",\"partition\":" << opt.partition
+                    << ",\"startCluster\":" << f.startCluster
+                    << ",\"size\":" << f.size
+                    << ",\"fileType\":\"" << f.type << "\""
+                    << ",\"contentHash\":\"" << hexHash(f.contentHash) << "\""
+                    << ",\"known\":" << (f.known ? "true" : "false")
+                    << ",\"outPath\":\"" << jsonEscape(f.outPath) << "\"}\n";
+            }
+        }
+        return 0;
+    }
+
+    if (opt.command == "orphans")
+    {
+        // Không có --repair: LOST.DIR chỉ được dựng trong RAM để xem trước.
+        // Cần census để cluster mới của LOST.DIR không lấy vào vùng của file đã xóa
+        if (tool.getDirectoryTree().empty())
+            tool.buildCensus();
+        vector<OrphanChain> orphans = tool.findOrphanChains();
+        if (!orphans.empty())
+            tool.graftOrphans(orphans);
+        for (const auto &o : orphans)
+        {
+            if (opt.json)
+                out << "{\"type\":\"orphan\",\"image\":\"" << jsonEscape(opt.image) << "\""
+                    << ",\"partition\":" << opt.partition
+                    << ",\"head\":" << o.head
+                    << ",\"clusters\":" << o.clusters
+                    << ",\"isDir\":" << (o.isDir ? "true" : "false")
+                    << ",\"parentCluster\":" << o.parentCluster
+                    << ",\"nested\":" << (o.nested ? "true" : "false")
+                    << ",\"lostPath\":\"" << jsonEscape(o.lostPath) << "\"}\n";
+            else
+                out << o.head << "\t" << o.clusters << "\t" << (o.isDir ? "DIR" : "FILE") << "\t"
+                    << o.parentCluster << "\t" << (o.nested ? "(nested)" : o.lostPath) << "\n";
+        }
+        return 0;
+    }
+
+    if (opt.command == "crosslinks")
+    {
+        // Owner array dùng chung ngân sách với --mem (mặc định 256 MiB)
+        vector<LiveEntry> live = tool.listLiveEntries();
+        vector<CrossLink> links = opt.memBudget > 0 ? tool.findCrossLinks(live, opt.memBudget)
+                                                    : tool.findCrossLinks(live);
+        for (const auto &l : links)
+        {
+            if (opt.json)
+            {
+                out << "{\"type\":\"crosslink\",\"image\":\"" << jsonEscape(opt.image) << "\""
+                    << ",\"partition\":" << opt.partition
+                    << ",\"cluster\":" << l.cluster << ",\"owners\":[";
+                for (size_t k = 0; k < l.owners.size(); ++k)
+                {
+                    const LiveEntry &e = live[l.owners[k]];
+                    out << (k ? "," : "") << "{\"path\":\"" << jsonEscape(e.path) << "\""
+                        << ",\"dirCluster\":" << e.dirCluster << ",\"entry\":" << e.entryIndex
+                        << ",\"startCluster\":" << e.startCluster << "}";
+                }
+                out << "]}\n";
+            }
+            else
+            {
+                out << l.cluster;
+                for (uint32_t o : l.owners)
+                    out << "\t" << live[o].path;
+                out << "\n";
+            }
+        }
+        // Không có --repair: bản sao chỉ nằm trong RAM để xem trước.
+        // Census cho bộ cấp phát biết cluster nào file đã xóa còn nhận
+        if (!links.empty() && tool.getDirectoryTree().empty())
+            tool.buildCensus();
+        tool.resolveCrossLinks(live, links);
+        return 0;
+    }
+
+    if (opt.command == "allocmap")
+    {
+        // Cần census để biết cluster nào đang được file đã xóa nhận
+        if (tool.getDirectoryTree().empty())
+            tool.buildCensus();
+        string format = opt.format.empty() ? "json" : opt.format;
+        if (opt.out.empty())
+        {
+            tool.writeAllocationMap(out, format);
+            return 0;
+        }
+        string tmp = opt.out + ".tmp";
+        {
+            ofstream f(tmp, ios::out | ios::binary | ios::trunc);
+            if (!f.is_open())
+                throw runtime_error("Cannot create " + tmp);
+            tool.writeAllocationMap(f, format);
+            if (!f)
+                throw runtime_error("Failed to write " + tmp);
+        }
+        filesystem::rename(tmp, opt.out);
+        return 0;
+    }
+
+    if (opt.command == "classify")
+    {
+        // Quét theo lô để bộ nhớ kết quả không phụ thuộc kích thước volume; in các run cùng loại
+        uint64_t end = (uint64_t)tool.getTotalClusters() + 2;
+        uint32_t first = opt.cluster != 0 ? opt.cluster : 2;
+        uint64_t last = opt.count > 0 ? min<uint64_t>(end, (uint64_t)first + opt.count) : end;
+        if (first < 2 || first >= last)
+            throw runtime_error("Invalid cluster range");
+
+        const uint32_t BATCH = 1 << 20;
+        uint64_t counts[4] = {0, 0, 0, 0};
+        uint32_t runStart = first, runCount = 0;
+        ContentClass runType = CONTENT_ZERO;
+        double runEntropy = 0.0;
+        auto flush = [&]()
+        {
+            if (runCount == 0)
+                return;
+            if (opt.json)
+                out << "{\"type\":\"content_run\",\"image\":\"" << jsonEscape(opt.image) << "\""
+                    << ",\"partition\":" << opt.partition << ",\"first\":" << runStart << ",\"count\":" << runCount
+                    << ",\"class\":\"" << ContentClassifier::className(runType) << "\""
+                    << ",\"entropy\":" << runEntropy / runCount << "}\n";
+            else
+                out << runStart << "\t" << runCount << "\t" << ContentClassifier::className(runType) << "\t"
+                    << runEntropy / runCount << "\n";
+        };
+        for (uint64_t c = first; c < last; c += BATCH)
+        {
+            uint32_t n = (uint32_t)min<uint64_t>(BATCH, last - c);
+            vector<ClusterProfile> profiles = tool.profileClusters((uint32_t)c, n, opt.threads);
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                const ClusterProfile &p = profiles[i];
+                ++counts[p.type];
+                if (runCount == 0 || p.type != runType)
+                {
+                    flush();
+                    runStart = uint32_t(c + i);
+                    runCount = 0;
+                    runType = p.type;
+                    runEntropy = 0.0;
+                }
+                ++runCount;
+                runEntropy += p.entropy;
+            }
+        }
+        flush();
+        cout << "[INFO] Classified " << (last - first) << " clusters: " << counts[CONTENT_ZERO] << " zero, "
+             << counts[CONTENT_TEXT] << " text, " << counts[CONTENT_COMPRESSED] << " compressed, "
+             << counts[CONTENT_STRUCTURED] << " structured.\n";
+        return 0;
+    }
+
+    if (opt.command == "timeline")
+    {
+        // --mem ở đây là bộ đệm sort; vượt quá thì spill run ra thư mục tạm
+        size_t budget = opt.memBudget > 0 ? opt.memBudget : size_t(64) << 20;
+        if (opt.out.empty())
+        {
+            tool.writeTimeline(out, opt.format.empty() ? "csv" : opt.format, budget);
+            return 0;
+        }
+        string tmp = opt.out + ".tmp";
+        {
+            ofstream f(tmp, ios::out | ios::binary | ios::trunc);
+            if (!f.is_open())
+                throw runtime_error("Cannot create " + tmp);
+            tool.writeTimeline(f, opt.format.empty() ? "csv" : opt.format, budget);
+            if (!f)
+                throw runtime_error("Failed to write " + tmp);
+        }
+        filesystem::rename(tmp, opt.out);
+        return 0;
+    }
+
+    // Chọn thư mục làm việc
+    uint32_t dirCluster = opt.cluster != 0 ? opt.cluster : tool.getRootCluster();
+    if (!opt.path.empty())
+    {
+        dirCluster = tool.resolvePath(opt.path);
+        if (dirCluster == 0)
+            throw runtime_error("Path not found: " + opt.path);
+    }
+
+    // Dùng kết quả trong index nếu có, tránh đọc lại thư mục
+    vector<DeletedFileInfo> report;
+    auto cached = tool.getCensus().find(dirCluster);
+    if (cached != tool.getCensus().end())
+        report = cached->second;
+    else if (!fromIndex || tool.getDirectoryTree().empty())
+        report = tool.analyzeRecoveryCandidates(dirCluster);
+    else
+    {
+        // Thư mục có trong cây nhưng không có entry đã xóa
+        bool known = false;
+        for (const auto &node : tool.getDirectoryTree())
+            known = known || node.cluster == dirCluster;
+        if (!known)
+            report = tool.analyzeRecoveryCandidates(dirCluster);
+    }
+
+    if (opt.command == "analyze")
+    {
+        if (opt.score)
+        {
+            tool.scoreCandidates(report);
+            stable_sort(report.begin(), report.end(),
+                        [](const DeletedFileInfo &a, const DeletedFileInfo &b) { return a.score > b.score; });
+            if (opt.top > 0 && report.size() > opt.top)
+                report.resize(opt.top);
+        }
+        for (const auto &f : report)
+        {
+            if (opt.json)
+                printJsonEntry(out, opt.image, opt.partition, dirCluster, f);
+            else
+            {
+                out << f.entryIndex << "\t" << f.name << "\t" << (f.isDir ? "DIR" : "FILE") << "\t"
+                    << f.size << "\t" << (f.isRecoverable ? "GOOD" : "LOST") << "\t" << f.statusReason;
+                if (opt.score)
+                    printScore(out, f);
+                out << "\n";
+            }
+        }
+        return 0;
+    }
+
+    const DeletedFileInfo *target = findEntry(report, opt.entry);
+    if (!target)
+        throw runtime_error("Entry " + to_string(opt.entry) + " is not a deleted entry of cluster " + to_string(dirCluster));
+
+    if (opt.command == "preview")
+    {
+        // Chỉ đọc: không đổi FAT hay entry nào, kể cả khi có --repair
+        if (!target->isDir)
+            throw runtime_error("preview only supports directories");
+        DeletedTreeView view(tool);
+        set<uint32_t> visited = {dirCluster, target->startCluster};
+        if (view.directoryClusters(target->startCluster).empty())
+            cout << "[WARN] Cluster " << target->startCluster << " no longer holds directory entries.\n";
+        string base = opt.path == "/" ? "" : opt.path;
+        printPreview(out, opt, view, target->startCluster, base + "/" + target->name, 1, visited);
+        return 0;
+    }
+
+    if (opt.command == "export")
+    {
+        if (opt.out.empty())
+            throw runtime_error("export requires --out");
+        if (target->isDir)
+            throw runtime_error("export only supports files");
+        if (!target->isRecoverable && !opt.yes)
+            throw runtime_error("Entry is marked LOST (" + target->statusReason + "), use --yes to force");
+        bool written = tool.recoverFile(target->startCluster, target->size, opt.out);
+        if (opt.json)
+            out << "{\"type\":\"" << (written ? "exported" : "skipped") << "\",\"entry\":" << target->entryIndex
+                << ",\"outPath\":\"" << (written ? jsonEscape(opt.out) : "") << "\",\"size\":" << target->size << "}\n";
+        return 0;
+    }
+
+    if (opt.command == "restore")
+    {
+        if (!target->isRecoverable && !opt.yes)
+            throw runtime_error("Entry is marked LOST (" + target->statusReason + "), use --yes to force");
+
+        bool ok = true;
+        if (target->isDir)
+            tool.restoreTree(dirCluster, target->entryIndex);
+        else
+            ok = tool.restoreDeletedFile(dirCluster, target->entryIndex, 'R');
+
+        if (opt.json)
+            out << "{\"type\":\"restored\",\"entry\":" << target->entryIndex
+                << ",\"ok\":" << (ok ? "true" : "false") << "}\n";
+        return ok ? 0 : 1;
+    }
+
+    printUsage();
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        return runInteractive();
+
+    CliOptions opt;
+    try
+    {
+        if (!parseArgs(argc, argv, opt))
+        {
+            printUsage();
+            return 2;
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << "[ERROR] " << e.what() << "\n";
+        printUsage();
+        return 2;
+    }
+
+    // JSON mode (và timeline ra stdout): stdout chỉ chứa dữ liệu, log [INFO]/[WARN] chuyển sang stderr
+    streambuf *stdoutBuf = cout.rdbuf();
+    ostream out(stdoutBuf);
+    bool dataOnStdout = (opt.command == "timeline" || opt.command == "allocmap") && opt.out.empty();
+    if (opt.json || dataOnStdout)
+        cout.rdbuf(cerr.rdbuf());
+
+    Logger::setLevel(opt.logLevel);
+    if (opt.logRate >= 0)
+        Logger::setRateLimit((unsigned)opt.logRate);
+
+    // Đo đạc chỉ bật khi được yêu cầu
+    Metrics::enable(!opt.metrics.empty() || opt.progressMs > 0);
+    Metrics::startProgress(opt.progressMs);
+
+    int rc;
+    try
+    {
+        rc = runBatch(opt, out);
+    }
+    catch (const exception &e)
+    {
+        cerr << "\n[CRITICAL ERROR] " << e.what() << endl;
+        if (opt.json)
+            out << "{\"type\":\"error\",\"image\":\"" << jsonEscape(opt.image) << "\",\"message\":\""
+                << jsonEscape(e.what()) << "\"}\n";
+        rc = 1;
+    }
+
+    Logger::shutdown();
+    Metrics::stopProgress();
+    if (!opt.metrics.empty())
+    {
+        string dump = opt.metrics == "json" ? Metrics::toJSON() + "\n" : Metrics::toPrometheus();
+        if (opt.metricsOut.empty())
+            cerr << dump;
+        else
+        {
+            ofstream mf(opt.metricsOut, ios::out | ios::trunc);
+            mf << dump;
+        }
+    }
+
+    cout.rdbuf(stdoutBuf);
+    return rc;
+}